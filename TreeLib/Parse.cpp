@@ -221,46 +221,25 @@ tokentype Parser::ParseNumber ()
 
 
 //------------------------------------------------------------------------------
+// A switch rather than strchr on a list, as in Tokeniser ('\0' is included, as
+// strchr matched the terminator)
 bool Parser::IsPunctuation (char ch)
 {
-	char punctuation[23];
-	punctuation[0]  = '(';
-	punctuation[1]  = ')';
-	punctuation[2]  = '[';
-	punctuation[3]  = ']';
-	punctuation[4]  = '{';
-	punctuation[5]  = '}';
-	punctuation[6]  = '/';
-	punctuation[7]  = '\\';
-	punctuation[8]  = ',';
-	punctuation[9]  = ';';
-	punctuation[10] = ':';
-	punctuation[11] = '=';
-	punctuation[12] = '*';
-	punctuation[13] = '\'';
-	punctuation[14] = '"';
-	punctuation[15] = '`';
-	punctuation[16] = '+';
-	punctuation[17] = '-';
-	punctuation[18] = '<';
-	punctuation[19] = '>';
-	punctuation[20] = '!';
-	punctuation[21] = '#';
-	punctuation[22] = '\0';
-
-
-    return (bool)(strchr (punctuation, ch) != NULL);
+	switch (ch)
+	{
+		case '(': case ')': case '[': case ']': case '{': case '}':
+		case '/': case '\\': case ',': case ';': case ':': case '=':
+		case '*': case '\'': case '"': case '`': case '+': case '-':
+		case '<': case '>': case '!': case '#': case '\0':
+			return true;
+		default:
+			return false;
+	}
 }
 
 
 //------------------------------------------------------------------------------
 bool Parser::IsWhiteSpace (char ch)
 {
-	char whitespace[4];
-	whitespace[0]  = ' ';
-	whitespace[1]  = '\t';
-	whitespace[2]  = '\n';
-	whitespace[3]  = '\0';
-
-    return (bool)(strchr (whitespace, ch) != NULL);
+	return ((ch == ' ') || (ch == '\t') || (ch == '\n') || (ch == '\0'));
 }
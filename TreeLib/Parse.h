@@ -59,7 +59,7 @@ public:
 	Parser (char *s) { text = s; token = ""; pos = 0; };
         virtual ~Parser () {};	
 	virtual tokentype NextToken ();
-	virtual string GetToken () { return token; };
+	virtual const string &GetToken () { return token; };
 	virtual const char *GetTokenAsCstr () { return token.c_str(); };
 	virtual int GetPos () { return pos; };
 
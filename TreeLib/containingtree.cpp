@@ -36,6 +36,36 @@
 #include "brownie.h"
 
 
+ContainingTree::ContainingTree(const ContainingTree &t) : STree(t)
+{
+    CopyContainingTreeMembers(t);
+}
+
+ContainingTree &ContainingTree::operator=(const ContainingTree &t)
+{
+    if (this!=&t) {
+        STree::operator=(t);
+        CopyContainingTreeMembers(t);
+    }
+    return *this;
+}
+
+void ContainingTree::CopyContainingTreeMembers(const ContainingTree &t)
+{
+    NodeToBreak=t.NodeToBreak;
+    NodeToAttach=t.NodeToAttach;
+    BreakVector=t.BreakVector;
+    AttachVector=t.AttachVector;
+    ReRootVector=t.ReRootVector;
+    NodeToBreakInt=t.NodeToBreakInt;
+    NodeToAttachInt=t.NodeToAttachInt;
+    nodecount=t.nodecount;
+    LeavesCreated=t.LeavesCreated;
+    CherryNodes=t.CherryNodes;
+    LCAQueries=RMQLCAQuery(); //leave the table empty rather than copying it
+    LCAQueriesCurrent=false;
+}
+
 ContainingTree::~ContainingTree() {
 	//deletetraverse(Root);
 	//delete [] Nodes;
@@ -111,34 +141,60 @@ void ContainingTree::ResetAttachVector()
 
 void ContainingTree::AttachTraverse (NodePtr p)
 {
-    if (p)
+    std::stack < NodePtr, std::vector<NodePtr> > stk;
+    while (p || !stk.empty())
     {
-        // cout<<"AttachTraverse on node "<<p<<endl;
-        if (p!=NodeToBreak) { //so we don't grab the node to break on or its descendants
-            AttachTraverse (p->GetChild());
+        if (p)
+        {
+            // cout<<"AttachTraverse on node "<<p<<endl;
+            if (p!=NodeToBreak) { //so we don't grab the node to break on or its descendants
+                stk.push(p);
+                p=p->GetChild();
+            }
+            else {
+                p=p->GetSibling();
+            }
+        }
+        else
+        {
+            p=stk.top();
+            stk.pop();
             if (p!=Root && (p!=(NodeToBreak->GetAnc()))) { //Since we're basically dealing with unrooted species trees, don't want to bother adding things below the root AND we also don't want to bother breaking below a node and then reattaching in the same place
                 AttachVector.push_back(nodecount);
             }
             nodecount++;
+            p=p->GetSibling();
         }
-        AttachTraverse (p->GetSibling());
     }
 }
 
 void ContainingTree::FindAttachTraverse (NodePtr p)
 {
-    if (p)
+    std::stack < NodePtr, std::vector<NodePtr> > stk;
+    while (p || !stk.empty())
     {
-        //cout<<"FindAttachTraverse on node "<<p<<endl;
-        if (p!=NodeToBreak) { //so we don't grab the node to break on or its descendants
-            FindAttachTraverse (p->GetChild());
+        if (p)
+        {
+            //cout<<"FindAttachTraverse on node "<<p<<endl;
+            if (p!=NodeToBreak) { //so we don't grab the node to break on or its descendants
+                stk.push(p);
+                p=p->GetChild();
+            }
+            else {
+                p=p->GetSibling();
+            }
+        }
+        else
+        {
+            p=stk.top();
+            stk.pop();
             if (nodecount==NodeToAttachInt) {
                 NodeToAttach=p;
                 //cout<<"Found NodeToAttach = "<<NodeToAttach<<" "<<nodecount<<endl;
             }
             nodecount++;
+            p=p->GetSibling();
         }
-        FindAttachTraverse (p->GetSibling());
     }
 }
 
@@ -1282,21 +1338,16 @@ vector<nxsstring> ContainingTree::GetLeafLabelVector()
     return LeafLabelVector;
 }
 
+void ContainingTree::MakeNodeList()
+{
+    STree::MakeNodeList();
+    LCAQueriesCurrent=false;
+}
+
 vector<int> ContainingTree::GetLCADepthVector(nxsstring a, nxsstring b, nxsstring c)
 {
-    //first, initialize depth vector
-    PreorderIterator <Node> n (GetRoot());
-    int count = 0;
-    Node *q = n.begin();
-    while (q)
-    {
-        depth[q] = count++;
-        q = n.next();
-    }
-	
-    //Now get depths for each pair
-    vector<int> LCADepthVector;
     //MakeNodeList(); //Note: you must call MakeNodeList before using this
+    vector<int> LCADepthVector;
     LCADepthVector.push_back(LCADepthQuery(a,b));
     LCADepthVector.push_back(LCADepthQuery(b,c));
     LCADepthVector.push_back(LCADepthQuery(a,c));
@@ -1307,16 +1358,11 @@ int ContainingTree::LCADepthQuery(nxsstring a, nxsstring b) {
     //make sure you've called MakeNodeList before using this
     NodePtr p = GetLeafWithLabel(a);
     NodePtr q = GetLeafWithLabel(b);
-	//  cout<<"Comparing "<<p->GetLabel()<<" and "<<q->GetLabel();
-    while (depth[p] != depth[q])
-    {
-        if (depth[p] < depth[q])
-            q = q->GetAnc();
-        else
-            p = p->GetAnc();
+    if (!LCAQueriesCurrent) { //number nodes in preorder once, rather than for every triplet
+        LCAQueries.SetTree(this);
+        LCAQueriesCurrent=true;
     }
-	//   cout<<" depth is "<<depth[p]<<endl;
-    return depth[p];
+    return LCAQueries.GetDepth(LCAQueries.LCA(p->GetIndex(),q->GetIndex()));
 }
 
 NodePtr ContainingTree::GetLeafWithNumber (int i)
@@ -2,6 +2,7 @@
 #define CONTAININGTREEH
 
 #include "stree.h"
+#include "lcaquery.h"
 
 #include <string>
 #include <stack>
@@ -34,7 +35,11 @@ extern gsl_rng * r;
 class ContainingTree : public STree
 {
 public:
-    ContainingTree () { stk.empty(); };
+    ContainingTree () { stk.empty(); LCAQueriesCurrent=false; };
+
+    //Copies don't take the LCA queries, which point into the source tree; they're set up again when needed
+    ContainingTree (const ContainingTree &t);
+    ContainingTree &operator= (const ContainingTree &t);
 	
 	//destructor
 	virtual ~ContainingTree();
@@ -98,8 +103,14 @@ public:
 
     vector<int> GetLeafNumberVector();
 
-    std::map<Node *, int, std::less<Node *> > depth;
+    //Also marks the LCA queries used by GetLCADepthVector as out of date
+    virtual void MakeNodeList ();
+
+    //LCA queries for GetLCADepthVector, set up the first time they're needed after each MakeNodeList
+    RMQLCAQuery LCAQueries;
+    bool LCAQueriesCurrent;
 
+    //Depths (edges from the root) of the LCAs of ab, bc, and ac
     vector<int> GetLCADepthVector(nxsstring a, nxsstring b, nxsstring c);
 
     int LCADepthQuery(nxsstring a, nxsstring b);
@@ -168,6 +179,9 @@ public:
 	virtual void NodeSlideBranchLength(double markedmultiplier);
 	
 	virtual void ModifyTotalBranchLength(double brlensigma);
+
+protected:
+    void CopyContainingTreeMembers(const ContainingTree &t);
 };
 
 
@@ -5,12 +5,12 @@
 	#include <stdio.h>
 #endif
 
-LCAQuery::LCAQuery (Tree *tree)
+LCAQuery::LCAQuery (const Tree *tree)
 {
 	SetTree (tree);
 }
 
-void LCAQuery::SetTree (Tree *tree)
+void LCAQuery::SetTree (const Tree *tree)
 {
 	t = tree;
     Initialise ();
@@ -53,3 +53,78 @@ NodePtr SimpleLCAQuery::LCA (NodePtr i, NodePtr j)
     return p;
 }
 
+void RMQLCAQuery::Initialise ()
+{
+	nodes.clear();
+	depth.clear();
+	first.clear();
+	table.clear();
+	floorlog2.clear();
+	if ((t == NULL) || (t->GetRoot() == NULL))
+		return;
+
+	PreorderIterator <Node> n (t->GetRoot());
+	Node *q = n.begin();
+	while (q)
+	{
+		q->SetIndex (nodes.size());
+		if (nodes.empty())
+			depth.push_back (0);
+		else
+			depth.push_back (depth[q->GetAnc()->GetIndex()] + 1);
+		nodes.push_back (q);
+		q = n.next();
+	}
+
+	// Euler tour: each node is listed when first reached and again after each of its children
+	std::vector<int> tour;
+	tour.reserve (2 * nodes.size());
+	first.resize (nodes.size());
+	std::stack < std::pair<NodePtr, NodePtr>, std::vector< std::pair<NodePtr, NodePtr> > > stk;
+	first[0] = 0;
+	tour.push_back (0);
+	stk.push (std::make_pair (nodes[0], nodes[0]->GetChild()));
+	while (!stk.empty())
+	{
+		NodePtr child = stk.top().second;
+		if (child)
+		{
+			stk.top().second = child->GetSibling();
+			first[child->GetIndex()] = tour.size();
+			tour.push_back (child->GetIndex());
+			stk.push (std::make_pair (child, child->GetChild()));
+		}
+		else
+		{
+			stk.pop();
+			if (!stk.empty())
+				tour.push_back (stk.top().first->GetIndex());
+		}
+	}
+
+	int m = tour.size();
+	floorlog2.resize (m + 1);
+	floorlog2[1] = 0;
+	for (int i = 2; i <= m; i++)
+		floorlog2[i] = floorlog2[i / 2] + 1;
+	table.push_back (tour);
+	for (int k = 1; (1 << k) <= m; k++)
+	{
+		const std::vector<int> &prev = table[k - 1];
+		std::vector<int> row (m - (1 << k) + 1);
+		for (int i = 0; i < (int)row.size(); i++)
+		{
+			int a = prev[i];
+			int b = prev[i + (1 << (k - 1))];
+			row[i] = (a < b) ? a : b;
+		}
+		table.push_back (row);
+	}
+}
+
+void RMQLCAQuery::LCA (const std::vector< std::pair<int, int> > &pairs, std::vector<int> &result) const
+{
+	result.resize (pairs.size());
+	for (int i = 0; i < (int)pairs.size(); i++)
+		result[i] = LCA (pairs[i].first, pairs[i].second);
+}
@@ -42,6 +42,7 @@
 #endif
 
 #include <vector>
+#include <stack>
 
 #include "TreeLib.h"
 #include "nodeiterator.h"
@@ -55,12 +56,12 @@ class LCAQuery
 {
 public:
 	LCAQuery () { t = NULL; };
-	LCAQuery (Tree *tree);
+	LCAQuery (const Tree *tree);
     virtual ~LCAQuery () {};
     virtual NodePtr LCA (NodePtr i, NodePtr j) = 0;
-    virtual void SetTree (Tree *tree);
+    virtual void SetTree (const Tree *tree);
 protected:
-	Tree *t;
+	const Tree *t;
 	virtual void Initialise () {};
 };
 
@@ -73,7 +74,7 @@ class SimpleLCAQuery : public LCAQuery
 {
 public:
 	SimpleLCAQuery () {};
-	SimpleLCAQuery (Tree *tree) :  LCAQuery (tree) { Initialise (); };
+	SimpleLCAQuery (const Tree *tree) :  LCAQuery (tree) { Initialise (); };
 	/**
 	 * Finds LCA by going down tree twowards root until we reach node
      * with the same preorder number.
@@ -88,6 +89,77 @@ protected:
 	virtual void Initialise ();
 };
 
+/**
+ * @class RMQLCAQuery
+ * Constant time LCA queries. The nodes are numbered in preorder (root = 0), and
+ * the tree is stored as an Euler tour of these numbers with a sparse table of
+ * range minima. The LCA of two nodes is the node with the smallest number
+ * between their first appearances in the tour. Setting up the tree takes
+ * O(n log n) time and space.
+ *
+ * Each node's preorder number is stored as its index (see Node::SetIndex),
+ * replacing any numbering from Tree::MakeNodeList, so that queries can be made
+ * on indices without looking nodes up. The numbers are only valid until the
+ * tree is changed; call SetTree again after that.
+ */
+class RMQLCAQuery : public LCAQuery
+{
+public:
+	RMQLCAQuery () {};
+	RMQLCAQuery (const Tree *tree) :  LCAQuery (tree) { Initialise (); };
+	/**
+	 * @return LCA of nodes i and j
+	 */
+    virtual NodePtr LCA (NodePtr i, NodePtr j) { return nodes[LCA (i->GetIndex(), j->GetIndex())]; };
+	/**
+	 * @param i preorder number of a node
+	 * @param j preorder number of a node
+	 * @return preorder number of the LCA of nodes i and j
+	 */
+	virtual int LCA (int i, int j) const
+	{
+		int l = first[i];
+		int r = first[j];
+		if (l > r)
+		{
+			int tmp = l;
+			l = r;
+			r = tmp;
+		}
+		int k = floorlog2[r - l + 1];
+		int a = table[k][l];
+		int b = table[k][r - (1 << k) + 1];
+		return (a < b) ? a : b;
+	};
+	/**
+	 * @brief LCAs of many pairs of nodes at once
+	 * @param pairs preorder numbers of the pairs of nodes
+	 * @param result set to the preorder number of the LCA of each pair
+	 */
+	virtual void LCA (const std::vector< std::pair<int, int> > &pairs, std::vector<int> &result) const;
+	/**
+	 * @param i preorder number of a node
+	 * @return the node
+	 */
+	virtual NodePtr GetNode (int i) const { return nodes[i]; };
+	/**
+	 * @return number of nodes in the tree
+	 */
+	virtual int GetNumNodes () const { return nodes.size(); };
+	/**
+	 * @param i preorder number of a node
+	 * @return number of edges between the node and the root
+	 */
+	virtual int GetDepth (int i) const { return depth[i]; };
+protected:
+	std::vector<NodePtr> nodes;
+	std::vector<int> depth;
+	std::vector<int> first;			// first position of each node in the Euler tour
+	std::vector< std::vector<int> > table;	// table[k][i] is the smallest number in positions i to i+2^k-1 of the tour
+	std::vector<int> floorlog2;
+	virtual void Initialise ();
+};
+
 #if __BORLANDC__
 	// Redefine __MINMAX_DEFINED so Windows header files compile
 	#ifndef __MINMAX_DEFINED
@@ -1,4 +1,5 @@
 #include "ntree.h"
+#include "nodeiterator.h"
 
 #ifdef __GNUC__
 #include <algorithm>
@@ -8,30 +9,46 @@
 
 void NTree::BuildClustersTraverse (NNodePtr p)
 {
-	if (p)
+	// Explicit stack: a node is pushed once to clear its cluster and again, marked, to add
+	// it to its ancestor's cluster after its children and siblings are done
+	if (p == NULL)
+		return;
+	std::stack < std::pair<NNodePtr, bool>, std::vector< std::pair<NNodePtr, bool> > > stk;
+	stk.push (std::make_pair (p, false));
+	while (!stk.empty())
     {
-    	p->Cluster.erase (p->Cluster.begin(), p->Cluster.end());
-        BuildClustersTraverse ((NNodePtr)(p->GetChild()));
-        BuildClustersTraverse ((NNodePtr)(p->GetSibling()));
-        if (p->IsLeaf())
+		NNodePtr q = stk.top().first;
+		bool expanded = stk.top().second;
+		stk.pop();
+		if (!expanded)
+		{
+			q->Cluster.erase (q->Cluster.begin(), q->Cluster.end());
+			stk.push (std::make_pair (q, true));
+			if (q->GetSibling())
+				stk.push (std::make_pair ((NNodePtr)(q->GetSibling()), false));
+			if (q->GetChild())
+				stk.push (std::make_pair ((NNodePtr)(q->GetChild()), false));
+			continue;
+		}
+        if (q->IsLeaf())
         {
         	switch (use)
             {
             	case useLeafNumber:
-        			p->Cluster.insert (p->GetLeafNumber());
+        			q->Cluster.insert (q->GetLeafNumber());
                     break;
 
                 case useLabelNumber:
-        			p->Cluster.insert (p->GetLabelNumber());
+        			q->Cluster.insert (q->GetLabelNumber());
                     break;
             }
         }
-        if (p !=Root)
+        if (q !=Root)
         {
-        	NNodePtr anc = (NNodePtr)(p->GetAnc());
+        	NNodePtr anc = (NNodePtr)(q->GetAnc());
 			std::set<int, less<int> > temp_set;
 			std::set_union(anc->Cluster.begin(), anc->Cluster.end(),
-				p->Cluster.begin(), p->Cluster.end(),
+				q->Cluster.begin(), q->Cluster.end(),
 				std::inserter(temp_set, temp_set.begin()));
 			anc->Cluster.swap(temp_set);
         }
@@ -40,13 +57,14 @@ void NTree::BuildClustersTraverse (NNodePtr p)
 
 void NTree::BuildLeafLabelsTraverse (NNodePtr p)
 {
-	if (p)
+	if (p == NULL)
+		return;
+	NodeIterator <Node> n (p);
+	for (NodePtr q = n.begin(); q; q = n.next())
     {
-        BuildLeafLabelsTraverse ((NNodePtr)(p->GetChild()));
-        BuildLeafLabelsTraverse ((NNodePtr)(p->GetSibling()));
-        if (p->IsLeaf())
+        if (q->IsLeaf())
         {
-			leaf_labels[p->GetLabel()] = p;
+			leaf_labels[q->GetLabel()] = (NNodePtr)q;
         }
     }
 }
@@ -55,15 +73,25 @@ void NTree::BuildLeafLabelsTraverse (NNodePtr p)
 //------------------------------------------------------------------------------
 void NTree::ShowClustersTraverse (NNodePtr p)
 {
-	if (p)
+	std::stack < NNodePtr, std::vector<NNodePtr> > stk;
+	while (p || !stk.empty())
 	{
-        ShowClustersTraverse ((NNodePtr)(p->GetChild()));
-        // Show clusters
-		cout << "{ ";
-		std::copy (p->Cluster.begin(), p->Cluster.end(),
-			std::ostream_iterator<int>(cout, " "));
-		cout << "}" << endl;
-        ShowClustersTraverse ((NNodePtr)(p->GetSibling()));
+		if (p)
+		{
+			stk.push (p);
+			p = (NNodePtr)(p->GetChild());
+		}
+		else
+		{
+			p = stk.top();
+			stk.pop();
+	        // Show clusters
+			cout << "{ ";
+			std::copy (p->Cluster.begin(), p->Cluster.end(),
+				std::ostream_iterator<int>(cout, " "));
+			cout << "}" << endl;
+			p = (NNodePtr)(p->GetSibling());
+		}
 	}
 }
 
@@ -45,6 +45,11 @@
 
 #include "treereader.h"
 #include "treewriter.h"
+#include "nodeiterator.h"
+#include "treestream.h"
+
+#include <cstdio>
+#include <sstream>
 
 // NCL includes
 #include "nexusdefs.h"
@@ -106,7 +111,7 @@ public:
 	/**
 	 * Constructor
 	 */
-	Profile () {};
+	Profile () : ChunkSize (0), ChunkStart (0), NumStreamedTrees (0) {};
 	/**
 	 * Destructor
 	 */
@@ -118,7 +123,28 @@ public:
 	 * @param i the index of the tree in the range 0 - (n-1)
 	 * @return The tree
 	 */
-	 virtual T GetIthTree (int i) { return Trees[i]; };
+	 virtual T GetIthTree (int i) { LoadChunk (i); return Trees[i - ChunkStart]; };
+	/**
+	 * @brief The ith tree in the profile, without copying it
+	 *
+	 * The reference stays valid until trees are added to or removed from the profile.
+	 * When streaming, asking for a tree in another chunk (with any of the GetIth
+	 * functions) loads that chunk and also invalidates the reference, so copy the tree,
+	 * or build what is needed from it, before asking for another one.
+	 * Use GetIthTree instead if the tree is going to be changed and the stored
+	 * tree must not be.
+	 *
+	 * @param i the index of the tree in the range 0 - (n-1)
+	 * @return A read-only reference to the tree
+	 */
+	 virtual const T &GetIthTreeRef (int i) { LoadChunk (i); return Trees[i - ChunkStart]; };
+	/**
+	 * @brief The stored ith tree, for changes that should be kept in the profile
+	 *
+	 * @param i the index of the tree in the range 0 - (n-1)
+	 * @return A reference to the tree
+	 */
+	 virtual T &GetIthTreeForEdit (int i) { LoadChunk (i); return Trees[i - ChunkStart]; };
 
 	 /**
 	 * @brief The name of the ith tree in the profile
@@ -126,7 +152,7 @@ public:
 	 * @param i the index of the tree in the range 0 - (n-1)
 	 * @return The tree
 	 */
-	 virtual std::string GetIthTreeName (int i) { return Trees[i].GetName(); };
+	 virtual std::string GetIthTreeName (int i) { LoadChunk (i); return Trees[i - ChunkStart].GetName(); };
 	/**
 	 * @return The number of labels in the profile
 	 */
@@ -134,7 +160,7 @@ public:
 	/**
 	 * @return The number of trees in the profile
 	 */
-	virtual int GetNumTrees () { return Trees.size(); };
+	virtual int GetNumTrees () { return (ChunkSize > 0) ? NumStreamedTrees : Trees.size(); };
 	/**
 	 * @brief The index of a leaf label
 	 * @param s A leaf label
@@ -157,6 +183,11 @@ public:
 	 * @brief Count the number of trees each leaf label occurs in
 	 */
 	virtual void MakeLabelFreqList ();
+	/**
+	 * @brief Store the index of each leaf's label (see Profile::GetIndexOfLabel) in the leaf,
+	 * so later code can get a leaf's taxon without looking up its label
+	 */
+	virtual void SetLeafTaxonNumbers ();
 	/**
 	 * @brief Read a NEXUS file and store the trees in Profile::trees. 
 	 
@@ -184,6 +215,47 @@ public:
 	 * @return true if successful
 	 */
 	virtual bool ReadTrees (std::istream &f);
+	/**
+	 * @brief Read a set of trees from a file as ReadTrees does, keeping a binary
+	 * snapshot of the result in filename.treecache
+	 *
+	 * If the snapshot matches the size and a hash of the file's contents, the trees and
+	 * labels are loaded from it instead of parsing the file; otherwise the file is
+	 * parsed and the snapshot written afresh (if the directory isn't writable the file is
+	 * simply parsed each time). The snapshot is only used if the profile is empty.
+	 *
+	 * @param filename name of the tree file
+	 * @return true if successful
+	 */
+	virtual bool ReadTreesCached (const char *filename);
+	/**
+	 * @brief Read the trees in a NEXUS or PHYLIP file lazily, holding at most chunksize
+	 * of them in memory
+	 *
+	 * Any trees already in the profile are dropped. Trees are read a chunk at a time
+	 * as they are asked for, so going through them in order never holds more than one
+	 * chunk. The file position of each chunk is noted the first time it is passed, so
+	 * going back to an earlier chunk reads just that chunk again. Trees
+	 * changed through GetIthTreeForEdit keep their changes only while their chunk is
+	 * loaded. Leaf labels are numbered as in ReadNEXUS if the file has a TAXA block,
+	 * otherwise in the order they are first met.
+	 *
+	 * @param filename name of the tree file
+	 * @param burnin number of trees to skip at the start of the file
+	 * @param thinning keep only every thinning-th tree after the burn-in
+	 * @param chunksize number of trees to hold at once; 0 reads all the kept trees now
+	 * @return true if at least one tree was read
+	 */
+	virtual bool StreamTrees (const char *filename, int burnin = 0, int thinning = 1, int chunksize = 0);
+	/**
+	 * @return true if the trees are being read from a file as they are needed
+	 */
+	virtual bool IsStreaming () { return (ChunkSize > 0); };
+	/**
+	 * @brief Remove all the trees and labels, and give the memory of the deleted
+	 * nodes back to the heap (see Node::ReleaseNodePool)
+	 */
+	virtual void Clear ();
 #if USE_XML
 	/**
 	 * @brief Read a XML file and store the trees in Profile::trees. 
@@ -228,6 +300,25 @@ protected:
 	 *
 	 */
 	std::vector <std::string> LabelIndex;
+	/**
+	 * Source of the trees when streaming; Trees then holds the kept trees
+	 * ChunkStart to ChunkStart + Trees.size() - 1
+	 *
+	 */
+	TreeStream <T> Stream;
+	/**
+	 * Where chunk k + 1 starts in the file, for each chunk reached so far
+	 */
+	std::vector <typename TreeStream <T>::Position> ChunkPositions;
+	int ChunkSize;
+	int ChunkStart;
+	int NumStreamedTrees;
+	virtual void LoadChunk (int i);
+	virtual void StopStreaming ();
+	virtual void NumberStreamedLabels ();
+	virtual bool HashFile (const char *filename, unsigned long long &size, unsigned long long &hash);
+	virtual bool ReadTreeCache (const char *cachename, unsigned long long size, unsigned long long hash);
+	virtual void WriteTreeCache (const char *cachename, unsigned long long size, unsigned long long hash);
 	
 #if USE_XML
 	virtual bool xmlTraverse (XMLElementPtr p);
@@ -295,9 +386,9 @@ template <class T> void Profile<T>::ShowLabelList (std::ostream &f)
 template <class T> void Profile<T>::MakeLabelFreqList ()
 {
 //	cout << "MakeLabelListFreq" << endl;
-	for (int i = 0; i < Trees.size(); i++)
+	for (int i = 0; i < GetNumTrees(); i++)
 	{
-		T t = Trees[i];
+		T t = GetIthTree (i);
 		t.MakeNodeList();
 		for (int j = 0; j < t.GetNumLeaves(); j++)
 		{
@@ -324,6 +415,30 @@ template <class T> void Profile<T>::MakeLabelFreqList ()
 	}*/
 }
 
+//------------------------------------------------------------------------------
+template <class T> void Profile<T>::SetLeafTaxonNumbers ()
+{
+	for (int i = 0; i < Trees.size(); i++)
+	{
+		if (Trees[i].GetRoot() == NULL)
+			continue;
+		NodeIterator <Node> n (Trees[i].GetRoot());
+		Node *q = n.begin();
+		while (q)
+		{
+			if (q->IsLeaf())
+			{
+				LabelMap::iterator there = Labels.find (q->GetLabel());
+				if (there != Labels.end ())
+					q->SetTaxonNumber ((*there).second);
+				else
+					q->SetTaxonNumber (-1);
+			}
+			q = n.next();
+		}
+	}
+}
+
 /**
  * @class MyNexus
  * Extends Nexus class to output progress to cout
@@ -454,12 +569,15 @@ template <class T> bool Profile<T>::ReadNEXUS (std::istream &f)
 		trees->Report (std::cout);
 		std::cout << endl;
 #endif
-		// Store the trees themselves
+		// Store the trees themselves, parsing each straight into its place
+		// in Trees (copying a tree copies all its nodes)
+		Trees.reserve (Trees.size() + trees->GetNumTrees());
 		int i = 0;
 		int error = 0;
 		while ((i < trees->GetNumTrees()) && (error == 0))
 		{ 
-			T t;
+			Trees.push_back (T());
+			T &t = Trees.back();
 			std::string tstr;
 			if (trees->HasTranslationTable())
 				tstr = trees->GetTranslatedTreeDescription (i);
@@ -472,7 +590,6 @@ template <class T> bool Profile<T>::ReadNEXUS (std::istream &f)
 				t.SetName (trees->GetTreeName (i));
 				t.SetRooted (trees->IsRootedTree (i));
 				t.SetWeight (trees->GetTreeWeight (i));
-				Trees.push_back (t);
 			}
                             
 			else
@@ -486,16 +603,19 @@ template <class T> bool Profile<T>::ReadNEXUS (std::istream &f)
 #else
                                 cerr << "Error in tree description " << (i + 1) << t.GetErrorMsg() << endl << "Note that one way this can happen is through inserted line feeds (for example, pico on a mac wraps lines by default, which can introduce extra feeds)"<<endl;
 #endif
-				return false;
+				Trees.pop_back ();
 			}           
 			 i++;
 		}
         
 		// Assign each label a unique index
-		if (taxa->GetNumTaxonLabels() == 0)
+		if (error != 0)
+			result = false;
+		else if (taxa->GetNumTaxonLabels() == 0)
 		{
 			// No taxa block in NEXUS file
 			MakeLabelList ();
+			result = true;
 		}
 		else
 		{
@@ -506,9 +626,18 @@ template <class T> bool Profile<T>::ReadNEXUS (std::istream &f)
 				Labels[taxa->GetTaxonLabel (i)] = i;
 				LabelIndex.push_back (taxa->GetTaxonLabel (i));
 			}
+			result = true;
 		}
-		result = true;
+		if (result)
+			SetLeafTaxonNumbers ();
 	}
+
+	// The tree descriptions are no longer needed
+	delete trees;
+	delete characters;
+	delete data;
+	delete assumptions;
+	delete taxa;
 	return result;
 }
 
@@ -518,6 +647,7 @@ template <class T> bool Profile<T>::ReadTrees (std::istream &f)
 {
 	bool result = false;
 
+	StopStreaming ();
 	char ch = (char)f.peek ();
 	if (ch == '#')
 		result = ReadNEXUS (f);
@@ -530,6 +660,163 @@ template <class T> bool Profile<T>::ReadTrees (std::istream &f)
 	return result;
 }
 
+//------------------------------------------------------------------------------
+// Layout of a .treecache file, all in the byte order of the machine that wrote it:
+// magic, format version, size and FNV-1a hash of the tree file, the labels, the
+// trees (see Tree::WriteBinary), and the magic again to show the file is complete.
+#define TREECACHE_MAGIC "TLTREEC\x01"
+#define TREECACHE_VERSION 1
+
+template <class T> bool Profile<T>::ReadTreesCached (const char *filename)
+{
+	StopStreaming ();
+	unsigned long long size, hash;
+	bool cacheable = (Trees.size() == 0) && (Labels.size() == 0) && HashFile (filename, size, hash);
+	std::string cachename = filename;
+	cachename += ".treecache";
+	if (cacheable && ReadTreeCache (cachename.c_str(), size, hash))
+		return true;
+
+	std::ifstream f (filename);
+	bool result = ReadTrees (f);
+	f.close ();
+	if (result && cacheable)
+		WriteTreeCache (cachename.c_str(), size, hash);
+	return result;
+}
+
+//------------------------------------------------------------------------------
+template <class T> bool Profile<T>::HashFile (const char *filename, unsigned long long &size, unsigned long long &hash)
+{
+	std::ifstream f (filename, std::ios::in | std::ios::binary);
+	if (!f)
+		return false;
+	std::vector<char> buffer (1 << 20);
+	size = 0;
+	hash = 14695981039346656037ULL;
+	while (f)
+	{
+		f.read (&buffer[0], buffer.size());
+		std::streamsize n = f.gcount();
+		for (std::streamsize i = 0; i < n; i++)
+		{
+			hash ^= (unsigned char)buffer[i];
+			hash *= 1099511628211ULL;
+		}
+		size += n;
+	}
+	return f.eof();
+}
+
+//------------------------------------------------------------------------------
+// The whole snapshot is read with one read and the trees rebuilt from memory; on
+// any mismatch or damage the profile is left empty and false returned
+template <class T> bool Profile<T>::ReadTreeCache (const char *cachename, unsigned long long size, unsigned long long hash)
+{
+	std::ifstream f (cachename, std::ios::in | std::ios::binary);
+	if (!f)
+		return false;
+	f.seekg (0, std::ios::end);
+	std::streamoff length = f.tellg();
+	f.seekg (0, std::ios::beg);
+	if (length < (std::streamoff)(2 * strlen (TREECACHE_MAGIC)))
+		return false;
+	std::vector<char> data (length);
+	if (!f.read (&data[0], length))
+		return false;
+	f.close ();
+
+	BinaryBuffer b (&data[0], &data[0] + length);
+	std::string magic, endmagic;
+	int version, nlabels, nindex, ntrees;
+	unsigned long long cachedsize, cachedhash;
+	b.GetString (magic);
+	b.Get (version);
+	b.Get (cachedsize);
+	b.Get (cachedhash);
+	if (!b.IsOK() || (magic != TREECACHE_MAGIC) || (version != TREECACHE_VERSION)
+		|| (cachedsize != size) || (cachedhash != hash))
+		return false;
+
+	bool ok = b.Get (nlabels) && (nlabels >= 0);
+	for (int i = 0; ok && (i < nlabels); i++)
+	{
+		std::string s;
+		int index;
+		ok = b.GetString (s) && b.Get (index);
+		if (ok)
+			Labels[s] = index;
+	}
+	ok = ok && b.Get (nindex) && (nindex >= 0);
+	for (int i = 0; ok && (i < nindex); i++)
+	{
+		std::string s;
+		ok = b.GetString (s);
+		if (ok)
+			LabelIndex.push_back (s);
+	}
+	ok = ok && b.Get (ntrees) && (ntrees >= 0);
+	if (ok)
+		Trees.reserve (ntrees);
+	for (int i = 0; ok && (i < ntrees); i++)
+	{
+		Trees.push_back (T());
+		ok = Trees.back().ReadBinary (b);
+	}
+	ok = ok && b.GetString (endmagic) && (endmagic == TREECACHE_MAGIC)
+		&& (b.GetPosition() == &data[0] + length);
+	if (!ok)
+	{
+		Trees.clear();
+		Labels.clear();
+		LabelIndex.clear();
+	}
+	return ok;
+}
+
+//------------------------------------------------------------------------------
+// Written to a temporary file that is then renamed, so a job reading the cache
+// never sees a half-written one, even if several jobs write it at once
+template <class T> void Profile<T>::WriteTreeCache (const char *cachename, unsigned long long size, unsigned long long hash)
+{
+	std::ostringstream tmp;
+	tmp << cachename << "." << (unsigned long)time (NULL) << "." << (unsigned long)clock () << "." << (size_t)this;
+	std::string tmpname = tmp.str();
+	std::ofstream f (tmpname.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!f)
+		return;
+	PutBinaryString (f, TREECACHE_MAGIC);
+	PutBinary (f, (int)TREECACHE_VERSION);
+	PutBinary (f, size);
+	PutBinary (f, hash);
+	PutBinary (f, (int)Labels.size());
+	for (LabelMap::iterator it = Labels.begin(); it != Labels.end(); it++)
+	{
+		PutBinaryString (f, (*it).first);
+		PutBinary (f, (*it).second);
+	}
+	PutBinary (f, (int)LabelIndex.size());
+	for (int i = 0; i < (int)LabelIndex.size(); i++)
+		PutBinaryString (f, LabelIndex[i]);
+	PutBinary (f, (int)Trees.size());
+	for (int i = 0; i < (int)Trees.size(); i++)
+		Trees[i].WriteBinary (f);
+	PutBinaryString (f, TREECACHE_MAGIC);
+	f.close ();
+	if (!f)
+	{
+		remove (tmpname.c_str());
+		return;
+	}
+	if (rename (tmpname.c_str(), cachename) != 0)
+	{
+		// Some systems won't rename over an existing file
+		remove (cachename);
+		if (rename (tmpname.c_str(), cachename) != 0)
+			remove (tmpname.c_str());
+	}
+}
+
 //------------------------------------------------------------------------------
 template <class T> bool Profile<T>::ReadPHYLIP (std::istream &f)
 {
@@ -538,7 +825,9 @@ template <class T> bool Profile<T>::ReadPHYLIP (std::istream &f)
 	bool ok = true;
 	while (ok)
 	{
-		T t;
+		// Read straight into the stored tree, rather than copying a read one in
+		Trees.push_back (T());
+		T &t = Trees.back();
 
 		try
 		{
@@ -555,11 +844,12 @@ template <class T> bool Profile<T>::ReadPHYLIP (std::istream &f)
 #else
 			std::cerr << x.msg << " (line " << x.line << ", column " << x.col << ")" << std::endl;
 #endif
+			Trees.pop_back ();
 		 	return false;
 		}
 
-		if (ok)
-			Trees.push_back (t);
+		if (!ok)
+			Trees.pop_back ();
 	}
 	
 	bool result = (Trees.size() > 0);
@@ -569,16 +859,152 @@ template <class T> bool Profile<T>::ReadPHYLIP (std::istream &f)
 		// Build a list of labels in the profile, such that each label 
 		// is assigned a unique index    	
 		MakeLabelList ();
+		SetLeafTaxonNumbers ();
+	}
+	return result;
+}
+
+//------------------------------------------------------------------------------
+template <class T> bool Profile<T>::StreamTrees (const char *filename, int burnin, int thinning, int chunksize)
+{
+	Clear ();
+	Stream.SetBurnin (burnin);
+	Stream.SetThinning (thinning);
+	if (!Stream.Open (filename))
+		return false;
+	if (chunksize > 0)
+	{
+		NumStreamedTrees = Stream.CountTrees ();
+		if (!Stream.GetIsOK())
+		{
+			Stream.Close ();
+			return false;
+		}
+		Stream.ReadChunk (Trees, chunksize);
+		ChunkSize = chunksize;
+		if ((int)Trees.size() == ChunkSize)
+			ChunkPositions.push_back (Stream.GetPosition ());
+	}
+	else
+	{
+		for (;;)
+		{
+			T t;
+			if (!Stream.Next (t))
+				break;
+			Trees.push_back (t);
+		}
+	}
+	bool result = Stream.GetIsOK() && (Trees.size() > 0);
+	if (result)
+	{
+		// Labels in the TAXA block come before the trees, so are known by now
+		const std::vector <std::string> &taxa = Stream.GetTaxonLabels ();
+		for (int i = 0; i < taxa.size(); i++)
+		{
+			Labels[taxa[i]] = i;
+			LabelIndex.push_back (taxa[i]);
+		}
+		NumberStreamedLabels ();
+	}
+	if (!result || (ChunkSize == 0))
+	{
+		if (!result)
+			StopStreaming ();
+		Stream.Close ();
 	}
 	return result;
 }
 
+//------------------------------------------------------------------------------
+template <class T> void Profile<T>::NumberStreamedLabels ()
+{
+	if (Stream.GetTaxonLabels().size() == 0)
+		MakeLabelList ();
+	SetLeafTaxonNumbers ();
+}
+
+//------------------------------------------------------------------------------
+// Makes sure tree i is in Trees, reading on, or going back to the start of the
+// nearest chunk whose position is known, if need be
+template <class T> void Profile<T>::LoadChunk (int i)
+{
+	if ((ChunkSize == 0) || ((i >= ChunkStart) && (i < ChunkStart + (int)Trees.size())))
+		return;
+	int next = ChunkStart + Trees.size(); // kept tree the stream will return next
+	int chunk = i / ChunkSize;
+	int start = chunk * ChunkSize;
+	if (start < next)
+	{
+		int known = (chunk < (int)ChunkPositions.size()) ? chunk : ChunkPositions.size();
+		if (known == 0)
+			Stream.Rewind ();
+		else
+			Stream.SetPosition (ChunkPositions[known - 1]);
+		next = known * ChunkSize;
+	}
+	Trees.clear();
+	// Pass over whole chunks, noting where each one starts
+	while (next < start)
+	{
+		if (Stream.Skip (ChunkSize) < ChunkSize)
+			break;
+		next += ChunkSize;
+		if (next / ChunkSize > (int)ChunkPositions.size())
+			ChunkPositions.push_back (Stream.GetPosition ());
+	}
+	ChunkStart = start;
+	if (next == start)
+	{
+		Stream.ReadChunk (Trees, ChunkSize);
+		if (((int)Trees.size() == ChunkSize) && (chunk + 1 > (int)ChunkPositions.size()))
+			ChunkPositions.push_back (Stream.GetPosition ());
+	}
+	if (i - ChunkStart >= (int)Trees.size())
+	{
+		// The file is shorter than when it was counted, or a tree couldn't be read
+		Trees.clear();
+		nxsstring errormsg = "Could not read tree ";
+		errormsg += (i + 1);
+		errormsg += " from the tree file";
+		throw XNexus (errormsg);
+	}
+	NumberStreamedLabels ();
+}
+
+//------------------------------------------------------------------------------
+template <class T> void Profile<T>::StopStreaming ()
+{
+	if (ChunkSize > 0)
+	{
+		Stream.Close ();
+		Trees.clear();
+	}
+	ChunkPositions.clear();
+	ChunkSize = 0;
+	ChunkStart = 0;
+	NumStreamedTrees = 0;
+}
+
+//------------------------------------------------------------------------------
+template <class T> void Profile<T>::Clear ()
+{
+	StopStreaming ();
+	Trees.clear();
+	Labels.clear();
+	LabelFreq.clear();
+	LabelIndex.clear();
+	// Each thread has its own node pool
+#pragma omp parallel
+	Node::ReleaseNodePool ();
+}
+
 //------------------------------------------------------------------------------
 template <class T> void Profile<T>::ShowTrees (std::ostream &f)
 {
-	for (int i = 0; i < Trees.size(); i++)
+	for (int i = 0; i < GetNumTrees(); i++)
 	{
-		T t = Trees[i];
+		T t = GetIthTree (i);
 		t.Update ();
 		t.Draw (f);
 	}
@@ -605,9 +1031,9 @@ template <class T> bool Profile<T>::WriteTrees (std::ostream &f, const int forma
 		*q = '\0';
 	f << time_buf << "]" << endOfLine;
 
-	for (int i = 0; i < Trees.size(); i++)
+	for (int i = 0; i < GetNumTrees(); i++)
 	{
-		T t = Trees[i];
+		T t = GetIthTree (i);
 		f << "\ttree ";
 		if (t.GetName() != "")
 			f << NEXUSString (t.GetName());
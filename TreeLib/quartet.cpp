@@ -59,7 +59,7 @@ protected:
 	int i;
 	int j;
 	Tree * t;
-    SimpleLCAQuery lca;
+    RMQLCAQuery lca;
     IntegerSet mVisited;
 };
 
@@ -774,3 +774,158 @@ void CompareTriplets (NTree &t1, NTree &t2, QTValues &QR)
     }
 
 }
+
+//------------------------------------------------------------------------------
+void QTComparison::FlatTree::Build (const Tree &t)
+{
+	lca.SetTree (&t);
+	int nodes = lca.GetNumNodes();
+	parent.assign (nodes, -1);
+	children.assign (nodes, std::vector<int>());
+	size.assign (nodes, 0);
+	firstleaf.assign (nodes, 0);
+	lastleaf.assign (nodes, 0);
+	taxon.assign (nodes, -1);
+	leaves.clear();
+	for (int i = 1; i < nodes; i++)
+	{
+		parent[i] = lca.GetNode(i)->GetAnc()->GetIndex();
+		children[parent[i]].push_back (i);
+	}
+	for (int i = 0; i < nodes; i++)
+	{
+		if (children[i].empty())
+		{
+			firstleaf[i] = leaves.size();
+			leaves.push_back (i);
+			lastleaf[i] = leaves.size();
+		}
+	}
+	for (int i = nodes - 1; i >= 0; i--)
+	{
+		if (!children[i].empty())
+		{
+			firstleaf[i] = firstleaf[children[i].front()];
+			lastleaf[i] = lastleaf[children[i].back()];
+		}
+		size[i] = lastleaf[i] - firstleaf[i];
+	}
+}
+
+//------------------------------------------------------------------------------
+bool QTComparison::SetReference (const Tree &reference)
+{
+	taxa.clear();
+	t1.Build (reference);
+	n = t1.leaves.size();
+	t1.taxonnode.assign (n, -1);
+	ok = true;
+	for (int i = 0; i < n; i++)
+	{
+		int leaf = t1.leaves[i];
+		std::string label = t1.lca.GetNode(leaf)->GetLabel();
+		if (taxa.find (label) != taxa.end())
+			ok = false;
+		taxa[label] = i;
+		t1.taxon[leaf] = i;
+		t1.taxonnode[i] = leaf;
+	}
+	return ok;
+}
+
+//------------------------------------------------------------------------------
+// Matches the leaves of t to those of the reference, and fills in the number
+// of leaves shared by each pair of clusters
+bool QTComparison::SetTree (const Tree &t)
+{
+	if (!ok)
+		return false;
+	t2.Build (t);
+	if ((int)t2.leaves.size() != n)
+		return false;
+	t2.taxonnode.assign (n, -1);
+	for (int i = 0; i < n; i++)
+	{
+		int leaf = t2.leaves[i];
+		std::map<std::string, int>::const_iterator found = taxa.find (t2.lca.GetNode(leaf)->GetLabel());
+		if ((found == taxa.end()) || (t2.taxonnode[found->second] != -1))
+			return false;
+		t2.taxon[leaf] = found->second;
+		t2.taxonnode[found->second] = leaf;
+	}
+
+	int N1 = t1.size.size();
+	N2 = t2.size.size();
+	shared.assign (N1 * N2, 0);
+	for (int i = 0; i < n; i++)
+	{
+		int *row = &shared[t1.taxonnode[i] * N2];
+		for (int v = t2.taxonnode[i]; v >= 0; v = t2.parent[v])
+			row[v] = 1;
+	}
+	for (int u = N1 - 1; u >= 0; u--) // reverse preorder, so children are done first
+	{
+		int *row = &shared[u * N2];
+		for (int c = 0; c < (int)t1.children[u].size(); c++)
+		{
+			const int *childrow = &shared[t1.children[u][c] * N2];
+			for (int v = 0; v < N2; v++)
+				row[v] += childrow[v];
+		}
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+bool QTComparison::CompareTriplets (const Tree &t, QTValues &QR)
+{
+	if (!SetTree (t))
+		return false;
+
+	// Go through each pair of leaves a, b by their LCA v in t, with c_a and c_b the
+	// children of v above a and b, and u their LCA in the reference. Then ab|c in
+	// the reference for the c outside u, and ab|c in t for the c outside v; for c
+	// in c_a or c_b the triplet is resolved the other way in t.
+	std::vector<int> match (N2, -1);
+	for (int i = 0; i < n; i++)
+		match[t2.taxonnode[i]] = t1.taxonnode[i];
+	long long same = 0;
+	long long different = 0;
+	long long resolved1 = 0;
+	long long resolved2 = 0;
+	for (int v = 0; v < N2; v++)
+	{
+		const std::vector<int> &ch = t2.children[v];
+		for (int p = 0; p < (int)ch.size(); p++)
+		{
+			for (int q = p + 1; q < (int)ch.size(); q++)
+			{
+				int ca = ch[p];
+				int cb = ch[q];
+				for (int i = t2.firstleaf[ca]; i < t2.lastleaf[ca]; i++)
+				{
+					int a = match[t2.leaves[i]];
+					for (int j = t2.firstleaf[cb]; j < t2.lastleaf[cb]; j++)
+					{
+						int u = t1.lca.LCA (a, match[t2.leaves[j]]);
+						resolved1 += n - t1.size[u];
+						resolved2 += n - t2.size[v];
+						same += n - t1.size[u] - t2.size[v] + Shared (u, v);
+						different += t2.size[ca] - Shared (u, ca) + t2.size[cb] - Shared (u, cb);
+					}
+				}
+			}
+		}
+	}
+
+	long long total = ((long long)n * (n - 1) * (n - 2)) / 6;
+	QR.n = total;
+	QR.s = same;
+	QR.d = different;
+	QR.x1 = resolved1;
+	QR.r1 = resolved1 - (same + different);
+	QR.r2 = resolved2 - (same + different);
+	QR.u = total - resolved1 - resolved2 + same + different;
+	QR.SD = QR.EA = QR.SJA = QR.DC = 0.0;
+	return true;
+}
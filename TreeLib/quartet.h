@@ -47,19 +47,22 @@
 #endif
 
 #include <vector>
+#include <map>
+#include <string>
 
 #include "ntree.h"
+#include "lcaquery.h"
 
 
 // Values
 typedef struct  {
-	int u;		// unresolved in T1 and T2
-	int d;      // resolved but different
-	int s;      // resolved and same
-	int r1;     // resolved in T1 but not T2
-	int r2;     // resolved in T2 but not T1
-	int x1;     // total resolved in T1
-	int n;      // maximum no. of quartets/triplets
+	long long u;   // unresolved in T1 and T2
+	long long d;   // resolved but different
+	long long s;   // resolved and same
+	long long r1;  // resolved in T1 but not T2
+	long long r2;  // resolved in T2 but not T1
+	long long x1;  // total resolved in T1
+	long long n;   // maximum no. of quartets/triplets
 	float SD;   // symmetric difference
 	float EA;   // explicitly agree
 	float SJA;  // strict joint assertions
@@ -74,6 +77,66 @@ void CompareQuartets (NTree &t1, NTree &t2, QTValues &QR);
 void CompareTriplets (NTree &t1, NTree &t2, QTValues &QR);
 
 
+/**
+ * @class QTComparison
+ * Triplet comparison of trees with one reference tree. The number of leaves
+ * below both of each pair of nodes (one in each tree) is found once, in
+ * O(n^2) time. Triplets are then counted from the LCAs of each pair of
+ * leaves: ab|c holds for every c outside the cluster of LCA(a,b), so the
+ * comparison takes O(n^2) time. Trees are treated as rooted.
+ *
+ * The reference tree is set up once, so it can be compared with many trees.
+ * Leaves are matched by label; a tree whose leaf labels differ from those of
+ * the reference, or are not unique, isn't compared.
+ */
+class QTComparison
+{
+public:
+	QTComparison () { n = 0; ok = false; };
+	QTComparison (const Tree &reference) { SetReference (reference); };
+	virtual ~QTComparison () {};
+	/**
+	 * @brief Set the tree that other trees are compared with
+	 * @return false if the leaf labels aren't unique
+	 */
+	virtual bool SetReference (const Tree &reference);
+	/**
+	 * @brief Compare the triplets in t with those in the reference tree
+	 * (T1 in QR is the reference). Fills in all the counts in QR, but not
+	 * the summary statistics; call SummaryStats for those.
+	 * @return false if t doesn't have the same leaves as the reference
+	 */
+	virtual bool CompareTriplets (const Tree &t, QTValues &QR);
+protected:
+	/**
+	 * A tree as arrays indexed by preorder number (see RMQLCAQuery).
+	 */
+	class FlatTree
+	{
+	public:
+		RMQLCAQuery lca;
+		std::vector<int> parent;
+		std::vector< std::vector<int> > children;
+		std::vector<int> size;			// number of leaves in the cluster of each node
+		std::vector<int> leaves;		// leaves in preorder, so each cluster is a range
+		std::vector<int> firstleaf;
+		std::vector<int> lastleaf;		// one past the last leaf of each cluster
+		std::vector<int> taxon;			// leaf's number in the reference tree, -1 for internal nodes
+		std::vector<int> taxonnode;		// leaf for each taxon
+		void Build (const Tree &t);
+	};
+	int n;
+	bool ok;
+	std::map<std::string, int> taxa;	// reference leaf labels
+	FlatTree t1;
+	FlatTree t2;
+	std::vector<int> shared;			// shared[u * N2 + v] leaves in both cluster u of t1 and cluster v of t2
+	int N2;
+	bool SetTree (const Tree &t);
+	int Shared (int u, int v) const { return shared[u * N2 + v]; };
+};
+
+
 
 #if __BORLANDC__
 	// Redefine __MINMAX_DEFINED so Windows header files compile
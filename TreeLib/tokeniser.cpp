@@ -53,48 +53,27 @@ Tokeniser::~Tokeniser ()
 }
 
 //------------------------------------------------------------------------------
+// Called for every character, so a switch rather than strchr on a list ('\0' is
+// included, as strchr matched the terminator)
 bool Tokeniser::IsPunctuation (char ch)
 {
-	char punctuation[22];
-	punctuation[0]  = '(';
-	punctuation[1]  = ')';
-	punctuation[2]  = '[';
-	punctuation[3]  = ']';
-	punctuation[4]  = '{';
-	punctuation[5]  = '}';
-	punctuation[6]  = '/';
-	punctuation[7]  = '\\';
-	punctuation[8]  = ',';
-	punctuation[9]  = ';';
-	punctuation[10] = ':';
-	punctuation[11] = '=';
-	punctuation[12] = '*';
-	punctuation[13] = '\'';
-	punctuation[14] = '"';
-	punctuation[15] = '`';
-	punctuation[16] = '+';
-	punctuation[17] = '-';
-	punctuation[18] = '<';
-	punctuation[19] = '>';
-	punctuation[20] = '!';
-	punctuation[21] = '#';
-	punctuation[22] = '\0';
-
-
-	return (bool)(strchr (punctuation, ch) != NULL);
+	switch (ch)
+	{
+		case '(': case ')': case '[': case ']': case '{': case '}':
+		case '/': case '\\': case ',': case ';': case ':': case '=':
+		case '*': case '\'': case '"': case '`': case '+': case '-':
+		case '<': case '>': case '!': case '#': case '\0':
+			return true;
+		default:
+			return false;
+	}
 }
 
 
 //------------------------------------------------------------------------------
 bool Tokeniser::IsWhiteSpace (char ch)
 {
-	char whitespace[4];
-	whitespace[0]  = ' ';
-	whitespace[1]  = '\t';
-	whitespace[2]  = '\n';
-	whitespace[3]  = '\0';
-
-	return (bool)(strchr (whitespace, ch) != NULL);
+	return ((ch == ' ') || (ch == '\t') || (ch == '\n') || (ch == '\0'));
 }
 
 //------------------------------------------------------------------------------
@@ -138,7 +117,7 @@ char Tokeniser::GetNextChar ()
 		atEOL = false;
 	}
 
-	filepos = in.tellg();
+	// filepos is found by GetFilePosition when needed, as tellg can cost a system call
 
 
 
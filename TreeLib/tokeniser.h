@@ -130,15 +130,15 @@ public:
 	bool      	AtEOL() { return atEOL; };
 	long       	GetFileColumn() { return filecol; };
 #if (defined( __MWERKS__ ) || (defined __BORLANDC__  && (__BORLANDC__ < 0x0550)))
-	long     	GetFilePosition() { return filepos; };
+	long     	GetFilePosition() { filepos = in.tellg(); return filepos; };
 #else
-	std::streampos  GetFilePosition() { return filepos; };
+	std::streampos  GetFilePosition() { filepos = in.tellg(); return filepos; };
 #endif
 	long       	GetFileLine() { return fileline; };
 	char 	  	GetNextChar ();
 	tokentype 	GetNextToken ();
 	tokentype	GetNextPHYLIPToken ();
-	std::string GetToken () { return token; };
+	const std::string &GetToken () { return token; };
 	bool 		IsPHYLIPEndOfToken (char ch);
 	virtual bool IsPunctuation (char ch);
 	virtual bool IsWhiteSpace (char ch);
@@ -0,0 +1,655 @@
+/*
+ * TreeLib
+ * A library for manipulating phylogenetic trees.
+ * Copyright (C) 2001 Roderic D. M. Page <r.page@bio.gla.ac.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/**
+ * @file treestream.h
+ *
+ * Reading trees from a file one at a time (added by BCO)
+ *
+ */
+#ifndef TREESTREAM_H
+#define TREESTREAM_H
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "TreeLib.h"
+#include "treereader.h"
+
+#include "nexusdefs.h"
+#include "xnexus.h"
+#include "nexustoken.h"
+
+/**
+ * @class TreeStream
+ * Reads the trees in a NEXUS or PHYLIP file lazily, so that only the trees
+ * being worked on need to be in memory. The first Burnin trees in the file
+ * are skipped, and after that only every Thinning-th tree is returned.
+ * Skipped trees are only tokenised, never built.
+ *
+ * NEXUS trees are read from every TREES block in the file, using that
+ * block's TRANSLATE table in the same way as TreesBlock; the labels of a
+ * TAXA block, if any, are kept so the trees can be numbered consistently.
+ */
+template <class T> class TreeStream
+{
+public:
+	/**
+	 * Where the stream is between two trees, with what has been read so far that
+	 * affects the trees after it (see GetPosition and SetPosition)
+	 */
+	struct Position
+	{
+		std::streampos FilePosition;
+		bool InTreesBlock;
+		int FileTreeNumber;
+		std::map <std::string, std::string> TranslateTable;
+		std::vector <std::string> TaxonLabels;
+	};
+	/**
+	 * Constructor
+	 */
+	TreeStream () : Token (NULL), Burnin (0), Thinning (1), isOK (true) { Reset (); };
+	/**
+	 * Destructor
+	 */
+	virtual ~TreeStream () { Close (); };
+
+	/**
+	 * @brief Open a tree file
+	 *
+	 * The format is guessed from the first character, as in Profile::ReadTrees.
+	 * @param filename the name of the file
+	 * @return true if the file was opened and is in a format we can read
+	 */
+	virtual bool Open (const char *filename);
+	/**
+	 * @brief Close the file
+	 */
+	virtual void Close ();
+	/**
+	 * @brief Go back to the start of the file
+	 * @return true if successful
+	 */
+	virtual bool Rewind ();
+	/**
+	 * @brief The current position, to come back to with SetPosition. Only valid
+	 * between trees, i.e. not in the middle of Next or Skip.
+	 */
+	virtual Position GetPosition ();
+	/**
+	 * @brief Go back (or forward) to a position from GetPosition, without reading
+	 * the file up to it
+	 * @return true if successful
+	 */
+	virtual bool SetPosition (const Position &p);
+	/**
+	 * @brief Number of trees to skip at the start of the file
+	 */
+	virtual void SetBurnin (int n) { Burnin = (n < 0) ? 0 : n; };
+	/**
+	 * @brief Keep only every kth tree after the burn-in
+	 */
+	virtual void SetThinning (int k) { Thinning = (k < 1) ? 1 : k; };
+	virtual int GetBurnin () { return Burnin; };
+	virtual int GetThinning () { return Thinning; };
+	/**
+	 * @brief Read the next tree that is kept
+	 *
+	 * @param t the tree, with its name, weight, and rooting set
+	 * @return false at the end of the file or if there is an error (see GetIsOK)
+	 */
+	virtual bool Next (T &t);
+	/**
+	 * @brief Pass over the next n trees that would be kept, without building them
+	 * @return the number of trees passed over, less than n at the end of the file
+	 */
+	virtual int Skip (int n);
+	/**
+	 * @brief Append up to n more trees to chunk
+	 * @return the number of trees read
+	 */
+	virtual int ReadChunk (std::vector <T> &chunk, int n);
+	/**
+	 * @brief Number of trees that would be kept, found by passing over the whole
+	 * file once. Leaves the stream at the start of the file.
+	 */
+	virtual int CountTrees ();
+	/**
+	 * @brief Position in the file of the last tree returned or skipped, counting from 1
+	 */
+	virtual int GetFileTreeNumber () { return FileTreeNumber; };
+	/**
+	 * @brief Labels in the TAXA block of a NEXUS file, in order; empty if there is none
+	 * or it has not been reached yet
+	 */
+	virtual const std::vector <std::string> &GetTaxonLabels () { return TaxonLabels; };
+	virtual bool GetIsOK () { return isOK; };
+	virtual bool IsOpen () { return f.is_open(); };
+
+protected:
+	std::ifstream f;
+	NexusToken *Token;
+	bool IsNEXUS;
+	bool InTreesBlock;
+	int Burnin;
+	int Thinning;
+	int FileTreeNumber;
+	bool isOK;
+	std::map <std::string, std::string> TranslateTable;
+	std::vector <std::string> TaxonLabels;
+
+	// Current tree, not yet parsed
+	std::string Name;
+	std::string Description;
+	bool Rooted;
+	double Weight;
+
+	virtual void Reset ();
+	virtual bool NextDescription ();
+	virtual bool NextKeptDescription ();
+	virtual bool NextNEXUSDescription ();
+	virtual bool NextPHYLIPDescription ();
+	virtual void ReadTranslate ();
+	virtual void ReadOtherBlock (bool isTaxaBlock);
+	virtual std::string TranslatedDescription ();
+};
+
+//------------------------------------------------------------------------------
+template <class T> void TreeStream<T>::Reset ()
+{
+	InTreesBlock = false;
+	FileTreeNumber = 0;
+	TranslateTable.clear();
+	TaxonLabels.clear();
+	isOK = true;
+}
+
+//------------------------------------------------------------------------------
+template <class T> bool TreeStream<T>::Open (const char *filename)
+{
+	Close ();
+	f.open (filename, std::ios::in | std::ios::binary);
+	if (!f.is_open())
+		return false;
+	return Rewind ();
+}
+
+//------------------------------------------------------------------------------
+template <class T> void TreeStream<T>::Close ()
+{
+	if (Token != NULL)
+	{
+		delete Token;
+		Token = NULL;
+	}
+	if (f.is_open())
+		f.close();
+	Reset ();
+}
+
+//------------------------------------------------------------------------------
+template <class T> bool TreeStream<T>::Rewind ()
+{
+	if (Token != NULL)
+	{
+		delete Token;
+		Token = NULL;
+	}
+	Reset ();
+	f.clear();
+	f.seekg (0, std::ios::beg);
+
+	char ch = (char)f.peek ();
+	if (ch == '#')
+	{
+		IsNEXUS = true;
+		Token = new NexusToken (f);
+		try
+		{
+			Token->GetNextToken ();
+		}
+		catch (XNexus x)
+		{
+			isOK = false;
+			return false;
+		}
+		if (!Token->Equals ("#NEXUS"))
+		{
+			isOK = false;
+			return false;
+		}
+	}
+	else if (strchr ("([", ch))
+		IsNEXUS = false;
+	else
+	{
+		isOK = false;
+		return false;
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+// The tokeniser keeps no characters back after the ';' ending a TREE command, so
+// the file position is exactly where the next tree's text starts
+template <class T> typename TreeStream<T>::Position TreeStream<T>::GetPosition ()
+{
+	Position p;
+	p.FilePosition = f.tellg ();
+	p.InTreesBlock = InTreesBlock;
+	p.FileTreeNumber = FileTreeNumber;
+	p.TranslateTable = TranslateTable;
+	p.TaxonLabels = TaxonLabels;
+	return p;
+}
+
+//------------------------------------------------------------------------------
+template <class T> bool TreeStream<T>::SetPosition (const Position &p)
+{
+	if (!f.is_open())
+		return false;
+	if (Token != NULL)
+	{
+		delete Token;
+		Token = NULL;
+	}
+	f.clear();
+	f.seekg (p.FilePosition);
+	if (!f)
+	{
+		isOK = false;
+		return false;
+	}
+	if (IsNEXUS)
+		Token = new NexusToken (f);
+	InTreesBlock = p.InTreesBlock;
+	FileTreeNumber = p.FileTreeNumber;
+	TranslateTable = p.TranslateTable;
+	TaxonLabels = p.TaxonLabels;
+	isOK = true;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+template <class T> bool TreeStream<T>::NextDescription ()
+{
+	if (!f.is_open() || !isOK)
+		return false;
+	bool found;
+	if (IsNEXUS)
+	{
+		try
+		{
+			found = NextNEXUSDescription ();
+		}
+		catch (XNexus x)
+		{
+#if USE_WXWINDOWS
+			wxLogError ("%s at line %d, column %d", x.msg.c_str(), x.line, x.col);
+#else
+			std::cerr << x.msg << " (line " << x.line << ", column " << x.col << ")" << std::endl;
+#endif
+			isOK = false;
+			found = false;
+		}
+	}
+	else
+		found = NextPHYLIPDescription ();
+	if (found)
+		FileTreeNumber++;
+	return found;
+}
+
+//------------------------------------------------------------------------------
+// Moves on to the next tree that survives the burn-in and thinning
+template <class T> bool TreeStream<T>::NextKeptDescription ()
+{
+	for (;;)
+	{
+		if (!NextDescription ())
+			return false;
+		if ((FileTreeNumber > Burnin) && ((FileTreeNumber - Burnin - 1) % Thinning == 0))
+			return true;
+	}
+}
+
+//------------------------------------------------------------------------------
+// Reads a TREE command, skipping anything outside TREES blocks. Follows
+// TreesBlock::Read.
+template <class T> bool TreeStream<T>::NextNEXUSDescription ()
+{
+	NexusToken &token = *Token;
+	for (;;)
+	{
+		token.SetLabileFlagBit (NexusToken::saveCommandComments);
+		token.GetNextToken ();
+		if (token.AtEOF())
+			return false;
+
+		if (!InTreesBlock)
+		{
+			if (token.Equals ("BEGIN"))
+			{
+				token.GetNextToken ();
+				if (token.Equals ("TREES"))
+				{
+					token.GetNextToken (); // the semicolon after the block name
+					InTreesBlock = true;
+					TranslateTable.clear();
+				}
+				else
+					ReadOtherBlock (token.Equals ("TAXA"));
+			}
+		}
+		else if (token.Equals ("TRANSLATE"))
+			ReadTranslate ();
+		else if (token.Equals ("TREE"))
+		{
+			token.GetNextToken ();
+			if (token.Equals ("*"))
+				token.GetNextToken ();
+			Name = token.GetToken ();
+			token.GetNextToken ();
+			if (!token.Equals ("="))
+			{
+				nxsstring errormsg = "Expecting '=' after tree name in TREE command, but found ";
+				errormsg += token.GetToken ();
+				errormsg += " instead";
+				throw XNexus (errormsg, token.GetFilePosition(), token.GetFileLine(), token.GetFileColumn());
+			}
+			Rooted = false;
+			Weight = 1.0;
+			token.SetLabileFlagBit (NexusToken::saveCommandComments);
+			token.SetLabileFlagBit (NexusToken::parentheticalToken);
+			token.GetNextToken ();
+			nxsstring s = token.GetToken ();
+			while ((s.size() > 1) && (s[0] == '&'))
+			{
+				if (s[1] == 'R' || s[1] == 'r')
+					Rooted = true;
+				else if (s[1] == 'U' || s[1] == 'u')
+					Rooted = false;
+				else if (s[1] == 'W' || s[1] == 'w')
+				{
+					int pos = s.find ("/", 2);
+					if (pos > 0 && pos < s.length())
+					{
+						nxsstring num;
+						num.assign (s, 2, pos - 2);
+						double numerator = atof (num.c_str());
+						num.assign (s, pos + 1, s.size() - pos);
+						Weight = numerator / atof (num.c_str());
+					}
+					else
+						Weight = atof (s.c_str() + 2);
+				}
+				token.SetLabileFlagBit (NexusToken::saveCommandComments);
+				token.SetLabileFlagBit (NexusToken::parentheticalToken);
+				token.GetNextToken ();
+				s = token.GetToken ();
+			}
+			Description = s;
+			token.GetNextToken ();
+			if (!token.Equals (";"))
+			{
+				nxsstring errormsg = "Expecting ';' to terminate the TREE command, but found ";
+				errormsg += token.GetToken ();
+				errormsg += " instead";
+				throw XNexus (errormsg, token.GetFilePosition(), token.GetFileLine(), token.GetFileColumn());
+			}
+			return true;
+		}
+		else if (token.Equals ("END") || token.Equals ("ENDBLOCK"))
+		{
+			token.GetNextToken (); // the semicolon
+			InTreesBlock = false;
+		}
+		else
+		{
+			// some other command in the TREES block
+			while (!token.Equals (";") && !token.AtEOF())
+				token.GetNextToken ();
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+template <class T> void TreeStream<T>::ReadTranslate ()
+{
+	NexusToken &token = *Token;
+	do {
+		token.GetNextToken ();
+		std::string key = token.GetToken ();
+		token.GetNextToken ();
+		TranslateTable[key] = token.GetToken ();
+		token.GetNextToken ();
+		if (!token.Equals (";") && !token.Equals (","))
+		{
+			nxsstring errormsg = "Expecting ',' or ';' in TRANSLATE command, but found ";
+			errormsg += token.GetToken ();
+			errormsg += " instead.";
+			throw XNexus (errormsg, token.GetFilePosition(), token.GetFileLine(), token.GetFileColumn());
+		}
+	} while (!token.Equals (";"));
+}
+
+//------------------------------------------------------------------------------
+// Skips a block other than TREES, keeping the TAXLABELS of a TAXA block
+template <class T> void TreeStream<T>::ReadOtherBlock (bool isTaxaBlock)
+{
+	NexusToken &token = *Token;
+	for (;;)
+	{
+		token.GetNextToken ();
+		if (token.AtEOF())
+			return;
+		if (token.Equals ("END") || token.Equals ("ENDBLOCK"))
+		{
+			token.GetNextToken (); // the semicolon
+			return;
+		}
+		if (isTaxaBlock && token.Equals ("TAXLABELS"))
+		{
+			TaxonLabels.clear();
+			for (;;)
+			{
+				token.GetNextToken ();
+				if (token.Equals (";") || token.AtEOF())
+					break;
+				TaxonLabels.push_back (token.GetToken ());
+			}
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+// Reads raw characters up to the next ';', outside quotes and comments
+template <class T> bool TreeStream<T>::NextPHYLIPDescription ()
+{
+	Description = "";
+	bool inQuote = false;
+	int commentLevel = 0;
+	char ch;
+	while (f.get (ch))
+	{
+		if (Description.empty() && isspace ((unsigned char)ch))
+			continue;
+		Description += ch;
+		if (inQuote)
+		{
+			if (ch == '\'')
+				inQuote = false;
+		}
+		else if (ch == '[')
+			commentLevel++;
+		else if (ch == ']' && commentLevel > 0)
+			commentLevel--;
+		else if (commentLevel == 0)
+		{
+			if (ch == '\'')
+				inQuote = true;
+			else if (ch == ';')
+				break;
+		}
+	}
+	if (Description.empty())
+		return false;
+	Name = "";
+	Rooted = false;
+	Weight = 1.0;
+	return true;
+}
+
+//------------------------------------------------------------------------------
+// As TreesBlock::GetTranslatedTreeDescription
+template <class T> std::string TreeStream<T>::TranslatedDescription ()
+{
+	const std::string &s = Description;
+	if (TranslateTable.empty() || (s.size() < 2))
+		return s;
+	std::string x;
+	x += s[0];
+	int slen = s.size();
+	int curlyparenlevel = 0;
+	for (int k = 1; k < slen; k++)
+	{
+		char prev = s[k-1];
+		char curr = s[k];
+		if (curr == '{')
+			curlyparenlevel++;
+		else if (curr == '}')
+			curlyparenlevel--;
+		if (isdigit (curr) && (prev == '(' || prev == ',') && (curlyparenlevel == 0))
+		{
+			std::string ns;
+			ns += curr;
+			while ((k + 1 < slen) && isdigit (s[k+1]))
+				ns += s[++k];
+			std::string nss = TranslateTable[ns];
+			for (int j = 0; j < nss.size(); j++)
+			{
+				if (nss[j] == ' ')
+					nss[j] = '_';
+			}
+			x += "'";
+			x += nss;
+			x += "'";
+		}
+		else
+			x += curr;
+	}
+	return x;
+}
+
+//------------------------------------------------------------------------------
+template <class T> bool TreeStream<T>::Next (T &t)
+{
+	if (!NextKeptDescription ())
+		return false;
+	if (IsNEXUS)
+	{
+		std::string tstr = TranslatedDescription ();
+		tstr += ";";
+		if (t.Parse (tstr.c_str()) != 0)
+		{
+#if USE_WXWINDOWS
+			wxLogError ("Error in description of tree %d: %s", FileTreeNumber, t.GetErrorMsg().c_str());
+#else
+			std::cerr << "Error in tree description " << FileTreeNumber << ": " << t.GetErrorMsg() << std::endl;
+#endif
+			isOK = false;
+			return false;
+		}
+		t.SetName (Name);
+		t.SetRooted (Rooted);
+		t.SetWeight (Weight);
+	}
+	else
+	{
+		std::istringstream s (Description);
+		Tokeniser p (s);
+		PHYLIPReader tr (p);
+		try
+		{
+			if (!tr.Read (&t))
+				return false;
+		}
+		catch (XTokeniser x)
+		{
+#if USE_WXWINDOWS
+			wxLogError ("%s in tree %d, column %d", x.msg.c_str(), FileTreeNumber, x.col);
+#else
+			std::cerr << x.msg << " (tree " << FileTreeNumber << ", column " << x.col << ")" << std::endl;
+#endif
+			isOK = false;
+			return false;
+		}
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+template <class T> int TreeStream<T>::Skip (int n)
+{
+	int skipped = 0;
+	while ((skipped < n) && NextKeptDescription ())
+		skipped++;
+	return skipped;
+}
+
+//------------------------------------------------------------------------------
+template <class T> int TreeStream<T>::ReadChunk (std::vector <T> &chunk, int n)
+{
+	int count = 0;
+	chunk.reserve (chunk.size() + n);
+	while (count < n)
+	{
+		chunk.push_back (T());
+		if (!Next (chunk.back()))
+		{
+			chunk.pop_back();
+			break;
+		}
+		count++;
+	}
+	return count;
+}
+
+//------------------------------------------------------------------------------
+template <class T> int TreeStream<T>::CountTrees ()
+{
+	if (!Rewind ())
+		return 0;
+	int count = 0;
+	while (NextKeptDescription ())
+		count++;
+	Rewind ();
+	return count;
+}
+
+#endif
@@ -34,6 +34,7 @@
 #include "treewriter.h"
 #include <time.h>
 #include <map>
+#include <algorithm>
 #include <limits>
 #include "brownie.h"
 #include <gsl/gsl_math.h>
@@ -68,6 +69,9 @@
 #include <sstream>
 #include <iostream>
 #include "superdouble.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 //took out this section since GTP is built in
 //extern "C" {
@@ -155,6 +159,10 @@ BROWNIE::~BROWNIE()
         echof<<"end;";
         echof.close();
     }
+    ClearContourSearchTables();
+    if (ContourSearchFile.length()>0) {
+        remove(ContourSearchFile.c_str());
+    }
 }
 
 /**
@@ -286,6 +294,7 @@ void BROWNIE::FactoryDefaults()
 	useMS=false;
 	msbasereps=100000;
 	contourBrlenToExport=2;
+	ContourSearchRows=0;
 	contourMaxRecursions=20;
 	contourstartingnumbersteps=15;
 	contourstartingwidth=10;
@@ -313,6 +322,11 @@ void BROWNIE::FactoryDefaults()
 	minsamplesperspecies=3;
 	maxstartstops=10;
 	rearrlimit=-1;
+	sprbatch=1;
+	maxtime=0;
+	checkpointfilename="";
+	checkpointinterval=600;
+	resumesearch=false;
     steepest=false;
 	exhaustive=false;
     status=true;
@@ -326,6 +340,7 @@ void BROWNIE::FactoryDefaults()
 	triplettoohigh=false;
 	gtptoohigh=false;
 	infinitescore=false;
+	tripletmemorylimit=1024;
 	tripletdistthreshold=0.2; //Sets how often to use NJ tree distances for starting assignments (higher number=more often) and how often to use triplet support
     pthreshold=1;
 	chosensubsampling=2.0;
@@ -539,14 +554,12 @@ void BROWNIE::HandleExecuteCmdLine(nxsstring fn)
         NexusToken ftoken(inf);
 
         inf_open = true;
-        ifstream intreefile;
-        intreefile.open(fn.c_str(),ios::in);
-        if (!intrees.ReadTrees(intreefile))
+        ClearGeneTreeCaches();
+        if (!intrees.ReadTreesCached(fn.c_str()))
         {
             message="No trees read from file\n";
             PrintMessage();
         }
-        intreefile.close();
 
         try {
             Execute( ftoken );
@@ -691,14 +704,12 @@ void BROWNIE::HandleExecute( NexusToken& token )
             ifstream inf( fn.c_str(), ios::binary | ios::in );
 
             inf_open = true;
-            ifstream intreefile;
-            intreefile.open(fn.c_str(),ios::in);
-            if (!intrees.ReadTrees(intreefile))
+            ClearGeneTreeCaches();
+            if (!intrees.ReadTreesCached(fn.c_str()))
             {
                 message="No trees read from file\n";
                 PrintMessage();
             }
-            intreefile.close();
 
             NexusToken ftoken(inf);
 
@@ -1042,6 +1053,11 @@ double BROWNIE::AICc(double neglnL, int K, int N) {
  *
  * If there are trees already in the executed Nexus block, no need
  *   to run this.
+ *
+ * Burnin= and Thin= drop trees from the start of the file and keep
+ *   only every nth tree after that. With Stream=yes the trees are not
+ *   all stored, but read Chunk= at a time as they are used, so big
+ *   posterior samples can be looped over in limited memory.
  */
 void BROWNIE::HandleGettrees( NexusToken& token )
 {
@@ -1060,6 +1076,10 @@ void BROWNIE::HandleGettrees( NexusToken& token )
     }
 
     nxsstring fn;
+    int burnin=0;
+    int thinning=1;
+    bool streaming=false;
+    int chunksize=100;
     for(;;)
     {
         token.GetNextToken();
@@ -1069,12 +1089,58 @@ void BROWNIE::HandleGettrees( NexusToken& token )
         }
         else if( token.Abbreviation("File") ) {
             fn=GetFileName(token);
-            break;
+        }
+        else if( token.Abbreviation("BUrnin") ) {
+            nxsstring numbernexus = GetNumber(token);
+            burnin=atoi( numbernexus.c_str() ); //convert to int
+        }
+        else if( token.Abbreviation("THin") ) {
+            nxsstring numbernexus = GetNumber(token);
+            thinning=atoi( numbernexus.c_str() ); //convert to int
+            if (thinning<1) {
+                errormsg = "Error: thin must be at least one";
+                throw XNexus (errormsg, token.GetFilePosition(), token.GetFileLine(), token.GetFileColumn() );
+            }
+        }
+        else if( token.Abbreviation("STream") ) {
+            nxsstring yesnostream=GetFileName(token);
+            if (yesnostream[0] == 'n' || yesnostream[0] == 'N') {
+                streaming=false;
+            }
+            else {
+                streaming=true;
+            }
+        }
+        else if( token.Abbreviation("CHunk") ) {
+            nxsstring numbernexus = GetNumber(token);
+            chunksize=atoi( numbernexus.c_str() ); //convert to int
+            if (chunksize<1) {
+                errormsg = "Error: chunk must be at least one";
+                throw XNexus (errormsg, token.GetFilePosition(), token.GetFileLine(), token.GetFileColumn() );
+            }
         }
         else {
             fn=token.GetToken();
         }
     }
+    ClearGeneTreeCaches();
+    if (streaming || burnin>0 || thinning>1) {
+        if (!intrees.StreamTrees(fn.c_str(),burnin,thinning,(streaming ? chunksize : 0)))
+        {
+            errormsg="Failed to read trees";
+            throw XNexus (errormsg, token.GetFilePosition(), token.GetFileLine(), token.GetFileColumn() );
+        }
+        message="Using ";
+        message+=intrees.GetNumTrees();
+        message+=" trees";
+        if (streaming) {
+            message+=", read ";
+            message+=chunksize;
+            message+=" at a time";
+        }
+        PrintMessage();
+        return;
+    }
     //input stream
     ifstream intreefile;
     intreefile.open(fn.c_str(),ios::in);
@@ -1090,6 +1156,39 @@ void BROWNIE::HandleGettrees( NexusToken& token )
     intreefile.close();
 }
 
+/**
+* @method GetNumLoopTrees [int:protected]
+ *
+ * Number of trees the treeloop options go over: those in the TREES
+ * block, or if there are none, the trees from GetTrees (which may be
+ * streamed from their file rather than stored).
+ */
+int BROWNIE::GetNumLoopTrees()
+{
+    if (trees->GetNumTrees()>0) {
+        return trees->GetNumTrees();
+    }
+    return intrees.GetNumTrees();
+}
+
+//Weight of tree i (from 0) of the trees counted by GetNumLoopTrees
+double BROWNIE::GetLoopTreeWeight(int i)
+{
+    if (trees->GetNumTrees()>0) {
+        return trees->GetTreeWeight(i);
+    }
+    return intrees.GetIthTreeRef(i).GetWeight();
+}
+
+//Name of tree i (from 0) of the trees counted by GetNumLoopTrees
+nxsstring BROWNIE::GetLoopTreeName(int i)
+{
+    if (trees->GetNumTrees()>0) {
+        return trees->GetTreeName(i);
+    }
+    return intrees.GetIthTreeRef(i).GetName().c_str();
+}
+
 /**
 * @method HandleShowtree [void:protected]
  * @param token [NexusToken&] the token used to read from in
@@ -1205,6 +1304,31 @@ void BROWNIE::HandleHeuristicSearch( NexusToken& token )
 			else {
 				message+=rearrlimit;
 			}
+            message+="\nSPRBatch     <integer-value>                         ";
+            message+=sprbatch;
+            message+="\nMaxTime      <integer-value>|None                    ";
+			if (maxtime>0) {
+				message+=int(maxtime);
+			}
+			else {
+				message+="None";
+			}
+            message+="\nCheckpoint   <file-name>|None                        ";
+			if (checkpointfilename.length()>0) {
+				message+=checkpointfilename;
+			}
+			else {
+				message+="None";
+			}
+            message+="\nCheckInterval <integer-value>                        ";
+            message+=int(checkpointinterval);
+            message+="\nResume       No|Yes                                  ";
+			if (resumesearch) {
+				message+="Yes";
+			}
+			else {
+				message+="No";
+			}
             //message+="\nAssignFixed  No|Yes                                  Yes";
             //message+="\nSppNumFixed  No|Yes                                  Yes";
             message+="\nMaxNumSpp    <integer-value>                         ";
@@ -1269,6 +1393,9 @@ void BROWNIE::HandleHeuristicSearch( NexusToken& token )
             //message+="\nTimeLimit: Limit search to X seconds";
             //message+="\nClock: Count seconds for time limit using actual elapsed time ('Wall'->Clock on a wall) or CPU time"; //NOte to self: see discussion online of time() fn and clock() fn in C++
             message+="\nRearrLimit: Limit search to X rearrangements for each nrep";
+            message+="\nMaxTime: Stop the search after X seconds of elapsed time, keeping the best trees found so far";
+            message+="\nCheckpoint: Save the state of the search to this file after each replicate and every CheckInterval seconds within one, and when MaxTime is reached";
+            message+="\nResume: Continue the search saved in the Checkpoint file rather than starting again. The data and search options should be the same as when it was saved";
             //message+="\nAssignFixed: Assignment of gene samples to species is not optimized during a search";
             //message+="\nSppNumFixed: The total number of species is not optimized during the search (if set to No, then AssignFixed is also set to No)";
             message+="\nMaxNumSpp: The maximum number of species to split the samples into (only relevant if SppNumFixed==No)";
@@ -1279,8 +1406,8 @@ void BROWNIE::HandleHeuristicSearch( NexusToken& token )
            // message+="\nStatus: Output status of search to screen (and a log file, if open).";
            // message+="\nSteepest: Whether to look at all rearrangements and then take the best one or just take the first better one.";
 			message+="\nSubsample: How extensively to try taxon reassignments on leaf splits. \n\tA value of 1 means try all of the possible reassignments, \n\ta value of 2 means try the square root of all the possible assignments,\n\t3 means the cube root, etc. A higher number means a faster but less effective search.\n\tThe program won't let you try fewer than 10 assignments on average.";
-			message+="\nMS: Use Hudson's program MS to simulate gene trees to estimate probabilities. MAKE SURE MS IS INSTALLED SOMEWHERE ACCESSIBLE TO BROWNIE.";
-			message+="\nCOAL: Use Degnan's program COAL to optimize the likelihood of the species delimitation and tree rather than the semiparametric penalty function. MAKE SURE COAL IS INSTALLED SOMEWHERE ACCESSIBLE TO BROWNIE.";
+			message+="\nMS: Simulate gene trees under the coalescent, as Hudson's program MS does, to estimate probabilities. Simulation is done within Brownie, so MS need not be installed.";
+			message+="\nCOAL: Optimize the likelihood of the species delimitation and tree (the probability of the gene trees under the coalescent, as in Degnan's program COAL) rather than the semiparametric penalty function. Gene trees must be rooted and fully resolved; species tree branch lengths are in coalescent units.";
 			message+="\nAIC_mode: When using COAL, use the 0: likelihood as the penalty term, 1: AIC value (k=number of species), 2: AICc with n=number of genes, 3: AICc with n=number of samples, 4: AICc with n=(number of genes) * (number of samples)";
 			message+="\nGridWidth, GridSize, MaxRecursions all affect grid search";
 			message+="\nBranch_export: if set to 0, returns a single estimate of the best branch lengths on the species tree. If set to 1, returns a table of equally-good branch lengths. If set to 2, returns a table of the best and neighboring branch lengths, suitable for doing a contour plot of score versus branch lengths";
@@ -1325,6 +1452,56 @@ void BROWNIE::HandleHeuristicSearch( NexusToken& token )
 			}
 			PrintMessage();
         }		
+		else if(token.Abbreviation("MAXTime")) {
+            nxsstring numbernexus;
+			message="Time limit set to ";
+            numbernexus = GetFileName(token);
+			if (numbernexus[0]=='n' || numbernexus[0]=='N') {
+				maxtime=0;
+				message+="None";
+			}
+			else {
+				maxtime=GSL_MAX(0,atof(numbernexus.c_str()));
+				message+=maxtime;
+				message+=" seconds";
+			}
+			PrintMessage();
+        }
+		else if(token.Abbreviation("CHECKPoint")) {
+            nxsstring filenamenexus=GetFileName(token);
+			if (filenamenexus=="none" || filenamenexus=="None" || filenamenexus=="NONE") {
+				checkpointfilename="";
+				message="No checkpoints will be saved";
+			}
+			else {
+				checkpointfilename=filenamenexus;
+				message="Search state will be saved to ";
+				message+=checkpointfilename;
+			}
+			PrintMessage();
+        }
+		else if(token.Abbreviation("CHECKInterval")) {
+            nxsstring numbernexus;
+            numbernexus = GetNumber(token);
+			checkpointinterval=GSL_MAX(1,atof(numbernexus.c_str()));
+        }
+		else if( token.Abbreviation("RESume") ) {
+            nxsstring yesnoreplace=GetFileName(token);
+            if (yesnoreplace[0] == 'n' || yesnoreplace[0] == 'N') {
+                resumesearch=false;
+            }
+            else {
+                resumesearch=true;
+            }
+        }
+		else if(token.Abbreviation("SPRBatch")) {
+            nxsstring numbernexus;
+            numbernexus = GetFileName(token);
+			sprbatch=GSL_MAX(1,atoi(numbernexus.c_str()));
+			message="Number of SPR rearrangements to make and score at once set to ";
+			message+=sprbatch;
+			PrintMessage();
+        }
         else if( token.Abbreviation("STEepest") ) {
             nxsstring yesnoreplace=GetFileName(token);
             if (yesnoreplace[0] == 'n' || yesnoreplace[0] == 'N') {
@@ -1363,7 +1540,7 @@ void BROWNIE::HandleHeuristicSearch( NexusToken& token )
             else {
                 useCOAL=true;
 				useMS=false;
-				message="This will use COAL for the search";
+				message="This will use gene tree probabilities under the coalescent (as in COAL) for the search";
 				PrintMessage();
 				
             }
@@ -1376,7 +1553,7 @@ void BROWNIE::HandleHeuristicSearch( NexusToken& token )
             else {
                 useMS=true;
 				useCOAL=false;
-				message="This will use ms for the search";
+				message="This will use simulated gene trees under the coalescent (as in ms) for the search";
 				PrintMessage();
 				if (movefreqvector[5]==0) {
 					movefreqvector[0]=0.1;
@@ -1639,37 +1816,29 @@ vector<double> BROWNIE::GetCombinedScore(ContainingTree *SpeciesTreePtr)
 				calculatescore=false;
 			}
 		}		
-		if (calculatescore && maxspecies==1) { //COAL can't calculate probability of gene tree on species tree with one species, so use Harding 1971 equation 5.3 to do it manually
+		if (calculatescore && maxspecies==1) { //with one species, use Harding 1971 equation 5.3 directly
 			neglnlikelihood=0;
 			for (int chosentreenum=0; chosentreenum<trees->GetNumTrees(); chosentreenum++) { //loop over all the gene trees
-				Tree CurrentGeneTreeTreeFmt=intrees.GetIthTree(chosentreenum);
-				CurrentGeneTreeTreeFmt.Update(); //sets weights
-				NodeIterator <Node> n (CurrentGeneTreeTreeFmt.GetRoot()); //starts at leaves and works down
+				CompactTree CurrentGeneTree(intrees.GetIthTreeRef(chosentreenum)); //the number of leaves below a node is the size of its leaf range
+				const vector<int> &postorder=CurrentGeneTree.GetPostorder(); //starts at leaves and works down
 				double probability=1;
-				cur = n.begin();
-				while (cur) {
-					if (!(cur->IsLeaf())) {
-						int Q=(cur->GetChild())->GetWeight();
-						int R=((cur->GetChild())->GetSibling())->GetWeight();
+				for (int nodeindex=0;nodeindex<postorder.size();nodeindex++) {
+					int node=postorder[nodeindex];
+					if (!(CurrentGeneTree.IsLeaf(node))) {
+						int firstchild=CurrentGeneTree.GetFirstChild(node);
+						int secondchild=CurrentGeneTree.GetSibling(firstchild);
+						int Q=CurrentGeneTree.GetLastLeaf(firstchild)-CurrentGeneTree.GetFirstLeaf(firstchild);
+						int R=CurrentGeneTree.GetLastLeaf(secondchild)-CurrentGeneTree.GetFirstLeaf(secondchild);
 						int N=R+Q;
 						probability*=2*(gsl_sf_fact(R))*(gsl_sf_fact(Q))/((N-1.0)*gsl_sf_fact(N)); //in Harding's equation, we calculate [Pl{Q] and Pl[R] when we are at the child nodes
 						//cout<<"probability now "<<probability<<" with Q="<<Q<<" and R="<<R<<endl;
 					}
-					//else {
-					//	cout<<"Leaf "<<cur->GetLabel()<<endl;
-					//}
-					cur = n.next();
 				}
 				neglnlikelihood+=-1.0*log(probability);
 				//cout<<"neglnlikelihood now "<<neglnlikelihood<<endl<<endl;
 			}
 		}
 		else if (calculatescore && maxspecies>1) {
-		//export the species tree
-			nxsstring coalspecies="coalspecies.txt";
-
-			ofstream coalspeciesstream;
-			coalspeciesstream.open( coalspecies.c_str() );
 			ContainingTree CurrentTree=*SpeciesTreePtr;
 			CurrentTree.FindAndSetRoot();
 			CurrentTree.Update();
@@ -1679,137 +1848,57 @@ vector<double> BROWNIE::GetCombinedScore(ContainingTree *SpeciesTreePtr)
 		//		CurrentTree.Write(logf);
 		//	}
 		//CurrentTree.Draw(cout);
+			vector<int> leafspecies; //species tree leaves are labeled taxon1, taxon2, etc.
 			NodeIterator <Node> n (CurrentTree.GetRoot());
 			cur = n.begin();
 			while (cur) {
 				if (cur->IsLeaf()) {
 					currentnumberofspecies++;
-				//nxsstring newlabel=PipeLeafFinalSpeciesTree();
-				//cur->SetLabel(newlabel);
-				}
-				else {
-					cur->SetLabel("");
-				}
-				cur = n.next();
-			}
-			(CurrentTree).Write(coalspeciesstream);
-			coalspeciesstream<<endl;
-			coalspeciesstream.close();
-			
-		//export the gene trees
-			nxsstring coalgenes="coalgenes.txt";
-			ofstream coalgenesstream;
-			coalgenesstream.open( coalgenes.c_str());
-			for (int chosentreenum=0; chosentreenum<trees->GetNumTrees(); chosentreenum++) { //loop over all the gene trees
-				Tree CurrentGeneTreeTreeFmt=intrees.GetIthTree(chosentreenum);
-				NodeIterator <Node> n (CurrentGeneTreeTreeFmt.GetRoot());
-				cur = n.begin();
-				while (cur) {
-					if (cur->IsLeaf()) {
-						int SampleNumber=taxa->FindTaxon(cur->GetLabel());
-						nxsstring newlabel="taxon";
-						newlabel+=convertsamplestospecies[SampleNumber];
-						newlabel+="-";
-						newlabel+=SampleNumber;
-						cur->SetLabel(newlabel);
-					//cout<<"current label is "<<cur->GetLabel()<<" perhaps with quotes"<<endl;
-					}
-					else {
-						cur->SetLabel("");
+					string speciesstring=cur->GetLabel();
+					size_t index = speciesstring.find("taxon");
+					if (index!=string::npos) {
+						speciesstring.erase(index,5); //erase "taxon"
 					}
-					cur = n.next();
+					leafspecies.push_back(atoi(speciesstring.c_str()));
 				}
-				(CurrentGeneTreeTreeFmt).WriteNoQuote(coalgenesstream);
-				coalgenesstream<<endl;
-				
-				
+				cur = n.next();
 			}
-			coalgenesstream.close();
 			
-		//export the infile
-			nxsstring coalinfile="infile";
-			ofstream coalinfilestream;
-			coalinfilestream.open(coalinfile.c_str() );
-			coalinfilestream<<"begin coal;"<<endl;
-			coalinfilestream<<"nstaxa ";
-			coalinfilestream<<currentnumberofspecies<<";"<<endl;
-			coalinfilestream<<"ngtaxa";
-			nxsstring speciesnames="taxa names = ";
-			for (int i=1; i<=currentnumberofspecies; i++) {
-				int samplecount=0;
-				for (int j=0; j<=convertsamplestospecies.size();j++) {
-					if (convertsamplestospecies[j]==i)  {
-						samplecount++;
+		//gene trees only need to be converted once; identical topologies are scored once
+			if (coalprobs.GetNumGeneTrees()!=trees->GetNumTrees()) {
+				coalprobs.Clear();
+				for (int chosentreenum=0; chosentreenum<trees->GetNumTrees(); chosentreenum++) { //loop over all the gene trees
+					const Tree &CurrentGeneTreeTreeFmt=intrees.GetIthTreeRef(chosentreenum);
+					vector<int> leafsamples;
+					NodeIterator <Node> n (CurrentGeneTreeTreeFmt.GetRoot());
+					cur = n.begin();
+					while (cur) {
+						if (cur->IsLeaf()) {
+							leafsamples.push_back(taxa->FindTaxon(cur->GetLabel()));
+						}
+						cur = n.next();
 					}
-				}
-				speciesnames+=" taxon";
-				speciesnames+=i;
-				coalinfilestream<<" "<<samplecount;
-			}
-			coalinfilestream<<";"<<endl;
-			coalinfilestream<<speciesnames<<";"<<endl;
-			coalinfilestream<<"intra yes;"<<endl;
-			coalinfilestream<<"gene tree file=coalgenes.txt;"<<endl;
-			coalinfilestream<<"species tree file=coalspecies.txt;"<<endl;
-			coalinfilestream<<"nstrees 1;"<<endl;
-			coalinfilestream<<"ngtrees "<<trees->GetNumTrees()<<";"<<endl;
-			nxsstring coaloutputfile="coalout.txt";
-			coalinfilestream<<"outfile = "<<coaloutputfile<<"  / probs   ;"<<endl;		
-			coalinfilestream<<"end;"<<endl;
-			coalinfilestream.close();
-			
-		//run coal
-		//cout<<"Starting to call coal"<<endl;
-			int coalreturncode=-1;
-			if (currentnumberofspecies>0) { //just to head off a weird error
-				int returncodefailurecount=-1;
-				while (coalreturncode!=0) {
-					returncodefailurecount++;
-					coalreturncode=system("coal > /dev/null");
-					if (returncodefailurecount>100) {
-						errormsg="Had over 100 failures of COAL";
+					if (!coalprobs.AddGeneTree(CurrentGeneTreeTreeFmt,leafsamples)) {
+						coalprobs.Clear();
+						errormsg="Gene tree ";
+						errormsg+=chosentreenum+1;
+						errormsg+=" is not rooted and fully resolved, so its probability on a species tree cannot be calculated";
 						throw XNexus( errormsg);
-						break;
 					}
 				}
 			}
-		//cout<<"Done calling  coal, now parsing"<<endl;
-		//cout <<"coal returncode is "<<coalreturncode<<endl;
-			if (coalreturncode==0) {
-				int returncount=0;
-				neglnlikelihood=0;
-				ifstream coalin;
-				coalin.open( coaloutputfile.c_str(), ios::binary | ios::in );
-				if (coalin) {
-					char inputitem [COMMAND_MAXLEN];
-					coalin>>inputitem;
-					bool nextisprob=true; //since the input file alternates gene_tree_number SPACES prob
-					while (!coalin.eof()) {
-						coalin>>inputitem;
-						if (nextisprob) {
-							double probability=atof(inputitem);
-							if (probability==0 || probability !=probability) { //test for it not being a number or for it being nan
-								neglnlikelihood=GSL_POSINF;
-								break;
-							}
-							neglnlikelihood+=-1.0*log(probability);
-							returncount++;
-						//cout<<"prob is "<<inputitem<<endl;
-							nextisprob=false;
-						}
-						else {
-							nextisprob=true;
-						}
-					}
-				}
-				coalin.close();
-				if (returncount!=trees->GetNumTrees()) {
-					neglnlikelihood=GSL_POSINF; //THere's an error, we returned the wrong number of likelihood scores
+			
+		//get the probability of each gene tree on the species tree
+			coalprobs.SetSpeciesTree(CurrentTree,leafspecies,convertsamplestospecies);
+			neglnlikelihood=0;
+			for (int chosentreenum=0; chosentreenum<trees->GetNumTrees(); chosentreenum++) {
+				double probability=coalprobs.GetGeneTreeProbability(chosentreenum);
+				if (probability==0 || probability !=probability) { //test for it not being a number or for it being nan
+					neglnlikelihood=GSL_POSINF;
+					break;
 				}
-				
+				neglnlikelihood+=-1.0*log(probability);
 			}
-		//cout<<"Done parsing"<<endl<<endl;
-		//process the output
 		}
 		assert(neglnlikelihood>0);
 		double score=neglnlikelihood;
@@ -1839,208 +1928,68 @@ vector<double> BROWNIE::GetCombinedScore(ContainingTree *SpeciesTreePtr)
 	}
 	else if (useMS) {
 		double neglnlikelihood=0.0;
-		//ms $nsamples $ntrees -T -I 2 $nsamplessp1 $nsamplessp2 -ej $splittime 1 2
-		//echo "cat" | grep "\(cat\|dog\)"
-		//Convert species tree to MS format
+		//simulate gene trees on the species tree as ms $nsamples $ntrees -T -I 2 $nsamplessp1 $nsamplessp2 -ej $splittime 1 2 would, counting matches to each gene tree
 		ContainingTree CurrentTree=*SpeciesTreePtr;
 		CurrentTree.FindAndSetRoot();
 		CurrentTree.Update();
 		CurrentTree.GetNodeDepths();
 		int numspecies=CurrentTree.GetNumLeaves();		
 		int ntax=taxa->GetNumTaxonLabels();
-		nxsstring msstring="ms ";
-		msstring+=ntax;
-		msstring+=" ";
-		msstring+=msbasereps; //number of trees to generate
-		msstring+=" -T -I ";
-		msstring+=numspecies;
-		msstring+=" ";
 		vector <int> samplesperspecies;
-		vector <nxsstring> labelswithinspecies;
 		double numberofpermutations=1;
-		int previoustotal=0;
 		for (int currentspecies=1; currentspecies<=numspecies; currentspecies++) {
 			int samplecountthisspecies=0;
-			nxsstring labelregex="\\(";
 			for (int currentsample=0; currentsample<ntax; currentsample++) {
 				if (convertsamplestospecies[currentsample]==currentspecies) {
 					samplecountthisspecies++;
 				}
 			}
-			msstring+=samplecountthisspecies;
 			samplesperspecies.push_back(samplecountthisspecies);
-			for (int i=1; i<=samplecountthisspecies; i++) {
-				if (i>1) {
-					labelregex+="\\|";
-				}
-				labelregex+=i+previoustotal;
-				
-			}
-			labelregex+="\\):[0-9]*.[0-9]*"; //ms exports brlen, too
-			labelswithinspecies.push_back(labelregex);
-			previoustotal+=samplecountthisspecies;
 			numberofpermutations*=gsl_sf_fact(samplecountthisspecies);
-			msstring+=" ";
 		}
+		vector<int> leafspecies; //species tree leaves are labeled taxon1, taxon2, etc.
 		NodeIterator <Node> n (CurrentTree.GetRoot());
-		//loop once to get MS string
 		cur = n.begin();
 		while (cur) {
 			if (cur->IsLeaf()) {
-				int speciesnumber;
-				nxsstring specieslabel=cur->GetLabel();
-				string speciesstring=specieslabel.c_str();
-				size_t index = speciesstring.find('t');
-				speciesstring.erase(index,5); //erase "taxon"
-				cur->SetLabel(speciesstring);
-			}
-			else {
-				//assumes binary, ultrametric tree
-				if (cur->GetChild()!=NULL) { //will only really occur if the tree has just a root node
-					if ((cur->GetChild())->GetSibling()!=NULL) {
-						int childid=atoi(((cur->GetChild())->GetLabel()).c_str());
-						int sibid=atoi((((cur->GetChild())->GetSibling())->GetLabel()).c_str());
-						nxsstring newlabel="";
-						newlabel+=GSL_MIN(childid,sibid);
-						cur->SetLabel(newlabel);
-						double splittime=0;
-						NodePtr childnode=cur->GetChild();
-						while (childnode!=NULL) {
-							splittime+=childnode->GetEdgeLength();
-							childnode=childnode->GetChild();
-						}
-						msstring+="-ej ";
-						msstring+=splittime;
-						msstring+=" ";
-						msstring+=GSL_MAX(childid,sibid);
-						msstring+=" ";
-						msstring+=GSL_MIN(childid,sibid);
-						msstring+=" ";
-					}
+				string speciesstring=cur->GetLabel();
+				size_t index = speciesstring.find("taxon");
+				if (index!=string::npos) {
+					speciesstring.erase(index,5); //erase "taxon"
 				}
+				leafspecies.push_back(atoi(speciesstring.c_str()));
 			}
 			cur = n.next();
 		}
+		CoalescentSimulator simulator;
+		simulator.SetSpeciesTree(CurrentTree,leafspecies,samplesperspecies);
 		
-		//rather than looking for exact match, get probabilities of given topology with all possible permutations of labels of samples from a given species onto ms taxon numbers, then divide by number of such permutations
-		
-		
-		//loop over all the gene trees
+		//rather than looking for exact match, get probabilities of given topology with all possible permutations of labels of samples from a given species, then divide by number of such permutations
+		vector<TopologyHash> genetreehashes;
+		vector<int> genetreesymmetricnodes;
 		for (int chosentreenum=0; chosentreenum<trees->GetNumTrees(); chosentreenum++) { //loop over all the gene trees
-			nxsstring grepstring="";
-			int numberintraspecificcherries=0;
-			Tree CurrentGeneTreeTreeFmt=intrees.GetIthTree(chosentreenum);
+			const Tree &CurrentGeneTreeTreeFmt=intrees.GetIthTreeRef(chosentreenum);
+			vector<int> genetreespecies;
 			NodeIterator <Node> n (CurrentGeneTreeTreeFmt.GetRoot());
-			//traverse once to count intraspecific sister cherries
-			cur = n.begin();
-			while (cur) {
-				if (cur->IsLeaf()) {
-					NodePtr sister=cur->GetSibling();
-					if (sister!=NULL) {
-						if (sister->IsLeaf()) {
-							//cout<<cur->GetLabel()<<" with "<<sister->GetLabel()<<endl;
-							if (convertsamplestospecies[taxa->FindTaxon(cur->GetLabel())]==convertsamplestospecies[taxa->FindTaxon(sister->GetLabel())]) { //they have the same species (though node labels are changed, we do the one that's a child before its sib)
-								numberintraspecificcherries++;
-							}
-						}
-					}
-				}
-				cur = n.next();
-			}
-			
-			//now get the grep lines
 			cur = n.begin();
 			while (cur) {
 				if (cur->IsLeaf()) {
-					cur->SetLabel(labelswithinspecies[-1+convertsamplestospecies[taxa->FindTaxon(cur->GetLabel())]]); //gets regex for tip labels
-				}
-				else {
-					nxsstring combinedstring="";
-					nxsstring leftchild=(cur->GetChild())->GetLabel();
-					nxsstring rightchild=((cur->GetChild())->GetSibling())->GetLabel();
-					nxsstring additionalregex="(\\(";
-					additionalregex+=leftchild;
-					additionalregex+=",";
-					additionalregex+=rightchild;
-					additionalregex+="\\|";
-					additionalregex+=rightchild;
-					additionalregex+=",";
-					additionalregex+=leftchild;
-					additionalregex+="\\))";
-					if (cur->GetAnc()!=NULL) { // not root
-						additionalregex+=":*[0-9]*.[0-9]*";
-					}
-					else { //originally, did this at each node, with the idea that from MS, you first filter out the lines that don't match a cherry, then filter from that filtered set, etc., thinking it would be faster than just using the regex at the root. Actually, just using the regex at the root was faster, so I do that.
-						grepstring+=" | grep -c \"";
-						grepstring+=additionalregex;
-						grepstring+="\"";
-					}
-					cur->SetLabel(additionalregex);
+					genetreespecies.push_back(convertsamplestospecies[taxa->FindTaxon(cur->GetLabel())]);
 				}
 				cur = n.next();
 			}
-			nxsstring finalsystemcall=msstring;
-			//cout<<msstring<<endl;
-			finalsystemcall+=grepstring;
-			nxsstring msinputfile="mscount.txt";
-			finalsystemcall+=" > ";
-			finalsystemcall+=msinputfile;
-			//system("rm mscount.txt");
-			int returncode=system(finalsystemcall.c_str());
-			if (debugmode) {
-				cout<<"return code is "<<returncode<<" (divided by 256, is "<<returncode/256<<")"<<endl;
-			}
-			//cout<<finalsystemcall<<endl;
-		/*	int returnattempts=-1;
-			int returncode=-1;
-			while (returncode!=0) {
-				if (returnattempts>0) {
-					system("rm mscount.txt");
-				}
-				returncode=system(finalsystemcall.c_str());
-				returnattempts++;
-				if (returnattempts>5) {
-					message="Had over 5 failures of MS, calling\n\n";
-					message+=finalsystemcall;
-					message+="\n";
-					PrintMessage();
-					//throw XNexus( errormsg);
-					break;
-				}
-				if (returncode!=0) {
-					message="Warning: ms returned error code ";
-					message+=returncode;
-					PrintMessage();
-				}
-				
-			}*/
-			//	if (returncode==0) {
-			ifstream msin;
-			msin.open( msinputfile.c_str(), ios::binary | ios::in );
-			if (msin) {
-				char inputitem [COMMAND_MAXLEN];
-				msin>>inputitem;
-				double numbermatches=atof(inputitem);
-				if (numbermatches==0) {
-					infinitescore=true;
-				}
-				neglnlikelihood+=-1.0*(log(GSL_MAX(numbermatches,0.01))-log(msbasereps)-log((1.0*numberofpermutations)/(1.0*numberintraspecificcherries))); //numbermatches is an integer, but log(0) is infinite. Idea is to make this a really big but not infinite number. Probability of a gene tree is #of times it was observed (with all permutations of tip labels within species) divided by the number of trees returned, all divided by the number of possible permutations (since this gene tree is just one realization of that), correcting for the number of intraspecific cherries (otherwise, for example, with a single species with a gene with two samples, (1,2) might be the gene tree, but we say the number of perms=2, and so though we find ((1|2),(1|2)) in all the ms returns, we would divide this by 2, when the real probability is one.
-				
-				//		}
-				msin.close();
-			}
-			else {
-				message="\nWarning: got return code of ";
-				message+=returncode;
-				message+=" for ms string of \n\n\t";
-				message+=msstring;
-				message+="\n\nand grep string of \n\n";
-				message+=grepstring;
-				message+="\n\n";
-			
-				neglnlikelihood=GSL_POSINF;
-			}
-			
+			int symmetricnodes=0;
+			genetreehashes.push_back(GetSpeciesTopologyHash(CurrentGeneTreeTreeFmt,genetreespecies,&symmetricnodes));
+			genetreesymmetricnodes.push_back(symmetricnodes);
+		}
+		vector<long> genetreematches;
+		simulator.CountTopologies(msbasereps,gsl_rng_get(r),genetreehashes,genetreematches);
+		for (int chosentreenum=0; chosentreenum<trees->GetNumTrees(); chosentreenum++) {
+			double numbermatches=genetreematches[chosentreenum];
+			if (numbermatches==0) {
+				infinitescore=true;
+			}
+			neglnlikelihood+=-1.0*(log(GSL_MAX(numbermatches,0.01))-log(msbasereps)-log(numberofpermutations)+genetreesymmetricnodes[chosentreenum]*log(2.0)); //numbermatches is an integer, but log(0) is infinite. Idea is to make this a really big but not infinite number. Probability of a gene tree is #of times its species-labeled topology was simulated divided by the number of trees simulated, divided by the number of ways of labeling samples within species, times the number of those labelings that give this same tree (2 for every node whose two subtrees are identical once relabeled by species; for example, with a single species with a gene with two samples, the probability of (1,2) is one).
 		}
 		double score=neglnlikelihood;
 		if (COALaicmode==0) {
@@ -2117,75 +2066,672 @@ vector<double> BROWNIE::GetCombinedScore(ContainingTree *SpeciesTreePtr)
     return scorevector;
 }
 
-//checks to make sure that the convertsamplestospecies vector is not missing assignments to any species (i.e, doesn't consist only of species 1, 3 and 4). If fix==true, it'll fix this. It will return true if check
-bool BROWNIE::CheckConvertSamplesToSpeciesVector(bool fix)
+//Species numbers of the species tree's leaves in postorder, as GetCombinedScore finds them from leaf labels taxon1, taxon2, etc.
+vector<int> BROWNIE::GetSpeciesTreeLeafSpecies(ContainingTree &SpeciesTree)
 {
-    int maxspecies=0;
-    bool goodshape=true;
-    int firstbadspecies=0;
-    for (int i=0;i<convertsamplestospecies.size();i++) {
-        maxspecies=GSL_MAX(maxspecies,convertsamplestospecies[i]);
-    }
-    vector<int> speciesvector(maxspecies,0);
-    for (int i=0;i<convertsamplestospecies.size();i++) {
-        speciesvector[(convertsamplestospecies[i])-1]++;
-    }
-    for (int i=0;i<speciesvector.size();i++) {
-        if (speciesvector[i]==0) {
-            goodshape=false;
-            firstbadspecies=i+1;
-            break;
-        }
-    }
-    if (!goodshape && fix) {
-        for (int i=0;i<convertsamplestospecies.size();i++) {
-            if (convertsamplestospecies[i]>firstbadspecies) {
-                convertsamplestospecies[i]=convertsamplestospecies[i]-1;
-            }
-        }
-        goodshape=CheckConvertSamplesToSpeciesVector(true);
+	vector<int> leafspecies;
+	NodeIterator <Node> n (SpeciesTree.GetRoot());
+	NodePtr currentnode = n.begin();
+	while (currentnode) {
+		if (currentnode->IsLeaf()) {
+			string speciesstring=currentnode->GetLabel();
+			size_t index = speciesstring.find("taxon");
+			if (index!=string::npos) {
+				speciesstring.erase(index,5); //erase "taxon"
+			}
+			leafspecies.push_back(atoi(speciesstring.c_str()));
+		}
+		currentnode = n.next();
+	}
+	return leafspecies;
+}
 
-    }
-    return goodshape;
+//Sum of -ln P(gene tree | species tree) under COAL over just the given gene trees, with the current assignment. leafspecies are as from
+//GetSpeciesTreeLeafSpecies. The gene trees must already be in scorer (GetCombinedScore puts them in coalprobs, which can be copied so that
+//several threads can score at once, each with its own scorer and species tree).
+double BROWNIE::GetCOALScoreOfGeneTrees(CoalescentProbability &scorer, ContainingTree &SpeciesTree, const vector<int> &leafspecies, const vector<int> &genetrees)
+{
+	scorer.SetSpeciesTree(SpeciesTree,leafspecies,convertsamplestospecies);
+	double neglnlikelihood=0;
+	for (int i=0;i<genetrees.size();i++) {
+		double probability=scorer.GetGeneTreeProbability(genetrees[i]);
+		if (probability==0 || probability !=probability) {
+			return GSL_POSINF;
+		}
+		neglnlikelihood+=-1.0*log(probability);
+	}
+	return neglnlikelihood;
 }
 
-bool BROWNIE::CombineSpeciesWithTooFewSamples(bool fix) { //The idea of this is to fix the assignment vector if there are too few samples per species by combining the too small species with the next species and then fixing the resulting hole
-	bool goodsamplenumber=true;
-	if (minsamplesperspecies>1) {
-		int maxspecies=0;
-		for (int i=0;i<convertsamplestospecies.size();i++) {
-			maxspecies=GSL_MAX(maxspecies,convertsamplestospecies[i]);
+//Optimizes the species tree's branch lengths under COAL by coordinate descent: each edge in turn is set by Brent's method on the log of its length,
+//scoring only the gene trees with at least two samples below the edge, as the others' probabilities don't depend on its length. Passes over all the
+//edges stop once one improves the score by less than 0.001, or after numbrlenadjustments passes (none if it is 0). Returns the tree's score vector.
+vector<double> BROWNIE::OptimizeSpeciesTreeBranchLengths(ContainingTree &SpeciesTree)
+{
+	SpeciesTree.FindAndSetRoot();
+	SpeciesTree.Update();
+	SpeciesTree.InitializeMissingBranchLengths();
+	vector<double> scorevector=GetCombinedScore(&SpeciesTree);
+	if (!useCOAL || SpeciesTree.GetNumLeaves()<2 || !(scorevector[0]<GSL_POSINF)) {
+		return scorevector;
+	}
+	double lowerlogbrlen=log(BROWNIE_EPSILON);
+	double upperlogbrlen=log(100.0); //in coalescent units, so longer edges have effectively no deep coalescence
+	double logtolerance=0.01;
+	int maxevaluations=30; //per edge per pass
+	double goldenfraction=0.5*(3.0-sqrt(5.0));
+	vector<int> leafspecies=GetSpeciesTreeLeafSpecies(SpeciesTree);
+	int maxspecies=0;
+	for (int i=0;i<leafspecies.size();i++) {
+		maxspecies=GSL_MAX(maxspecies,leafspecies[i]);
+	}
+	for (int i=0;i<convertsamplestospecies.size();i++) {
+		maxspecies=GSL_MAX(maxspecies,convertsamplestospecies[i]);
+	}
+	vector<vector<int> > genespeciescounts; //number of samples of each species on each gene tree
+	for (int chosentreenum=0; chosentreenum<trees->GetNumTrees(); chosentreenum++) {
+		vector<int> speciescounts(maxspecies+1,0);
+		NodeIterator <Node> m (intrees.GetIthTreeRef(chosentreenum).GetRoot());
+		NodePtr currentnode = m.begin();
+		while (currentnode) {
+			if (currentnode->IsLeaf()) {
+				int sample=taxa->FindTaxon(currentnode->GetLabel());
+				if (sample>=0 && sample<convertsamplestospecies.size()) {
+					speciescounts[convertsamplestospecies[sample]]++;
+				}
+			}
+			currentnode = m.next();
 		}
-		vector<int> speciesvector(maxspecies,0);
-		for (int i=0;i<convertsamplestospecies.size();i++) {
-			speciesvector[(convertsamplestospecies[i])-1]++;
+		genespeciescounts.push_back(speciescounts);
+	}
+	vector<NodePtr> edges;
+	vector<vector<int> > edgegenetrees; //gene trees whose probability depends on each edge's length
+	int leafcount=0;
+	map<Node *, vector<int> > speciesbelow;
+	NodeIterator <Node> n (SpeciesTree.GetRoot());
+	NodePtr currentnode = n.begin();
+	while (currentnode) { //postorder, so descendants come first
+		vector<int> &below=speciesbelow[currentnode];
+		if (currentnode->IsLeaf()) {
+			below.push_back(leafspecies[leafcount]);
+			leafcount++;
 		}
-		for (int i=0;i<speciesvector.size();i++) {
-			if (speciesvector[i]<minsamplesperspecies) {
-				goodsamplenumber=false;
-				if (fix) {
-					for (int j=0;j<convertsamplestospecies.size();j++) {
-						if (convertsamplestospecies[j]==i+1) {
-							if ((i+1)<maxspecies) { //so there's a species to the right to combine with.
-								convertsamplestospecies[j]=convertsamplestospecies[j]+1;
-							}
-							else { 
-								convertsamplestospecies[j]=convertsamplestospecies[j]-1;
-							}
+		else {
+			for (NodePtr q=currentnode->GetChild();q!=NULL;q=q->GetSibling()) {
+				below.insert(below.end(),speciesbelow[q].begin(),speciesbelow[q].end());
+			}
+		}
+		if (currentnode!=SpeciesTree.GetRoot()) {
+			vector<int> affectedgenetrees;
+			for (int chosentreenum=0; chosentreenum<genespeciescounts.size(); chosentreenum++) {
+				int samplesbelow=0;
+				for (int i=0;i<below.size();i++) {
+					samplesbelow+=genespeciescounts[chosentreenum][below[i]];
+				}
+				if (samplesbelow>=2) {
+					affectedgenetrees.push_back(chosentreenum);
+				}
+			}
+			if (affectedgenetrees.size()>0) {
+				edges.push_back(currentnode);
+				edgegenetrees.push_back(affectedgenetrees);
+			}
+		}
+		currentnode = n.next();
+	}
+	double totalscore=scorevector[0];
+	for (int pass=0; pass<numbrlenadjustments; pass++) {
+		double passstartscore=totalscore;
+		for (int edgenum=0; edgenum<edges.size(); edgenum++) {
+			NodePtr edge=edges[edgenum];
+			double originalbrlen=edge->GetEdgeLength();
+			double originalscore=GetCOALScoreOfGeneTrees(coalprobs,SpeciesTree,leafspecies,edgegenetrees[edgenum]);
+			double startbrlen=GSL_MIN(GSL_MAX(originalbrlen,BROWNIE_EPSILON),100.0); //the search is bounded, but the length is only changed if the score improves
+			double startscore=originalscore;
+			if (startbrlen!=originalbrlen) {
+				edge->SetEdgeLength(startbrlen);
+				startscore=GetCOALScoreOfGeneTrees(coalprobs,SpeciesTree,leafspecies,edgegenetrees[edgenum]);
+			}
+			//Brent's method, bounded to [lowerlogbrlen, upperlogbrlen] and started from the current length
+			double a=lowerlogbrlen;
+			double b=upperlogbrlen;
+			double x=log(startbrlen);
+			double w=x;
+			double v=x;
+			double fx=startscore;
+			double fw=fx;
+			double fv=fx;
+			double d=0.0;
+			double e=0.0;
+			for (int evaluation=0; evaluation<maxevaluations; evaluation++) {
+				double xm=0.5*(a+b);
+				double tol1=logtolerance;
+				double tol2=2.0*tol1;
+				if (fabs(x-xm)<=(tol2-0.5*(b-a))) {
+					break;
+				}
+				bool golden=true;
+				if (fabs(e)>tol1 && fx<GSL_POSINF && fw<GSL_POSINF && fv<GSL_POSINF) { //try a parabola through x, w, and v
+					double r=(x-w)*(fx-fv);
+					double q=(x-v)*(fx-fw);
+					double p=(x-v)*q-(x-w)*r;
+					q=2.0*(q-r);
+					if (q>0.0) {
+						p=-p;
+					}
+					q=fabs(q);
+					double etemp=e;
+					e=d;
+					if (fabs(p)<fabs(0.5*q*etemp) && p>q*(a-x) && p<q*(b-x)) {
+						d=p/q;
+						golden=false;
+						if ((x+d)-a<tol2 || b-(x+d)<tol2) {
+							d=(xm-x>=0 ? tol1 : -tol1);
 						}
 					}
-					bool goodshape=CheckConvertSamplesToSpeciesVector(true);
-					goodsamplenumber=CombineSpeciesWithTooFewSamples(true);
+				}
+				if (golden) {
+					e=(x>=xm ? a-x : b-x);
+					d=goldenfraction*e;
+				}
+				double u=x+(fabs(d)>=tol1 ? d : (d>=0 ? tol1 : -tol1));
+				edge->SetEdgeLength(exp(u));
+				double fu=GetCOALScoreOfGeneTrees(coalprobs,SpeciesTree,leafspecies,edgegenetrees[edgenum]);
+				if (fu<=fx) {
+					if (u>=x) {
+						a=x;
+					}
+					else {
+						b=x;
+					}
+					v=w;
+					fv=fw;
+					w=x;
+					fw=fx;
+					x=u;
+					fx=fu;
+				}
+				else {
+					if (u<x) {
+						a=u;
+					}
+					else {
+						b=u;
+					}
+					if (fu<=fw || w==x) {
+						v=w;
+						fv=fw;
+						w=u;
+						fw=fu;
+					}
+					else if (fu<=fv || v==x || v==w) {
+						v=u;
+						fv=fu;
+					}
 				}
 			}
-		}		
+			if (fx<originalscore) {
+				edge->SetEdgeLength(exp(x));
+				totalscore-=originalscore-fx;
+			}
+			else {
+				edge->SetEdgeLength(originalbrlen);
+			}
+		}
+		if (passstartscore-totalscore<0.001) {
+			break;
+		}
 	}
-	return goodsamplenumber;
+	SpeciesTree.Update();
+	return GetCombinedScore(&SpeciesTree);
 }
 
-bool BROWNIE::CheckConvertSamplesToSpeciesVectorSpNum(int actualmaxspeciesnum)
+//Reads the next row of a contour table file, as written by PutBinaryVector
+static bool GetContourRow(istream &in, vector<double> &row)
 {
-    int maxspecies=0;
+	int n=0;
+	if (!in.read((char *)&n,sizeof(int)) || n<=0) {
+		return false;
+	}
+	row.resize(n);
+	return !(in.read((char *)&row[0],n*sizeof(double)).fail());
+}
+
+//Whether the grid of ContourSearchBranchLengths starts again after a point with these increments and score (less that of the center): a point
+//at the margin within 2 lnL units of the center widens the grid, and a point better than the center recenters it
+static bool ContourPointEndsGrid(const vector<int> &increments, double numbersteps, double brlenscore, int recursions, int maxrecursions)
+{
+	bool atmargin=false;
+	for (int i=0; i<increments.size(); i++) {
+		if ((increments[i]==0) || (increments[i]==numbersteps-1)) {
+			atmargin=true;
+		}
+	}
+	return ((atmargin && brlenscore<2 && recursions<maxrecursions) || (brlenscore<0 && recursions<=maxrecursions));
+}
+
+//Grid search of the species tree's branch lengths under COAL. Each edge's length is varied over contourstartingnumbersteps values, evenly spaced
+//on a log scale from length/width to length*width, and every combination is scored, with edge 0 varying fastest. If a point beats the center the
+//grid is centered on it; if a point on the margin is within 2 lnL units of the center, width is increased by half; either way the grid starts over,
+//at most contourMaxRecursions times. Once a whole grid is done, each edge is set to its average over the points as good as the center.
+//
+//Points are scored in batches, spread over several threads, each with its own copy of the scorer and of the tree, then looked at in order just as
+//when scored one at a time. Once a point that starts the grid again is scored, the later points of the batch aren't. Scores are kept by the logs
+//of the edge lengths, so points shared by successive grids aren't scored again. If contourBrlenToExport asks for them, the final grid's rows (edge
+//lengths, then score less that of the center) are written to ContourSearchFile as they are looked at, rather than kept in memory.
+vector<double> BROWNIE::ContourSearchBranchLengths(ContainingTree &SpeciesTree)
+{
+#ifdef _OPENMP
+	int nscorers=omp_get_max_threads(); //a copy of the scorer for each thread
+#else
+	int nscorers=1;
+#endif
+	int batchsize=16*nscorers;
+	unsigned long maxcached=1000000;
+	ContourSearchRows=0;
+	SpeciesTree.FindAndSetRoot();
+	SpeciesTree.Update();
+	SpeciesTree.InitializeMissingBranchLengths();
+	int origCOALaicmode=COALaicmode;
+	COALaicmode=0;
+	vector<double> startingscorevector=GetCombinedScore(&SpeciesTree); //also makes sure the gene trees are in coalprobs
+	COALaicmode=origCOALaicmode;
+	double currentscore=startingscorevector[0];
+	if (!(currentscore<GSL_POSINF)) {
+		return startingscorevector;
+	}
+	vector<int> leafspecies=GetSpeciesTreeLeafSpecies(SpeciesTree);
+	vector<int> allgenetrees;
+	for (int chosentreenum=0; chosentreenum<trees->GetNumTrees(); chosentreenum++) {
+		allgenetrees.push_back(chosentreenum);
+	}
+	vector<CoalescentProbability> scorers(nscorers);
+	scorers[0]=coalprobs; //the probabilities already found are copied once, to the first scorer only
+	for (int scorer=1; scorer<nscorers; scorer++) {
+		scorers[scorer].CopyGeneTrees(coalprobs);
+	}
+	map<vector<long long>, double> scorecache;
+	double startingwidth=contourstartingwidth; //start by looking at all brlen between pointestimate/startingwidth and startingwidth*pointestimated
+	double startingnumbersteps=contourstartingnumbersteps; //works best if odd
+	int maxrecursions=contourMaxRecursions;
+	int recursions=0;
+	int numberofedges=0;
+	bool donecontour=false;
+	vector<double> totalbrlen;
+	int numequaltrees=0;
+	ofstream contourrows;
+	while (!donecontour) {
+		recursions++;
+		ContourSearchRows=0;
+		if (contourBrlenToExport>0) { //only the last grid's rows are wanted
+			contourrows.close();
+			contourrows.clear();
+			ContourSearchFile=treefilename;
+			ContourSearchFile+=".contour";
+			contourrows.open(ContourSearchFile.c_str(), ios::out | ios::binary | ios::trunc);
+		}
+		SpeciesTree.FindAndSetRoot();
+		SpeciesTree.Update();
+		SpeciesTree.InitializeMissingBranchLengths();
+		vector<double> midpointvector;
+		double basestep=exp(2.0*log(startingwidth)/(startingnumbersteps-1));
+		NodeIterator <Node> n (SpeciesTree.GetRoot());
+		NodePtr currentnode = n.begin();
+		NodePtr rootnode=SpeciesTree.GetRoot();
+		while (currentnode)
+		{
+			if (currentnode!=rootnode) {
+				double edgelength=currentnode->GetEdgeLength();
+				if (gsl_isnan(edgelength)) {
+					edgelength=1.0;
+				}
+				midpointvector.push_back(GSL_MAX(edgelength,BROWNIE_EPSILON)); //zero length edges can't be scaled, and have no log for the cache key
+			}
+			currentnode = n.next();
+		}
+		numberofedges=midpointvector.size();
+		totalbrlen.assign(numberofedges,0.0);
+		numequaltrees=0;
+		vector<ContainingTree> scorertrees(nscorers,SpeciesTree);
+		vector<vector<NodePtr> > scorertreeedges(nscorers);
+		for (int scorer=0; scorer<nscorers; scorer++) {
+			NodeIterator <Node> m (scorertrees[scorer].GetRoot());
+			currentnode = m.begin();
+			while (currentnode) {
+				if (currentnode!=scorertrees[scorer].GetRoot()) {
+					scorertreeedges[scorer].push_back(currentnode);
+				}
+				currentnode = m.next();
+			}
+		}
+		vector<int> increments(numberofedges,0);
+		bool donegrid=false;
+		bool lastpointqueued=false;
+		while (!donegrid) {
+			//next batch of points, in order
+			vector<vector<int> > batchincrements;
+			vector<vector<double> > batchbrlens;
+			vector<vector<long long> > batchkeys;
+			while (batchincrements.size()<batchsize && !lastpointqueued) {
+				vector<double> brlens;
+				vector<long long> key;
+				for (int i=0; i<numberofedges; i++) {
+					double newbrlen=midpointvector[i]*(pow(basestep,(increments[i]-startingnumbersteps+((startingnumbersteps+1)/2))));
+					brlens.push_back(newbrlen);
+					key.push_back((long long)(floor(1.0e6*log(newbrlen)+0.5)));
+				}
+				batchincrements.push_back(increments);
+				batchbrlens.push_back(brlens);
+				batchkeys.push_back(key);
+				increments[0]++;
+				for (int itemtoexamine=0; itemtoexamine<numberofedges; itemtoexamine++) {
+					if (increments[itemtoexamine]==startingnumbersteps) {
+						if (itemtoexamine<numberofedges-1) { //means there's room to the left
+							increments[itemtoexamine]=0;
+							increments[itemtoexamine+1]++;
+						}
+						else {
+							lastpointqueued=true;
+						}
+					}
+				}
+			}
+			int npoints=batchincrements.size();
+			vector<double> batchscores(npoints,GSL_POSINF);
+			vector<char> scored(npoints,0); //not vector<bool>, as its elements can't be set from different threads
+			vector<int> tobescored;
+			int firstendpoint=npoints; //first point after which the grid starts again; the points after it needn't be scored
+			for (int point=0; point<npoints; point++) {
+				map<vector<long long>, double>::iterator found=scorecache.find(batchkeys[point]);
+				if (found!=scorecache.end()) {
+					batchscores[point]=found->second;
+					scored[point]=1;
+					if (firstendpoint==npoints && ContourPointEndsGrid(batchincrements[point],startingnumbersteps,batchscores[point]-currentscore,recursions,maxrecursions)) {
+						firstendpoint=point;
+					}
+				}
+				else {
+					tobescored.push_back(point);
+				}
+			}
+			int ntobescored=tobescored.size();
+#pragma omp parallel for schedule(dynamic)
+			for (int i=0; i<ntobescored; i++) {
+#ifdef _OPENMP
+				int scorer=omp_get_thread_num();
+#else
+				int scorer=0;
+#endif
+				int point=tobescored[i];
+				bool needed;
+#pragma omp critical (contourendpoint)
+				needed=(point<firstendpoint);
+				if (!needed) {
+					continue;
+				}
+				for (int edge=0; edge<numberofedges; edge++) {
+					scorertreeedges[scorer][edge]->SetEdgeLength(batchbrlens[point][edge]);
+				}
+				batchscores[point]=GetCOALScoreOfGeneTrees(scorers[scorer],scorertrees[scorer],leafspecies,allgenetrees);
+				scored[point]=1;
+				if (ContourPointEndsGrid(batchincrements[point],startingnumbersteps,batchscores[point]-currentscore,recursions,maxrecursions)) {
+#pragma omp critical (contourendpoint)
+					firstendpoint=GSL_MIN(firstendpoint,point);
+				}
+			}
+			for (int i=0; i<tobescored.size() && scorecache.size()<maxcached; i++) {
+				if (scored[tobescored[i]]) {
+					scorecache[batchkeys[tobescored[i]]]=batchscores[tobescored[i]];
+				}
+			}
+			//look at the points in order
+			for (int point=0; point<npoints && !donegrid; point++) {
+				assert(scored[point]); //points are only skipped after one that ends the grid
+				double brlenscore=batchscores[point]-currentscore;
+				bool atmargin=false;
+				for (int i=0; i<numberofedges; i++) {
+					if ((batchincrements[point][i]==0) || (batchincrements[point][i]==startingnumbersteps-1)) {
+						atmargin=true;
+					}
+				}
+				if (atmargin) { //we're at a margin of the space; want to make sure that the region within two lnL is inside this region
+					if (brlenscore<2 && recursions<maxrecursions) { //our region is too small, since points 2 lnL units away from the max are outside the region
+						startingwidth*=1.5;
+						donegrid=true; //start the grid again; since donecontour isn't done, reinitialize everything
+					}
+				}
+				if (contourBrlenToExport>0) {
+					vector<double> resultvector=batchbrlens[point];
+					resultvector.push_back(brlenscore);
+					PutBinaryVector(contourrows,resultvector);
+					ContourSearchRows++;
+				}
+				if (brlenscore<=0) {
+					for (int j=0; j<numberofedges; j++) {
+						totalbrlen[j]+=batchbrlens[point][j];
+					}
+					numequaltrees++;
+				}
+				if (brlenscore<0 && recursions<=maxrecursions) {
+					currentscore=batchscores[point];
+					currentnode = n.begin();
+					int edge=0;
+					while (currentnode) {
+						if (currentnode!=rootnode) {
+							currentnode->SetEdgeLength(batchbrlens[point][edge]);
+							edge++;
+						}
+						currentnode = n.next();
+					}
+					donegrid=true; //start the grid again, centered on this point
+					if (showtries) {
+						cout<<"Better branch lengths found in grid search"<<endl;
+					}
+				}
+				if (!donegrid && point==npoints-1 && lastpointqueued) {
+					donegrid=true;
+					donecontour=true;
+				}
+			}
+		}
+	}
+	if (contourBrlenToExport>0) {
+		contourrows.close();
+		if (!contourrows.good()) {
+			ContourSearchRows=0;
+			message="Warning: could not write the contour grid to ";
+			message+=ContourSearchFile;
+			PrintMessage();
+		}
+	}
+	if (numequaltrees>0) {
+		NodeIterator <Node> n (SpeciesTree.GetRoot());
+		NodePtr currentnode = n.begin();
+		NodePtr rootnode=SpeciesTree.GetRoot();
+		int edgenumber=0;
+		while (currentnode)
+		{
+			if (currentnode!=rootnode) {
+				currentnode->SetEdgeLength(totalbrlen[edgenumber]/(numequaltrees*1.0));
+				edgenumber++;
+			}
+			currentnode = n.next();
+		}
+	}
+	return GetCombinedScore(&SpeciesTree);
+}
+
+//Scores species trees that all have the same leaves, under the current assignment of samples to species, as GetCombinedScore would one at a time.
+//abortedscores is true for a tree whose duplication count stopped once the score passed bestscorelocal; triplettoohigh is left set if the structure
+//score did. The structure score depends only on the assignment, so it is found once, and the duplications on the different species trees are found in parallel.
+void BROWNIE::GetCombinedScores(vector<ContainingTree> &SpeciesTrees, vector<vector<double> > &scorevectors, vector<bool> &abortedscores)
+{
+	scorevectors.clear();
+	abortedscores.clear();
+	if (useCOAL || useMS || SpeciesTrees.size()<2) { //these scores depend on simulations or on stored species trees, so are found one at a time
+		for (int i=0;i<SpeciesTrees.size();i++) {
+			scorevectors.push_back(GetCombinedScore(&(SpeciesTrees[i])));
+			abortedscores.push_back(gtptoohigh);
+		}
+		return;
+	}
+	triplettoohigh=false;
+	gtptoohigh=false;
+	double tripletscore=0;
+	vector<double> gtpscores(SpeciesTrees.size(),0.0);
+	vector<int> gtpexceeded(SpeciesTrees.size(),0); //not vector<bool>, as its elements can't be set from different threads
+	bool calculatescore=true;
+	if (minsamplesperspecies>1) {
+		int maxspecies=0;
+		for (int i=0;i<convertsamplestospecies.size();i++) {
+			maxspecies=GSL_MAX(maxspecies,convertsamplestospecies[i]);
+		}
+		vector<int> speciesvector(maxspecies,0);
+		for (int i=0;i<convertsamplestospecies.size();i++) {
+			speciesvector[(convertsamplestospecies[i])-1]++;
+		}
+		for (int i=0;i<speciesvector.size();i++) {
+			if (speciesvector[i]<minsamplesperspecies) {
+				calculatescore=false;
+			}
+		}
+	}
+	if (!calculatescore) {
+		vector<double> infinitescorevector(3,GSL_POSINF);
+		scorevectors.assign(SpeciesTrees.size(),infinitescorevector);
+		abortedscores.assign(SpeciesTrees.size(),false);
+		return;
+	}
+	if (structwt>0) {
+		tripletscore=double(GetTripletScore(&(SpeciesTrees[0])));
+	}
+	if (structwt<1 && (triplettoohigh==false)) {
+		PrepareGTPScorer();
+		vector<double> treeweights=GetGTPTreeWeights();
+		double maxweightednumDup=GSL_POSINF;
+		if (structwt<1.0) {
+			maxweightednumDup=bestscorelocal/(1.0-structwt);
+		}
+		int ntrees=SpeciesTrees.size();
+#pragma omp parallel for schedule(dynamic)
+		for (int i=0;i<ntrees;i++) {
+			bool exceeded=false;
+			gtpscores[i]=GetWeightedDuplicationsOnTree(&(SpeciesTrees[i]),treeweights,maxweightednumDup,exceeded);
+			if (exceeded) {
+				gtpscores[i]=(0.0001+bestscorelocal)/(1.0-structwt);
+				gtpexceeded[i]=1;
+			}
+		}
+	}
+	for (int i=0;i<SpeciesTrees.size();i++) {
+		vector<double> scorevector;
+		scorevector.push_back(((1.0-structwt)*gtpscores[i])+(structwt*tripletscore));
+		scorevector.push_back(gtpscores[i]);
+		scorevector.push_back(tripletscore);
+		scorevectors.push_back(scorevector);
+		abortedscores.push_back(gtpexceeded[i]==1);
+	}
+}
+
+//Makes up to maxtrees successive SPR rearrangements of StartTree, as calling NextSPR on copies of it in turn would. For each, stores
+//the break and attach vectors left after the rearrangement, and whether there are more rearrangements to try.
+void BROWNIE::GetSPRNeighborhood(ContainingTree &StartTree, int maxtrees, vector<ContainingTree> &SwapTrees, vector<vector<int> > &BreakVectors, vector<vector<int> > &AttachVectors, vector<bool> &MoreSwaps)
+{
+	SwapTrees.clear();
+	BreakVectors.clear();
+	AttachVectors.clear();
+	MoreSwaps.clear();
+	vector<int> breakvector=StartTree.GetBreakVector();
+	vector<int> attachvector=StartTree.GetAttachVector();
+	bool moreswaps=true;
+	while (moreswaps && SwapTrees.size()<maxtrees) {
+		ContainingTree SwapTree=StartTree;
+		SwapTree.SetBreakVector(breakvector);
+		SwapTree.SetAttachVector(attachvector);
+		SwapTree.FindAndSetRoot();
+		SwapTree.Update();
+		moreswaps=SwapTree.NextSPR();
+		breakvector=SwapTree.GetBreakVector();
+		attachvector=SwapTree.GetAttachVector();
+		if (useCOAL || useMS) {
+			SwapTree.InitializeMissingBranchLengths();
+		}
+		SwapTrees.push_back(SwapTree);
+		BreakVectors.push_back(breakvector);
+		AttachVectors.push_back(attachvector);
+		MoreSwaps.push_back(moreswaps);
+	}
+}
+
+//checks to make sure that the convertsamplestospecies vector is not missing assignments to any species (i.e, doesn't consist only of species 1, 3 and 4). If fix==true, it'll fix this. It will return true if check
+bool BROWNIE::CheckConvertSamplesToSpeciesVector(bool fix)
+{
+    int maxspecies=0;
+    bool goodshape=true;
+    int firstbadspecies=0;
+    for (int i=0;i<convertsamplestospecies.size();i++) {
+        maxspecies=GSL_MAX(maxspecies,convertsamplestospecies[i]);
+    }
+    vector<int> speciesvector(maxspecies,0);
+    for (int i=0;i<convertsamplestospecies.size();i++) {
+        speciesvector[(convertsamplestospecies[i])-1]++;
+    }
+    for (int i=0;i<speciesvector.size();i++) {
+        if (speciesvector[i]==0) {
+            goodshape=false;
+            firstbadspecies=i+1;
+            break;
+        }
+    }
+    if (!goodshape && fix) {
+        for (int i=0;i<convertsamplestospecies.size();i++) {
+            if (convertsamplestospecies[i]>firstbadspecies) {
+                convertsamplestospecies[i]=convertsamplestospecies[i]-1;
+            }
+        }
+        goodshape=CheckConvertSamplesToSpeciesVector(true);
+
+    }
+    return goodshape;
+}
+
+bool BROWNIE::CombineSpeciesWithTooFewSamples(bool fix) { //The idea of this is to fix the assignment vector if there are too few samples per species by combining the too small species with the next species and then fixing the resulting hole
+	bool goodsamplenumber=true;
+	if (minsamplesperspecies>1) {
+		int maxspecies=0;
+		for (int i=0;i<convertsamplestospecies.size();i++) {
+			maxspecies=GSL_MAX(maxspecies,convertsamplestospecies[i]);
+		}
+		vector<int> speciesvector(maxspecies,0);
+		for (int i=0;i<convertsamplestospecies.size();i++) {
+			speciesvector[(convertsamplestospecies[i])-1]++;
+		}
+		for (int i=0;i<speciesvector.size();i++) {
+			if (speciesvector[i]<minsamplesperspecies) {
+				goodsamplenumber=false;
+				if (fix) {
+					for (int j=0;j<convertsamplestospecies.size();j++) {
+						if (convertsamplestospecies[j]==i+1) {
+							if ((i+1)<maxspecies) { //so there's a species to the right to combine with.
+								convertsamplestospecies[j]=convertsamplestospecies[j]+1;
+							}
+							else { 
+								convertsamplestospecies[j]=convertsamplestospecies[j]-1;
+							}
+						}
+					}
+					bool goodshape=CheckConvertSamplesToSpeciesVector(true);
+					goodsamplenumber=CombineSpeciesWithTooFewSamples(true);
+				}
+			}
+		}		
+	}
+	return goodsamplenumber;
+}
+
+bool BROWNIE::CheckConvertSamplesToSpeciesVectorSpNum(int actualmaxspeciesnum)
+{
+    int maxspecies=0;
     bool goodshape=true;
     int firstbadspecies=0;
     for (int i=0;i<convertsamplestospecies.size();i++) {
@@ -2337,9 +2883,10 @@ bool BROWNIE::TestMoveSamples(int Sample, int Destination)
 
 void BROWNIE::DoExhaustiveSearch()
 {
-	message="This will do an exhaustive search for up to 6 species. This will take some time.";
+	message="This will do an exhaustive search for up to 3 species. This will take some time.";
 	PrintMessage();
 	bestscore=GSL_POSINF;
+	structurescorecache.clear();
 	vector<double> nextscorevector;
 	double nextscore;
 	message="Now starting with 1 species";
@@ -2407,65 +2954,208 @@ void BROWNIE::DoExhaustiveSearch()
 	
 }
 
+//Tries every assignment of samples to exactly maxspecies species on SpeciesTree. Samples are assigned one species at a time, going through the sets
+//of samples for a species in Gray code order, so each set differs from the last by one sample. The structure score of a species depends only on its
+//samples, so it is stored for each set (see structurescorecache), and an assignment is abandoned as soon as the structure scores of the species
+//filled so far add up to more than the best score. The score isn't updated incrementally as samples move in and out: it comes from pruning the gene
+//trees to the species' samples and comparing the pieces, which isn't a sum over samples, so each new set is scored in full and only sets met again
+//(in other branches of the search, or on the other trees) are saved work. Labels of two species forming a cherry on SpeciesTree can be swapped
+//without changing the tree, so only one of the two labellings is tried.
 double BROWNIE::DoAllAssignments(double bestscore, int maxspecies, ContainingTree *SpeciesTree )
 {
-	vector<double> nextscorevector;
-	double nextscore;
-	vector <int> countpertaxon(taxa->GetNumTaxonLabels(),1);
-	for (int i=0;i<taxa->GetNumTaxonLabels();i++) {
-		convertsamplestospecies[i]=1;
-		cout<<" "<<convertsamplestospecies[i];
+	int nsamples=taxa->GetNumTaxonLabels();
+	if (nsamples>=64) {
+		errormsg="An exhaustive search can have at most 63 samples";
+		throw XNexus( errormsg);
 	}
-	for (int assignmentrep=0;assignmentrep<pow(maxspecies,taxa->GetNumTaxonLabels());assignmentrep++) {
-		if (CheckConvertSamplesToSpeciesVectorSpNum(maxspecies)) { //we have the right number of species
-			nextscorevector=GetCombinedScore(SpeciesTree);
-			nextscore=nextscorevector[0]; 
-			cout<<"  Score: "<<nextscore<<" Best: "<<GSL_MIN(nextscore,bestscore);
-			if (nextscore==bestscore) {
-			//	TotalScores.push_back(nextscorevector[0]);
-			//	GTPScores.push_back(nextscorevector[1]);
-			//	StructScores.push_back(nextscorevector[2]);				
-				FormatAndStoreBestTree(SpeciesTree,nextscorevector);
+	double oldbestscorelocal=bestscorelocal;
+	SpeciesTree->SetLeafNumbers();
+	SpeciesTree->Update();
+	speciescherrypartner.assign(maxspecies+1,0);
+	NodeIterator <Node> n (SpeciesTree->GetRoot());
+	for (NodePtr currentnode=n.begin(); currentnode!=NULL; currentnode=n.next()) {
+		if (!currentnode->IsLeaf() && currentnode->GetChild()->IsLeaf() && currentnode->GetChild()->GetSibling()!=NULL && currentnode->GetChild()->GetSibling()->IsLeaf() && currentnode->GetChild()->GetSibling()->GetSibling()==NULL) {
+			int firstspecies=currentnode->GetChild()->GetLeafNumber();
+			int secondspecies=currentnode->GetChild()->GetSibling()->GetLeafNumber();
+			speciescherrypartner[firstspecies]=secondspecies;
+			speciescherrypartner[secondspecies]=firstspecies;
+		}
+	}
+	if (!useCOAL && !useMS && structwt<1) {
+		PrepareGTPScorer();
+		exhaustivetreeweights=GetGTPTreeWeights();
+	}
+	assignmentsscored=0;
+	assignmentspruned=0;
+	convertsamplestospecies.assign(nsamples,0); //0 for samples not yet assigned
+	AssignSpeciesExhaustively(1,maxspecies,SpeciesTree,0.0,bestscore);
+	bestscorelocal=oldbestscorelocal;
+	message="Scored ";
+	message+=assignmentsscored;
+	message+=" assignments to ";
+	message+=maxspecies;
+	message+=" species; ";
+	message+=assignmentspruned;
+	message+=" more were ruled out by their structure or duplication scores alone. Best: ";
+	message+=bestscore;
+	PrintMessage();
+	return bestscore;
+}
+
+//Assigns samples not yet assigned to species, then to the species after it, until all maxspecies species are filled. tripletscore is the structure
+//score of the species already filled.
+void BROWNIE::AssignSpeciesExhaustively(int species, int maxspecies, ContainingTree *SpeciesTree, double tripletscore, double &bestscore)
+{
+	int minsamples=GSL_MAX(1,minsamplesperspecies);
+	bool usestructure=(!useCOAL && !useMS && structwt>0);
+	vector<int> unassigned;
+	for (int i=0;i<convertsamplestospecies.size();i++) {
+		if (convertsamplestospecies[i]==0) {
+			unassigned.push_back(i);
+		}
+	}
+	int laterspecies=maxspecies-species;
+	if (unassigned.size()<minsamples*(laterspecies+1)) {
+		return;
+	}
+	if (laterspecies==0) { //the remaining samples all go in the last species
+		for (int i=0;i<unassigned.size();i++) {
+			convertsamplestospecies[unassigned[i]]=species;
+		}
+		if (CherryOrderAllowed(species)) {
+			if (usestructure) {
+				tripletscore+=GetStructureScoreOfSpecies(species,bestscore);
 			}
-			else if (nextscore<bestscore) {
-				bestscore=nextscore;
-				FormattedBestTrees.clear();
-				TotalScores.clear();
-				GTPScores.clear();
-				StructScores.clear();
-				BestConversions.clear();
-				ContourSearchDescription.clear();
-				//TotalScores.push_back(nextscorevector[0]);
-				//GTPScores.push_back(nextscorevector[1]);
-				//StructScores.push_back(nextscorevector[2]);
-				
-                FormatAndStoreBestTree(SpeciesTree,nextscorevector);
+			if (usestructure && structwt*tripletscore>bestscore) {
+				assignmentspruned++;
+			}
+			else {
+				ScoreExhaustiveAssignment(SpeciesTree,tripletscore,bestscore);
 			}
 		}
+		for (int i=0;i<unassigned.size();i++) {
+			convertsamplestospecies[unassigned[i]]=0;
+		}
+		return;
+	}
+	int setsize=0;
+	unsigned long long previousgray=0;
+	unsigned long long numberofsets=1ULL<<unassigned.size();
+	for (unsigned long long step=1; step<numberofsets; step++) {
+		unsigned long long gray=step^(step>>1);
+		unsigned long long changed=gray^previousgray; //just one sample moves in or out of this species
+		int changedsample=0;
+		while (((changed>>changedsample)&1ULL)==0) {
+			changedsample++;
+		}
+		if ((gray&changed)!=0) {
+			convertsamplestospecies[unassigned[changedsample]]=species;
+			setsize++;
+		}
 		else {
-				cout<<"  Invalid assignment for "<<maxspecies<<" species";
+			convertsamplestospecies[unassigned[changedsample]]=0;
+			setsize--;
 		}
-		cout<<endl;
-	//	for (int i=0;i<countpertaxon.size();i++) {
-			//cout<<" "<<countpertaxon[i];
-	//	}
-		//cout<<endl;
-		for (int i=0;i<countpertaxon.size();i++) {
-			countpertaxon[i]++;
-		//	cout<<" maxspecies = "<<maxspecies<<" i = "<<i<<" pow = "<<pow(maxspecies,i)<<" countpertaxon = "<<countpertaxon[i];
-			if (countpertaxon[i]>pow(maxspecies,i)) {
-			//	cout<<" must change ";
-				convertsamplestospecies[i]++;
-				countpertaxon[i]=1;
-				if (convertsamplestospecies[i]>maxspecies) {
-					convertsamplestospecies[i]=1;
-				}
-			}
-			cout<<" "<<convertsamplestospecies[i];
+		previousgray=gray;
+		if (setsize<minsamples || (unassigned.size()-setsize)<minsamples*laterspecies || !CherryOrderAllowed(species)) {
+			continue;
+		}
+		double newtripletscore=tripletscore;
+		if (usestructure) {
+			newtripletscore+=GetStructureScoreOfSpecies(species,bestscore);
+			if (structwt*newtripletscore>bestscore) {
+				assignmentspruned++;
+				continue;
+			}
 		}
+		AssignSpeciesExhaustively(species+1,maxspecies,SpeciesTree,newtripletscore,bestscore);
+	}
+	for (int i=0;i<unassigned.size();i++) {
+		convertsamplestospecies[unassigned[i]]=0;
+	}
+}
 
-	}	
-	return bestscore;
+//If species and the species it forms a cherry with are both filled, the one with the lower number must have the lowest numbered sample
+bool BROWNIE::CherryOrderAllowed(int species)
+{
+	int partner=speciescherrypartner[species];
+	if (partner==0 || partner>species) {
+		return true;
+	}
+	for (int i=0;i<convertsamplestospecies.size();i++) {
+		if (convertsamplestospecies[i]==partner) {
+			return true;
+		}
+		if (convertsamplestospecies[i]==species) {
+			return false;
+		}
+	}
+	return true;
+}
+
+//Structure score of the samples now assigned to species. If finding it was stopped once structwt times the score passed bestscore, the stopping
+//point is stored, which is still enough to rule the set out as bestscore can only go down.
+double BROWNIE::GetStructureScoreOfSpecies(int species, double bestscore)
+{
+	unsigned long long sampleset=0;
+	for (int i=0;i<convertsamplestospecies.size();i++) {
+		if (convertsamplestospecies[i]==species) {
+			sampleset|=(1ULL<<i);
+		}
+	}
+	map<unsigned long long, double>::iterator found=structurescorecache.find(sampleset);
+	if (found!=structurescorecache.end()) {
+		return found->second;
+	}
+	int oldchosentree=chosentree;
+	bestscorelocal=bestscore;
+	triplettoohigh=false;
+	double score=GetTripletScoreForSpecies(species,0.0);
+	triplettoohigh=false;
+	chosentree=oldchosentree;
+	structurescorecache[sampleset]=score;
+	return score;
+}
+
+//Scores the full assignment in convertsamplestospecies, whose species have a total structure score of tripletscore, and stores it if it's among the best
+void BROWNIE::ScoreExhaustiveAssignment(ContainingTree *SpeciesTree, double tripletscore, double &bestscore)
+{
+	vector<double> nextscorevector;
+	if (useCOAL || useMS) {
+		bestscorelocal=bestscore;
+		nextscorevector=GetCombinedScore(SpeciesTree);
+	}
+	else {
+		double gtpscore=0;
+		if (structwt<1) {
+			bool exceeded=false;
+			gtpscore=GetWeightedDuplicationsOnTree(SpeciesTree,exhaustivetreeweights,(bestscore-(structwt*tripletscore))/(1.0-structwt),exceeded);
+			if (exceeded) {
+				assignmentspruned++;
+				return;
+			}
+		}
+		nextscorevector.push_back(((1.0-structwt)*gtpscore)+(structwt*tripletscore));
+		nextscorevector.push_back(gtpscore);
+		nextscorevector.push_back(tripletscore);
+	}
+	assignmentsscored++;
+	double nextscore=nextscorevector[0];
+	if (nextscore==bestscore) {
+		FormatAndStoreBestTree(SpeciesTree,nextscorevector);
+	}
+	else if (nextscore<bestscore) {
+		bestscore=nextscore;
+		FormattedBestTrees.clear();
+		FormattedBestTopologies.clear();
+		UnresolvedFormattedBestTrees.clear();
+		TotalScores.clear();
+		GTPScores.clear();
+		StructScores.clear();
+		BestConversions.clear();
+		ClearContourSearchTables();
+		FormatAndStoreBestTree(SpeciesTree,nextscorevector);
+	}
 }
 
 void BROWNIE::DoHeuristicSearch()
@@ -2563,6 +3253,48 @@ void BROWNIE::DoHeuristicSearch()
     double nexttripletscore;
     vector<double> nextscorevector;
     nxsstring scoretype;
+	//A search can be stopped after maxtime seconds and carried on later from a checkpoint: the best trees so far, and the tree,
+	//assignment, and remaining moves of the replicate under way. Jackknife searches start afresh each time, so aren't checkpointed.
+	time_t searchstarttime=time(NULL);
+	time_t lastcheckpointtime=searchstarttime;
+	bool usecheckpoint=(checkpointfilename.length()>0 && !jackknifesearch);
+	bool outoftime=false;
+	int firstreplicate=1;
+	bool resumeinreplicate=false;
+	ContainingTree ResumeTree;
+	vector<int> resumeconvertsamplestospecies;
+	double resumebestscorelocal=GSL_POSINF;
+	vector<double> resumebestscorelocalvector;
+	int resumemovecount=0;
+	vector<int> resumemoveflags;
+	if (usecheckpoint && resumesearch) {
+		ifstream checkpointf(checkpointfilename.c_str());
+		if (!checkpointf) {
+			message="No checkpoint found in ";
+			message+=checkpointfilename;
+			message+=", so starting a new search";
+			PrintMessage();
+		}
+		else {
+			checkpointf.close();
+			if (!ReadSearchCheckpoint(firstreplicate,resumeinreplicate,ResumeTree,resumeconvertsamplestospecies,resumebestscorelocal,resumebestscorelocalvector,resumemovecount,resumemoveflags)) {
+				gsl_matrix_free(TaxonDistance);
+				gsl_matrix_free(TaxonProportDistance);
+				errormsg="Could not resume the search: ";
+				errormsg+=checkpointfilename;
+				errormsg+=" is damaged or was saved for different data";
+				throw XNexus(errormsg);
+			}
+			message="Resuming the search saved in ";
+			message+=checkpointfilename;
+			message+=" at replicate ";
+			message+=firstreplicate;
+			message+=" with ";
+			message+=int(FormattedBestTrees.size());
+			message+=" best trees so far";
+			PrintMessage();
+		}
+	}
 	message="Now starting the search proper.\nA \">\" before a score indicates that calculation of that score was aborted once the score for that move exceeded the best local score\n";
 	if (!jackknifesearch) {
 		if (!useCOAL && !useMS) {
@@ -2585,7 +3317,31 @@ void BROWNIE::DoHeuristicSearch()
 	}
     PrintMessage();
 
-    for (int replicate=1;replicate<=nreps;replicate++) {
+    for (int replicate=firstreplicate;replicate<=nreps && !outoftime;replicate++) {
+		vector<ContainingTree> BestTreesThisRep;
+		vector<double> bestscorelocalvector;
+		int movecount=0;
+		bool moreswaps=true;
+		bool morereassignments=true;
+		bool moreincreases=true;
+		bool moredecreases=true;
+		bool morererootings=true;
+		if (resumeinreplicate) {
+			convertsamplestospecies=resumeconvertsamplestospecies;
+			bestscorelocal=resumebestscorelocal;
+			movecount=resumemovecount;
+			moreswaps=(resumemoveflags[0]!=0);
+			morereassignments=(resumemoveflags[1]!=0);
+			moreincreases=(resumemoveflags[2]!=0);
+			moredecreases=(resumemoveflags[3]!=0);
+			morererootings=(resumemoveflags[4]!=0);
+			ResumeTree.Update();
+			bestscorelocalvector=resumebestscorelocalvector; //not scored again, as that could use random numbers (for MS) and change the score
+			BestTreesThisRep.push_back(ResumeTree);
+			scoretype="*L\t";
+			resumeinreplicate=false;
+		}
+		else {
         convertsamplestospecies=intialconvertsamplestospeciesvector;
         ContainingTree StartingTree;
         //cout<<"Starting vector = "<<endl;
@@ -2763,7 +3519,6 @@ void BROWNIE::DoHeuristicSearch()
         //}
         //cout<<endl;
 bestscorelocal=GSL_POSINF;
-vector<ContainingTree> BestTreesThisRep;
 
 //ContainingTree BestTree;
 StartingTree.RandomTree(CurrentSppNum);
@@ -2781,197 +3536,34 @@ StartingTree.ConvertTaxonNamesToRandomTaxonNumbers();
 //cout<<"\n";
 // char* inputforgtp=OutputForGTP(&CurrentTree);
 // cout<<OutputForGTP(&StartingTree)<<endl;
-// bestscorelocal=ReturnScore(OutputForGTP(&StartingTree));
-//cout<<"currentsppnum = "<<CurrentSppNum<<endl;
-//cout<<"starting tree health:\n";
-//StartingTree.ReportTreeHealth();
-if (useCOAL || useMS) {
-		StartingTree.InitializeMissingBranchLengths();
-}
-
-
-//////////Copied from stuff below////////////////
-			//brlen optimization
-StartingTree.FindAndSetRoot();
-StartingTree.Update();
-if (useCOAL && StartingTree.GetNumLeaves()>1) {
-				StartingTree.InitializeMissingBranchLengths();
-				for (int brlenrep=0; brlenrep<20*(numbrlenadjustments-1); brlenrep++) {
-					ContainingTree StartingTreeBrlenMod;
-					StartingTreeBrlenMod.SetRoot(StartingTree.CopyOfSubtree(StartingTree.GetRoot()));
-					StartingTreeBrlenMod.InitializeMissingBranchLengths();
-					StartingTreeBrlenMod.RandomlyModifySingleBranchLength(markedmultiplier,brlensigma);
-					vector<double> brlenscorevector=GetCombinedScore(&StartingTreeBrlenMod);
-					if (brlenscorevector[0]<=bestscorelocal) {
-						if (brlenscorevector[0]<bestscorelocal) {
-							brlenrep=0; //so we restart from the new optimum
-							bestscorelocal=brlenscorevector[0];
-						}
-						StartingTree.SetRoot(StartingTreeBrlenMod.CopyOfSubtree(StartingTreeBrlenMod.GetRoot()));
-						StartingTree.FindAndSetRoot();
-						StartingTree.Update();
-						
-					}
-				}
-				
-}
-
-			//Contour search
-if (useCOAL  && StartingTree.GetNumLeaves()>1) {
-				vector<double> speciestreebranchlengthvector;
-				double startingwidth=contourstartingwidth; //start by looking at all brlen between pointestimate/startingwidth and startingwidth*pointestimated
-				double startingnumbersteps=contourstartingnumbersteps; //works best if odd
-				int maxrecursions=contourMaxRecursions;
-				int recursions=0;
-				int numberofedges=0;
-				bool donecontour=false;
-				ContainingTree StartingTreeBrlenMod;
-				while (!donecontour) {
-					recursions++;
-					vector<double> midpointvector;
-					vector<double> incrementwidths;
-					vector<double> currentvector;
-					speciestreebranchlengthvector.clear();
-					ContourSearchVector.clear();
-					StartingTree.FindAndSetRoot();
-					StartingTree.Update();
-					StartingTree.InitializeMissingBranchLengths();
-					StartingTreeBrlenMod.SetRoot(StartingTree.CopyOfSubtree(StartingTree.GetRoot()));
-					StartingTreeBrlenMod.Update();
-					StartingTreeBrlenMod.InitializeMissingBranchLengths();
-					vector<double> speciestreebranchlengthvector;
-					NodeIterator <Node> n (StartingTreeBrlenMod.GetRoot());
-					NodePtr currentnode = n.begin();
-					NodePtr rootnode=StartingTreeBrlenMod.GetRoot();
-					numberofedges=0;
-					while (currentnode)
-					{
-						if (currentnode!=rootnode) {
-							double edgelength=currentnode->GetEdgeLength();
-							if (gsl_isnan(edgelength)) {
-								edgelength=1.0;
-							}
-							speciestreebranchlengthvector.push_back(edgelength); //get midpoint edges
-							double basestep=exp(2.0*log(startingwidth)/(startingnumbersteps-1));
-							double smallestbrlen=edgelength*(pow(basestep,(0-startingnumbersteps+((startingnumbersteps+1.0)/2.0))));
-							midpointvector.push_back(edgelength);
-							currentvector.push_back(smallestbrlen); //start with minimum values, then  move up
-							incrementwidths.push_back(basestep);
-							numberofedges++;
-						}
-						currentnode = n.next();
-					}
-					bool donegrid=false;
-					vector<int> increments;
-					increments.assign(numberofedges,0);
-					int origCOALaicmode=COALaicmode;
-					COALaicmode=0;
-					vector<double> startingscorevector=GetCombinedScore(&StartingTree);
-					double currentscore=startingscorevector[0];
-					while (!donegrid) {
-						//cout<<"Looping over grid tries"<<endl;
-						currentnode = n.begin();
-						int nodenumber=0;
-						while (currentnode)
-						{
-							if (currentnode!=rootnode) {
-								currentnode->SetEdgeLength(currentvector[nodenumber]);
-								nodenumber++;
-							}
-							currentnode = n.next();
-						}
-						vector<double> brlenscorevector=GetCombinedScore(&StartingTreeBrlenMod);
-						double brlenscore=brlenscorevector[0]-currentscore;
-						bool atmargin=false;
-						for (int i=0; i<numberofedges; i++) {
-							if ((increments[i]==0) || (increments[i]==startingnumbersteps-1)) {
-								atmargin=true;
-								
-							}
-						}
-						if (atmargin) { //if we're bumping up against minimum branchlength, there's nowhere further to expand the grid
-							for (int i=0; i<numberofedges; i++) {
-								if (currentvector[i]==0) {
-									atmargin=false;
-									
-								}
-							}
-						}
-						//cout<<endl;
-						if (atmargin) { //we're at a margin of the space; want to make sure that the region within two lnL is inside this region
-							if (brlenscore<2 && recursions<maxrecursions) { //our region is too small, since points 2 lnL units away from the max are outside the region
-								startingwidth*=1.5;
-								donegrid=true; //break the while(!donegrid) loop; since donecontour isn't done, reinitialize everything
-							}
-						}
-						vector<double> resultvector=currentvector;
-						resultvector.push_back(brlenscore);
-						ContourSearchVector.push_back(resultvector);
-						if (brlenscore<0 && recursions<=maxrecursions) {
-							currentscore=brlenscorevector[0];
-							StartingTree.SetRoot(StartingTreeBrlenMod.CopyOfSubtree(StartingTreeBrlenMod.GetRoot()));
-							StartingTree.FindAndSetRoot();
-							StartingTree.Update();
-							donegrid=true; //break the while(!donegrid) loop; since donecontour isn't done, reinitialize everything
-							if (showtries) {
-								cout<<"Better branch lengths found in grid search"<<endl;
-							}
-						}
-						increments[0]++;
-						if (!donegrid) {
-							for (int itemtoexamine=0; itemtoexamine<numberofedges; itemtoexamine++) {
-								if (increments[itemtoexamine]==startingnumbersteps) {
-									if (itemtoexamine<numberofedges-1) { //means there's room to the left
-										increments[itemtoexamine]=0;
-										increments[itemtoexamine+1]++;
-									}
-									else {
-										donegrid=true;
-										donecontour=true;
-									}
-								}
-							}
-						}
-						currentvector.clear();
-						for (int i=0; i<numberofedges; i++) {
-							double newbrlen=midpointvector[i]*(pow(incrementwidths[i],(increments[i]-startingnumbersteps+((startingnumbersteps+1)/2))));
-							currentvector.push_back(newbrlen);
-						}
-					}
-					
-					COALaicmode=origCOALaicmode;
-					
-				}
-				vector<double> totalbrlen;
-				totalbrlen.assign(numberofedges-1,0);
-				int numequaltrees=0;
-				for (int i=0; i<ContourSearchVector.size(); i++) {
-					if (ContourSearchVector[i][numberofedges]<=0) {
-						for (int j=0; j<numberofedges; j++) {
-							totalbrlen[j]+=ContourSearchVector[i][j];
-							numequaltrees++;
-						}
-					}
+// bestscorelocal=ReturnScore(OutputForGTP(&StartingTree));
+//cout<<"currentsppnum = "<<CurrentSppNum<<endl;
+//cout<<"starting tree health:\n";
+//StartingTree.ReportTreeHealth();
+if (useCOAL || useMS) {
+		StartingTree.InitializeMissingBranchLengths();
+}
+
+
+//////////Copied from stuff below////////////////
+			//brlen optimization
+StartingTree.FindAndSetRoot();
+StartingTree.Update();
+if (useCOAL && StartingTree.GetNumLeaves()>1 && numbrlenadjustments>1) { //as with the 20*(numbrlenadjustments-1) random proposals this replaced, numbrlenadjustments=1 leaves the starting lengths alone
+				vector<double> brlenscorevector=OptimizeSpeciesTreeBranchLengths(StartingTree);
+				if (brlenscorevector[0]<=bestscorelocal) {
+					bestscorelocal=brlenscorevector[0];
 				}
-NodeIterator <Node> n (StartingTree.GetRoot());
-NodePtr currentnode = n.begin();
-NodePtr rootnode=StartingTree.GetRoot();
-int edgenumber=0;
-while (currentnode)
-{
-	if (currentnode!=rootnode) {
-						//cout<<"new brlen = "<<totalbrlen[edgenumber]/(numequaltrees*1.0)<<endl;
-		currentnode->SetEdgeLength(totalbrlen[edgenumber]/(numequaltrees*1.0));
-		edgenumber++;
-	}
-	currentnode = n.next();
 }
-nextscorevector=GetCombinedScore(&StartingTree);
-nextscore=nextscorevector[0];
+
+			//Contour search
+if (useCOAL  && StartingTree.GetNumLeaves()>1) {
+				nextscorevector=ContourSearchBranchLengths(StartingTree);
+				nextscore=nextscorevector[0];
 }
 //////////END Copied from stuff below////////////////
 
-vector<double> bestscorelocalvector=GetCombinedScore(&StartingTree);
+bestscorelocalvector=GetCombinedScore(&StartingTree);
 bestscorelocal=bestscorelocalvector[0];
 if (bestscorelocal==bestscore) {
 	//cout<<"Before RawBestTrees.push_back(StartingTree);"<<endl;
@@ -2989,11 +3581,13 @@ else if (bestscorelocal<bestscore) {
 	//StartingTree.ReportTreeHealth();
     RawBestTrees.push_back(StartingTree);
     FormattedBestTrees.clear();
+    FormattedBestTopologies.clear();
+    UnresolvedFormattedBestTrees.clear();
 	TotalScores.clear();
 	GTPScores.clear();
 	StructScores.clear();
 	BestConversions.clear();
-	ContourSearchDescription.clear();
+	ClearContourSearchTables();
 //	TotalScores.push_back(bestscorelocalvector[0]);
 //	GTPScores.push_back(bestscorelocalvector[1]);
 //	StructScores.push_back(bestscorelocalvector[2]);
@@ -3012,9 +3606,9 @@ else {
 //StartingTree.ReportTreeHealth();
 
 BestTreesThisRep.push_back(StartingTree);
+		} //start of a new replicate
 
 //BestTree=StartingTree;
-int movecount=0;
 if (status) {
     //cout<<"\n\n"<<OutputForGTP(&CurrentTree)<<"\n\n";
     // cout<<"Starting tree: \n\n"; //Rewrite the draw function to allow output to a file
@@ -3025,15 +3619,31 @@ if (status) {
 //    BestTrees.push_back(CurrentTree);
 // }
 bool improvement=true;
-		bool moreswaps=true;
-		bool morereassignments=true;
-		bool moreincreases=true;
-		bool moredecreases=true;
-		bool morererootings=true;
 		
-while (improvement && (rearrlimit<0 || movecount<rearrlimit)) {
+while (improvement && !outoftime && (rearrlimit<0 || movecount<rearrlimit)) {
     //cout<<"\nimprovement, restarting\n";
     improvement=false;
+	vector<int> passmoveflags; //where this pass starts, which is saved if time runs out during it
+	passmoveflags.push_back(moreswaps);
+	passmoveflags.push_back(morereassignments);
+	passmoveflags.push_back(moreincreases);
+	passmoveflags.push_back(moredecreases);
+	passmoveflags.push_back(morererootings);
+	vector<int> passconvertsamplestospecies=convertsamplestospecies;
+	int passmovecount=movecount;
+	double passbestscorelocal=bestscorelocal;
+	vector<double> passbestscorelocalvector=bestscorelocalvector;
+	vector<ContainingTree> passtree; //the tree and random number state are only kept when checkpointing
+	vector<char> passrngstate;
+	if (usecheckpoint) {
+		passtree.push_back(BestTreesThisRep.back());
+		const char *rngstate=(const char *)gsl_rng_state(r);
+		passrngstate.assign(rngstate,rngstate+gsl_rng_size(r));
+	}
+	if (usecheckpoint && difftime(time(NULL),lastcheckpointtime)>=checkpointinterval) {
+		WriteSearchCheckpoint(replicate,&(BestTreesThisRep.back()),bestscorelocalvector,movecount,passmoveflags);
+		lastcheckpointtime=time(NULL);
+	}
 	if (chosenmove!=6) { //only reset moves on topology change
 		bool moreswaps=true;
 		bool morereassignments=true;
@@ -3266,8 +3876,22 @@ while (improvement && (rearrlimit<0 || movecount<rearrlimit)) {
         }
     }
 
+    //SPR rearrangements of CurrentTree made and scored together (see sprbatch), waiting to be tried in order
+    vector<ContainingTree> SPRSwapTrees;
+    vector<vector<int> > SPRBreakVectors;
+    vector<vector<int> > SPRAttachVectors;
+    vector<bool> SPRMoreSwaps;
+    vector<vector<double> > SPRScoreVectors;
+    vector<bool> SPRAbortedScores;
+    bool SPRtriplettoohigh=false;
+    vector<int> SPRconvertsamplestospecies;
+    int nextSPR=0;
     while ((moreswaps || morereassignments || moreincreases || moredecreases || morererootings) && (rearrlimit<0 || movecount<rearrlimit)) {
 		//cout<<"while ((moreswaps || morereassignments || moreincreases || moredecreases || morererootings) && (rearrlimit<0 || movecount<rearrlimit)) {"<<endl;
+		if (maxtime>0 && difftime(time(NULL),searchstarttime)>=maxtime) {
+			outoftime=true;
+			break;
+		}
         bool somethinghappened=true;
 		//cout<<"just before ContainingTree NextTree=CurrentTree"<<endl;
 		CurrentTree.FindAndSetRoot();
@@ -3365,22 +3989,50 @@ while (improvement && (rearrlimit<0 || movecount<rearrlimit)) {
                 cout<<"Start tree = \n";
                 NextTree.Draw(cout);
             }
-            NextTree.SetBreakVector(CurrentTree.GetBreakVector());
-            NextTree.SetAttachVector(CurrentTree.GetAttachVector());
-            NextTree.FindAndSetRoot();
-            NextTree.Update();
-            moreswaps=NextTree.NextSPR();
-            if (showtries) {
-                cout<<"Swap tree = \n";
-                NextTree.Draw(cout);
+            if (sprbatch>1) { //take the next of a set of rearrangements scored together
+                bool batchcurrent=(nextSPR<SPRSwapTrees.size() && SPRconvertsamplestospecies==convertsamplestospecies);
+                if (batchcurrent && nextSPR>0) { //make sure CurrentTree is where the batch left it
+                    batchcurrent=(CurrentTree.GetBreakVector()==SPRBreakVectors[nextSPR-1] && CurrentTree.GetAttachVector()==SPRAttachVectors[nextSPR-1]);
+                }
+                if (!batchcurrent) {
+                    GetSPRNeighborhood(NextTree,sprbatch,SPRSwapTrees,SPRBreakVectors,SPRAttachVectors,SPRMoreSwaps);
+                    GetCombinedScores(SPRSwapTrees,SPRScoreVectors,SPRAbortedScores);
+                    SPRtriplettoohigh=triplettoohigh;
+                    SPRconvertsamplestospecies=convertsamplestospecies;
+                    nextSPR=0;
+                }
+                NextTree=SPRSwapTrees[nextSPR];
+                moreswaps=SPRMoreSwaps[nextSPR];
+                CurrentTree.SetBreakVector(SPRBreakVectors[nextSPR]);
+                CurrentTree.SetAttachVector(SPRAttachVectors[nextSPR]);
+                nextscorevector=SPRScoreVectors[nextSPR];
+                nextscore=nextscorevector[0];
+                gtptoohigh=SPRAbortedScores[nextSPR]; //for the status line
+                triplettoohigh=SPRtriplettoohigh;
+                nextSPR++;
+                if (showtries) {
+                    cout<<"Swap tree = \n";
+                    NextTree.Draw(cout);
+                }
+            }
+            else {
+                NextTree.SetBreakVector(CurrentTree.GetBreakVector());
+                NextTree.SetAttachVector(CurrentTree.GetAttachVector());
+                NextTree.FindAndSetRoot();
+                NextTree.Update();
+                moreswaps=NextTree.NextSPR();
+                if (showtries) {
+                    cout<<"Swap tree = \n";
+                    NextTree.Draw(cout);
+                }
+                CurrentTree.SetBreakVector(NextTree.GetBreakVector()); //due to how the vectors are updated during a swap.
+                CurrentTree.SetAttachVector(NextTree.GetAttachVector());
+                if (useCOAL || useMS) {
+                    NextTree.InitializeMissingBranchLengths();
+                }
+                nextscorevector=GetCombinedScore(&NextTree);
+                nextscore=nextscorevector[0];
             }
-            CurrentTree.SetBreakVector(NextTree.GetBreakVector()); //due to how the vectors are updated during a swap.
-            CurrentTree.SetAttachVector(NextTree.GetAttachVector());
-			if (useCOAL || useMS) {
-				NextTree.InitializeMissingBranchLengths();
-			}
-            nextscorevector=GetCombinedScore(&NextTree);
-            nextscore=nextscorevector[0];
         }
         else if(chosenmove==2) {
             if (showtries) {
@@ -3690,212 +4342,17 @@ while (improvement && (rearrlimit<0 || movecount<rearrlimit)) {
 			
 			//brlen optimization
 			if (useCOAL && NextTree.GetNumLeaves()>1) { //only do this is there are at least two species (brlen doesn't matter for single species);
-				NextTree.InitializeMissingBranchLengths();
-				for (int brlenrep=0; brlenrep<numbrlenadjustments; brlenrep++) {
-					BrlenChangedTree.SetRoot(NextTree.CopyOfSubtree(NextTree.GetRoot()));
-					BrlenChangedTree.InitializeMissingBranchLengths();
-					BrlenChangedTree.RandomlyModifySingleBranchLength(markedmultiplier,brlensigma);
-					vector<double> brlenscorevector=GetCombinedScore(&BrlenChangedTree);
-					if (brlenscorevector[0]<=nextscore) {
-						if (brlenscorevector[0]<nextscore) {
-							brlenrep=0; //so we restart from the new optimum
-							nextscore=brlenscorevector[0];
-							nextscorevector[0]=brlenscorevector[0]; //other elements are the same
-						}
-						NextTree.SetRoot(BrlenChangedTree.CopyOfSubtree(BrlenChangedTree.GetRoot()));
-						NextTree.FindAndSetRoot();
-						NextTree.Update();
-						
-					}
+				vector<double> brlenscorevector=OptimizeSpeciesTreeBranchLengths(NextTree);
+				if (brlenscorevector[0]<nextscore) {
+					nextscore=brlenscorevector[0];
+					nextscorevector[0]=brlenscorevector[0]; //other elements are the same
 				}
-				
 			}
 			 
 			
 			//Contour search
 			if (useCOAL  && NextTree.GetNumLeaves()>1) {
-				vector<double> speciestreebranchlengthvector;
-				double startingwidth=contourstartingwidth; //start by looking at all brlen between pointestimate/startingwidth and startingwidth*pointestimated
-				double startingnumbersteps=contourstartingnumbersteps; //works best if odd
-				int maxrecursions=contourMaxRecursions;
-				int recursions=0;
-				int numberofedges=0;
-				bool donecontour=false;
-				while (!donecontour) {
-					recursions++;
-					//cout<<"donecontour"<<endl;
-					vector<double> midpointvector;
-					vector<double> incrementwidths;
-					vector<double> currentvector;
-					speciestreebranchlengthvector.clear();
-					ContourSearchVector.clear();
-					NextTree.FindAndSetRoot();
-					NextTree.Update();
-					NextTree.InitializeMissingBranchLengths();
-					BrlenChangedTree.SetRoot(NextTree.CopyOfSubtree(NextTree.GetRoot()));
-					BrlenChangedTree.Update();
-					BrlenChangedTree.InitializeMissingBranchLengths();
-					//BrlenChangedTree.ReportTreeHealth();
-					vector<double> speciestreebranchlengthvector;
-					NodeIterator <Node> n (BrlenChangedTree.GetRoot());
-					NodePtr currentnode = n.begin();
-					NodePtr rootnode=BrlenChangedTree.GetRoot();
-					numberofedges=0;
-					while (currentnode)
-					{
-						if (currentnode!=rootnode) {
-							double edgelength=currentnode->GetEdgeLength();
-							if (gsl_isnan(edgelength)) {
-								edgelength=1.0;
-							}
-							speciestreebranchlengthvector.push_back(edgelength); //get midpoint edges
-							double basestep=exp(2.0*log(startingwidth)/(startingnumbersteps-1));
-							//cout<<"basestep = "<<basestep<<endl;
-							//brlen if startingnumbersteps=5 and starting width is 4 is edgelength/4, edgelength/2, edgelength, edgelength*2, edgelength*4; aka 2^-2, 2^-1, 
-							//double mindepth=GSL_MAX(edgelength*(1-startingwidth),0);
-							//double maxdepth=edgelength*(1+startingwidth);
-							//cout<<"mindepth = "<<mindepth<<" maxdepth = "<<maxdepth<<endl<<endl;
-							double smallestbrlen=edgelength*(pow(basestep,(0-startingnumbersteps+((startingnumbersteps+1.0)/2.0))));
-							midpointvector.push_back(edgelength);
-							currentvector.push_back(smallestbrlen); //start with minimum values, then  move up
-							incrementwidths.push_back(basestep);
-							numberofedges++;
-						}
-						currentnode = n.next();
-					}
-					bool donegrid=false;
-					vector<int> increments;
-					increments.assign(numberofedges,0);
-					int origCOALaicmode=COALaicmode;
-					COALaicmode=0;
-					vector<double> startingscorevector=GetCombinedScore(&NextTree);
-					double currentscore=startingscorevector[0];
-					while (!donegrid) {
-						for (int i=0;i<currentvector.size();i++) {
-							//cout<<currentvector[i]<<" ";
-						}
-						//cout<<endl;
-						//cout<<"donegrid"<<endl;
-						currentnode = n.begin();
-						int nodenumber=0;
-						while (currentnode)
-						{
-							if (currentnode!=rootnode) {
-								currentnode->SetEdgeLength(currentvector[nodenumber]);
-								nodenumber++;
-							}
-							currentnode = n.next();
-						}
-						vector<double> brlenscorevector=GetCombinedScore(&BrlenChangedTree);
-						double brlenscore=brlenscorevector[0]-currentscore;
-						//cout<<"score "<<brlenscore;
-						bool atmargin=false;
-						for (int i=0; i<numberofedges; i++) {
-							if ((increments[i]==0) || (increments[i]==startingnumbersteps-1)) {
-								atmargin=true;
-								
-							}
-							//cout<<" "<<currentvector[i];
-						}
-						if (atmargin) { //if we're bumping up against minimum branchlength, there's nowhere further to expand the grid
-							for (int i=0; i<numberofedges; i++) {
-								if (currentvector[i]==0) {
-									atmargin=false;
-									
-								}
-							}
-						}
-						//cout<<endl;
-						if (atmargin) { //we're at a margin of the space; want to make sure that the region within two lnL is inside this region
-							if (brlenscore<2 && recursions<maxrecursions) { //our region is too small, since points 2 lnL units away from the max are outside the region
-								//message="Starting width of ";
-								//message+=startingwidth;
-								//message+=" was too small, now increasing to ";
-								startingwidth*=1.5;
-								//message+=startingwidth;
-								//PrintMessage();
-								donegrid=true; //break the while(!donegrid) loop; since donecontour isn't done, reinitialize everything
-							}
-						}
-						vector<double> resultvector=currentvector;
-						resultvector.push_back(brlenscore);
-						ContourSearchVector.push_back(resultvector);
-						if (brlenscore<0 && recursions<=maxrecursions) {
-							currentscore=brlenscorevector[0];
-							//message="Better branch length found, restarting contour search";
-							//PrintMessage();
-							//recursions=0; //restart search
-							NextTree.SetRoot(BrlenChangedTree.CopyOfSubtree(BrlenChangedTree.GetRoot()));
-							NextTree.FindAndSetRoot();
-							NextTree.Update();
-							donegrid=true; //break the while(!donegrid) loop; since donecontour isn't done, reinitialize everything
-							if (showtries) {
-								cout<<"Better branch lengths found in grid search"<<endl;
-							}
-							
-						}
-						increments[0]++;
-						if (!donegrid) {
-							for (int itemtoexamine=0; itemtoexamine<numberofedges; itemtoexamine++) {
-								if (increments[itemtoexamine]==startingnumbersteps) {
-									if (itemtoexamine<numberofedges-1) { //means there's room to the left
-										increments[itemtoexamine]=0;
-										increments[itemtoexamine+1]++;
-									}
-									else {
-										donegrid=true;
-										donecontour=true;
-									}
-								}
-							}
-						}
-						currentvector.clear();
-						for (int i=0; i<numberofedges; i++) {
-							//cout<<midpointvector[i]<<" * ("<<incrementwidths[i]<<"^"<<increments[i]-startingnumbersteps+((startingnumbersteps+1)/2)<<") = ";
-							double newbrlen=midpointvector[i]*(pow(incrementwidths[i],(increments[i]-startingnumbersteps+((startingnumbersteps+1)/2))));
-							currentvector.push_back(newbrlen);
-							//cout<<newbrlen<<" ";
-						}
-						//cout<<endl;
-						//cout<<"donegrid is "<<donegrid<<" and donecontour is "<<donecontour<<endl;
-					}
-					
-					COALaicmode=origCOALaicmode;
-					
-				}
-				vector<double> totalbrlen;
-				totalbrlen.assign(numberofedges-1,0);
-				int numequaltrees=0;
-				for (int i=0; i<ContourSearchVector.size(); i++) {
-					//if (logf_open) {
-					//	for (int k=0; k<=numberofedges; k++) {
-							//logf<<ContourSearchVector[i][k]<<"\t";
-					//		cout<<ContourSearchVector[i][k]<<"\t";
-					//	}
-						//logf<<endl<<endl; 
-					//cout<<endl;
-					//}
-					if (ContourSearchVector[i][numberofedges]<=0) {
-						for (int j=0; j<numberofedges; j++) {
-							totalbrlen[j]+=ContourSearchVector[i][j];
-							numequaltrees++;
-						}
-					}
-				}
-				NodeIterator <Node> n (NextTree.GetRoot());
-				NodePtr currentnode = n.begin();
-				NodePtr rootnode=NextTree.GetRoot();
-				int edgenumber=0;
-				while (currentnode)
-				{
-					if (currentnode!=rootnode) {
-						//cout<<"new brlen = "<<totalbrlen[edgenumber]/(numequaltrees*1.0)<<endl;
-						currentnode->SetEdgeLength(totalbrlen[edgenumber]/(numequaltrees*1.0));
-						edgenumber++;
-					}
-					currentnode = n.next();
-				}
-				nextscorevector=GetCombinedScore(&NextTree);
+				nextscorevector=ContourSearchBranchLengths(NextTree);
 				nextscore=nextscorevector[0];
 			}
 			
@@ -3911,6 +4368,8 @@ while (improvement && (rearrlimit<0 || movecount<rearrlimit)) {
                 RawBestTrees.clear();
                 RawBestTrees.push_back(NextTree);
                 FormattedBestTrees.clear();
+                FormattedBestTopologies.clear();
+                UnresolvedFormattedBestTrees.clear();
 				TotalScores.clear();
 				GTPScores.clear();
 				StructScores.clear();
@@ -4077,7 +4536,23 @@ while (improvement && (rearrlimit<0 || movecount<rearrlimit)) {
         } //if something happened
 		//cout<<"done if something happened loop"<<endl;
     } //while (moreswaps || morereassignments || moreincreases || moredecreases )
+	if (outoftime && usecheckpoint) { //save the start of this pass, so it's tried again in full on resuming
+		convertsamplestospecies=passconvertsamplestospecies;
+		bestscorelocal=passbestscorelocal;
+		bestscorelocalvector=passbestscorelocalvector;
+		memcpy(gsl_rng_state(r),&passrngstate[0],passrngstate.size()); //the search is stopping, so the generator can go back to the start of the pass too
+		WriteSearchCheckpoint(replicate,&(passtree[0]),passbestscorelocalvector,passmovecount,passmoveflags);
+	}
 }//while improvement
+if (usecheckpoint && !outoftime) {
+	vector<int> nomoveflags;
+	vector<double> noscorevector;
+	WriteSearchCheckpoint(replicate+1,NULL,noscorevector,0,nomoveflags);
+	lastcheckpointtime=time(NULL);
+}
+if (maxtime>0 && replicate<nreps && difftime(time(NULL),searchstarttime)>=maxtime) {
+	outoftime=true;
+}
  //DelDupes();
  //message="Replicate finished, now removing duplicate trees and saving best to file";
  //PrintMessage();
@@ -4103,6 +4578,16 @@ while (improvement && (rearrlimit<0 || movecount<rearrlimit)) {
 //}
     }//nrep
      //DelDupes();
+if (outoftime) {
+	message="\nStopped the search after reaching the time limit of ";
+	message+=int(maxtime);
+	message+=" seconds";
+	if (usecheckpoint) {
+		message+="; to carry on, run hsearch again with resume=yes checkpoint=";
+		message+=checkpointfilename;
+	}
+	PrintMessage();
+}
 cout<<endl<<"Best trees overall"<<endl<<endl;
 for (int i=0; i<FormattedBestTrees.size(); i++) {
     (FormattedBestTrees[i]).Update();
@@ -4158,7 +4643,7 @@ void BROWNIE::DoDettmanCollapse()
 	//This just collapses branches on a partially-resolved input tree (the only branches are "independent evolutionary lineages") so that each sample is in a species. Assumes input tree has all branches but "independent evolutionary lineages" (and terminals) collapsed
 	//basically, every taxon should be connecting to a branch with only taxa as descendants
 	ContainingTree TreeToCollapse;
-	TreeToCollapse.SetRoot((intrees.GetIthTree(chosentree-1)).CopyOfSubtree((intrees.GetIthTree(chosentree-1)).GetRoot()));
+	TreeToCollapse.SetRoot((intrees.GetIthTreeRef(chosentree-1)).CopyOfSubtree((intrees.GetIthTreeRef(chosentree-1)).GetRoot()));
 	bool isokay=false;
 	while (!isokay) {
 		TreeToCollapse.FindAndSetRoot();
@@ -4227,6 +4712,15 @@ double BROWNIE::GetTripletScore(ContainingTree *SpeciesTreePtr) { //Note that ex
 		if (triplettoohigh) {
 			break;
 		}
+        totalscore=GetTripletScoreForSpecies(i,totalscore);
+    }
+    chosentree=oldchosentree;
+    return totalscore;
+}
+
+//Adds the structure score of the samples assigned to one species to totalscore, stopping (and setting triplettoohigh) once totalscore*structwt passes bestscorelocal.
+//The score depends only on which samples are in the species, not on the rest of the assignment.
+double BROWNIE::GetTripletScoreForSpecies(int i, double totalscore) {
         int nsamplesinspecies=0;
         vector<nxsstring> taxatoexclude;
         for (int j=0; j<convertsamplestospecies.size();j++) {
@@ -4247,6 +4741,8 @@ double BROWNIE::GetTripletScore(ContainingTree *SpeciesTreePtr) { //Note that ex
             vector<int> TreesPerGene;
             vector<ContainingTree> OneGeneTreeVector;
             vector<double> OneGeneTreeWeights;
+            map<int, pair<int, int> > TopologyPieces; //first piece and number of pieces in OneGeneTreeVector of each gene tree topology already split in this gene
+            GroupIdenticalGeneTrees();
             for (int chosentreenum=0; chosentreenum<trees->GetNumTrees(); chosentreenum++) {
 				if (triplettoohigh) {
 					break;
@@ -4262,6 +4758,8 @@ double BROWNIE::GetTripletScore(ContainingTree *SpeciesTreePtr) { //Note that ex
 							numberofgenes++;
 							TreesPerGene.push_back(OneGeneTreeVector.size());
 							OneGeneTreeVector.clear();
+							OneGeneTreeWeights.clear();
+							TopologyPieces.clear();
 						}
 						totalweight=newweight;
 					}
@@ -4279,6 +4777,8 @@ double BROWNIE::GetTripletScore(ContainingTree *SpeciesTreePtr) { //Note that ex
 								numberofgenes++;
 								TreesPerGene.push_back(OneGeneTreeVector.size());
 								OneGeneTreeVector.clear();
+								OneGeneTreeWeights.clear();
+								TopologyPieces.clear();
 							}
 						}
 					}
@@ -4291,16 +4791,25 @@ double BROWNIE::GetTripletScore(ContainingTree *SpeciesTreePtr) { //Note that ex
 				}
 				if (usethistree) {
 					//Now we can deal with the gene tree, having re-initialized the vector if need be
-					Tree CurrentGeneTreeTreeFmt=intrees.GetIthTree(chosentreenum);
-					//	cout<<"Gene tree is "<<endl;
-					//	CurrentGeneTreeTreeFmt.Draw(cout);
-					ContainingTree CurrentGeneTree;
-					CurrentGeneTree.SetRoot(CurrentGeneTreeTreeFmt.CopyOfSubtree(CurrentGeneTreeTreeFmt.GetRoot()));
-					vector<ContainingTree> SplitTreeVector;
-					SplitTreeVector=CurrentGeneTree.SplitOnTaxon(taxatoexclude);
-					for (int k=0; k<SplitTreeVector.size(); k++) {
-						OneGeneTreeVector.push_back(SplitTreeVector[k]);
-						OneGeneTreeWeights.push_back(newweight);
+					map<int, pair<int, int> >::iterator samepieces=TopologyPieces.find(genetreerepresentative[chosentreenum]);
+					if (samepieces!=TopologyPieces.end()) { //a copy of a tree already in this gene: its weight goes on that tree's pieces, as costs are proportional to weight
+						for (int k=0; k<(samepieces->second).second; k++) {
+							OneGeneTreeWeights[(samepieces->second).first+k]+=newweight;
+						}
+					}
+					else {
+						const Tree &CurrentGeneTreeTreeFmt=intrees.GetIthTreeRef(chosentreenum);
+						//	cout<<"Gene tree is "<<endl;
+						//	CurrentGeneTreeTreeFmt.Draw(cout);
+						ContainingTree CurrentGeneTree;
+						CurrentGeneTree.SetRoot(CurrentGeneTreeTreeFmt.CopyOfSubtree(CurrentGeneTreeTreeFmt.GetRoot()));
+						vector<ContainingTree> SplitTreeVector;
+						SplitTreeVector=CurrentGeneTree.SplitOnTaxon(taxatoexclude);
+						TopologyPieces[genetreerepresentative[chosentreenum]]=pair<int, int>(OneGeneTreeVector.size(),SplitTreeVector.size());
+						for (int k=0; k<SplitTreeVector.size(); k++) {
+							OneGeneTreeVector.push_back(SplitTreeVector[k]);
+							OneGeneTreeWeights.push_back(newweight);
+						}
 					}
 				}
             }
@@ -4310,6 +4819,8 @@ double BROWNIE::GetTripletScore(ContainingTree *SpeciesTreePtr) { //Note that ex
                 numberofgenes++;
                 TreesPerGene.push_back(OneGeneTreeVector.size());
                 OneGeneTreeVector.clear();
+                OneGeneTreeWeights.clear();
+                TopologyPieces.clear();
             }
             //now compare all genes to all other genes
             for (int chosengene1=0;chosengene1<numberofgenes-1; chosengene1++) {
@@ -4329,6 +4840,8 @@ double BROWNIE::GetTripletScore(ContainingTree *SpeciesTreePtr) { //Note that ex
                         assert((GeneTreesVector[chosengene1]).size()>chosentreenum1);
                         double Tree1Wt=GeneTreesWeights[chosengene1][chosentreenum1];
                         int Tree1Ntax=(GeneTreesVector[chosengene1][chosentreenum1]).GetNumLeaves();
+                        (GeneTreesVector[chosengene1][chosentreenum1]).Update();
+                        QTComparison comparison(GeneTreesVector[chosengene1][chosentreenum1]); //set up once for all the trees of the other gene
                         for (int chosentreenum2=0; chosentreenum2<TreesPerGene[chosengene2]; chosentreenum2++) {
 							if (triplettoohigh) {
 								break;
@@ -4341,15 +4854,21 @@ double BROWNIE::GetTripletScore(ContainingTree *SpeciesTreePtr) { //Note that ex
                             (GeneTreesVector[chosengene2][chosentreenum2]).Update();
                             int Tree2Ntax=(GeneTreesVector[chosengene2][chosentreenum2]).GetNumLeaves();
                             if ((Tree1Ntax>2) && (Tree2Ntax>2)) { //so, at least a triplet in each
-                                ContainingTree t1=GeneTreesVector[chosengene1][chosentreenum1]; //Need to store copies of trees because they're modified (leaves deleted)
-                                ContainingTree t2=GeneTreesVector[chosengene2][chosentreenum2];
-                                int taxaincommon=PrepareTreesForTriplet(&t1,&t2);
+                                vector<int> tripletoverlapoutput;
+                                int taxaincommon=Tree1Ntax;
+                                if (!GetTripletOverlap(comparison,&(GeneTreesVector[chosengene2][chosentreenum2]),tripletoverlapoutput)) { //the leaves differ, so prune to those in common
+                                    ContainingTree t1=GeneTreesVector[chosengene1][chosentreenum1]; //Need to store copies of trees because they're modified (leaves deleted)
+                                    ContainingTree t2=GeneTreesVector[chosengene2][chosentreenum2];
+                                    taxaincommon=PrepareTreesForTriplet(&t1,&t2);
+                                    if (taxaincommon>2) {
+                                        //cout<<"t1=\n";
+                                        //t1.Draw(cout);
+                                        //cout<<"\nt2=\n";
+                                        //t2.Draw(cout);
+                                        tripletoverlapoutput=GetTripletOverlap(&t1,&t2,taxaincommon);
+                                    }
+                                }
                                 if (taxaincommon>2) {
-									//cout<<"t1=\n";
-									//t1.Draw(cout);
-									//cout<<"\nt2=\n";
-									//t2.Draw(cout);
-                                    vector<int> tripletoverlapoutput=GetTripletOverlap(&t1,&t2,taxaincommon);
                                     int maxnumber=tripletoverlapoutput[0];
                                     int numberdisagree=tripletoverlapoutput[1];
                                     int numberunresolved=tripletoverlapoutput[2];
@@ -4370,164 +4889,53 @@ double BROWNIE::GetTripletScore(ContainingTree *SpeciesTreePtr) { //Note that ex
             }
             
         }
-        
-    }
-    chosentree=oldchosentree;
     return totalscore;
 }
 
 //computes the TaxonDistance matrix. each entry (i,j) is the number of times taxon i and taxon j are each others' closest relatives in a triplet
 void BROWNIE::GetTaxonTaxonTripletDistances() {
-	TripletCounts.clear(); //Clear the triplet counts map
-	TripleCounts.clear(); //Clears the triples counts map (number of time each set of three taxa co-occur on a tree)
     int nsamples=taxa->GetNumTaxonLabels();
     //cout<<"nsamples = "<<nsamples<<endl;
     if (nsamples==0) {
              errormsg = "ERROR: There are no samples recorded. This can happen if the taxa block is not formatted correctly.";
             throw XNexus( errormsg);
     }
+    if (nsamples>=TRIPLETINDEX_MAXTAXA) {
+        errormsg = "ERROR: Too many samples to count triplets (maximum is ";
+        errormsg += TRIPLETINDEX_MAXTAXA-1;
+        errormsg += ")";
+        throw XNexus( errormsg);
+    }
+	TripletCounts.Initialize(nsamples,intrees.GetNumTrees(),tripletmemorylimit); //Clears the triplet counts (number of times each triplet, and so each set of three taxa, occurs on a tree)
+	if (!TripletCounts.IsDense()) {
+		message="Counting only the triplets that occur, as storing all of them would take more than ";
+		message+=tripletmemorylimit;
+		message+=" MB";
+		PrintMessage();
+	}
     TaxonDistance=gsl_matrix_calloc(nsamples,nsamples); //on diagonal is number of triplets containing the taxon, other elements are as above.
                                                         //	gsl_matrix *TaxonTripletsNotOnSameSide=gsl_matrix_calloc(,);
                                                         //	gsl_matrix *TaxonTripletsTotal=gsl_matrix_calloc(intrees.GetNumTrees(),intrees.GetNumTrees()); //at end, do element by element division, watch for division by zero
+    GroupIdenticalGeneTrees();
+    vector<unsigned int> copiesoftopology(intrees.GetNumTrees(),0); //each topology's triplets are added once, counted once for each copy
+    for (int i=0;i<intrees.GetNumTrees();i++) {
+		if (!jackknifesearch || jackknifevector[i]!=0) {
+			copiesoftopology[genetreerepresentative[i]]++;
+		}
+    }
     for (int i=0;i<intrees.GetNumTrees();i++) {
 			message="now getting triplets on tree ";
 			message+=i+1;
 			message+=" of ";
 			message+=intrees.GetNumTrees();
 			PrintMessage();
-		bool usethistree=true;
-		if (jackknifesearch) {
-			if (jackknifevector[i]==0) {
-				usethistree=false;
-			}
-		}
-		if (usethistree) {
-			Tree t1=intrees.GetIthTree(i);
-			gsl_combination *combo;
-			combo=gsl_combination_calloc(t1.GetNumLeaves(),3);
-			vector<nxsstring> LeafLabelVect; //this section taken from containingtree.cpp (no easy way to convert tree to containing tree)
-			NodeIterator <Node> n (t1.GetRoot());
-			NodePtr currentnode = n.begin();
-			t1.MakeNodeList(); //moved from below
-			while (currentnode)
-			{
-				if(currentnode->IsLeaf()) {
-					LeafLabelVect.push_back(currentnode->GetLabel());
-				}
-				currentnode = n.next();
-			}
-			do
-			{
-				NodePtr p;
-				NodePtr q;
-				nxsstring a=LeafLabelVect[gsl_combination_get(combo,0)];
-				nxsstring b=LeafLabelVect[gsl_combination_get(combo,1)];
-				nxsstring c=LeafLabelVect[gsl_combination_get(combo,2)];
-				std::map<Node *, int, std::less<Node *> > depth;
-				PreorderIterator <Node> n (t1.GetRoot());
-				int count = 0;
-				q = n.begin();
-				while (q)
-				{
-					depth[q] = count++;
-					q = n.next();
-				}
-				
-            //Now get depths for each pair
-				vector<int> LCADepthVectorT1;
-				//t1.MakeNodeList(); //Move this up a level -- calculate it once, see if it goes faster
-				p = t1.GetLeafWithLabel(a.c_str());
-				q = t1.GetLeafWithLabel(b.c_str());
-				while (depth[p] != depth[q])
-				{
-					if (depth[p] < depth[q])
-						q = q->GetAnc();
-					else
-						p = p->GetAnc();
-				}
-				LCADepthVectorT1.push_back(depth[p]);
-				p = t1.GetLeafWithLabel(b.c_str());
-				q = t1.GetLeafWithLabel(c.c_str());
-				while (depth[p] != depth[q])
-				{
-					if (depth[p] < depth[q])
-						q = q->GetAnc();
-					else
-						p = p->GetAnc();
-				}
-				LCADepthVectorT1.push_back(depth[p]);
-				p = t1.GetLeafWithLabel(a.c_str());
-				q = t1.GetLeafWithLabel(c.c_str());
-				while (depth[p] != depth[q])
-				{
-					if (depth[p] < depth[q])
-						q = q->GetAnc();
-					else
-						p = p->GetAnc();
-				}
-				LCADepthVectorT1.push_back(depth[p]);
-				int T1DepthMax=0; //root has depth 0, others have higher depths.
-				int T1DepthMaxIndex=0;
-				int anum=taxa->FindTaxon(a);
-				int bnum=taxa->FindTaxon(b);
-				int cnum=taxa->FindTaxon(c);
-            //cout<<anum<<": "<<a<<" "<<bnum<<": "<<b<<" "<<cnum<<": "<<c<<endl;
-				for (int j=0;j<3;j++) {
-					if(LCADepthVectorT1[j]>T1DepthMax) {
-						T1DepthMax=LCADepthVectorT1[j];
-						T1DepthMaxIndex=j;
-					}
-				}
-            //j=0->ab, j=1->bc j=2->ac
-				gsl_matrix_set(TaxonDistance,anum,anum,1+gsl_matrix_get(TaxonDistance,anum,anum));
-				gsl_matrix_set(TaxonDistance,bnum,bnum,1+gsl_matrix_get(TaxonDistance,bnum,bnum));
-				gsl_matrix_set(TaxonDistance,cnum,cnum,1+gsl_matrix_get(TaxonDistance,cnum,cnum));
-				nxsstring tripletlabel="";
-				if (T1DepthMaxIndex==0) {
-					gsl_matrix_set(TaxonDistance,anum,bnum,1+gsl_matrix_get(TaxonDistance,anum,bnum));
-					gsl_matrix_set(TaxonDistance,bnum,anum,gsl_matrix_get(TaxonDistance,anum,bnum));
-					tripletlabel+=GSL_MIN(anum,bnum);
-					tripletlabel+="_";
-					tripletlabel+=GSL_MAX(anum,bnum);
-					tripletlabel+="_";
-					tripletlabel+=cnum;
-					TripletCounts[tripletlabel]++;
-				}
-				else if (T1DepthMaxIndex==1) {
-					gsl_matrix_set(TaxonDistance,bnum,cnum,1+gsl_matrix_get(TaxonDistance,bnum,cnum));
-					gsl_matrix_set(TaxonDistance,cnum,bnum,gsl_matrix_get(TaxonDistance,bnum,cnum));
-					tripletlabel+=GSL_MIN(cnum,bnum);
-					tripletlabel+="_";
-					tripletlabel+=GSL_MAX(cnum,bnum);
-					tripletlabel+="_";
-					tripletlabel+=anum;
-					TripletCounts[tripletlabel]++;
-				}
-				else if (T1DepthMaxIndex==2) {
-					gsl_matrix_set(TaxonDistance,anum,cnum,1+gsl_matrix_get(TaxonDistance,anum,cnum));
-					gsl_matrix_set(TaxonDistance,cnum,anum,gsl_matrix_get(TaxonDistance,anum,cnum));
-					tripletlabel+=GSL_MIN(cnum,anum);
-					tripletlabel+="_";
-					tripletlabel+=GSL_MAX(cnum,anum);
-					tripletlabel+="_";
-					tripletlabel+=bnum;
-					TripletCounts[tripletlabel]++;
-				}
-				int taxonarray[3]={anum, bnum, cnum};
-				sort(taxonarray,taxonarray+3);
-				nxsstring triplelabel="";
-				triplelabel+=taxonarray[0];
-				triplelabel+="_";
-				triplelabel+=taxonarray[1];
-				triplelabel+="_";
-				triplelabel+=taxonarray[2];
-				TripleCounts[triplelabel]++;
-				//if (debugmode) {
-				//	cout<<"just got triplet for taxa "<<anum<<", "<<bnum<<", and "<<cnum<<endl;
-				//}
+		if (copiesoftopology[i]>0) {
+			CompactTree CompactT1(intrees.GetIthTreeRef(i));
+			for (int leafnum=0;leafnum<CompactT1.GetNumLeaves();leafnum++) { //taxon numbers are looked up once per leaf rather than once per triplet
+				int leaf=CompactT1.GetLeaves()[leafnum];
+				CompactT1.SetTaxon(leaf,taxa->FindTaxon(CompactT1.GetLabel(leaf)));
 			}
-			while (gsl_combination_next(combo) == GSL_SUCCESS);
-			gsl_combination_free(combo);
+			TripletCounts.AddTree(CompactT1,TaxonDistance,copiesoftopology[i]);
 		}
     }
     TaxonProportDistance=gsl_matrix_calloc(nsamples,nsamples);
@@ -4603,10 +5011,18 @@ ContainingTree BROWNIE::ComputeTripletNJTree() {
     ContainingTree NJresult;
     vector<NodePtr> NewNodeVector;
     vector<bool> UnattachedNodeVector;
-    vector<int> MatrixToNodeVector;
     int nsamples=taxa->GetNumTaxonLabels();
     int nsamplesremaining=nsamples;
-    gsl_matrix *dmatrix=gsl_matrix_calloc(nsamples,nsamples);
+    //Distances are kept as the lower triangle of the matrix, row s starting at rowstart[s]. A joined pair's new node takes the slot of the
+    //first of the pair and the second's slot is dropped from activeslots, so the active slots are in the same order as the rows of the
+    //shrinking matrix in textbook NJ: pairs are scanned, and ties broken, in the same order, and row sums are added up in the same order.
+    vector<size_t> rowstart(nsamples,0);
+    for (int i=1;i<nsamples;i++) {
+        rowstart[i]=rowstart[i-1]+i;
+    }
+    vector<double> dtriangle(nsamples>0 ? rowstart[nsamples-1]+nsamples : 0,0.0);
+    vector<int> activeslots;
+    vector<int> slottonode;
     for (int i=0;i<nsamples;i++) {
         NodePtr p=NJresult.NewNode();
         p->SetLabel(taxa->GetTaxonLabel(i));
@@ -4617,154 +5033,76 @@ ContainingTree BROWNIE::ComputeTripletNJTree() {
         NJresult.SetRooted(true);
         NewNodeVector.push_back(p);
         UnattachedNodeVector.push_back(true); //true means unattached
-        MatrixToNodeVector.push_back(i);
-        for (int j=0;j<nsamples;j++) {
-            gsl_matrix_set(dmatrix,i,j,gsl_matrix_get(TaxonProportDistance,i,j));
+        activeslots.push_back(i);
+        slottonode.push_back(i);
+        for (int j=0;j<=i;j++) {
+            dtriangle[rowstart[i]+j]=gsl_matrix_get(TaxonProportDistance,i,j);
         }
     }
+    vector<double> rvector(nsamples,0.0);
     while (nsamplesremaining>2) {
-        //cout<<"\n\nMatrixToNodeVector=";
-        ////for (int i=0;i<nsamplesremaining;i++) {
-        //	cout<<" "<<MatrixToNodeVector[i];
-        //}
-        //cout<<"\n\nNewNodeVector=";
-        //for (int i=0;i<NewNodeVector.size();i++) {
-        //	cout<<" "<<NewNodeVector[i]<<"("<<(NewNodeVector[i])->GetLabel()<<")";
-        //}
-        //for (int i=0;i<nsamplesremaining;i++) {
-        //	cout<<endl<<i<<": ";
-        //	for (int j=0;j<nsamplesremaining;j++) {
-        //		cout<<"\t"<<gsl_matrix_get(dmatrix,i,j);
-        //	}
-        //}
-        //cout<<endl;
-gsl_vector *rvector=gsl_vector_calloc(nsamplesremaining);
-for (int i=0;i<nsamplesremaining;i++) {
-    for (int j=0;j<nsamplesremaining;j++) {
-        if(i!=j) {
-            gsl_vector_set(rvector,i,(gsl_vector_get(rvector,i))+gsl_matrix_get(dmatrix,i,j));
-        }
-    }
-}
-int imin;
-int jmin;
-double Mijmin=GSL_POSINF;
-for (int i=0;i<nsamplesremaining;i++) {
-    for (int j=i+1;j<nsamplesremaining;j++) {
-        double Mij=gsl_matrix_get(dmatrix,i,j)-((gsl_vector_get(rvector,i)+gsl_vector_get(rvector,j))/(nsamplesremaining-2.0));
-        if (Mij<Mijmin) {
-            Mijmin=Mij;
-            imin=i;
-            jmin=j;
-        }
-    }
-}
-NodePtr u=NJresult.NewNode();
-u->SetWeight(0);
-NodePtr i=NewNodeVector[MatrixToNodeVector[imin]];
-NodePtr j=NewNodeVector[MatrixToNodeVector[jmin]];
-//cout<<"Now joining imin: "<<imin<<": "<<i<<"("<<i->GetLabel()<<") and jmin: "<<jmin<<": "<<j<<"("<<j->GetLabel()<<") to make "<<u<<endl;
-u->SetLeaf(false);
-u->SetChild(i);
-i->SetAnc(u);
-i->SetSibling(j);
-j->SetAnc(u);
-gsl_matrix *dmatrixnew=gsl_matrix_calloc(nsamplesremaining-1,nsamplesremaining-1);
-gsl_matrix *dmatrixorig=gsl_matrix_calloc(nsamplesremaining,nsamplesremaining);
-gsl_matrix_memcpy(dmatrixorig,dmatrix);
-i->SetEdgeLength(gsl_matrix_get(dmatrix,imin,jmin)/2.0+(1.0*gsl_vector_get(rvector,imin)-1.0*gsl_vector_get(rvector,jmin))/(2.0*(1.0*nsamplesremaining-2.0)));
-j->SetEdgeLength(gsl_matrix_get(dmatrix,imin,jmin)-(i->GetEdgeLength()));
-NewNodeVector.push_back(u);
-UnattachedNodeVector.push_back(true);
-UnattachedNodeVector[MatrixToNodeVector[imin]]=false;
-UnattachedNodeVector[MatrixToNodeVector[jmin]]=false;
-bool seenj=false;
-for (int i=0;i<MatrixToNodeVector.size();i++) {
-    if (seenj==false) {
-        if (i==jmin) {
-            seenj=true;
-        }
-        else if (i==imin) {
-            MatrixToNodeVector[i]=-1+NewNodeVector.size();
-        }
-    }
-    else {
-        if (i==imin) {
-            MatrixToNodeVector[i-1]=-1+NewNodeVector.size();
-        }
-        else {
-            MatrixToNodeVector[i-1]=MatrixToNodeVector[i];
-        }
-    }
-}
-MatrixToNodeVector.pop_back();
-for (int i=0;i<nsamplesremaining;i++) {
-    for (int j=0;j<nsamplesremaining;j++) {
-        if(i==imin) {
-            double newvalue=0.0;
-            newvalue+=gsl_matrix_get(dmatrixorig,j,imin);
-            newvalue+=gsl_matrix_get(dmatrixorig,j,jmin);
-            newvalue-=gsl_matrix_get(dmatrixorig,imin,jmin);
-            newvalue*=0.5;
-            //			cout<<"changed pos ("<<i<<","<<j<<") from value "<<gsl_matrix_get(dmatrix,i,j)<<" or "<<gsl_matrix_get(dmatrixorig,i,j);
-            gsl_matrix_set(dmatrix,i,j,newvalue);
-            //			cout<<" to have value "<<gsl_matrix_get(dmatrixorig,j,imin)<<"+"<<gsl_matrix_get(dmatrixorig,j,jmin)<<"-"<<gsl_matrix_get(dmatrixorig,imin,jmin)<<"="<<gsl_matrix_get(dmatrix,i,j)<<endl;
-        }
-        if(j==imin) {
-            double newvalue=0.0;
-            newvalue+=gsl_matrix_get(dmatrixorig,imin,i);
-            newvalue+=gsl_matrix_get(dmatrixorig,jmin,i);
-            newvalue-=gsl_matrix_get(dmatrixorig,imin,jmin);
-            newvalue*=0.5;
-            //			cout<<"changed pos ("<<i<<","<<j<<") from value "<<gsl_matrix_get(dmatrix,i,j)<<" or "<<gsl_matrix_get(dmatrixorig,i,j);
-            gsl_matrix_set(dmatrix,i,j,newvalue);
-            //			cout<<" to have value "<<gsl_matrix_get(dmatrixorig,imin,i)<<"+"<<gsl_matrix_get(dmatrixorig,jmin,i)<<"-"<<gsl_matrix_get(dmatrixorig,imin,jmin)<<"="<<gsl_matrix_get(dmatrix,i,j)<<endl;
-        }
-    }
-}
-gsl_matrix_set(dmatrix,imin,imin,0);
-gsl_matrix_set(dmatrix,jmin,jmin,0);
-gsl_matrix_set(dmatrix,imin,jmin,0);
-gsl_matrix_set(dmatrix,jmin,imin,0);
-int rowoffset=0;
-gsl_matrix *dmatrixintermed=gsl_matrix_calloc(nsamplesremaining-1,nsamplesremaining);
-for (int i=0;i<nsamplesremaining;i++) {
-    if (i==jmin) {
-        rowoffset=1;
-    }
-    else {
-        for (int j=0;j<nsamplesremaining;j++) {
-            gsl_matrix_set(dmatrixintermed,i-rowoffset,j,gsl_matrix_get(dmatrix,i,j));
-        }
-    }
-}
-//cout<<"\ndintermed\n";
-//for (int i=0;i<nsamplesremaining-1;i++) {
-//	cout<<endl<<i<<":\t";
-//	for (int j=0;j<nsamplesremaining;j++) {
-//		cout<<"\t"<<gsl_matrix_get(dmatrixintermed,i,j);
-//	}
-//}
-for (int i=0;i<nsamplesremaining-1;i++) {
-    int coloffset=0;
-    for (int j=0;j<nsamplesremaining;j++) {
-        if (j==jmin) {
-            coloffset=1;
+        for (int i=0;i<nsamplesremaining;i++) {
+            int islot=activeslots[i];
+            double rowsum=0.0;
+            for (int j=0;j<i;j++) {
+                rowsum+=dtriangle[rowstart[islot]+activeslots[j]];
+            }
+            for (int j=i+1;j<nsamplesremaining;j++) {
+                rowsum+=dtriangle[rowstart[activeslots[j]]+islot];
+            }
+            rvector[i]=rowsum;
+        }
+        int imin=0;
+        int jmin=1;
+        double Mijmin=GSL_POSINF;
+        for (int i=0;i<nsamplesremaining;i++) {
+            int islot=activeslots[i];
+            double ri=rvector[i];
+            for (int j=i+1;j<nsamplesremaining;j++) {
+                double Mij=dtriangle[rowstart[activeslots[j]]+islot]-((ri+rvector[j])/(nsamplesremaining-2.0));
+                if (Mij<Mijmin) {
+                    Mijmin=Mij;
+                    imin=i;
+                    jmin=j;
+                }
+            }
         }
-        else {
-            gsl_matrix_set(dmatrixnew,i,j-coloffset,gsl_matrix_get(dmatrixintermed,i,j));
+        int islot=activeslots[imin];
+        int jslot=activeslots[jmin]; //jslot>islot
+        double dij=dtriangle[rowstart[jslot]+islot];
+        NodePtr u=NJresult.NewNode();
+        u->SetWeight(0);
+        NodePtr i=NewNodeVector[slottonode[islot]];
+        NodePtr j=NewNodeVector[slottonode[jslot]];
+        u->SetLeaf(false);
+        u->SetChild(i);
+        i->SetAnc(u);
+        i->SetSibling(j);
+        j->SetAnc(u);
+        i->SetEdgeLength(dij/2.0+(1.0*rvector[imin]-1.0*rvector[jmin])/(2.0*(1.0*nsamplesremaining-2.0)));
+        j->SetEdgeLength(dij-(i->GetEdgeLength()));
+        NewNodeVector.push_back(u);
+        UnattachedNodeVector.push_back(true);
+        UnattachedNodeVector[slottonode[islot]]=false;
+        UnattachedNodeVector[slottonode[jslot]]=false;
+        slottonode[islot]=-1+NewNodeVector.size();
+        for (int k=0;k<nsamplesremaining;k++) {
+            int kslot=activeslots[k];
+            if (kslot!=islot && kslot!=jslot) {
+                double dki=(kslot>islot ? dtriangle[rowstart[kslot]+islot] : dtriangle[rowstart[islot]+kslot]);
+                double dkj=(kslot>jslot ? dtriangle[rowstart[kslot]+jslot] : dtriangle[rowstart[jslot]+kslot]);
+                double newvalue=0.5*((dki+dkj)-dij);
+                if (kslot>islot) {
+                    dtriangle[rowstart[kslot]+islot]=newvalue;
+                }
+                else {
+                    dtriangle[rowstart[islot]+kslot]=newvalue;
+                }
+            }
         }
-    }
-}
-
-nsamplesremaining--;
-gsl_vector_free(rvector);
-gsl_matrix_free(dmatrix);
-dmatrix=gsl_matrix_calloc(nsamplesremaining,nsamplesremaining);
-gsl_matrix_memcpy(dmatrix,dmatrixnew);
-gsl_matrix_free(dmatrixintermed);
-gsl_matrix_free(dmatrixnew);
-gsl_matrix_free(dmatrixorig);
+        dtriangle[rowstart[islot]+islot]=0;
+        activeslots.erase(activeslots.begin()+jmin);
+        nsamplesremaining--;
     }
 //now two nodes left to attach
 NodePtr u=NJresult.NewNode();
@@ -4783,8 +5121,8 @@ u->SetChild(i);
 i->SetAnc(u);
 i->SetSibling(j);
 j->SetAnc(u);
-i->SetEdgeLength(0.5*gsl_matrix_get(dmatrix,0,0));
-j->SetEdgeLength(0.5*gsl_matrix_get(dmatrix,0,0));
+i->SetEdgeLength(0.5*dtriangle[rowstart[activeslots[0]]+activeslots[0]]);
+j->SetEdgeLength(0.5*dtriangle[rowstart[activeslots[0]]+activeslots[0]]);
 for (int i=0;i<NewNodeVector.size();i++) {
     NodePtr p=NewNodeVector[i];
     //cout<<"p = "<<p;
@@ -5039,35 +5377,14 @@ while (currentnode) {
 		}
 		for (int aindex=0;aindex<avector.size();aindex++) {
 			for (int bindex=0;bindex<bvector.size();bindex++) {
-				nxsstring tripletstringroot="";
 				int anum=avector[aindex];
 				int bnum=bvector[bindex];
-				tripletstringroot+=GSL_MIN(anum,bnum);
-				tripletstringroot+="_";
-				tripletstringroot+=GSL_MAX(anum,bnum);
-				tripletstringroot+="_";
 				for (int cindex=0;cindex<cvector.size();cindex++) {
-					nxsstring tripletstring=tripletstringroot;
 					int cnum=cvector[cindex];
-					tripletstring+=cnum;
-					int taxonarray[3]={anum, bnum, cnum};
-					sort(taxonarray,taxonarray+3);
-					nxsstring triplelabel="";
-					triplelabel+=taxonarray[0];
-					triplelabel+="_";
-					triplelabel+=taxonarray[1];
-					triplelabel+="_";
-					triplelabel+=taxonarray[2];
-					map<nxsstring,int>::iterator iter = TripletCounts.find(tripletstring);
-					if( iter != TripletCounts.end() ) {
-						numberofmatchingtriplets+=iter->second;
-					}
-					map<nxsstring,int>::iterator iter2 = TripleCounts.find(triplelabel);
-					if( iter != TripleCounts.end() ) {
-						numberoftriplespossible+=iter2->second;
-					}					
+					numberofmatchingtriplets+=TripletCounts.GetTripletCount(anum,bnum,cnum);
+					numberoftriplespossible+=TripletCounts.GetTripleCount(anum,bnum,cnum);
 					if (debugmode) {
-						cout<<"Triplet = "<<tripletstring<<" triple = "<<triplelabel<<endl;
+						cout<<"Triplet = ("<<GSL_MIN(anum,bnum)<<","<<GSL_MAX(anum,bnum)<<"),"<<cnum<<endl;
 					}
 				}
 			}
@@ -5093,13 +5410,21 @@ while (currentnode) {
 
 if (debugmode) {
 	
-	for( map<nxsstring, int>::iterator iter = TripletCounts.begin(); iter != TripletCounts.end(); iter++ ) {
-		cout << "Triplet "<<(*iter).first << " found " << (*iter).second << " times" << endl;
+	vector<TripleKey> observedtriples;
+	TripletCounts.GetObservedTriples(observedtriples);
+	for (int i=0;i<observedtriples.size();i++) {
+		int a, b, c;
+		UnpackTriple(observedtriples[i],a,b,c);
+		cout << "Triplet ("<<b<<","<<c<<"),"<<a<< " found " << TripletCounts.GetTripletCount(b,c,a) << " times" << endl;
+		cout << "Triplet ("<<a<<","<<c<<"),"<<b<< " found " << TripletCounts.GetTripletCount(a,c,b) << " times" << endl;
+		cout << "Triplet ("<<a<<","<<b<<"),"<<c<< " found " << TripletCounts.GetTripletCount(a,b,c) << " times" << endl;
 	}
 	
 	cout<<endl<<endl<<endl;
-	for( map<nxsstring, int>::iterator iter = TripleCounts.begin(); iter != TripleCounts.end(); iter++ ) {
-		cout << "Triple "<<(*iter).first << " found " << (*iter).second << " times" << endl;
+	for (int i=0;i<observedtriples.size();i++) {
+		int a, b, c;
+		UnpackTriple(observedtriples[i],a,b,c);
+		cout << "Triple "<<a<<"_"<<b<<"_"<<c<< " found " << TripletCounts.GetTripleCount(a,b,c) << " times" << endl;
 	}
 }
 //for (int i=0;i<CladeVector.size();i++) {
@@ -5109,210 +5434,40 @@ if (debugmode) {
 //   }
 //}
 //cout<<endl;
-gsl_matrix_free(dmatrix);
 return NJresult;
 }
 
 
-vector<nxsstring> BROWNIE::ReturnClade(Tree *T, nxsstring a, nxsstring b, nxsstring c) {
-	NodePtr p;
-	NodePtr q;
-	std::map<Node *, int, std::less<Node *> > depth;
-	PreorderIterator <Node> n ((*T).GetRoot());
-	int count = 0;
-	q = n.begin();
-	while (q)
-	{
-		depth[q] = count++;
-		q = n.next();
-	}
-	
-	//Now get depths for each pair
-	vector<int> LCADepthVectorT1;
-	(*T).MakeNodeList();
-	p = (*T).GetLeafWithLabel(a.c_str());
-	q = (*T).GetLeafWithLabel(b.c_str());
-	while (depth[p] != depth[q])
-	{
-		if (depth[p] < depth[q])
-			q = q->GetAnc();
-		else
-			p = p->GetAnc();
-	}
-	LCADepthVectorT1.push_back(depth[p]);
-	p = (*T).GetLeafWithLabel(b.c_str());
-	q = (*T).GetLeafWithLabel(c.c_str());
-	while (depth[p] != depth[q])
-	{
-		if (depth[p] < depth[q])
-			q = q->GetAnc();
-		else
-			p = p->GetAnc();
-	}
-	LCADepthVectorT1.push_back(depth[p]);
-	p = (*T).GetLeafWithLabel(a.c_str());
-	q = (*T).GetLeafWithLabel(c.c_str());
-	while (depth[p] != depth[q])
-	{
-		if (depth[p] < depth[q])
-			q = q->GetAnc();
-		else
-			p = p->GetAnc();
+void BROWNIE::InitializeQuartetCounts() {
+	int ntrees=trees->GetNumTrees();
+	if (taxa->GetNumTaxonLabels()>=QUARTETINDEX_MAXTAXA) {
+		errormsg = "ERROR: Too many samples to count quartets (maximum is ";
+		errormsg += QUARTETINDEX_MAXTAXA-1;
+		errormsg += ")";
+		throw XNexus( errormsg);
 	}
-	LCADepthVectorT1.push_back(depth[p]);
-	int T1DepthMax=0; //root has depth 0, others have higher depths.
-	int T1DepthMaxIndex=-1;
-	//int anum=taxa->FindTaxon(a);
-	//int bnum=taxa->FindTaxon(b);
-	//int cnum=taxa->FindTaxon(c);
-	//cout<<anum<<": "<<a<<" "<<bnum<<": "<<b<<" "<<cnum<<": "<<c<<endl;
-	for (int j=0;j<3;j++) {
-		if(LCADepthVectorT1[j]>T1DepthMax) {
-			T1DepthMax=LCADepthVectorT1[j];
-			T1DepthMaxIndex=j;
+	vector<CompactTree> CompactTrees(ntrees);
+	for (int treenum=0;treenum<ntrees; treenum++) {
+		CompactTrees[treenum].Compile(intrees.GetIthTreeRef(treenum));
+		for (int leafnum=0;leafnum<CompactTrees[treenum].GetNumLeaves();leafnum++) { //taxon numbers are looked up once per leaf rather than once per quartet
+			int leaf=CompactTrees[treenum].GetLeaves()[leafnum];
+			CompactTrees[treenum].SetTaxon(leaf,taxa->FindTaxon(CompactTrees[treenum].GetLabel(leaf)));
 		}
 	}
-	if (LCADepthVectorT1[0]==LCADepthVectorT1[1] && LCADepthVectorT1[0]==LCADepthVectorT1[2]) {
-		T1DepthMaxIndex=-1;
-	}
-	//j=0->ab, j=1->bc j=2->ac
-	//gsl_matrix_set(TaxonDistance,anum,anum,1+gsl_matrix_get(TaxonDistance,anum,anum));
-	//gsl_matrix_set(TaxonDistance,bnum,bnum,1+gsl_matrix_get(TaxonDistance,bnum,bnum));
-	//gsl_matrix_set(TaxonDistance,cnum,cnum,1+gsl_matrix_get(TaxonDistance,cnum,cnum));
-	vector<nxsstring> returnvector;
-	if (T1DepthMaxIndex==0) {
-		returnvector.push_back(a);
-		returnvector.push_back(b);
-	}
-	else if (T1DepthMaxIndex==1) {
-		returnvector.push_back(b);
-		returnvector.push_back(c);
-	}
-	else if (T1DepthMaxIndex==2) {
-		returnvector.push_back(a);
-		returnvector.push_back(c);
-	}
-	else if (T1DepthMaxIndex==-1) {
-		returnvector.push_back("nope");
-	}
-	return returnvector;
-}
-
-
-void BROWNIE::InitializeQuartetCounts() {
-	ProgressBar(trees->GetNumTrees());
-	for (int treenum=0;treenum<trees->GetNumTrees(); treenum++) {
-		Tree T=intrees.GetIthTree(treenum);
-		vector<nxsstring> LeafLabelVector;
-		NodeIterator <Node> n (T.GetRoot());
-		NodePtr currentnode = n.begin();
-		while (currentnode)
-		{
-			if(currentnode->IsLeaf()) {
-				LeafLabelVector.push_back(currentnode->GetLabel());
-			}
-			currentnode = n.next();
-		}
-		gsl_combination *comb;
-		comb=gsl_combination_calloc(T.GetNumLeaves(),4);
-		do {
-			nxsstring a=LeafLabelVector[gsl_combination_get(comb,0)];
-			nxsstring b=LeafLabelVector[gsl_combination_get(comb,1)];
-			nxsstring c=LeafLabelVector[gsl_combination_get(comb,2)];
-			nxsstring d=LeafLabelVector[gsl_combination_get(comb,3)];
-			map< nxsstring, int> LabelToNum;
-			map< int, nxsstring > NumToLabel;
-			vector<int> LabelNums;
-			vector<int> OutputVector;
-			LabelToNum[a]=taxa->FindTaxon(a);
-			NumToLabel[LabelToNum[a]]=a;
-			LabelToNum[b]=taxa->FindTaxon(b);
-			NumToLabel[LabelToNum[b]]=b;
-			LabelToNum[c]=taxa->FindTaxon(c);
-			NumToLabel[LabelToNum[c]]=c;
-			LabelToNum[d]=taxa->FindTaxon(d);
-			NumToLabel[LabelToNum[d]]=d;
-			int minlabel=-1;
-			int maxlabel=100000000;
-			map<nxsstring, int>::const_iterator itr;
-			
-			for(itr = LabelToNum.begin(); itr != LabelToNum.end(); ++itr){
-				minlabel=GSL_MIN((*itr).second,minlabel);
-				maxlabel=GSL_MAX((*itr).second,maxlabel);
-				LabelNums.push_back((*itr).second);
-			}
-			
-			vector<nxsstring> taxainclade;
-			bool validquartet=false;
-			taxainclade=ReturnClade(&T,LeafLabelVector[gsl_combination_get(comb,0)],LeafLabelVector[gsl_combination_get(comb,1)],LeafLabelVector[gsl_combination_get(comb,2)]);
-			if(taxainclade.size()==2) {
-				taxainclade=ReturnClade(&T,taxainclade[0],taxainclade[1],LeafLabelVector[gsl_combination_get(comb,3)]);	
-			}
-			if (taxainclade.size()==2) {
-				OutputVector.push_back(minlabel);
-				if (LabelToNum[taxainclade[0]]==minlabel) {
-					
-					OutputVector.push_back(LabelToNum[taxainclade[1]]);
-					vector<int>remainingoutput;
-					for (int i=0;i<4;i++) {
-						if(LabelNums[i]!=OutputVector[0] && LabelNums[i]!=OutputVector[1]) {
-							remainingoutput.push_back(LabelNums[i]);
-						}
-					}
-					OutputVector.push_back(GSL_MIN(remainingoutput[0],remainingoutput[1]));
-					OutputVector.push_back(GSL_MAX(remainingoutput[0],remainingoutput[1]));
-				}
-				else if (LabelToNum[taxainclade[1]]==minlabel) {
-					OutputVector.push_back(LabelToNum[taxainclade[0]]);
-					vector<int> remainingoutput;
-					for (int i=0;i<4;i++) {
-						if(LabelNums[i]!=OutputVector[0] && LabelNums[i]!=OutputVector[1]) {
-							remainingoutput.push_back(LabelNums[i]);
-						}
-					}
-					OutputVector.push_back(GSL_MIN(remainingoutput[0],remainingoutput[1]));
-					OutputVector.push_back(GSL_MAX(remainingoutput[0],remainingoutput[1]));
-				}
-				else {
-					vector<int> remainingoutput;
-					for (int i=0;i<4;i++) {
-						if(LabelNums[i]!=OutputVector[0] && LabelNums[i]!=OutputVector[1] && LabelNums[i]!=minlabel) {
-							OutputVector.push_back(LabelNums[i]);
-						}
-					}
-					OutputVector.push_back(GSL_MIN(LabelToNum[taxainclade[0]],LabelToNum[taxainclade[1]]));
-					OutputVector.push_back(GSL_MAX(LabelToNum[taxainclade[0]],LabelToNum[taxainclade[1]]));
-				}
-				
-			}
-			else {
-				OutputVector.push_back(maxlabel);
-				vector<int> remainingoutput;
-				int newmaxlabel=-1;
-				for (int i=0;i<4;i++) {
-					if(LabelNums[i]!=maxlabel) {
-						newmaxlabel=GSL_MAX(LabelNums[i],newmaxlabel);
-					}
-				}
-				OutputVector.push_back(newmaxlabel);
-				int newmaxlabel2=-1;
-				int newminlabel2=100000000;
-				for (int i=0;i<4;i++) {
-					if(LabelNums[i]!=maxlabel && LabelNums[i]!=newmaxlabel) {
-						newmaxlabel2=GSL_MAX(LabelNums[i],newmaxlabel2);
-						newminlabel2=GSL_MAX(LabelNums[i],newminlabel2);
-					}
-				}
-				OutputVector.push_back(newmaxlabel2);
-				OutputVector.push_back(newminlabel2);
-			}
-			quartetcounts[OutputVector]++;
+	QuartetCounts.Clear();
+	ProgressBar(ntrees);
+#pragma omp parallel
+	{
+		QuartetIndex LocalQuartetCounts; //each thread counts its own trees, then adds them in
+#pragma omp for schedule(dynamic)
+		for (int treenum=0;treenum<ntrees; treenum++) {
+			LocalQuartetCounts.AddTree(CompactTrees[treenum]);
+#pragma omp critical (quartetcounts)
+			ProgressBar(0);
 		}
-		while (gsl_combination_next(comb) == GSL_SUCCESS);
-		gsl_combination_free(comb);
-		ProgressBar(0);
+#pragma omp critical (quartetcounts)
+		QuartetCounts.Merge(LocalQuartetCounts);
 	}
-	
 }
 
 void BROWNIE::HandleNast( NexusToken& token ) {
@@ -5348,17 +5503,50 @@ void BROWNIE::HandleNast( NexusToken& token ) {
 }
 
 void BROWNIE::DoNast() {
-	if (quartetcounts.size()==0) {
+	if (QuartetCounts.GetNumQuads()==0) {
 		message="Now initializing quartet counts";
 		PrintMessage();
 		InitializeQuartetCounts();
+		message="Found ";
+		message+=int(QuartetCounts.GetNumQuads());
+		message+=" sets of four taxa on the trees";
+		PrintMessage();
 	}
 	
 }
 
 
 
+//Compares t2 with the reference tree of comparison, which is set up once so it can be compared with many trees.
+//Returns false, leaving tripletoverlapoutput alone, if t2 doesn't have the same leaves as the reference.
+bool BROWNIE::GetTripletOverlap(QTComparison &comparison, ContainingTree *t2, vector<int> &tripletoverlapoutput) {
+    QTValues Q;
+    if (!comparison.CompareTriplets(*t2,Q)) {
+        return false;
+    }
+    tripletoverlapoutput.clear();
+    tripletoverlapoutput.push_back(int(Q.n));
+    tripletoverlapoutput.push_back(int(Q.d));
+    tripletoverlapoutput.push_back(int(Q.n-Q.s-Q.d));
+	tripletoverlapoutput.push_back(int(Q.u));
+	tripletoverlapoutput.push_back(int(Q.r2)); //unresolved in t1 only
+	tripletoverlapoutput.push_back(int(Q.r1)); //unresolved in t2 only
+	if(debugmode) {
+		cout<<"tripletoverlapoutput = (";
+		for(int vectorposition=0;vectorposition<6;vectorposition++) {
+			cout<<" "<<tripletoverlapoutput[vectorposition];
+		}
+		cout<<" )"<<endl;
+	}
+    return true;
+}
+
 vector<int> BROWNIE::GetTripletOverlap(ContainingTree *t1, ContainingTree *t2,int taxaincommon) {
+    vector<int> tripletoverlapoutput;
+    QTComparison comparison(*t1);
+    if (GetTripletOverlap(comparison,t2,tripletoverlapoutput)) { //counts every triplet at once from the LCAs of pairs of leaves
+        return tripletoverlapoutput;
+    }
     int maxnumber=0;
     int numberdisagree=0;
     int numunresolved=0; //number unresolved in one or the other trees
@@ -5417,7 +5605,6 @@ vector<int> BROWNIE::GetTripletOverlap(ContainingTree *t1, ContainingTree *t2,in
     }
     while (gsl_combination_next(c) == GSL_SUCCESS);
     gsl_combination_free(c);
-    vector<int> tripletoverlapoutput;
     tripletoverlapoutput.push_back(maxnumber);
     tripletoverlapoutput.push_back(numberdisagree);
     tripletoverlapoutput.push_back(numunresolved);
@@ -5460,15 +5647,16 @@ void BROWNIE::HandleAccuracy( NexusToken& token )
 
 
 void BROWNIE::ComputeAccuracy() {
-	Tree TrueTreeGeneTreeFmt=intrees.GetIthTree(0); //we assume the first tree in the file is the accurate one
+	const Tree &TrueTreeGeneTreeFmt=intrees.GetIthTreeRef(0); //we assume the first tree in the file is the accurate one
 	ContainingTree TrueTree;
 	TrueTree.SetRoot(TrueTreeGeneTreeFmt.CopyOfSubtree(TrueTreeGeneTreeFmt.GetRoot()));
 	//message="TreeNum\tTreeName\tNumTripletsProperlyResolved\tNumTripletsProperlyUnresolved\tNumTripletsImproperlyResolved\tNumTripletsImproperlyUnresolved";
 	message="\t\tCorrect\t\tIncorrect\tNumber\nNum\tName\tRes\tUn\tRes\tUn\tSpecies";
 	PrintMessage();
+	TrueTree.Update();
+	QTComparison comparison(TrueTree); //set up once for all the gene trees
 	for (int selectedtree=1;selectedtree<trees->GetNumTrees();selectedtree++) {
-		ContainingTree ModifiedTrueTree=TrueTree;
-		Tree CurrentGeneTreeTreeFmt=intrees.GetIthTree(selectedtree);
+		const Tree &CurrentGeneTreeTreeFmt=intrees.GetIthTreeRef(selectedtree);
 		ContainingTree CurrentGeneTree;
 		CurrentGeneTree.SetRoot(CurrentGeneTreeTreeFmt.CopyOfSubtree(CurrentGeneTreeTreeFmt.GetRoot()));
 		CurrentGeneTree.FindAndSetRoot();
@@ -5492,8 +5680,12 @@ void BROWNIE::ComputeAccuracy() {
 			CurrentGeneTree.ReportTreeHealth();
 		}
 		
-		int ntaxincommon=PrepareTreesForTriplet(&ModifiedTrueTree,&CurrentGeneTree);
-		vector<int> tripletoverlapoutput=GetTripletOverlap(&ModifiedTrueTree,&CurrentGeneTree,ntaxincommon);
+		vector<int> tripletoverlapoutput;
+		if (!GetTripletOverlap(comparison,&CurrentGeneTree,tripletoverlapoutput)) { //the leaves differ, so prune to those in common
+			ContainingTree ModifiedTrueTree=TrueTree;
+			int ntaxincommon=PrepareTreesForTriplet(&ModifiedTrueTree,&CurrentGeneTree);
+			tripletoverlapoutput=GetTripletOverlap(&ModifiedTrueTree,&CurrentGeneTree,ntaxincommon);
+		}
 		message="";
 		message+=selectedtree+1;
 		message+="\t";
@@ -5570,7 +5762,7 @@ void BROWNIE::HandlePartitionedEdgeSupport ( NexusToken& token) {
 void BROWNIE::BatchPartitionedEdgeSupport (int numberofpartitions) {
 	int totaledges=0;
 	ContainingTree OriginalTree;
-	Tree OriginalTreeTreeFmt=intrees.GetIthTree(chosentree-1);
+	const Tree &OriginalTreeTreeFmt=intrees.GetIthTreeRef(chosentree-1);
 	OriginalTree.SetRoot(OriginalTreeTreeFmt.CopyOfSubtree(OriginalTreeTreeFmt.GetRoot()));
 	ofstream partedgef;
 	nxsstring partedgefile="partitionededgesupport.tre";
@@ -5579,6 +5771,7 @@ void BROWNIE::BatchPartitionedEdgeSupport (int numberofpartitions) {
 	OriginalTree.Update();
 	OriginalTree.GetNodeDepths();
 	int NodesTouched=0;
+	vector<int> EdgeNodeNumbers; //NodesTouched for each internal edge, in the order the edges are written
 	NodeIterator <Node> npe (OriginalTree.GetRoot());
 	//OriginalTree.ReportTreeHealth();
     NodePtr currentnodepe = npe.begin();
@@ -5592,24 +5785,32 @@ void BROWNIE::BatchPartitionedEdgeSupport (int numberofpartitions) {
 			nxsstring newlabel="edge";
 			newlabel+=NodesTouched;
 			currentnodepe->SetLabel(newlabel);
-			ContainingTree NewTree=OriginalTree;
-			NewTree.NonRandomNNIAtNode(NodesTouched,1);
-			partedgef<<"tree edge"<<NodesTouched<<"_res1 = [&R] ";
-			NewTree.Write(partedgef);
-			partedgef<<endl;
-			ContainingTree NewTree2=OriginalTree;
-			NewTree2.NonRandomNNIAtNode(NodesTouched,2);
-			partedgef<<"tree edge"<<NodesTouched<<"_res2 = [&R] ";
-			NewTree2.Write(partedgef);
-			partedgef<<endl;
-			//OriginalTree.ReportTreeHealth();
-			totaledges++;
+			EdgeNodeNumbers.push_back(NodesTouched);
 		}
 //cout<<"currentnode before next is "<<currentnodepe<<endl;
         currentnodepe=npe.next();
 		//cout<<"currentnode after next is "<<currentnodepe<<endl;
 
     }
+	//Each edge's two resolutions are made from their own copies of the tree, so edges are done in parallel; the trees are kept and
+	//written afterwards in edge order. The edge labels aren't written until the end, so they can all be set first.
+	totaledges=EdgeNodeNumbers.size();
+	vector<string> EdgeTreeDescriptions(totaledges);
+#pragma omp parallel for schedule(dynamic)
+	for (int edge=0; edge<totaledges; edge++) {
+		ostringstream edgetreef;
+		for (int resolution=1; resolution<=2; resolution++) {
+			ContainingTree NewTree=OriginalTree;
+			NewTree.NonRandomNNIAtNode(EdgeNodeNumbers[edge],resolution);
+			edgetreef<<"tree edge"<<EdgeNodeNumbers[edge]<<"_res"<<resolution<<" = [&R] ";
+			NewTree.Write(edgetreef);
+			edgetreef<<endl;
+		}
+		EdgeTreeDescriptions[edge]=edgetreef.str();
+	}
+	for (int edge=0; edge<totaledges; edge++) {
+		partedgef<<EdgeTreeDescriptions[edge];
+	}
 	partedgef<<"[tree original = [&R] ";
 	OriginalTree.Write(partedgef);
 	partedgef<<"]"<<endl;
@@ -5631,7 +5832,7 @@ void BROWNIE::BatchPartitionedEdgeSupport (int numberofpartitions) {
 double BROWNIE::ComputeTripletCost(int numberagree,int maxnumber,int ntaxincommon, double Tree1Wt,int Tree1Ntax,double Tree2Wt,int Tree2Ntax, int numberofgenes) {
     double initialscorealgorithm;
     double cdfundermodel;
-    if (ntaxincommon<=50) { //change this to use exact values
+    if (ntaxincommon-3<CDFvector.size() && CDFvector[ntaxincommon-3].size()>0) { //built in for up to 50 taxa, more can be read with set cdffile
                             //cdfundermodel=gsl_cdf_binomial_P(numberagree, 2.0/3.0, maxnumber);
         cdfundermodel=CDFvector[ntaxincommon-3][maxnumber-numberagree]; //assumes gene trees are resolved
                                                                         //	cout<<"ntax="<<ntaxincommon<<" cdfundermodelVector="<<cdfundermodel<<" ";
@@ -5662,7 +5863,7 @@ double BROWNIE::ComputeTripletCost(int numberagree,int maxnumber,int ntaxincommo
 		if (debugmode) {
 			if (isinf(initialscorealgorithm)==1) {
 				cout<<"Error: initialscorealgorithm = "<<initialscorealgorithm<<" cdfundermodel = "<<cdfundermodel;
-				if (ntaxincommon<=32) {
+				if (ntaxincommon-3<CDFvector.size() && CDFvector[ntaxincommon-3].size()>0) {
 					cout<<" calculated using cdfundermodelVector"<<endl;
 				}
 				else {
@@ -5817,44 +6018,17 @@ void BROWNIE::DelDupes()
     vector<ContainingTree> FormattedBestTreesBkup;
     FormattedBestTreesBkup.swap(FormattedBestTrees); //empties besttrees into best treesbkup
     assert(FormattedBestTreesBkup.size()>0);
-    FormattedBestTrees.push_back(FormattedBestTreesBkup.back());
-    (FormattedBestTrees.back()).FindAndSetRoot();
-    (FormattedBestTrees.back()).Update();
-    FormattedBestTreesBkup.pop_back(); // transfer a tree back into best trees bkup
+    FormattedBestTopologies.clear();
+    UnresolvedFormattedBestTrees.clear();
+    FormattedBestTreesBkup.insert(FormattedBestTreesBkup.begin(),FormattedBestTreesBkup.back()); //the last tree is kept first, as before
+    FormattedBestTreesBkup.pop_back();
     for (int i=0; i<FormattedBestTreesBkup.size(); i++) {
         (FormattedBestTreesBkup[i]).FindAndSetRoot();
         (FormattedBestTreesBkup[i]).Update();
-        bool newtree=true;
-        for (int j=0; j<FormattedBestTrees.size(); j++) {
-            ContainingTree t1=FormattedBestTreesBkup[i];
-            ContainingTree t2=FormattedBestTrees[j];
-            // cout<<"Compare \n\t";
-            // (FormattedBestTreesBkup[i]).Write(cout);
-            //cout<<"\n\t";
-            //  (FormattedBestTrees[j]).Write(cout);
-            int ntaxt1=t1.GetNumLeaves();
-            int ntaxt2=t2.GetNumLeaves();
-            int ntaxincommon=PrepareTreesForTriplet(&t1,&t2);
-            // cout<<"\n\tT1 leaves before = "<<ntaxt1<<" after "<<t1.GetNumLeaves()<<"\n\tT2 leaves before = "<<ntaxt2<<" after "<<t2.GetNumLeaves()<<"\n\tntaxincommon = "<<ntaxincommon<<endl;
-            if (ntaxincommon==ntaxt1 && ntaxincommon==ntaxt2) {
-                if (ntaxincommon>=3) { //so, all leaves are in common, but is the topology the same? If there are only two or one species, yes, so newtree=false. If there are at least 3 taxa, there are different possible topologies, so maybe, thus check below
-                    vector<int> tripletoverlapoutput=GetTripletOverlap(&t1,&t2,ntaxincommon);
-                    int numberdisagree=tripletoverlapoutput[1];
-                    if (numberdisagree==0) {
-                        newtree=false;
-                    }
-                    //      cout<<"\tNumDisagree = "<<numberdisagree<<endl;
-                }
-                else {
-                    newtree=false; //all leaves in common, must have same topology, so same tree
-                }
-            }
-            //ShowHeader(cout);
-            //ShowQTRecord(cout,Q);
-            //cout<<endl<<endl;
-        }
-        if (newtree) {
+        vector<unsigned long long> topologykey;
+        if (IsNewBestTopology(FormattedBestTreesBkup[i],topologykey)) {
             FormattedBestTrees.push_back(FormattedBestTreesBkup[i]); //BestTreesBkup is going out of scope soon, anyway, so don't need to bother pop_backing
+            RecordBestTopology(topologykey);
         }
     }
     for (int k=0; k<FormattedBestTrees.size(); k++) {
@@ -5864,6 +6038,257 @@ void BROWNIE::DelDupes()
     }
 }
 
+//Is FormattedTree's topology missing from FormattedBestTrees? A fully resolved tree is looked up by its topology key, and then only needs
+//comparing by triplets with the stored trees that have polytomies (a resolution of one of those counts as the same tree, as no triplets
+//disagree). A tree with polytomies is compared with all stored trees. topologykey is left empty for a tree with polytomies.
+bool BROWNIE::IsNewBestTopology(ContainingTree &FormattedTree, vector<unsigned long long> &topologykey)
+{
+    CompactTree CompactFormattedTree(FormattedTree);
+    vector<int> treestocompare;
+    if (CompactFormattedTree.GetTopologyKey(topologykey)) {
+        if (FormattedBestTopologies.count(topologykey)>0) {
+            return false;
+        }
+        treestocompare=UnresolvedFormattedBestTrees;
+    }
+    else {
+        topologykey.clear();
+        for (int j=0; j<FormattedBestTrees.size(); j++) {
+            treestocompare.push_back(j);
+        }
+    }
+    if (treestocompare.size()==0) {
+        return true;
+    }
+    QTComparison comparison(FormattedTree); //set up once for all the stored trees
+    for (int k=0; k<treestocompare.size(); k++) {
+        vector<int> tripletoverlapoutput;
+        if (GetTripletOverlap(comparison,&(FormattedBestTrees[treestocompare[k]]),tripletoverlapoutput)) { //same leaves, so nothing to prune
+            if (tripletoverlapoutput[1]==0) {
+                return false;
+            }
+            continue;
+        }
+        ContainingTree t1=FormattedTree;
+        ContainingTree t2=FormattedBestTrees[treestocompare[k]];
+        int ntaxt1=t1.GetNumLeaves();
+        int ntaxt2=t2.GetNumLeaves();
+        int ntaxincommon=PrepareTreesForTriplet(&t1,&t2);
+        if (ntaxincommon==ntaxt1 && ntaxincommon==ntaxt2) {
+            if (ntaxincommon>=3) { //so, all leaves are in common, but is the topology the same? If there are only two or one species, yes, so newtree=false. If there are at least 3 taxa, there are different possible topologies, so maybe, thus check below
+                vector<int> tripletoverlapoutput=GetTripletOverlap(&t1,&t2,ntaxincommon);
+                int numberdisagree=tripletoverlapoutput[1];
+                if (numberdisagree==0) {
+                    return false;
+                }
+            }
+            else {
+                return false; //all leaves in common, must have same topology, so same tree
+            }
+        }
+    }
+    return true;
+}
+
+//Call after adding a tree to FormattedBestTrees, with the key from IsNewBestTopology
+void BROWNIE::RecordBestTopology(const vector<unsigned long long> &topologykey)
+{
+    if (topologykey.size()>0) {
+        FormattedBestTopologies.insert(topologykey);
+    }
+    else {
+        UnresolvedFormattedBestTrees.push_back(FormattedBestTrees.size()-1);
+    }
+}
+
+//Layout of a heuristic search checkpoint, all in the byte order of the machine that wrote it: magic, format version, number of samples and
+//of gene trees, where the search had got to (with the tree and state of the replicate it was in, if any, including the replicate's score
+//vector, which can't always be found again as MS scores use random numbers), the best trees so far (see Tree::WriteBinary) with their
+//assignments and scores, the state of the random number generator, and the magic again to show the file is complete. It is written to a
+//temporary file that is then renamed, so stopping the program while saving leaves the last checkpoint intact.
+void BROWNIE::WriteSearchCheckpoint(int replicate, ContainingTree *RepTree, const vector<double> &localscorevector, int movecount, const vector<int> &moveflags)
+{
+	nxsstring tmpname=checkpointfilename;
+	tmpname+=".";
+	tmpname+=long(time(NULL));
+	tmpname+=".";
+	tmpname+=long(clock());
+	ofstream f(tmpname.c_str(), ios::out | ios::binary | ios::trunc);
+	bool ok=f.good();
+	if (ok) {
+		PutBinaryString(f,BROWNIE_CHECKPOINT_MAGIC);
+		PutBinary(f,int(BROWNIE_CHECKPOINT_VERSION));
+		PutBinary(f,int(taxa->GetNumTaxonLabels()));
+		PutBinary(f,int(trees->GetNumTrees()));
+		PutBinary(f,char(useCOAL || useMS));
+		PutBinary(f,replicate);
+		PutBinary(f,bestscore);
+		PutBinary(f,char(RepTree!=NULL));
+		if (RepTree!=NULL) {
+			PutBinaryVector(f,convertsamplestospecies);
+			PutBinary(f,bestscorelocal);
+			PutBinaryVector(f,localscorevector);
+			PutBinary(f,movecount);
+			PutBinaryVector(f,moveflags);
+			RepTree->WriteBinary(f);
+		}
+		PutBinary(f,int(RawBestTrees.size()));
+		for (int i=0; i<RawBestTrees.size(); i++) {
+			RawBestTrees[i].WriteBinary(f);
+		}
+		PutBinary(f,int(FormattedBestTrees.size()));
+		for (int i=0; i<FormattedBestTrees.size(); i++) {
+			FormattedBestTrees[i].WriteBinary(f);
+			PutBinaryVector(f,BestConversions[i]);
+		}
+		PutBinaryVector(f,TotalScores);
+		PutBinaryVector(f,GTPScores);
+		PutBinaryVector(f,StructScores);
+		PutBinary(f,int(ContourSearchTables.size()));
+		for (int i=0; i<ContourSearchTables.size(); i++) { //rows are copied from the table's file one at a time, after counting them
+			ifstream table(ContourSearchTables[i].c_str(), ios::in | ios::binary);
+			vector<double> row;
+			int nrows=0;
+			while (GetContourRow(table,row)) {
+				nrows++;
+			}
+			PutBinary(f,nrows);
+			table.clear();
+			table.seekg(0, ios::beg);
+			for (int j=0; j<nrows && GetContourRow(table,row); j++) {
+				PutBinaryVector(f,row);
+			}
+		}
+		const char *rngstate=(const char *)gsl_rng_state(r);
+		PutBinaryString(f,gsl_rng_name(r));
+		PutBinaryVector(f,vector<char>(rngstate,rngstate+gsl_rng_size(r)));
+		PutBinaryString(f,BROWNIE_CHECKPOINT_MAGIC);
+		f.close();
+		ok=f.good();
+	}
+	if (ok) {
+		ok=(rename(tmpname.c_str(),checkpointfilename.c_str())==0);
+	}
+	if (!ok) {
+		remove(tmpname.c_str());
+		message="Warning: could not save the search to ";
+		message+=checkpointfilename;
+		PrintMessage();
+	}
+}
+
+//Reads a checkpoint written by WriteSearchCheckpoint, replacing the best trees and their scores and the state of the random number
+//generator, and returning the replicate to carry on with. If the search stopped within that replicate, inreplicate is set and the tree,
+//assignment, score, score vector, move count, and move flags it had reached are returned. False, with nothing changed, if the file is
+//damaged or was saved for a different data set.
+bool BROWNIE::ReadSearchCheckpoint(int &replicate, bool &inreplicate, ContainingTree &RepTree, vector<int> &assignment, double &localscore, vector<double> &localscorevector, int &movecount, vector<int> &moveflags)
+{
+	ifstream f(checkpointfilename.c_str(), ios::in | ios::binary);
+	if (!f) {
+		return false;
+	}
+	f.seekg(0, ios::end);
+	streamoff length=f.tellg();
+	f.seekg(0, ios::beg);
+	if (length<streamoff(2*strlen(BROWNIE_CHECKPOINT_MAGIC))) {
+		return false;
+	}
+	vector<char> data(length);
+	if (!f.read(&data[0],length)) {
+		return false;
+	}
+	f.close();
+
+	BinaryBuffer b(&data[0],&data[0]+length);
+	string magic, endmagic, rngname;
+	int version, ntax, ntrees;
+	char coalescent, hasreptree;
+	double savedbestscore;
+	b.GetString(magic);
+	b.Get(version);
+	b.Get(ntax);
+	b.Get(ntrees);
+	b.Get(coalescent);
+	if (!b.IsOK() || magic!=BROWNIE_CHECKPOINT_MAGIC || version!=BROWNIE_CHECKPOINT_VERSION || ntax!=taxa->GetNumTaxonLabels() || ntrees!=trees->GetNumTrees() || (coalescent!=0)!=(useCOAL || useMS)) {
+		return false;
+	}
+	bool ok=b.Get(replicate) && b.Get(savedbestscore) && b.Get(hasreptree);
+	inreplicate=ok && hasreptree!=0;
+	if (inreplicate) {
+		ok=b.GetVector(assignment) && b.Get(localscore) && b.GetVector(localscorevector) && b.Get(movecount) && b.GetVector(moveflags) && RepTree.ReadBinary(b);
+	}
+	vector<ContainingTree> SavedRawBestTrees;
+	vector<ContainingTree> SavedFormattedBestTrees;
+	vector<vector<int> > SavedBestConversions;
+	vector<double> SavedTotalScores, SavedGTPScores, SavedStructScores;
+	vector<const char *> SavedContourTableStarts; //rows are only checked here, and written back to the tables' files once all is read
+	vector<int> SavedContourTableRows;
+	vector<char> rngstate;
+	int count=0;
+	ok=ok && b.Get(count) && count>=0;
+	for (int i=0; ok && i<count; i++) {
+		SavedRawBestTrees.push_back(ContainingTree());
+		ok=SavedRawBestTrees.back().ReadBinary(b);
+	}
+	ok=ok && b.Get(count) && count>=0;
+	for (int i=0; ok && i<count; i++) {
+		SavedFormattedBestTrees.push_back(ContainingTree());
+		SavedBestConversions.push_back(vector<int>());
+		ok=SavedFormattedBestTrees.back().ReadBinary(b) && b.GetVector(SavedBestConversions.back());
+	}
+	ok=ok && b.GetVector(SavedTotalScores) && b.GetVector(SavedGTPScores) && b.GetVector(SavedStructScores);
+	ok=ok && b.Get(count) && count>=0;
+	for (int i=0; ok && i<count; i++) {
+		int nrows=0;
+		ok=b.Get(nrows) && nrows>=0;
+		SavedContourTableStarts.push_back(b.GetPosition());
+		SavedContourTableRows.push_back(nrows);
+		vector<double> row;
+		for (int j=0; ok && j<nrows; j++) {
+			ok=b.GetVector(row) && row.size()>0;
+		}
+	}
+	ok=ok && b.GetString(rngname) && b.GetVector(rngstate) && b.GetString(endmagic) && endmagic==BROWNIE_CHECKPOINT_MAGIC && b.GetPosition()==&data[0]+length;
+	ok=ok && SavedTotalScores.size()==SavedFormattedBestTrees.size() && rngname==gsl_rng_name(r) && rngstate.size()==gsl_rng_size(r);
+	ok=ok && (!inreplicate || (moveflags.size()==5 && assignment.size()==ntax && localscorevector.size()==3));
+	if (!ok) {
+		return false;
+	}
+	bestscore=savedbestscore;
+	RawBestTrees.swap(SavedRawBestTrees); //swapped rather than assigned, as trees can't be assigned
+	FormattedBestTrees.swap(SavedFormattedBestTrees);
+	BestConversions.swap(SavedBestConversions);
+	TotalScores.swap(SavedTotalScores);
+	GTPScores.swap(SavedGTPScores);
+	StructScores.swap(SavedStructScores);
+	ClearContourSearchTables();
+	for (int i=0; i<SavedContourTableStarts.size(); i++) {
+		BinaryBuffer savedtable(SavedContourTableStarts[i],&data[0]+length);
+		nxsstring tablefile=ContourTableFileName(i);
+		ofstream table(tablefile.c_str(), ios::out | ios::binary | ios::trunc);
+		vector<double> row;
+		for (int j=0; j<SavedContourTableRows[i] && savedtable.GetVector(row); j++) {
+			PutBinaryVector(table,row);
+		}
+		ContourSearchTables.push_back(tablefile);
+	}
+	FormattedBestTopologies.clear();
+	UnresolvedFormattedBestTrees.clear();
+	for (int i=0; i<FormattedBestTrees.size(); i++) {
+		(FormattedBestTrees[i]).Update();
+		(FormattedBestTrees[i]).GetNodeDepths();
+		vector<unsigned long long> topologykey;
+		if (CompactTree(FormattedBestTrees[i]).GetTopologyKey(topologykey)) {
+			FormattedBestTopologies.insert(topologykey);
+		}
+		else {
+			UnresolvedFormattedBestTrees.push_back(i);
+		}
+	}
+	memcpy(gsl_rng_state(r),&rngstate[0],rngstate.size());
+	return true;
+}
+
 /**
 * @method HandleCitation [void:protected]
  * @param token [NexusToken&] the token used to read from in
@@ -5960,11 +6385,11 @@ void BROWNIE::HandleChoose( NexusToken& token )
                 chosentree=1;
                 throw XNexus (errormsg, token.GetFilePosition(), token.GetFileLine(), token.GetFileColumn() );
             }
-            if (chosentree>trees->GetNumTrees()) {
+            if (chosentree>GetNumLoopTrees()) {
                 errormsg = "Error: you chose tree number ";
                 errormsg += chosentree;
                 errormsg += " but there are only ";
-                errormsg += trees->GetNumTrees();
+                errormsg += GetNumLoopTrees();
                 errormsg += " trees loaded.\n";
                 errormsg += "Tree 1 has been selected by default.";
                 chosentree=1;
@@ -6071,13 +6496,17 @@ void BROWNIE::HandleCompareRandomTrees( NexusToken& token)
     bool loopmode=false;
     bool automode=false;
     int requiredminimum=5;
+    nxsstring cdffilename="";
+    bool replacetables=false;
+    vector<int> skippedntax; //numbers of taxa whose tables in use were kept rather than replaced by new ones
     nxsstring numbernexus;
+    CDFvectorholder bob;
     for(;;)
     {
         token.GetNextToken();
         if( token.Equals(";") ) {
             if (donenothing) {
-                message="Usage: Compare [ltax=<integer> rtax=<integer> nreps=<integer> [loop] [auto]]\n\nIf you use loop, ltax=taxmax and rtax=taxmin";
+                message="Usage: Compare [ltax=<integer> rtax=<integer> nreps=<integer> [loop] [auto] [cdffile=<file-name> [replace]]]\n\nIf you use loop, ltax=taxmax and rtax=taxmin. With cdffile, tables are only added for numbers of taxa\nthat have none (including the built-in ones for 3 to 50 taxa) unless you also use replace";
                 PrintMessage();
             }
             else {
@@ -6105,26 +6534,21 @@ void BROWNIE::HandleCompareRandomTrees( NexusToken& token)
                         int minnumleaves=GSL_MIN(ltax,rtax);
                         int maxnumsametriplets=(minnumleaves*(minnumleaves-1)*(minnumleaves-2))/6; //minnumleaves choose 3
 						vector<int> differencevector(maxnumsametriplets+1,0); // the +1 is so we can have zero in the vector, too
+						vector<long> disagreements; //simulated in parallel, each block of pairs of trees with its own random number stream
+						bob.SimulateDisagreements(ltax,rtax,nreps,gsl_rng_get(r),disagreements);
 						for (int i=0;i<nreps;i++) {
-							ContainingTree t1;
-							ContainingTree t2;
-							t1.RandomTree(ltax);
-							t2.RandomTree(rtax);
-							t1.ConvertTaxonNamesToRandomTaxonNumbers();
-							t2.ConvertTaxonNamesToRandomTaxonNumbers();
-							int taxaincommon=PrepareTreesForTriplet(&t1,&t2);
-							// QTValues Q;
-							// CompareTriplets(t1,t2, Q);
-							// SummaryStats(Q);
-							// int numberdisagree=Q.d;
-							vector<int> tripletoverlapoutput=GetTripletOverlap(&t1,&t2,taxaincommon);
-							int numberdisagree=tripletoverlapoutput[1];
-							if (debugmode) {
-								t1.Draw(cout);
-								t2.Draw(cout);
-								cout<<"rep "<<i+1<<" "<<numberdisagree<<endl;
+							differencevector[disagreements[i]]++;
+						}
+						if (cdffilename.length()>0) {
+							if (CDFvector.size()<ntax-2) {
+								CDFvector.resize(ntax-2);
+							}
+							if (CDFvector[ntax-3].size()>0 && !replacetables) {
+								skippedntax.push_back(ntax);
+							}
+							else {
+								CDFvector[ntax-3]=bob.MakeCDF(disagreements,ntax);
 							}
-							differencevector[numberdisagree]++;
 						}
 						
 						double cumprob=0;
@@ -6155,6 +6579,30 @@ void BROWNIE::HandleCompareRandomTrees( NexusToken& token)
 						comparisonfile<<"CDFvector.push_back(contentsofrow); //comparison where ntax="<<ntax<<endl;
                     }
 					comparisonfile.close();
+					if (cdffilename.length()>0) {
+						if (bob.WriteTables(cdffilename.c_str(),CDFvector)) {
+							if (skippedntax.size()==0) {
+								message="Tables for these numbers of taxa are now used for structure scores, and all tables in use were saved to ";
+							}
+							else {
+								message="Tables for";
+								for (int i=0; i<skippedntax.size(); i++) {
+									message+=" ";
+									message+=skippedntax[i];
+								}
+								message+=" taxa were already in use and were kept (use replace to replace them); the others are now used for structure scores, and all tables in use were saved to ";
+							}
+							message+=cdffilename;
+							message+=" (read them again with set cdffile=";
+							message+=cdffilename;
+							message+=")";
+						}
+						else {
+							message="Warning: could not save the tables to ";
+							message+=cdffilename;
+						}
+						PrintMessage();
+					}
                 }
                 else if (automode) {
                     int minnumleaves=GSL_MIN(ltax,rtax);
@@ -6162,7 +6610,6 @@ void BROWNIE::HandleCompareRandomTrees( NexusToken& token)
 					vector<int> differencevector(maxnumsametriplets+1,0); // the +1 is so we can have zero in the vector, too
 					int vectorminimum=0;
 					int loopcounttotal=0;
-					int loopcount=0;
 					message="Loops\tNumber of samples in the 4 most similar & 4 least similar scores\tTime remaining";
 					PrintMessage();
 					nxsstring filename="comparisonof";
@@ -6175,21 +6622,13 @@ void BROWNIE::HandleCompareRandomTrees( NexusToken& token)
 					int oldminimum=0;
 					double secondstotal=-1;
 					while (vectorminimum<requiredminimum) {
-						ContainingTree t1;
-						ContainingTree t2;
-						t1.RandomTree(ltax);
-						t2.RandomTree(rtax);
-						t1.ConvertTaxonNamesToRandomTaxonNumbers();
-						t2.ConvertTaxonNamesToRandomTaxonNumbers();
-						int taxaincommon=PrepareTreesForTriplet(&t1,&t2);
-							// QTValues Q;
-							// CompareTriplets(t1,t2, Q);
-							// SummaryStats(Q);
-							// int numberdisagree=Q.d;
-						vector<int> tripletoverlapoutput=GetTripletOverlap(&t1,&t2,taxaincommon);
-						int numberdisagree=tripletoverlapoutput[1];
-						comparisonfile<<1.0*numberdisagree/maxnumsametriplets<<endl;
-						differencevector[numberdisagree]++;
+						vector<long> disagreements; //a batch of pairs simulated in parallel, each block with its own random number stream; progress is reported after each batch
+						bob.SimulateDisagreements(ltax,rtax,5000,gsl_rng_get(r),disagreements);
+						for (int i=0; i<disagreements.size(); i++) {
+							comparisonfile<<1.0*disagreements[i]/maxnumsametriplets<<endl;
+							differencevector[disagreements[i]]++;
+						}
+						loopcounttotal+=disagreements.size();
 						vectorminimum=requiredminimum*10;
 						for (int i=0; i<differencevector.size(); i++) {
 							if (differencevector[i]<vectorminimum) {
@@ -6203,9 +6642,7 @@ void BROWNIE::HandleCompareRandomTrees( NexusToken& token)
 							secondstotal=(1.0*timedifference)*(1.0*requiredminimum)/(1.0*vectorminimum); // all the 1.0 to make them treated as doubles.
 																										 // cout<<"timedif is "<<timedifference<<" sectotal is "<<secondstotal<<" vectorminimum is "<<vectorminimum<<" requiredminimum is "<<requiredminimum<<endl;
 						}
-						loopcount++;
-						loopcounttotal++;
-						if (loopcount==5000) {
+						if (vectorminimum<requiredminimum) {
 							message="";
 							message+=loopcounttotal;
 							message+="\t";
@@ -6252,7 +6689,6 @@ void BROWNIE::HandleCompareRandomTrees( NexusToken& token)
 								message+="Too long";
 							}
 							PrintMessage();
-							loopcount=0;
 						}
 					}
 					comparisonfile.close();
@@ -6346,23 +6782,10 @@ void BROWNIE::HandleCompareRandomTrees( NexusToken& token)
                     int minnumleaves=GSL_MIN(ltax,rtax);
                     int maxnumsametriplets=(minnumleaves*(minnumleaves-1)*(minnumleaves-2))/6; //minnumleaves choose 3
 					vector<int> differencevector(maxnumsametriplets+1,0); // the +1 is so we can have zero in the vector, too
-					ProgressBar(nreps);
+					vector<long> disagreements; //simulated in parallel, each block of pairs of trees with its own random number stream
+					bob.SimulateDisagreements(ltax,rtax,nreps,gsl_rng_get(r),disagreements);
 					for (int i=0;i<nreps;i++) {
-						ProgressBar(0);
-						ContainingTree t1;
-						ContainingTree t2;
-						t1.RandomTree(ltax);
-						t2.RandomTree(rtax);
-						t1.ConvertTaxonNamesToRandomTaxonNumbers();
-						t2.ConvertTaxonNamesToRandomTaxonNumbers();
-						int taxaincommon=PrepareTreesForTriplet(&t1,&t2);
-							// QTValues Q;
-							// CompareTriplets(t1,t2, Q);
-							// SummaryStats(Q);
-							// int numberdisagree=Q.d;
-						vector<int> tripletoverlapoutput=GetTripletOverlap(&t1,&t2,taxaincommon);
-						int numberdisagree=tripletoverlapoutput[1];
-						differencevector[numberdisagree]++;
+						differencevector[disagreements[i]]++;
 					}
 					message="ltax\trtax\tnreps\tdiffs\tobs\tprobability\tcum prob";
 					PrintMessage();
@@ -6441,6 +6864,12 @@ void BROWNIE::HandleCompareRandomTrees( NexusToken& token)
         else if ( token.Abbreviation("AUto") ) {
             automode=true;
         }
+        else if( token.Abbreviation("CDffile") ) {
+            cdffilename=GetFileName(token);
+        }
+        else if( token.Abbreviation("REplace") ) {
+            replacetables=true;
+        }
         else if( token.Abbreviation("Nreps") ) {
             donenothing=false;
             numbernexus = GetNumber(token);
@@ -6453,7 +6882,8 @@ void BROWNIE::HandleCompareRandomTrees( NexusToken& token)
         }
 		else if( token.Abbreviation("?") ) {
             donenothing=false;
-            message="Usage: Compare [ltax=<integer> rtax=<integer> nreps=<integer> <loop> <auto>]\n\n";
+            message="Usage: Compare [ltax=<integer> rtax=<integer> nreps=<integer> <loop> <auto> <cdffile=<file-name>>]\n\n";
+            message+="Pairs of random trees are simulated in parallel. With loop, cdffile saves tables of the results for each number of taxa,\nalong with the tables already in use, and uses them for structure scores from then on (see set cdffile).\n\n";
             PrintMessage();
         }
         else {
@@ -6479,12 +6909,44 @@ void BROWNIE::HandleSet( NexusToken& token )
 {
     nxsstring numbernexus;
     bool donenothing=true;
+    nxsstring cdffilename=""; //read once the whole command is parsed, so cdfreplace can come before or after it
+    bool replacetables=false;
     for(;;)
     {
         token.GetNextToken();
         if( token.Equals(";") ) {
             if (donenothing) {
-                message="Usage: Set [maxspecies=<integer>]\n\n";
+                message="Usage: Set [maxspecies=<integer>] [tripletmem=<number>] [cdffile=<file-name> [cdfreplace]]\n\n";
+                PrintMessage();
+            }
+            if (cdffilename.length()>0) {
+                CDFvectorholder bob;
+                vector<int> skippedntax;
+                if (!bob.ReadTables(cdffilename.c_str(),CDFvector,replacetables,skippedntax)) {
+                    errormsg = "Error: could not read triplet disagreement tables from ";
+                    errormsg += cdffilename;
+                    throw XNexus (errormsg, token.GetFilePosition(), token.GetFileLine(), token.GetFileColumn() );
+                }
+                message="Read triplet disagreement tables from ";
+                message+=cdffilename;
+                if (skippedntax.size()>0) {
+                    message+="; the tables already in use for";
+                    for (int i=0; i<skippedntax.size(); i++) {
+                        message+=" ";
+                        message+=skippedntax[i];
+                    }
+                    message+=" taxa were kept (use cdfreplace to replace them)";
+                }
+                message+="; tables are now available for ";
+                int ntables=0;
+                for (int i=0; i<CDFvector.size(); i++) {
+                    if (CDFvector[i].size()>0) {
+                        ntables++;
+                    }
+                }
+                message+=ntables;
+                message+=" numbers of taxa, up to ";
+                message+=int(CDFvector.size())+2;
                 PrintMessage();
             }
             break;
@@ -6511,6 +6973,22 @@ void BROWNIE::HandleSet( NexusToken& token )
                 throw XNexus (errormsg, token.GetFilePosition(), token.GetFileLine(), token.GetFileColumn() );
             }
         }
+        else if( token.Abbreviation("Tripletmem") ) {
+            donenothing=false;
+            numbernexus = GetNumber(token);
+            tripletmemorylimit=atof( numbernexus.c_str() );
+            message="Triplet counts for all triples will be stored if they take no more than ";
+            message+=tripletmemorylimit;
+            message+=" MB";
+            PrintMessage();
+        }
+        else if( token.Abbreviation("CDffile") ) {
+            donenothing=false;
+            cdffilename=GetFileName(token);
+        }
+        else if( token.Abbreviation("CDFReplace") ) {
+            replacetables=true;
+        }
         else if( token.Abbreviation("Compare")) {
             ContainingTree t1;
             ContainingTree t2;
@@ -6595,12 +7073,17 @@ void BROWNIE::HandleSet( NexusToken& token )
         }
         else if( token.Abbreviation("?") ) {
             donenothing=false;
-            message="Usage: Set [maxspecies=<integer>]\n\n";
+            message="Usage: Set [maxspecies=<integer>] [tripletmem=<number>] [cdffile=<file-name> [cdfreplace]]\n\n";
             message+="Sets the maximum number of species to test.\n\n";
             message+="Available options:\n\n";
             message+="Keyword ---- Option type ------------------------ Current setting --\n";
             message+="MaxSpecies   <integer-value>                      ";
             message+=maxnumspecies;
+            message+="\nTripletmem   <number>                             ";
+            message+=tripletmemorylimit;
+            message+="\nCDFFile      <file-name>                          ";
+            message+="\nCDFReplace                                        ";
+            message+="\n\nCDFFile reads tables of how often random trees disagree on triplets, made with compare loop cdffile=<file-name>,\nso the structure score uses them rather than an approximation for more than 50 samples. Tables already in use,\nincluding the built-in ones for 3 to 50 samples, are kept unless you also use cdfreplace.";
             PrintMessage();
         }
         else {
@@ -7720,7 +8203,7 @@ Char1:				Char2
 			
 			
 			gsl_vector* output=DiscreteGeneralOptimization();
-			nxsstring treename=trees->GetTreeName(chosentree-1);
+			nxsstring treename=GetLoopTreeName(chosentree-1);
 			message="Tree = ";
 			message+=chosentree;
 			message+=": ";
@@ -8148,7 +8631,7 @@ void BROWNIE::HandleDiscrete( NexusToken& token )
 				int looplimit=1;
 				int ntax=taxa->GetNumTaxonLabels();
 				if (treeloop==true) {
-					looplimit=trees->GetNumTrees();
+					looplimit=GetNumLoopTrees();
 				}
 				if (globalstates || charloop) {
 					localnumbercharstates=numbercharstates;
@@ -8220,9 +8703,9 @@ void BROWNIE::HandleDiscrete( NexusToken& token )
 						if (treeloop==true) {
 							chosentree=treenum;
 						}
-						double treeweight=trees->GetTreeWeight(chosentree-1);
+						double treeweight=GetLoopTreeWeight(chosentree-1);
 						weighttotal+=treeweight;
-						nxsstring treename=trees->GetTreeName(chosentree-1);
+						nxsstring treename=GetLoopTreeName(chosentree-1);
 						
 						gsl_vector* output;
 						if (!confidence) {
@@ -9403,7 +9886,6 @@ void BROWNIE::SimulateCharacters(int n, int chartype, nxsstring outputfilename,
 				}
 			}			
 		}
-		Tree T=intrees.GetIthTree(chosentree-1);
 				//Simulate up tree
 		double desiredstartingfreq=gsl_ran_flat (r,0.0,1.0);
 		int startingchar=0;
@@ -9416,17 +9898,15 @@ void BROWNIE::SimulateCharacters(int n, int chartype, nxsstring outputfilename,
 		}
 		//we've chosen a starting char
 		if(chartype==0) {
-			PreorderIterator <Node> m (T.GetRoot()); //Goes from root up
-			NodePtr currentnode = m.begin();
-			while (currentnode)
+			CompactTree CompactT(intrees.GetIthTreeRef(chosentree-1));
+			vector<int> ancestralstates(CompactT.GetNumNodes(),0);
+			ancestralstates[CompactT.GetRoot()]=startingchar;
+			for (int currentnode=0;currentnode<CompactT.GetNumNodes();currentnode++) //Goes from root up
 			{
-				if (currentnode==T.GetRoot() ) {
-					currentnode->SetLabelNumber(startingchar); //just use label numbers to store ancestral states
-				}
-				if (currentnode!=T.GetRoot() ) {
-					int startstate=(currentnode->GetAnc())->GetLabelNumber();
+				if (currentnode!=CompactT.GetRoot() ) {
+					int startstate=ancestralstates[CompactT.GetParent(currentnode)];
 					int nextstate=0;
-					gsl_matrix * Pmatrix=ComputeTransitionProbBuiltInFn(optimaldiscretecharQmatrix,currentnode->GetEdgeLength());
+					gsl_matrix * Pmatrix=ComputeTransitionProbBuiltInFn(optimaldiscretecharQmatrix,CompactT.GetEdgeLength(currentnode));
 					vector<double> Pancstatetopossiblenext;
 					double cumulativeP=0;
 					for (int endstate=0;endstate<localnumbercharstates;endstate++) {
@@ -9439,18 +9919,17 @@ void BROWNIE::SimulateCharacters(int n, int chartype, nxsstring outputfilename,
 							break;
 						}
 					}
-					if (currentnode->IsLeaf()) {
+					if (CompactT.IsLeaf(currentnode)) {
 						nxsstring newstate="";
 						newstate+=nextstate;
-						charactermatrixvector[taxa->FindTaxon(currentnode->GetLabel())]+=newstate;
+						charactermatrixvector[taxa->FindTaxon(CompactT.GetLabel(currentnode))]+=newstate;
 					//gsl_vector_set(newtips,taxa->FindTaxon(currentnode->GetLabel()),nextstate);
 					}
 					else {
-						currentnode->SetLabelNumber(nextstate);
+						ancestralstates[currentnode]=nextstate;
 					}
 					gsl_matrix_free(Pmatrix);
 				}
-				currentnode=m.next();
 			}
 		}
 		if (chartype==1) {
@@ -10319,7 +10798,7 @@ void BROWNIE::HandleRateTest( NexusToken& token )
         else if (token.Abbreviation("Taxset") ) {
             adequateinput=true;
             int ntax=0;
-            if (trees->GetNumTrees()<1) {
+            if (GetNumLoopTrees()<1) {
                 errormsg = "Error: No valid trees are loaded.";
                 throw XNexus (errormsg, token.GetFilePosition(), token.GetFileLine(), token.GetFileColumn() );
             }
@@ -10449,7 +10928,7 @@ IntSet::const_iterator xi;
         int originalchosenchar=chosenchar;
         if (treeloop) {
             starttree=1;
-            stoptree=trees->GetNumTrees();
+            stoptree=GetNumLoopTrees();
         }
         else {
             starttree=chosentree;
@@ -10495,9 +10974,9 @@ IntSet::const_iterator xi;
             //            gsl_vector VCVvectorvector(0,0);
             gsl_matrix *VCVcomb=gsl_matrix_calloc(ntaxcomb,ntaxcomb);
             //gsl_matrix VCVcomb(0,0,0);
-            double treeweight=trees->GetTreeWeight(chosentree-1);
+            double treeweight=GetLoopTreeWeight(chosentree-1);
             weighttotal+=treeweight;
-            nxsstring treename=trees->GetTreeName(chosentree-1);
+            nxsstring treename=GetLoopTreeName(chosentree-1);
             map<nxsstring, int>::const_iterator iter;
             for (iter=chosentaxsetntaxmap.begin();iter!=chosentaxsetntaxmap.end();++iter) {
                 nxsstring currenttaxset=iter->first;
@@ -11334,7 +11813,7 @@ void BROWNIE::HandleOrderByTree( NexusToken& token)
 		else {
 			nxsstring exportfname="ReorderedTaxonNames.nex";
 			exportf.open( exportfname.c_str(), ios::out | ios::app );
-			Tree t = intrees.GetIthTree(chosentree-1);
+			const Tree &t = intrees.GetIthTreeRef(chosentree-1);
 			NodeIterator <Node> n (t.GetRoot());
 			NodePtr cur = n.begin();
 			while (cur) {
@@ -12252,7 +12731,7 @@ char* BROWNIE::OutputForGTP(ContainingTree *SpeciesTreePtr)
     //now the gene trees
     int originalchosentree=chosentree;
     for (chosentree = 0; chosentree < trees->GetNumTrees(); chosentree++) {
-		      Tree t = intrees.GetIthTree(chosentree);
+		      const Tree &t = intrees.GetIthTreeRef(chosentree);
 		      TreeFile+="\ntree ";
                       //  if (t.GetName() != "")
                       //		  TreeFile+=NEXUSString (t.GetName());
@@ -12300,6 +12779,50 @@ vector<ContainingTree> BROWNIE::MakePrettyForOutput()
     return PrettyTrees;
 }
 
+//File holding the contour grid rows of stored best tree tablenumber (see ContourSearchTables)
+nxsstring BROWNIE::ContourTableFileName(int tablenumber)
+{
+	nxsstring filename=treefilename;
+	filename+=".contour";
+	filename+=tablenumber+1;
+	return filename;
+}
+
+void BROWNIE::ClearContourSearchTables()
+{
+	for (int i=0; i<ContourSearchTables.size(); i++) {
+		remove(ContourSearchTables[i].c_str());
+	}
+	ContourSearchTables.clear();
+}
+
+//Writes the rows of a contour grid (see ContourSearchBranchLengths), each on its own line as the score less that of the best point and then the edge
+//lengths, tab-delimited. Rows as good as the best come first; the others follow only if contourBrlenToExport is 2. Rows are read from the table's
+//file one at a time, so the table is never all in memory.
+void BROWNIE::WriteContourTable(ostream &out, const nxsstring &tablefile)
+{
+	for (int pass=0; pass<2; pass++) {
+		if (pass==1 && contourBrlenToExport!=2) {
+			break;
+		}
+		ifstream table(tablefile.c_str(), ios::in | ios::binary);
+		vector<double> branchcombination;
+		while (GetContourRow(table,branchcombination)) {
+			int numberofbranches=-1+branchcombination.size();
+			bool isbest=(branchcombination[numberofbranches]<=0); //if the score is the best
+			if (isbest==(pass==0)) {
+				nxsstring row="\n";
+				row+=branchcombination[numberofbranches];
+				for (int branch=0; branch<numberofbranches; branch++) {
+					row+="\t";
+					row+=branchcombination[branch];
+				}
+				out<<row;
+			}
+		}
+	}
+}
+
 void BROWNIE::FormatAndStoreBestTree(ContainingTree *NewBestTree,vector<double> scorevector)
 {
     ContainingTree FormattedNewBestTree=*NewBestTree;
@@ -12322,64 +12845,29 @@ void BROWNIE::FormatAndStoreBestTree(ContainingTree *NewBestTree,vector<double>
         cur = n.next();
     }
     bool newtree=true;
-    for (int j=0; j<FormattedBestTrees.size(); j++) {
-        ContainingTree t1=FormattedNewBestTree;
-        ContainingTree t2=FormattedBestTrees[j];
-        int ntaxt1=t1.GetNumLeaves();
-        int ntaxt2=t2.GetNumLeaves();
-        int ntaxincommon=PrepareTreesForTriplet(&t1,&t2);
-        if (ntaxincommon==ntaxt1 && ntaxincommon==ntaxt2) {
-            if (ntaxincommon>=3) { //so, all leaves are in common, but is the topology the same? If there are only two or one species, yes, so newtree=false. If there are at least 3 taxa, there are different possible topologies, so maybe, thus check below
-                vector<int> tripletoverlapoutput=GetTripletOverlap(&t1,&t2,ntaxincommon);
-                int numberdisagree=tripletoverlapoutput[1];
-                if (numberdisagree==0) {
-                    newtree=false;
-                }
-            }
-            else {
-                newtree=false; //all leaves in common, must have same topology, so same tree
-            }
-        }
-    }
+    vector<unsigned long long> topologykey;
 	if ((useCOAL || useMS) && exportalltrees) {
 		newtree=true; //since brlen might be different
+		if (!CompactTree(FormattedNewBestTree).GetTopologyKey(topologykey)) { //still recorded, so later trees are checked against it
+			topologykey.clear();
+		}
+	}
+	else {
+		newtree=IsNewBestTopology(FormattedNewBestTree,topologykey);
 	}
     if (newtree) {
         FormattedBestTrees.push_back(FormattedNewBestTree);
+        RecordBestTopology(topologykey);
 		BestConversions.push_back(convertsamplestospecies);
 		TotalScores.push_back(scorevector[0]);
 		GTPScores.push_back(scorevector[1]);
 		StructScores.push_back(scorevector[2]);
-		if (useCOAL && ContourSearchVector.size()>0 && contourBrlenToExport>0) {
-			vector<double> particularcombo=ContourSearchVector[0];
-			int numberofbranches=-1+particularcombo.size();
-			nxsstring ContourSearchStringBest="";
-			nxsstring ContourSearchStringOther="";
-			for (int branchcombination=0; branchcombination<ContourSearchVector.size(); branchcombination++) {
-				if (ContourSearchVector[branchcombination][numberofbranches]<=0) { //if the score is the best
-					ContourSearchStringBest+="\n";
-					ContourSearchStringBest+=ContourSearchVector[branchcombination][numberofbranches];
-					for (int branch=0; branch<numberofbranches; branch++) {
-						ContourSearchStringBest+="\t";
-						ContourSearchStringBest+=ContourSearchVector[branchcombination][branch];
-					}
-				}
-				else {
-					ContourSearchStringOther+="\n";
-					ContourSearchStringOther+=ContourSearchVector[branchcombination][numberofbranches];
-					for (int branch=0; branch<numberofbranches; branch++) {
-						ContourSearchStringOther+="\t";
-						ContourSearchStringOther+=ContourSearchVector[branchcombination][branch];
-					}
-				}
-			}
-			if (contourBrlenToExport==1) {
-				ContourSearchDescription.push_back(ContourSearchStringBest);
-			}
-			else if (contourBrlenToExport==2) {
-				ContourSearchStringBest+=ContourSearchStringOther;
-				ContourSearchDescription.push_back(ContourSearchStringBest);
-			}
+		if (useCOAL && ContourSearchRows>0 && contourBrlenToExport>0) { //the last grid's rows are copied to a file kept with this tree
+			nxsstring tablefile=ContourTableFileName(ContourSearchTables.size());
+			ifstream lastgrid(ContourSearchFile.c_str(), ios::in | ios::binary);
+			ofstream table(tablefile.c_str(), ios::out | ios::binary | ios::trunc);
+			table<<lastgrid.rdbuf();
+			ContourSearchTables.push_back(tablefile);
 		}
     }
     for (int k=0; k<FormattedBestTrees.size(); k++) {
@@ -12404,8 +12892,10 @@ void BROWNIE::FormatAndStoreBestTree(ContainingTree *NewBestTree,vector<double>
 				numspecies=GSL_MAX(numspecies,BestConversions[i][j]);
 			}
 			outtreef<<" ) ]\n";
-			if (useCOAL && contourBrlenToExport && ContourSearchDescription.size()>i) {
-				outtreef<<"["<<endl<<ContourSearchDescription[i]<<endl<<"]"<<endl;
+			if (useCOAL && contourBrlenToExport && ContourSearchTables.size()>i) {
+				outtreef<<"["<<endl;
+				WriteContourTable(outtreef,ContourSearchTables[i]);
+				outtreef<<endl<<"]"<<endl;
 			}
 			if (jackknifesearch) {
 				jackknifetreestooutput+="tree jackrep";
@@ -12509,167 +12999,139 @@ void BROWNIE::FormatAndStoreBestTree(ContainingTree *NewBestTree,vector<double>
 
 double BROWNIE::GetGTPScoreNew(ContainingTree *SpeciesTreePtr)
 {
-    //cout<<"SpeciesTree"<<endl;
-    //(*SpeciesTreePtr).Write(cout);
-    //cout<<endl;
     //uses algorithm from Zmasek & Eddy 2001, with modification by Sanderson for inferring only "strong" duplications (those that haven't happened after the last speciation event)
-    SpeciesTreePtr->SetLeafNumbers();
-    //cout<<"has set leafnumbers\n";
-    PreorderIterator <Node> n (SpeciesTreePtr->GetRoot());
-    //cout<<"set preorderiterator\n";
-    //cout<<"Species Tree = "<<endl;
-    // SpeciesTreePtr->ReportTreeHealth();
-    //FormatAndStoreBestTree(SpeciesTreePtr);
-    //SpeciesTreePtr->Update();
-    //SpeciesTreePtr->Draw(cout);
-    //cout<<ReturnFinalSpeciesTree(FormattedBestTrees.back());
-    //FormattedBestTrees.pop_back();
-    //cout<<endl;
+    if (gtptoohigh) {
+        return 0;
+    }
+    PrepareGTPScorer();
+    vector<double> treeweights=GetGTPTreeWeights();
+    double maxweightednumDup=GSL_POSINF;
+    if (structwt<1.0) {
+        maxweightednumDup=bestscorelocal/(1.0-structwt);
+    }
+    bool exceeded=false;
+    double weightednumDup=GetWeightedDuplicationsOnTree(SpeciesTreePtr,treeweights,maxweightednumDup,exceeded);
+    if (exceeded) {
+        weightednumDup=(0.0001+bestscorelocal)/(1.0-structwt);
+        gtptoohigh=true;
+    }
+    //cout<<"weightednumDup="<<weightednumDup<<endl;
+    return weightednumDup;
+}
 
+//gene trees only need to be converted once; copies of a topology are added once, and their weights summed in GetGTPTreeWeights
+void BROWNIE::PrepareGTPScorer()
+{
+    GroupIdenticalGeneTrees();
+    if (gtpscorer.GetNumGeneTrees()==0 || gtpscorer.GetNumGeneTrees()!=gtpgenetrees.size()) {
+        gtpscorer.Clear();
+        gtpgenetrees.clear();
+        for (int selectedtree = 0; selectedtree < intrees.GetNumTrees(); selectedtree++) {
+            if (genetreerepresentative[selectedtree]!=selectedtree) {
+                continue;
+            }
+            CompactTree CompactGeneTree(intrees.GetIthTreeRef(selectedtree));
+            for (int leafnum=0;leafnum<CompactGeneTree.GetNumLeaves();leafnum++) {
+                int leaf=CompactGeneTree.GetLeaves()[leafnum];
+                int SampleNumber=taxa->FindTaxon(CompactGeneTree.GetLabel(leaf));
+                assert(SampleNumber>=0 && SampleNumber<convertsamplestospecies.size());
+                CompactGeneTree.SetTaxon(leaf,SampleNumber);
+            }
+            if (!gtpscorer.AddGeneTree(CompactGeneTree)) {
+                gtpscorer.Clear();
+                gtpgenetrees.clear();
+                errormsg="Gene tree ";
+                errormsg+=selectedtree+1;
+                errormsg+=" has a node with only one descendant, so its duplications cannot be counted";
+                throw XNexus( errormsg);
+            }
+            gtpgenetrees.push_back(selectedtree);
+        }
+    }
+}
 
-    NodePtr currentnode = n.begin();
-    //cout<<"    NodePtr currentnode = n.begin();\n";
-    assert(currentnode!=NULL);
-    //cout<<"beginning to update\n";
-    SpeciesTreePtr->Update();
-    //cout<<"finished updating\n";
-    //cout<<endl;
-    //SpeciesTreePtr->ReportTreeHealth();
-    //cout<<endl<<"finished reporttreehealth"<<endl;
-    int labelcount=1;
-    while (currentnode)
-    {
-        //	cout<<"in while(currentnode)\n";
-        //	cout<<"currentnode="<<currentnode<<endl;
-        //	cout<<"currentnode anc = "<<currentnode->GetAnc()<<endl;
-        //	cout<<"current node index = "<<currentnode->GetIndex()<<endl;
-        currentnode->SetIndex(labelcount);
-        //	cout<<"currentnode->SetIndex(labelcount)\n";
-        labelcount++;
-        //	cout<<"labelcount++\n";
-        currentnode = n.next();
-        //	cout<<"currentnode = n.next();\n";
+//weight of each tree in gtpscorer: the total weight of the input trees with its topology
+vector<double> BROWNIE::GetGTPTreeWeights()
+{
+    vector<int> gtpposition(intrees.GetNumTrees(),-1);
+    for (int i=0;i<gtpgenetrees.size();i++) {
+        gtpposition[gtpgenetrees[i]]=i;
     }
-    //cout<<"out of while(currentnode)\n";
-    int originalchosentree=chosentree;
-    double weightednumDup=0;
+    vector<double> treeweights(gtpgenetrees.size(),0.0);
     for (int selectedtree = 0; selectedtree < intrees.GetNumTrees(); selectedtree++) {
-		if (gtptoohigh) {
-			break;
-		}
-		bool usethistree=true;
-		if (jackknifesearch) {
-			if (jackknifevector[selectedtree]==0) {
-				usethistree=false;
-			}
-		}
-		if (usethistree) {
-			int numDup=0;
-			Tree t=intrees.GetIthTree(selectedtree);
-			
-        //t.Write(cout);
-        //   cout<<endl;
-        //cout<<"Gene Tree = "<<endl;
-			t.Update();
-        // t.Draw(cout);
-        //  cout<<endl;
-			NodeIterator <Node> m (t.GetRoot());
-			NodePtr genetreenode=m.begin();
-			NodePtr a;
-			NodePtr b;
-			NodePtr g1;
-			NodePtr g2;
-			NodePtr Mg1;
-			NodePtr Mg2;
-			map<NodePtr,NodePtr> GtoSmap;
-			map<NodePtr,NodePtr>::iterator GtoSmapiter;
-        //map<NodePtr,map<int, int> > setsM;
-        //   map<int,int> g1map;
-        //   map<int,int> g2map;
-        //   map<int,int> a;
-        // map<int,int> b;
-        //map<NodePtr,map<int, int> >::iterator setsMiterator;
-			while (genetreenode!=NULL) {
-				if (gtptoohigh) {
-					break;
-				}				
-				genetreenode->SetMarked(false); //in this context, whether it predates a speciation event and so could be a strong duplication
-                                            //  cout<<"\ngenetreenode = "<<genetreenode<<" is leaf? "<<genetreenode->IsLeaf()<<" "<<genetreenode->GetLabel()<<endl;
-				if (!(genetreenode->IsLeaf())) {
-					g1=genetreenode->GetChild();
-					g2=g1->GetSibling();
-					if(g1->IsLeaf()) {
-						int SampleNumber=taxa->FindTaxon(g1->GetLabel());
-                    //cout<<"samplenum = "<<SampleNumber<<" convertsamplestospecies.size() = "<<convertsamplestospecies.size()<<endl;
-                    //   tempmap.insert(make_pair(convertsamplestospecies[SampleNumber],1));
-                    //  setsM.insert(make_pair(g1,tempmap));
-						if (SampleNumber>=convertsamplestospecies.size()) {
-							cout<<"SampleNumber "<<SampleNumber<<" but...";
-							cout<<" convertsamplestospecies.size() = "<<convertsamplestospecies.size()<<endl;
-							for(int i=0;i<convertsamplestospecies.size();i++) {
-								cout<<convertsamplestospecies[i]<<" ";
-							}
-							cout<<endl;
-						}
-						assert(SampleNumber<convertsamplestospecies.size());
-						GtoSmap.insert(make_pair(g1,SpeciesTreePtr->GetLeafWithNumber(convertsamplestospecies[SampleNumber])));
-                    //  cout<<"Found leaf "<<SpeciesTreePtr->GetLeafWithNumber(convertsamplestospecies[SampleNumber]);
-                    //  cout<<" "<<(SpeciesTreePtr->GetLeafWithNumber(convertsamplestospecies[SampleNumber]))->GetLabel()<<endl;
-					}
-					if(g2->IsLeaf()) {
-						int SampleNumber=taxa->FindTaxon(g2->GetLabel());
-						GtoSmap.insert(make_pair(g2,SpeciesTreePtr->GetLeafWithNumber(convertsamplestospecies[SampleNumber])));
-                    //  cout<<"Found leaf "<<SpeciesTreePtr->GetLeafWithNumber(convertsamplestospecies[SampleNumber]);
-                    //  cout<<" "<<(SpeciesTreePtr->GetLeafWithNumber(convertsamplestospecies[SampleNumber]))->GetLabel()<<endl;
-						
-					}
-					if(g1->IsMarked() || g2->IsMarked()) {
-						genetreenode->SetMarked(true); // it predates a speciation event, so can be a strong dup (idea from Sanderson)
-					}
-					GtoSmapiter=GtoSmap.find(g1);
-					a=(*GtoSmapiter).second;
-					Mg1=a;
-					GtoSmapiter=GtoSmap.find(g2);
-					b=(*GtoSmapiter).second;
-					Mg2=b;
-                //cout<<"a = "<<a<<" b = "<<b<<endl;
-					while (a->GetIndex() != b->GetIndex()) {
-						if (a->GetIndex() > b->GetIndex()) {
-							a=a->GetAnc();
-						}
-						else {
-							b=b->GetAnc();
-						}
-					}
-					GtoSmap.insert(make_pair(genetreenode,a));
-                //  cout<<"Mgenetreenode,Mg1,Mg2,genetreenode,g1,g2\n"<<a<<"\t"<<Mg1<<"\t"<<Mg2<<"\t"<<genetreenode<<"\t"<<g1<<"\t"<<g2<<endl;
-					if((a==Mg1) || (a==Mg2)) {
-                    //   cout<<"Dup";
-						if(genetreenode->IsMarked()) {
-                        //    cout<<"--Strong, will count"<<endl;
-							numDup++;
-                        //    cout<<"Match, numDup = "<<numDup<<endl;
-						}
-					}
-					else {
-						genetreenode->SetMarked(true); //since it's a speciation event
-                                                   //  cout<<"SpeciationEvent"<<endl;
-					}
-				}
-				genetreenode=m.next();
-			}
-        //     cout<<"numDup="<<numDup<<" weight = "<<trees->GetTreeWeight(chosentree)<<endl;
-			weightednumDup+=(trees->GetTreeWeight(chosentree))*(1.0*numDup);
-			if (weightednumDup*(1.0-structwt)>bestscorelocal) {
-				weightednumDup=(0.0001+bestscorelocal)/(1.0-structwt);
-				gtptoohigh=true;
-				break;
-			}
-		}
+        if (!(jackknifesearch && jackknifevector[selectedtree]==0)) {
+            treeweights[gtpposition[genetreerepresentative[selectedtree]]]+=trees->GetTreeWeight(selectedtree);
+        }
     }
-    chosentree=originalchosentree;
-    //cout<<"weightednumDup="<<weightednumDup<<endl;
-    return weightednumDup;
+    return treeweights;
+}
+
+//Everything worked out from the gene trees in intrees; call when they are read again or edited in place
+void BROWNIE::ClearGeneTreeCaches()
+{
+    coalprobs.Clear();
+    gtpscorer.Clear();
+    gtpgenetrees.clear();
+    genetreerepresentative.clear();
+    QuartetCounts.Clear();
+}
+
+//Finds input trees with the same rooted topology as an earlier tree, so that each topology need only be scored once, using the total weight of
+//its copies. Only fully resolved trees are grouped, as only the first two descendants of a polytomy are used in counting duplications. Trees
+//are looked up by topology key, and a tree with the same key is only taken as a copy once its clusters are compared.
+void BROWNIE::GroupIdenticalGeneTrees()
+{
+    if (genetreerepresentative.size()==intrees.GetNumTrees()) {
+        return;
+    }
+    genetreerepresentative.clear();
+    gtpscorer.Clear(); //it holds one tree per topology
+    gtpgenetrees.clear();
+    vector<CompactTree> firsttrees; //first tree with each topology
+    vector<int> firsttreenumbers;
+    map<vector<unsigned long long>, vector<int> > firsttreeswithkey; //positions in firsttrees; more than one only if different topologies share a key
+    for (int selectedtree = 0; selectedtree < intrees.GetNumTrees(); selectedtree++) {
+        CompactTree CompactGeneTree(intrees.GetIthTreeRef(selectedtree));
+        vector<unsigned long long> topologykey;
+        if (!CompactGeneTree.GetTopologyKey(topologykey)) {
+            genetreerepresentative.push_back(selectedtree);
+            continue;
+        }
+        vector<int> &candidates=firsttreeswithkey[topologykey];
+        int representative=selectedtree;
+        for (int k=0; k<candidates.size(); k++) {
+            if (firsttrees[candidates[k]].SameTopology(CompactGeneTree)) {
+                representative=firsttreenumbers[candidates[k]];
+                break;
+            }
+        }
+        if (representative==selectedtree) {
+            candidates.push_back(firsttrees.size());
+            firsttrees.push_back(CompactGeneTree);
+            firsttreenumbers.push_back(selectedtree);
+        }
+        genetreerepresentative.push_back(representative);
+    }
+}
+
+//Only changes the species tree and reads the gene trees in gtpscorer, so it can be called on different species trees at once, once PrepareGTPScorer has been called
+double BROWNIE::GetWeightedDuplicationsOnTree(ContainingTree *SpeciesTreePtr, const vector<double> &treeweights, double limit, bool &exceeded)
+{
+    SpeciesTreePtr->SetLeafNumbers();
+    SpeciesTreePtr->Update();
+    CompactTree CompactSpeciesTree(*SpeciesTreePtr);
+    NodeIterator <Node> n (SpeciesTreePtr->GetRoot());
+    int leafnum=0;
+    for (NodePtr currentnode=n.begin(); currentnode!=NULL; currentnode=n.next()) {
+        if (currentnode->IsLeaf()) {
+            CompactSpeciesTree.SetTaxon(CompactSpeciesTree.GetLeaves()[leafnum],currentnode->GetLeafNumber());
+            leafnum++;
+        }
+    }
+    GTPSpeciesTree IndexedSpeciesTree;
+    IndexedSpeciesTree.Set(CompactSpeciesTree,convertsamplestospecies);
+    exceeded=false;
+    return gtpscorer.GetWeightedDuplications(IndexedSpeciesTree,treeweights,limit,exceeded);
 }
 
 //took this function out as no longer depend on external gtp
@@ -13258,8 +13720,8 @@ void BROWNIE::RunCmdLine(bool inputfilegiven, nxsstring fn)
     		{
 			token.GetNextToken();
 			if( token.Abbreviation("?") ) {
-				message="Usage: GREP  observedtrees=file_of_observedtrees_trees.txt simulatedtrees=file_of_simulated_trees.txt assignments=file_of_assignments.txt returnmatches=no usefileregex=no usestepwise=no\n\n";
-			message+="Multiple gene trees may be consistent with a given species tree (i.e, if the species tree is ((A,B),C), gene trees ((((A1,A2,),A3),B1),C1) and ((((A3,A2,),A1),B1),C1) both match. This function takes one or more observed gene trees (in a file), an assignment (tab-delimited text, with the species name followed by a tab and then the gene sample name (i.e, SpeciesA<tab>A1), and makes a string to use with grep that will tell you how many trees in the gene trees file (set of newick trees, one line per tree) are consistent with each observed gene tree, given the assignment of samples to species. Note that passing Brownie's output to 'grep Match' will return only the relevant results. For very big trees, it may be better to set usefileregex=yes so that the grep line is stored in a file (good if you get the error message 'regular expression too big'). Usestepwise=y passes multiple short arguments to a chain of greps instead of one huge regex.";
+				message="Usage: GREP  observedtrees=file_of_observedtrees_trees.txt simulatedtrees=file_of_simulated_trees.txt assignments=file_of_assignments.txt returnmatches=no\n\n";
+			message+="Multiple gene trees may be consistent with a given species tree (i.e, if the species tree is ((A,B),C), gene trees ((((A1,A2,),A3),B1),C1) and ((((A3,A2,),A1),B1),C1) both match. This function takes one or more observed gene trees (in a file), an assignment (tab-delimited text, with the species name followed by a tab and then the gene sample name (i.e, SpeciesA<tab>A1), and tells you how many trees in the simulated trees file (set of newick trees, one line per tree, such as the output of ms -T) are consistent with each observed gene tree, given the assignment of samples to species. Note that passing Brownie's output to 'grep Match' will return only the relevant results. Returnmatches=yes saves the matching simulated trees for each observed tree. The old usefileregex, usestepwise, and useperl options are still accepted but are no longer needed, as trees are now compared directly rather than with grep or perl.";
 				PrintMessage();
 				finishexecuting=false;
 			}
@@ -13384,446 +13846,119 @@ void BROWNIE::RunCmdLine(bool inputfilegiven, nxsstring fn)
 					}				
 					
 					
-					
-//						ContainingTree CurrentTree;
-//						CurrentTree.SetRoot((intrees.GetIthTree(inputchosentree)).CopyOfSubtree((intrees.GetIthTree(inputchosentree)).GetRoot()));
-//						CurrentTree.Update();
-//						CurrentTree.GetNodeDepths();
-//						int numspecies=CurrentTree.GetNumLeaves();		
-//						int ntax=taxa->GetNumTaxonLabels();
-						vector <int> samplesperspecies;
-						vector <nxsstring> labelswithinspecies;
-						int numsamples=speciestosamples.size();
-						int numspecies=specieslist.size();
-
-						double numberofpermutations=1;
-						int previoustotal=0;
-						for (int currentspecies=0; currentspecies<numspecies; currentspecies++) {
-							int samplecountthisspecies=0;
-							nxsstring labelregex="\\(";
-							if (useperl) {
-								labelregex="(";
-							}
-							for (int currentsample=0; currentsample<numsamples; currentsample++) {
-								if (sampleslist[ samplesvector[currentsample] ]==speciesvector[currentspecies]) {
-									samplecountthisspecies++;
-									if (samplecountthisspecies>1) {
-										if (!useperl) {
-									   		labelregex+="\\|";
-									   }
-									   else {
-									   	labelregex+="|";
-									   }
-									}
-									labelregex+=samplesvector[currentsample];
-								}
-							}
-							labelregex+="\\):[0-9]*.[0-9]*"; //ms exports brlen, too
-							labelswithinspecies.push_back(labelregex);
-							previoustotal+=samplecountthisspecies;
-							numberofpermutations*=gsl_sf_fact(samplecountthisspecies);
-						}
-				
-					
-					
-						//rather than looking for exact match, get probabilities of given topology with all possible permutations of labels of samples from a given species onto ms taxon numbers, then divide by number of such permutations
-						
-						//loop over all the gene trees
-						message="\nGrep match results\n\tTree\tNumber of matches";
-						PrintMessage();
-						for (int chosentreenum=0; chosentreenum<inObservedTrees.GetNumTrees(); chosentreenum++) { //loop over all the observed gene trees
-							nxsstring grepstring="";
-							nxsstring grepfilestring="";
-							nxsstring grepstringreturnmatch="";
-							nxsstring grepstepwise="";
-							int numberintraspecificcherries=0;
-							Tree CurrentGeneTreeTreeFmt=inObservedTrees.GetIthTree(chosentreenum);
-							NodeIterator <Node> n (CurrentGeneTreeTreeFmt.GetRoot());
-							//traverse once to count intraspecific sister cherries
-							cur = n.begin();
-							while (cur) {
-								if (cur->IsLeaf()) {
-									NodePtr sister=cur->GetSibling();
-									if (sister!=NULL) {
-										if (sister->IsLeaf()) {
-											//cout<<cur->GetLabel()<<" with "<<sister->GetLabel()<<endl;
-											
-											if (sampleslist[cur->GetLabel()] == sampleslist[sister->GetLabel()]) { //they have the same species (though node labels are changed, we do the one that's a child before its sib)
-											//if (convertsamplestospecies[taxa->FindTaxon(cur->GetLabel())]==convertsamplestospecies[taxa->FindTaxon(sister->GetLabel())]) { //they have the same species (though node labels are changed, we do the one that's a child before its sib)
-												numberintraspecificcherries++;
-											}
-										}
-									}
-								}
-								cur = n.next();
+					
+					//species number (starting at 1) of each sample, in the order of speciesvector
+					map<nxsstring, int> samplespeciesnumber;
+					for (int currentsample=0; currentsample<samplesvector.size(); currentsample++) {
+						for (int currentspecies=0; currentspecies<speciesvector.size(); currentspecies++) {
+							if (sampleslist[ samplesvector[currentsample] ]==speciesvector[currentspecies]) {
+								samplespeciesnumber[samplesvector[currentsample]]=currentspecies+1;
 							}
-							
-							//now get the grep lines
-							cur = n.begin();
-							while (cur) {
-								if (cur->IsLeaf()) {
-									nxsstring specieslabel=sampleslist[cur->GetLabel()];
-									nxsstring greplabel="ERROR";
-									for (int currentspecies=0; currentspecies<numspecies; currentspecies++) {
-										if (speciesvector[currentspecies]==specieslabel) {
-											greplabel=labelswithinspecies[currentspecies];
-										}
-									}
-									cur->SetLabel(greplabel); //gets regex for tip labels
+						}
+					}
+					
+					//rather than making a regex for each observed tree, hash its topology with samples relabeled by species; simulated trees with the same hash match it
+					vector<TopologyHash> observedhashes;
+					for (int chosentreenum=0; chosentreenum<inObservedTrees.GetNumTrees(); chosentreenum++) { //loop over all the observed gene trees
+						const Tree &CurrentGeneTreeTreeFmt=inObservedTrees.GetIthTreeRef(chosentreenum);
+						vector<int> leafspecies;
+						NodeIterator <Node> n (CurrentGeneTreeTreeFmt.GetRoot());
+						cur = n.begin();
+						while (cur) {
+							if (cur->IsLeaf()) {
+								map<nxsstring, int>::iterator found=samplespeciesnumber.find(cur->GetLabel());
+								if (found!=samplespeciesnumber.end()) {
+									leafspecies.push_back(found->second);
 								}
 								else {
-									nxsstring combinedstring="";
-									nxsstring leftchild=(cur->GetChild())->GetLabel();
-									nxsstring rightchild=((cur->GetChild())->GetSibling())->GetLabel();
-									nxsstring additionalregex="(\\(";
-									additionalregex+=leftchild;
-									additionalregex+=",";
-									additionalregex+=rightchild;
-									additionalregex+="\\|";
-									additionalregex+=rightchild;
-									additionalregex+=",";
-									additionalregex+=leftchild;
-									additionalregex+="\\))";
-									if (cur->GetAnc()!=NULL) { // not root
-										additionalregex+=":*[0-9]*.[0-9]*";
-										grepstepwise+= " | grep \"";
-										grepstepwise+=additionalregex;
-										grepstepwise+="\"";
-									}
-									else { //originally, did this at each node, with the idea that from MS, you first filter out the lines that don't match a cherry, then filter from that filtered set, etc., thinking it would be faster than just using the regex at the root. Actually, just using the regex at the root was faster, so I do that.
-										grepstring+=" | grep -c \"";
-										grepstringreturnmatch+=" | grep \"";
-										grepstring+=additionalregex;
-										grepstringreturnmatch+=additionalregex;
-										grepfilestring+=additionalregex;
-										grepstring+="\"";
-										grepstringreturnmatch+="\"";
-										grepstepwise+=" | grep -c ';'";
-									}
-									cur->SetLabel(additionalregex);
+									leafspecies.push_back(-1); //not in the assignments, so cannot match
 								}
-								cur = n.next();
 							}
-							/*ofstream newickf;
-							newickf.open("tmp_newick.nwk");
-							CurrentGeneTreeTreeFmt.Write(newickf);
-							newickf.close();
-							nxsstring finalsystemcall="cat tmp_newick.nwk";*/
-							nxsstring finalsystemcall="cat ";
-							finalsystemcall+=simtreefile;
-							nxsstring msinputfile="tmp_mscount.txt";
-							if (useperl) {
-								//We're going to export a perl file, use it to find all the clades, and compare them.
-								//Monumentally stupid? Perhaps, but it does work on vary large trees where grep chokes.
-							   nxsstring perlscript="#!/usr/bin/perl -w";
-							   perlscript+="\n";
-							   perlscript+="#compareclades.pl";
-							   perlscript+="\n";
-							   perlscript+="#Brian OMeara, 11 August 2010";
-							   perlscript+="\n";
-							   perlscript+="#http://www.brianomeara.info";
-							   perlscript+="\n";
-							   perlscript+="#released under GPL2";
-							   perlscript+="\n";
-							   perlscript+="use diagnostics;";
-							   perlscript+="\n";
-							   perlscript+="use strict;";
-							   perlscript+="\n";
-							   perlscript+="my $assignmentfile=\"a\";";
-							   perlscript+="\n";
-							   perlscript+="my $observedfile=\"o\";";
-							   perlscript+="\n";
-							   perlscript+="my $simulatedfile=\"s\";";
-							   perlscript+="\n";
-							   perlscript+="my $countsim=0;";
-							   perlscript+="\n";
-							   perlscript+="my $desiredtree=0;";
-							   perlscript+="\n";
-							   perlscript+="if ($#ARGV<1) {";
-							   perlscript+="\n";
-							   perlscript+="	print \"Usage: perl compareclades.pl -aAssignment.txt -oObserved.txt -sSimulated.txt [-d#] [-c]\\n\\nThis script counts how many times each tree in the observed file occurs in the simulated file, taking into account the many-to-one mapping of samples to species.\\n\\nAssignments are given in a tab-delimited file with a column of species letters (A, B,....) and a column of corresponding sample numbers (1, 2, ...). The observed and simulated trees are lists of newick trees with sample numbers, not names. The optional -c argument just gives the count of each tree in the simulated trees file (after making samples from the same species equivalent: ((1,2),3) and ((3,1),2) are the same if samples 1 and 3 are from species A and sample 2 is from species B: the clades in each tree are thus A-B and A-A-B\\nIf you just want a particular tree from the observed file (say, #42), add the -d argument (i.e., -d42)\";";
-							   perlscript+="\n";
-							   perlscript+="}";
-							   perlscript+="\n";
-							   perlscript+="else {";
-							   perlscript+="\n";
-							   perlscript+="	for (my $i = 0; $i <= $#ARGV; $i++) {";
-							   perlscript+="\n";
-							   perlscript+="		if ($ARGV[$i] =~ /-a([\\w\\.]+)/) {";
-							   perlscript+="\n";
-							   perlscript+="			$assignmentfile=$1;";
-							   perlscript+="\n";
-							   perlscript+="		}";
-							   perlscript+="\n";
-							   perlscript+="		elsif ($ARGV[$i] =~ /-o([\\w\\.]+)/) {";
-							   perlscript+="\n";
-							   perlscript+="			$observedfile=$1;";
-							   perlscript+="\n";
-							   perlscript+="		}";
-							   perlscript+="\n";
-							   perlscript+="		elsif ($ARGV[$i] =~ /-s([\\w\\.]+)/) {";
-							   perlscript+="\n";
-							   perlscript+="			$simulatedfile=$1;";
-							   perlscript+="\n";
-							   perlscript+="		}";
-							   perlscript+="\n";
-							   perlscript+="		elsif ($ARGV[$i] =~ /-c/) {";
-							   perlscript+="\n";
-							   perlscript+="			$countsim=1;";
-							   perlscript+="\n";
-							   perlscript+="		}";
-							   perlscript+="\n";
-							   perlscript+="		elsif ($ARGV[$i] =~ /-d(\\d+)/) {";
-							   perlscript+="\n";
-							   perlscript+="			$desiredtree=$1;";
-							   perlscript+="\n";
-							   perlscript+="		}";
-							   perlscript+="\n";
-							   perlscript+="	}";
-							   perlscript+="\n";
-							   perlscript+="	";
-							   perlscript+="\n";
-							   perlscript+="	open(OBS,\"$observedfile\");";
-							   perlscript+="\n";
-							   perlscript+="	open(SIM,\"$simulatedfile\");";
-							   perlscript+="\n";
-							   perlscript+="	open(ASSIGN,\"$assignmentfile\");";
-							   perlscript+="\n";
-							   perlscript+="	my %assignments=();";
-							   perlscript+="\n";
-							   perlscript+="	foreach my $inline (<ASSIGN>) {";
-							   perlscript+="\n";
-							   perlscript+="		chomp $inline;";
-							   perlscript+="\n";
-							   perlscript+="		my @args=split(/\\s+/,$inline);";
-							   perlscript+="\n";
-							   perlscript+="		$assignments{ $args[1] } = $args[0];";
-							   perlscript+="\n";
-							   perlscript+="	}";
-							   perlscript+="\n";
-							   perlscript+="	close ASSIGN;";
-							   perlscript+="\n";
-							   perlscript+="	";
-							   perlscript+="\n";
-							   perlscript+="	my %simtreescount;";
-							   perlscript+="\n";
-							   perlscript+="	";
-							   perlscript+="\n";
-							   perlscript+="	foreach my $inline (<SIM>) {";
-							   perlscript+="\n";
-							   perlscript+="		chomp $inline;";
-							   perlscript+="\n";
-							   perlscript+="		my $clades=returnclades($inline, %assignments);";
-							   perlscript+="\n";
-							   perlscript+="		$simtreescount{$clades}++;";
-							   perlscript+="\n";
-							   perlscript+="	}";
-							   perlscript+="\n";
-							   perlscript+="	";
-							   perlscript+="\n";
-							   perlscript+="	if ($countsim==1) {";
-							   perlscript+="\n";
-							   perlscript+="		print \"Count\\tTree\\n\";";
-							   perlscript+="\n";
-							   perlscript+="		foreach my $clade (sort { $simtreescount{$b} <=> $simtreescount{$a} } keys %simtreescount) {";
-							   perlscript+="\n";
-							   perlscript+="			print \"$simtreescount{$clade}\\t$clade\\n\";";
-							   perlscript+="\n";
-							   perlscript+="		}";
-							   perlscript+="\n";
-							   perlscript+="	}";
-							   perlscript+="\n";
-							   perlscript+="	else {";
-							   perlscript+="\n";
-							   perlscript+="		my $obstreecount=0;";
-							   perlscript+="\n";
-							   perlscript+="		foreach my $inline (<OBS>) {";
-							   perlscript+="\n";
-							   perlscript+="			chomp $inline;";
-							   perlscript+="\n";
-							   perlscript+="			$obstreecount++;";
-							   perlscript+="\n";
-							   perlscript+="			if ($desiredtree==$obstreecount || $desiredtree==0) {";
-							   perlscript+="\n";
-							   perlscript+="			#	print \"Now working on observed tree $obstreecount\\n\";";
-							   perlscript+="\n";
-							   perlscript+="				my $clades=returnclades($inline, %assignments);";
-							   perlscript+="\n";
-							   perlscript+="			#	print \"\\t$clades\\n\";";
-							   perlscript+="\n";
-							   perlscript+="				my $matchcount=0;";
-							   perlscript+="\n";
-							   perlscript+="				if (exists($simtreescount{$clades})) {";
-							   perlscript+="\n";
-							   perlscript+="					$matchcount=$simtreescount{$clades};";
-							   perlscript+="\n";
-							   perlscript+="				}";
-							   perlscript+="\n";
-							   perlscript+="				if ($obstreecount>1 && $desiredtree==0) {";
-							   perlscript+="\n";
-							   perlscript+="					print \"\\n\";";
-							   perlscript+="\n";
-							   perlscript+="				}";
-							   perlscript+="\n";
-							   perlscript+="				print \"$matchcount\";";
-							   perlscript+="\n";
-							   perlscript+="			}";
-							   perlscript+="\n";
-							   perlscript+="		}";
-							   perlscript+="\n";
-							   perlscript+="	}";
-							   perlscript+="\n";
-							   perlscript+="	";
-							   perlscript+="\n";
-							   perlscript+="	sub returnclades {";
-							   perlscript+="\n";
-							   perlscript+="		my ($intree, %localassignments) = @_;";
-							   perlscript+="\n";
-							   perlscript+="		my @cladearray=();";
-							   perlscript+="\n";
-							   perlscript+="		$intree=~s/:\\d+\\.?\\d*e?\\-?\\d*//ig; #remove branch length (regex from Olaf Bininda-Emonds partitionmetric.pl script)";
-							   perlscript+="\n";
-							   perlscript+="		while ($intree=~m/(\\([\\w\\,]+\\))/) {";
-							   perlscript+="\n";
-							   perlscript+="			my $matchstring=$1;";
-							   perlscript+="\n";
-							   perlscript+="			my $innermatch=\"\";";
-							   perlscript+="\n";
-							   perlscript+="			if ($matchstring=~m/\\(([\\w\\,]+)\\)/) {";
-							   perlscript+="\n";
-							   perlscript+="				$innermatch=$1;";
-							   perlscript+="\n";
-							   perlscript+="			}";
-							   perlscript+="\n";
-							   perlscript+="			my @splitinner=split(/\\,/,$innermatch);";
-							   perlscript+="\n";
-							   perlscript+="			my @renamedinner=();";
-							   perlscript+="\n";
-							   perlscript+="			foreach my $taxon (@splitinner) {";
-							   perlscript+="\n";
-							   perlscript+="				push(@renamedinner,$assignments{ $taxon });";
-							   perlscript+="\n";
-							   perlscript+="			}";
-							   perlscript+="\n";
-							   perlscript+="			@renamedinner = sort(@renamedinner);";
-							   perlscript+="\n";
-							   perlscript+="			push(@cladearray,join(\"-\",@renamedinner));";
-							   perlscript+="\n";
-							   perlscript+="			$intree=~s/\\($innermatch\\)/$innermatch/;";
-							   perlscript+="\n";
-							   perlscript+="		}";
-							   perlscript+="\n";
-							   perlscript+="		@cladearray=sort(@cladearray);";
-							   perlscript+="\n";
-							   perlscript+="		my $clades=join(\"|\",@cladearray);";
-							   perlscript+="\n";
-							   perlscript+="		return $clades;";
-							   perlscript+="\n";
-							   perlscript+="	}";
-							   perlscript+="\n";
-							   perlscript+="}";								
-								ofstream perlout;
-								perlout.open( "tmp_perlcount.pl", ios::out | ios::trunc );
-								perlout<<perlscript;
-								perlout.close();	
-								//finalsystemcall=\"perl -pe 's/\\\\\\\\//g' < tmp_perlcount.pl > tmp_perlcountNEW.pl; mv tmp_perlcountNew.pl tmp_perlcount.pl; perl tmp_perlcount.pl";
-								finalsystemcall="perl tmp_perlcount.pl -s";
-								finalsystemcall+=simtreefile;
-								finalsystemcall+=" -a";
-								finalsystemcall+=assignmentfile;
-								finalsystemcall+=" -o";
-								finalsystemcall+=observedtreefile;
-								finalsystemcall+=" -d";
-								finalsystemcall+=chosentreenum+1;
-								finalsystemcall+=" > ";
-								finalsystemcall+=msinputfile;
-							}
-							else {
-								if (!usefileregex) {
-									if (!usestepwise) {
-										finalsystemcall+=grepstring;
-									}
-									else {
-										finalsystemcall+=grepstepwise;
-									}
+							cur = n.next();
+						}
+						observedhashes.push_back(GetSpeciesTopologyHash(CurrentGeneTreeTreeFmt,leafspecies));
+					}
+					
+					//read the simulated trees once (one newick tree per line, as from ms -T; other lines are skipped), counting matches to every observed tree
+					if( !FileExists( simtreefile.c_str() ) ) {
+						errormsg="File ";
+						errormsg+=simtreefile;
+						errormsg+=" does not exist, at least where Brownie is looking for it";
+						throw XNexus(errormsg);
+					}
+					map<TopologyHash, vector<long> > matchinglines;
+					for (int chosentreenum=0; chosentreenum<observedhashes.size(); chosentreenum++) {
+						matchinglines[observedhashes[chosentreenum]]=vector<long>();
+					}
+					ifstream simtreestream;
+					simtreestream.open(simtreefile.c_str(),ios::in);
+					string simline;
+					long linenumber=0;
+					while (getline(simtreestream,simline)) {
+						linenumber++;
+						size_t treestart=simline.find('(');
+						if (treestart==string::npos) {
+							continue;
+						}
+						Tree SimulatedTree;
+						if (SimulatedTree.Parse(simline.substr(treestart).c_str())!=0) {
+							continue;
+						}
+						vector<int> leafspecies;
+						NodeIterator <Node> n (SimulatedTree.GetRoot());
+						cur = n.begin();
+						while (cur) {
+							if (cur->IsLeaf()) {
+								map<nxsstring, int>::iterator found=samplespeciesnumber.find(cur->GetLabel());
+								if (found!=samplespeciesnumber.end()) {
+									leafspecies.push_back(found->second);
 								}
 								else {
-									nxsstring grepregex="tmp_grepregex.txt";
-									finalsystemcall+=" | grep -c -f tmp_grepregex.txt";
-									ofstream grepregexf;
-									grepregexf.open(grepregex.c_str(), ios::out | ios::app );
-									grepregexf<<grepfilestring;
-									grepregexf.close();
-								}
-								finalsystemcall+=" > ";
-								finalsystemcall+=msinputfile;
-							}
-							//system("rm mscount.txt");
-							if (debugmode) {
-								cout<<"finalsystemcall.c_str() = \n"<<finalsystemcall.c_str()<<endl;
-								if (useperl) {
-									nxsstring copyperl="cp tmp_perlcount.pl tmp_perlcount";
-									copyperl+=chosentreenum+1;
-									copyperl+=".pl";
-									system(copyperl.c_str()); 
-								}
-							}
-							int returncode=system(finalsystemcall.c_str());
-							if (debugmode) {
-								if (!usestepwise && !useperl) {
-									cout<<"grep line is "<<endl<<grepstring<<endl;
-								}
-								cout<<"return code is "<<returncode<<" (divided by 256, is "<<returncode/256<<")"<<endl;
-							}
-						
-							ifstream msin;
-							msin.open( msinputfile.c_str(), ios::binary | ios::in );
-							if (msin) {
-								char inputitem [COMMAND_MAXLEN];
-								msin>>inputitem;
-								double numbermatches=atoi(inputitem);
-								message="Match\t";
-								message+=chosentreenum+1;
-								message+="\t";
-								message+=numbermatches;
-								PrintMessage();
-								msin.close();
-								if (returnmatches) {
-									nxsstring finalsystemcallmatch="cat ";
-									finalsystemcallmatch+=simtreefile;
-									finalsystemcallmatch+=grepstringreturnmatch;
-									finalsystemcallmatch+=" > matching_observed_tree_";
-									finalsystemcallmatch+=chosentreenum+1;
-									finalsystemcallmatch+=".tre";
-									int returncodematch=system(finalsystemcallmatch.c_str());
-									message="\t\tSaved matches to matching_observed_tree_";
-									message+=chosentreenum+1;
-									message+=".tre";
-									PrintMessage();
+									leafspecies.push_back(-2);
 								}
 							}
-							else {
-								message="\nWarning: got return code of ";
-								message+=returncode;
-								message+="\n\nfor grep string of \n\n";
-								message+=grepstring;
-								message+="\n\n";
-							
-							}
-							if (!debugmode) {
-								system("rm tmp_mscount.txt");
-								if (usefileregex && !useperl) {
-									system("rm tmp_grepregex.txt");
-								}
-								if (useperl) {
-									system("rm tmp_perlcount.pl");
+							cur = n.next();
+						}
+						map<TopologyHash, vector<long> >::iterator found=matchinglines.find(GetSpeciesTopologyHash(SimulatedTree,leafspecies));
+						if (found!=matchinglines.end()) {
+							(found->second).push_back(linenumber);
+						}
+					}
+					simtreestream.close();
+					
+					message="\nGrep match results\n\tTree\tNumber of matches";
+					PrintMessage();
+					for (int chosentreenum=0; chosentreenum<observedhashes.size(); chosentreenum++) {
+						vector<long> &treematches=matchinglines[observedhashes[chosentreenum]];
+						message="Match\t";
+						message+=chosentreenum+1;
+						message+="\t";
+						message+=int(treematches.size());
+						PrintMessage();
+						if (returnmatches) {
+							nxsstring matchfilename="matching_observed_tree_";
+							matchfilename+=chosentreenum+1;
+							matchfilename+=".tre";
+							ofstream matchout;
+							matchout.open(matchfilename.c_str(), ios::out | ios::trunc );
+							simtreestream.clear();
+							simtreestream.open(simtreefile.c_str(),ios::in);
+							linenumber=0;
+							int nextmatch=0;
+							while (nextmatch<treematches.size() && getline(simtreestream,simline)) {
+								linenumber++;
+								if (linenumber==treematches[nextmatch]) {
+									matchout<<simline<<endl;
+									nextmatch++;
 								}
 							}
+							simtreestream.close();
+							matchout.close();
+							message="\t\tSaved matches to ";
+							message+=matchfilename;
+							PrintMessage();
 						}
-				
-					
-					
-
+					}
 				}
 				break;
 				
@@ -14080,7 +14215,7 @@ void BROWNIE::RunCmdLine(bool inputfilegiven, nxsstring fn)
         return output;
     }
 
-    nxsstring BROWNIE::PipeGTP (Tree t)
+    nxsstring BROWNIE::PipeGTP (const Tree &t)
     {
         nxsstring TreeDescription="";
         cur = t.GetRoot();
@@ -14219,7 +14354,7 @@ void BROWNIE::RunCmdLine(bool inputfilegiven, nxsstring fn)
     }
 
 
-    nxsstring BROWNIE::ReturnFinalSpeciesTree (Tree t)
+    nxsstring BROWNIE::ReturnFinalSpeciesTree (const Tree &t)
     {
         nxsstring TreeDescription="";
         cur = t.GetRoot();
@@ -14636,7 +14771,7 @@ void BROWNIE::HandleVCV(NexusToken& token)
         }
         else if (token.Abbreviation("Taxset") ) {
             donenothing=false;
-            if (trees->GetNumTrees()<1) {
+            if (GetNumLoopTrees()<1) {
                 errormsg = "Error: No valid trees are loaded yet\nYou can use Gettrees to load the trees.";
                 throw XNexus (errormsg, token.GetFilePosition(), token.GetFileLine(), token.GetFileColumn() );
             }
@@ -14666,7 +14801,6 @@ IntSet::const_iterator xi;
                 message+=currenttaxonlabel.c_str();
                 message+=" \n";
             }
-            Tree t = intrees.GetIthTree(chosentree-1);
             gsl_matrix* VCVmatrix=gsl_matrix_calloc(ntaxintaxset,ntaxintaxset);
             VCVmatrix=GetVCV(chosentaxset);
 			double 	TotalVCV=0.0;
@@ -14813,407 +14947,110 @@ IntSet::const_iterator ri;
     return tipvalues;
 }
 
-//Returns a VCV matrix with columns and rows IN THE SAME ORDER AS THE TAXA IN THE TAXSET
-gsl_matrix* BROWNIE::GetVCV(nxsstring chosentaxset)
+//Returns a VCV matrix with columns and rows IN THE SAME ORDER AS THE TAXA IN THE TAXSET, with edge lengths all raised to kappa power.
+//The covariance of two taxa is the height of their MRCA above the root, and the leaves below each node are a range in t's leaf order,
+//so every pair is filled in from the node where it joins rather than by searching up the tree from each leaf.
+gsl_matrix* BROWNIE::GetVCVwithCompactTree(nxsstring chosentaxset, const CompactTree &t, double kappa)
 {
-    nxsstring currenttaxonlabel;
-    nxsstring currenttaxonlabeltaxset;
-	std::string currenttaxonlabelnodeptr;
-    int ntaxintaxset=0;
     IntSet& taxonlist = assumptions->GetTaxSet( chosentaxset );
-    IntSet& taxonlistr = assumptions->GetTaxSet( chosentaxset );
-    IntSet& taxonlistc = assumptions->GetTaxSet( chosentaxset );
     if (taxonlist.empty()) {
         errormsg= "Error: Taxset ";
         errormsg+=chosentaxset.c_str();
         errormsg+=" does not exist.\nYou can define it using the taxset command.";
         throw XNexus (errormsg );
     }
-	IntSet::const_iterator xi;
-    for( xi = taxonlist.begin(); xi != taxonlist.end(); xi++ ) {
-        ntaxintaxset++;
-        currenttaxonlabel=taxa->GetTaxonLabel(*xi);
-    }
-    Tree t = intrees.GetIthTree(chosentree-1);
+    int ntaxintaxset=taxonlist.size();
     gsl_matrix *VCV=gsl_matrix_calloc(ntaxintaxset,ntaxintaxset);
-    int rowcount=-1;
-    nxsstring rtaxon;
-    nxsstring ctaxon;
-	IntSet::const_iterator ri;
-	
-    for( ri = taxonlistr.begin(); ri != taxonlistr.end(); ri++ ) {
-        int colcount=-1;
-        rowcount++;
-        rtaxon=taxa->GetTaxonLabel(*ri);
-        nxsstring rtaxonUnderscores=blanks_to_underscores(rtaxon);
-        nxsstring rtaxonBlanks=underscores_to_blanks(rtaxon);
-        Node *rleafptr;
-        NodeIterator <Node> n (t.GetRoot());
-        Node *q = n.begin();
-        bool goodmatch=false;
-        while (q)
-        {
-            if (q->IsLeaf())
-            {
-                string qlabel;
-                qlabel=q->GetLabel();
-                //nxsstring qlabel2<<qlabel;
-                //qlabel2=blanks_to_underscores(qlabel2);
-                if (qlabel==rtaxon.c_str() || qlabel==rtaxonUnderscores.c_str() || qlabel==rtaxonBlanks.c_str()) {
-                    rleafptr=q;
-                    goodmatch=true;
-                }
-            }
-            q = n.next();
-        }
-        if (goodmatch==false) {
-            errormsg= "Error: there was trouble identifying taxon ";
-            errormsg+=rtaxon.c_str();
-            errormsg+=".\nTry removing strange characters (underscores, dashes,\nperiods, spaces, etc.) in its name. Sorry.\nPlease let me know about this error.";
-            throw XNexus (errormsg );
-        }
-		IntSet::const_iterator ci;
-        for( ci = taxonlistc.begin(); ci != taxonlistc.end(); ci++ ) {
-            colcount++;
-            ctaxon=taxa->GetTaxonLabel(*ci);
-            nxsstring ctaxonUnderscores=blanks_to_underscores(ctaxon);
-            nxsstring ctaxonBlanks=underscores_to_blanks(ctaxon);
-            Node *cleafptr;
-            NodeIterator <Node> n (t.GetRoot());
-            Node *q = n.begin();
-            bool goodmatch=false;
-            while (q)
-            {
-                if (q->IsLeaf())
-                {
-                    string qlabel;
-                    qlabel=q->GetLabel();
-					// nxsstring qlabel2<<qlabel;
-     //qlabel2=blanks_to_underscores(qlabel2);
-                    if (qlabel==ctaxon.c_str() || qlabel==ctaxonUnderscores.c_str() || qlabel==ctaxonBlanks.c_str()) {
-                        cleafptr=q;
-                        goodmatch=true;
-                    }
-                }
-                q = n.next();
-            }
-            if (goodmatch==false) {
-                errormsg= "Error: there was trouble identifying taxon ";
-                errormsg+=ctaxon.c_str();
-                errormsg+=".\nTry removing strange characters (underscores, dashes,\nperiods, spaces, etc.) in its name. Sorry.\nPlease let me know about this error.";
-                throw XNexus (errormsg );
-            }
-            float pathlength=0;
-            Node *a;
-            a=rleafptr;
-   /*         if (debugmode) {
-                cout<<"Taxa "<<rleafptr->GetLabel()<<" (rtaxon="<<rtaxon<<") and "<<cleafptr->GetLabel()<<" (ctaxon="<<ctaxon<<"): ";
-            } */
-            if (cleafptr==rleafptr) { //We need the pendant edge length
-                pathlength+=cleafptr->GetEdgeLength();
-            }
-            bool mrcanotfound=true;
- /*           if (debugmode) {
-                cout<<pathlength;
-            } */
-            while (a->GetAnc() && mrcanotfound) { //General strategy here:
-                a=a->GetAnc();
-                Node *b;
-                b=cleafptr;
-                while (b->GetAnc() && mrcanotfound) {
-                    b=b->GetAnc();
-                    if (a==b) {
-                        Node* mrca;
-                        mrca=a;
-                        mrcanotfound=false;
-                        while(mrca->GetAnc()) {
-                            pathlength+=mrca->GetEdgeLength();
-/*                            if (debugmode) {
-                                cout<<" + "<<mrca->GetEdgeLength();
-                            } */
-                            mrca=mrca->GetAnc();
-                        }
-                    }
-                }
-            }
-            gsl_matrix_set(VCV,rowcount,colcount,pathlength);
-  /*          if (debugmode) {
-                cout<<" = "<<pathlength<<endl;
-            } */
-        }
-    }
-    //matrixsingular=TestSingularity(VCV);
-    return VCV;
-}
-
-//Returns a VCV matrix with columns and rows IN THE SAME ORDER AS THE TAXA IN THE TAXSET, with edge lengths all raised to kappa power
-gsl_matrix* BROWNIE::GetVCVwithKappa(nxsstring chosentaxset,double kappa)
-{
-    nxsstring currenttaxonlabel;
-    nxsstring currenttaxonlabeltaxset;
-	std::string currenttaxonlabelnodeptr;
-    int ntaxintaxset=0;
-    IntSet& taxonlist = assumptions->GetTaxSet( chosentaxset );
-    IntSet& taxonlistr = assumptions->GetTaxSet( chosentaxset );
-    IntSet& taxonlistc = assumptions->GetTaxSet( chosentaxset );
-    if (taxonlist.empty()) {
-        errormsg= "Error: Taxset ";
-        errormsg+=chosentaxset.c_str();
-        errormsg+=" does not exist.\nYou can define it using the taxset command.";
-        throw XNexus (errormsg );
-    }
-	IntSet::const_iterator xi;
-    for( xi = taxonlist.begin(); xi != taxonlist.end(); xi++ ) {
-        ntaxintaxset++;
-        currenttaxonlabel=taxa->GetTaxonLabel(*xi);
+    vector<vector<int> > rowsatleaf(t.GetNumLeaves()); //rows of the matrix for each leaf, in leaf order
+    map<string, int> leafwithlabel; //last leaf with each label, so each taxon is looked up rather than compared against every leaf
+    for (int leafnum=0;leafnum<t.GetNumLeaves();leafnum++) {
+        leafwithlabel[t.GetLabel(t.GetLeaves()[leafnum])]=leafnum;
     }
-    Tree t = intrees.GetIthTree(chosentree-1);
-    gsl_matrix *VCV=gsl_matrix_calloc(ntaxintaxset,ntaxintaxset);
     int rowcount=-1;
-    nxsstring rtaxon;
-    nxsstring ctaxon;
 	IntSet::const_iterator ri;
-	
-    for( ri = taxonlistr.begin(); ri != taxonlistr.end(); ri++ ) {
-        int colcount=-1;
+    for( ri = taxonlist.begin(); ri != taxonlist.end(); ri++ ) {
         rowcount++;
-        rtaxon=taxa->GetTaxonLabel(*ri);
+        nxsstring rtaxon=taxa->GetTaxonLabel(*ri);
         nxsstring rtaxonUnderscores=blanks_to_underscores(rtaxon);
         nxsstring rtaxonBlanks=underscores_to_blanks(rtaxon);
-        Node *rleafptr;
-        NodeIterator <Node> n (t.GetRoot());
-        Node *q = n.begin();
-        bool goodmatch=false;
-        while (q)
-        {
-            if (q->IsLeaf())
-            {
-                string qlabel;
-                qlabel=q->GetLabel();
-                //nxsstring qlabel2<<qlabel;
-                //qlabel2=blanks_to_underscores(qlabel2);
-                if (qlabel==rtaxon.c_str() || qlabel==rtaxonUnderscores.c_str() || qlabel==rtaxonBlanks.c_str()) {
-                    rleafptr=q;
-                    goodmatch=true;
-                }
-            }
-            q = n.next();
+        int rleaf=-1; //the last leaf matching any form of the label, as when leaves were searched in order
+        map<string, int>::const_iterator found=leafwithlabel.find(rtaxon.c_str());
+        if (found!=leafwithlabel.end()) {
+            rleaf=found->second;
         }
-        if (goodmatch==false) {
-            errormsg= "Error: there was trouble identifying taxon ";
-            errormsg+=rtaxon.c_str();
-            errormsg+=".\nTry removing strange characters (underscores, dashes,\nperiods, spaces, etc.) in its name. Sorry.\nPlease let me know about this error.";
-            throw XNexus (errormsg );
-        }
-		IntSet::const_iterator ci;
-        for( ci = taxonlistc.begin(); ci != taxonlistc.end(); ci++ ) {
-            colcount++;
-            ctaxon=taxa->GetTaxonLabel(*ci);
-            nxsstring ctaxonUnderscores=blanks_to_underscores(ctaxon);
-            nxsstring ctaxonBlanks=underscores_to_blanks(ctaxon);
-            Node *cleafptr;
-            NodeIterator <Node> n (t.GetRoot());
-            Node *q = n.begin();
-            bool goodmatch=false;
-            while (q)
-            {
-                if (q->IsLeaf())
-                {
-                    string qlabel;
-                    qlabel=q->GetLabel();
-					// nxsstring qlabel2<<qlabel;
-     //qlabel2=blanks_to_underscores(qlabel2);
-                    if (qlabel==ctaxon.c_str() || qlabel==ctaxonUnderscores.c_str() || qlabel==ctaxonBlanks.c_str()) {
-                        cleafptr=q;
-                        goodmatch=true;
-                    }
-                }
-                q = n.next();
-            }
-            if (goodmatch==false) {
-                errormsg= "Error: there was trouble identifying taxon ";
-                errormsg+=ctaxon.c_str();
-                errormsg+=".\nTry removing strange characters (underscores, dashes,\nperiods, spaces, etc.) in its name. Sorry.\nPlease let me know about this error.";
-                throw XNexus (errormsg );
-            }
-            float pathlength=0;
-            Node *a;
-            a=rleafptr;
-/*            if (debugmode) {
-                cout<<"Taxa "<<rleafptr->GetLabel()<<" (rtaxon="<<rtaxon<<") and "<<cleafptr->GetLabel()<<" (ctaxon="<<ctaxon<<"): ";
-            } */
-            if (cleafptr==rleafptr) { //We need the pendant edge length
-                pathlength+=pow(cleafptr->GetEdgeLength(),kappa);
-            }
-            bool mrcanotfound=true;
-/*            if (debugmode) {
-                cout<<pathlength;
-            } */
-            while (a->GetAnc() && mrcanotfound) { //General strategy here:
-                a=a->GetAnc();
-                Node *b;
-                b=cleafptr;
-                while (b->GetAnc() && mrcanotfound) {
-                    b=b->GetAnc();
-                    if (a==b) {
-                        Node* mrca;
-                        mrca=a;
-                        mrcanotfound=false;
-                        while(mrca->GetAnc()) {
-                            pathlength+=pow(mrca->GetEdgeLength(),kappa);
-/*                            if (debugmode) {
-                                cout<<" + "<<pow(mrca->GetEdgeLength(),kappa);
-                            } */
-                            mrca=mrca->GetAnc();
-                        }
-                    }
-                }
-            }
-            gsl_matrix_set(VCV,rowcount,colcount,pathlength);
-/*            if (debugmode) {
-                cout<<" = "<<pathlength<<endl;
-            } */
+        found=leafwithlabel.find(rtaxonUnderscores.c_str());
+        if (found!=leafwithlabel.end()) {
+            rleaf=GSL_MAX(rleaf,found->second);
         }
-    }
-    //matrixsingular=TestSingularity(VCV);
-    return VCV;
-}
-
-
-//Returns a VCV matrix with columns and rows IN THE SAME ORDER AS THE TAXA IN THE TAXSET
-gsl_matrix* BROWNIE::GetVCVwithTree(nxsstring chosentaxset,Tree t)
-{
-    //SimpleLCAQuery lca;
-    //lca.SetTree (&t);
-    nxsstring currenttaxonlabel;
-    nxsstring currenttaxonlabeltaxset;
-	std::string currenttaxonlabelnodeptr;
-    int ntaxintaxset=0;
-    IntSet& taxonlist = assumptions->GetTaxSet( chosentaxset );
-    IntSet& taxonlistr = assumptions->GetTaxSet( chosentaxset );
-    IntSet& taxonlistc = assumptions->GetTaxSet( chosentaxset );
-    if (taxonlist.empty()) {
-        errormsg= "Error: Taxset ";
-        errormsg+=chosentaxset.c_str();
-        errormsg+=" does not exist.\nYou can define it using the taxset command.";
-        throw XNexus (errormsg );
-    }
-	IntSet::const_iterator xi;
-    for( xi = taxonlist.begin(); xi != taxonlist.end(); xi++ ) {
-        ntaxintaxset++;
-        currenttaxonlabel=taxa->GetTaxonLabel(*xi);
-    }
-    gsl_matrix *VCV=gsl_matrix_calloc(ntaxintaxset,ntaxintaxset);
-    int rowcount=-1;
-    nxsstring rtaxon;
-    nxsstring ctaxon;
-	IntSet::const_iterator ri;
-	
-    for( ri = taxonlistr.begin(); ri != taxonlistr.end(); ri++ ) {
-        int colcount=-1;
-        rowcount++;
-        rtaxon=taxa->GetTaxonLabel(*ri);
-        nxsstring rtaxonUnderscores=blanks_to_underscores(rtaxon);
-        nxsstring rtaxonBlanks=underscores_to_blanks(rtaxon);
-        Node *rleafptr;
-        NodeIterator <Node> n (t.GetRoot());
-        Node *q = n.begin();
-        bool goodmatch=false;
-        while (q)
-        {
-            if (q->IsLeaf())
-            {
-                string qlabel;
-                qlabel=q->GetLabel();
-                //nxsstring qlabel2<<qlabel;
-                //qlabel2=blanks_to_underscores(qlabel2);
-                if (qlabel==rtaxon.c_str() || qlabel==rtaxonUnderscores.c_str() || qlabel==rtaxonBlanks.c_str()) {
-                    rleafptr=q;
-                    goodmatch=true;
-                }
-            }
-            q = n.next();
+        found=leafwithlabel.find(rtaxonBlanks.c_str());
+        if (found!=leafwithlabel.end()) {
+            rleaf=GSL_MAX(rleaf,found->second);
         }
-        if (goodmatch==false) {
+        if (rleaf<0) {
+            gsl_matrix_free(VCV);
             errormsg= "Error: there was trouble identifying taxon ";
-            errormsg+=rtaxon.c_str();
-            errormsg+=".\nTry removing strange characters (underscores, dashes,\nperiods, spaces, etc.) in its name. Sorry.\nPlease let me know about this error.";
-            throw XNexus (errormsg );
-        }
-		IntSet::const_iterator ci;
-        for( ci = taxonlistc.begin(); ci != taxonlistc.end(); ci++ ) {
-            colcount++;
-            ctaxon=taxa->GetTaxonLabel(*ci);
-            nxsstring ctaxonUnderscores=blanks_to_underscores(ctaxon);
-            nxsstring ctaxonBlanks=underscores_to_blanks(ctaxon);
-            Node *cleafptr;
-            NodeIterator <Node> n (t.GetRoot());
-            Node *q = n.begin();
-            bool goodmatch=false;
-            while (q)
-            {
-                if (q->IsLeaf())
-                {
-                    string qlabel;
-                    qlabel=q->GetLabel();
-                    // nxsstring qlabel2<<qlabel;
-                    //qlabel2=blanks_to_underscores(qlabel2);
-                    if (qlabel==ctaxon.c_str() || qlabel==ctaxonUnderscores.c_str() || qlabel==ctaxonBlanks.c_str()) {
-                        cleafptr=q;
-                        goodmatch=true;
-                    }
-                }
-                q = n.next();
-            }
-            if (goodmatch==false) {
-                errormsg= "Error: there was trouble identifying taxon ";
-                errormsg+=ctaxon.c_str();
-                errormsg+=".\nTry removing strange characters (underscores, dashes,\nperiods, spaces, etc.) in its name. Sorry.\nPlease let me know about this error.";
-                throw XNexus (errormsg );
-            }
-            float pathlength=0;
-            Node *a;
-            a=rleafptr;
-/*            if (debugmode) {
-                cout<<"Taxa "<<rleafptr->GetLabel()<<" (rtaxon="<<rtaxon<<") and "<<cleafptr->GetLabel()<<" (ctaxon="<<ctaxon<<"): ";
-            }*/
-            if (cleafptr==rleafptr) { //We need the pendant edge length
-                pathlength+=cleafptr->GetEdgeLength();
+            errormsg+=rtaxon.c_str();
+            errormsg+=".\nTry removing strange characters (underscores, dashes,\nperiods, spaces, etc.) in its name. Sorry.\nPlease let me know about this error.";
+            throw XNexus (errormsg );
+        }
+        rowsatleaf[rleaf].push_back(rowcount);
+    }
+    vector<double> height(t.GetNumNodes(),0.0); //distance from the root, with transformed edge lengths
+    for (int node=1;node<t.GetNumNodes();node++) {
+        if (kappa==1.0) {
+            height[node]=t.GetHeight(node);
+        }
+        else {
+            height[node]=height[t.GetParent(node)]+pow(t.GetEdgeLength(node),kappa);
+        }
+    }
+    for (int leafnum=0;leafnum<t.GetNumLeaves();leafnum++) { //variances, including taxa that are on the same leaf
+        double pathlength=height[t.GetLeaves()[leafnum]];
+        for (int i=0;i<rowsatleaf[leafnum].size();i++) {
+            for (int j=0;j<rowsatleaf[leafnum].size();j++) {
+                gsl_matrix_set(VCV,rowsatleaf[leafnum][i],rowsatleaf[leafnum][j],pathlength);
             }
-            bool mrcanotfound=true;
-/*            if (debugmode) {
-                cout<<pathlength;
-            }*/
-            while (a->GetAnc() && mrcanotfound) { //General strategy here:
-                a=a->GetAnc();
-                Node *b;
-                b=cleafptr;
-                while (b->GetAnc() && mrcanotfound) {
-                    b=b->GetAnc();
-                    if (a==b) {
-                        Node* mrca;
-                        mrca=a;
-                        mrcanotfound=false;
-                        while(mrca->GetAnc()) {
-                            pathlength+=mrca->GetEdgeLength();
-/*                            if (debugmode) {
-                                cout<<" + "<<mrca->GetEdgeLength();
-                            }*/
-                            mrca=mrca->GetAnc();
+        }
+    }
+    for (int node=0;node<t.GetNumNodes();node++) { //covariances
+        double pathlength=height[node];
+        for (int ichild=t.GetFirstChild(node);ichild>=0;ichild=t.GetSibling(ichild)) {
+            for (int jchild=t.GetSibling(ichild);jchild>=0;jchild=t.GetSibling(jchild)) {
+                for (int x=t.GetFirstLeaf(ichild);x<t.GetLastLeaf(ichild);x++) {
+                    for (int y=t.GetFirstLeaf(jchild);y<t.GetLastLeaf(jchild);y++) {
+                        for (int i=0;i<rowsatleaf[x].size();i++) {
+                            for (int j=0;j<rowsatleaf[y].size();j++) {
+                                gsl_matrix_set(VCV,rowsatleaf[x][i],rowsatleaf[y][j],pathlength);
+                                gsl_matrix_set(VCV,rowsatleaf[y][j],rowsatleaf[x][i],pathlength);
+                            }
                         }
                     }
                 }
             }
-            gsl_matrix_set(VCV,rowcount,colcount,pathlength);
-/*            if (debugmode) {
-                cout<<" = "<<pathlength<<endl;
-            }*/
         }
     }
-    //matrixsingular=TestSingularity(VCV);
     return VCV;
 }
 
+//Returns a VCV matrix with columns and rows IN THE SAME ORDER AS THE TAXA IN THE TAXSET
+gsl_matrix* BROWNIE::GetVCV(nxsstring chosentaxset)
+{
+    return GetVCVwithCompactTree(chosentaxset,CompactTree(intrees.GetIthTreeRef(chosentree-1)),1.0);
+}
+
+//Returns a VCV matrix with columns and rows IN THE SAME ORDER AS THE TAXA IN THE TAXSET, with edge lengths all raised to kappa power
+gsl_matrix* BROWNIE::GetVCVwithKappa(nxsstring chosentaxset,double kappa)
+{
+    return GetVCVwithCompactTree(chosentaxset,CompactTree(intrees.GetIthTreeRef(chosentree-1)),kappa);
+}
+
+
+//Returns a VCV matrix with columns and rows IN THE SAME ORDER AS THE TAXA IN THE TAXSET
+gsl_matrix* BROWNIE::GetVCVwithTree(nxsstring chosentaxset,const Tree &t)
+{
+    return GetVCVwithCompactTree(chosentaxset,CompactTree(t),1.0);
+}
+
 //Returns for each taxon a table of start and stop times in the selected state. Assumes no more than maxstartstops/2 changes occur root to tip along tree per state
 //Actually lists stop, then corresponding start, then next stop, then next corresponding start
 gsl_matrix* BROWNIE::GetStartStopTimesforOneState(nxsstring chosentaxset, int selectedstate) {
@@ -15236,7 +15073,7 @@ gsl_matrix* BROWNIE::GetStartStopTimesforOneState(nxsstring chosentaxset, int se
         ntaxintaxset++;
         currenttaxonlabel=taxa->GetTaxonLabel(*xi);
     }
-    Tree t = intrees.GetIthTree(chosentree-1);
+    const Tree &t = intrees.GetIthTreeRef(chosentree-1);
     gsl_matrix * StartStopTimes=gsl_matrix_calloc(ntaxintaxset,maxstartstops*ntaxintaxset);
     gsl_matrix * VCV=gsl_matrix_calloc(ntaxintaxset,ntaxintaxset);
     VCV=DeleteStem(GetVCV(chosentaxset));
@@ -15317,161 +15154,97 @@ gsl_matrix* BROWNIE::GetStartStopTimesforOneState(nxsstring chosentaxset, int se
 }
 
 
-/*Returns a VCV matrix for the selected taxset for one model
-* with columns and rows IN THE SAME ORDER AS THE TAXA
-* For each edge, there is a ModelCategory vector.
-* For each ModelCategory (such as a morphological state), the corresponding
-* entry in the vector is the amount of time spent in that Category on that edge.
-*/
-gsl_matrix* BROWNIE::GetVCVforOneModel(nxsstring chosentaxset, int selectedmodel)
+//Returns a VCV matrix with columns and rows IN THE SAME ORDER AS THE TAXA IN THE TAXSET, where edgeweight (indexed by
+//the preorder numbers of lca) gives the amount each edge adds. The covariance of two taxa is the total weight of the edges from
+//the root to their MRCA, and the variance of a taxon the total weight of the edges from the root to its leaf.
+gsl_matrix* BROWNIE::GetVCVwithEdgeWeights(nxsstring chosentaxset, const RMQLCAQuery &lca, const vector<double> &edgeweight)
 {
-    nxsstring currenttaxonlabel;
-    nxsstring currenttaxonlabeltaxset;
-std::string currenttaxonlabelnodeptr;
-    int ntaxintaxset=0;
     IntSet& taxonlist = assumptions->GetTaxSet( chosentaxset );
-    IntSet& taxonlistr = assumptions->GetTaxSet( chosentaxset );
-    IntSet& taxonlistc = assumptions->GetTaxSet( chosentaxset );
     if (taxonlist.empty()) {
         errormsg= "Error: Taxset ";
         errormsg+=chosentaxset.c_str();
         errormsg+=" does not exist.\nYou can define it using the taxset command.";
         throw XNexus (errormsg );
     }
-IntSet::const_iterator xi;
-    for( xi = taxonlist.begin(); xi != taxonlist.end(); xi++ ) {
-        ntaxintaxset++;
-        currenttaxonlabel=taxa->GetTaxonLabel(*xi);
+    int ntaxintaxset=taxonlist.size();
+    vector<int> leafnode; //leaves in postorder
+    map<string, int> leafwithlabel; //position in leafnode of the last leaf with each label
+    NodeIterator <Node> n (lca.GetNode(0));
+    for (Node *q = n.begin(); q; q = n.next()) {
+        if (q->IsLeaf()) {
+            leafwithlabel[q->GetLabel()]=leafnode.size();
+            leafnode.push_back(q->GetIndex());
+        }
     }
-    Tree t = intrees.GetIthTree(chosentree-1);
-    gsl_matrix *VCV=gsl_matrix_calloc(ntaxintaxset,ntaxintaxset);
-    int rowcount=-1;
-    nxsstring rtaxon;
-    nxsstring ctaxon;
+    vector<int> taxonnode; //leaf for each row
 IntSet::const_iterator ri;
-
-    for( ri = taxonlistr.begin(); ri != taxonlistr.end(); ri++ ) {
-        int colcount=-1;
-        rowcount++;
-        rtaxon=taxa->GetTaxonLabel(*ri);
-        nxsstring rtaxonUnderscores=blanks_to_underscores(rtaxon);
-        nxsstring rtaxonBlanks=underscores_to_blanks(rtaxon);
-        Node *rleafptr;
-        NodeIterator <Node> n (t.GetRoot());
-        Node *q = n.begin();
-        bool goodmatch=false;
-        while (q)
-        {
-            if (q->IsLeaf())
-            {
-                string qlabel;
-                qlabel=q->GetLabel();
-                //nxsstring qlabel2<<qlabel;
-                //qlabel2=blanks_to_underscores(qlabel2);
-                if (qlabel==rtaxon.c_str() || qlabel==rtaxonUnderscores.c_str() || qlabel==rtaxonBlanks.c_str()) {
-                    rleafptr=q;
-                    goodmatch=true;
-                }
-            }
-            q = n.next();
-        }
-        if (goodmatch==false) {
+    for( ri = taxonlist.begin(); ri != taxonlist.end(); ri++ ) {
+        nxsstring rtaxon=taxa->GetTaxonLabel(*ri);
+        nxsstring rtaxonvariants[3];
+        rtaxonvariants[0]=rtaxon;
+        rtaxonvariants[1]=blanks_to_underscores(rtaxon);
+        rtaxonvariants[2]=underscores_to_blanks(rtaxon);
+        int rleaf=-1;
+        for (int variant=0;variant<3;variant++) {
+            map<string, int>::const_iterator found=leafwithlabel.find(rtaxonvariants[variant].c_str());
+            if (found!=leafwithlabel.end()) {
+                rleaf=GSL_MAX(rleaf,found->second);
+            }
+        }
+        if (rleaf<0) {
             errormsg= "Error: there was trouble identifying taxon ";
             errormsg+=rtaxon.c_str();
             errormsg+=".\nTry removing strange characters (underscores, dashes,\nperiods, spaces, etc.) in its name. Sorry.\nPlease let me know about this error.";
             throw XNexus (errormsg );
         }
-IntSet::const_iterator ci;
-        for( ci = taxonlistc.begin(); ci != taxonlistc.end(); ci++ ) {
-            colcount++;
-            ctaxon=taxa->GetTaxonLabel(*ci);
-            nxsstring ctaxonUnderscores=blanks_to_underscores(ctaxon);
-            nxsstring ctaxonBlanks=underscores_to_blanks(ctaxon);
-            Node *cleafptr;
-            NodeIterator <Node> n (t.GetRoot());
-            Node *q = n.begin();
-            bool goodmatch=false;
-            while (q)
-            {
-                if (q->IsLeaf())
-                {
-                    string qlabel;
-                    qlabel=q->GetLabel();
-                    // nxsstring qlabel2<<qlabel;
-                    //qlabel2=blanks_to_underscores(qlabel2);
-                    if (qlabel==ctaxon.c_str() || qlabel==ctaxonUnderscores.c_str() || qlabel==ctaxonBlanks.c_str()) {
-                        cleafptr=q;
-                        goodmatch=true;
-                    }
-                }
-                q = n.next();
-            }
-            if (goodmatch==false) {
-                errormsg= "Error: there was trouble identifying taxon ";
-                errormsg+=ctaxon.c_str();
-                errormsg+=".\nTry removing strange characters (underscores, dashes,\nperiods, spaces, etc.) in its name. Sorry.\nPlease let me know about this error.";
-                throw XNexus (errormsg );
-            }
-            double pathlength=0;
-            Node *a;
-            a=rleafptr;
-/*            if (debugmode) {
-                cout<<"Taxa "<<rleafptr->GetLabel()<<" (rtaxon="<<rtaxon<<") and "<<cleafptr->GetLabel()<<" (ctaxon="<<ctaxon<<"): ";
-            }*/
-            if (cleafptr==rleafptr) { //We need the pendant edge length
-                                      // float unweightedpathlength=cleafptr->GetEdgeLength();
-                                      //gsl_vector *modelcategoryvector;
-                                      //modelcategoryvector=gsl_vector_calloc(cleafptr->GetModelCategory());
-                vector<double> modelcategoryvector(cleafptr->GetModelCategory());
-                // if (modelcategoryvector->size==0) {
-                //     pathlength+=0;
-                //}
-                //else if(modelcategoryvector->size<(selectedmodel-1)) {
-                //			errormsg= "Error: ModelCategory vector too short for the number of submodels ";
-                //			throw XNexus (errormsg );
-                //		}
-                //		else {
-                for (int position=0;position<staterestrictionvector.size();position++) {
-                    if (staterestrictionvector[position]==selectedmodel) { //position is the called state, staterestrictionvector.at(position) gives the rate category to which that state will be assigned
-                        pathlength+=modelcategoryvector[position];
-                    }
-                }
-                }
-            bool mrcanotfound=true;
-/*            if (debugmode) {
-                cout<<pathlength;
-            }*/
-            while (a->GetAnc() && mrcanotfound) { //General strategy here:
-                a=a->GetAnc();
-                Node *b;
-                b=cleafptr;
-                while (b->GetAnc() && mrcanotfound) {
-                    b=b->GetAnc();
-                    if (a==b) {
-                        Node* mrca;
-                        mrca=a;
-                        mrcanotfound=false;
-                        while(mrca->GetAnc()) {
-                            vector<double> modelcategoryvector(mrca->GetModelCategory());
-							for (int position=0;position<staterestrictionvector.size();position++) {
-								if (staterestrictionvector[position]==selectedmodel) { //position is the called state, staterestrictionvector.at(position) gives the rate category to which that state will be assigned
-									pathlength+=modelcategoryvector[position];
-								}
-							}
-                            mrca=mrca->GetAnc();
-                        }
-                    }
-                }
-            }
-            gsl_matrix_set(VCV,rowcount,colcount,pathlength);
-/*            if (debugmode) {
-                cout<<" = "<<pathlength<<endl;
-            }*/
+        taxonnode.push_back(leafnode[rleaf]);
+    }
+    vector<double> rootpath(lca.GetNumNodes(),0.0); //weight from the root to each node; the root's own edge isn't counted
+    for (int node=1;node<lca.GetNumNodes();node++) { //preorder, so the ancestor is already done
+        rootpath[node]=rootpath[lca.GetNode(node)->GetAnc()->GetIndex()]+edgeweight[node];
+    }
+    vector<pair<int, int> > pairs;
+    pairs.reserve((ntaxintaxset*(ntaxintaxset+1))/2);
+    for (int row=0;row<ntaxintaxset;row++) {
+        for (int col=row;col<ntaxintaxset;col++) {
+            pairs.push_back(make_pair(taxonnode[row],taxonnode[col]));
+        }
+    }
+    vector<int> mrca;
+    lca.LCA(pairs,mrca);
+    gsl_matrix *VCV=gsl_matrix_calloc(ntaxintaxset,ntaxintaxset);
+    int paircount=0;
+    for (int row=0;row<ntaxintaxset;row++) {
+        for (int col=row;col<ntaxintaxset;col++) {
+            double pathlength=rootpath[mrca[paircount]];
+            gsl_matrix_set(VCV,row,col,pathlength);
+            gsl_matrix_set(VCV,col,row,pathlength);
+            paircount++;
+        }
+    }
+    return VCV;
+}
+
+/*Returns a VCV matrix for the selected taxset for one model
+* with columns and rows IN THE SAME ORDER AS THE TAXA
+* For each edge, there is a ModelCategory vector.
+* For each ModelCategory (such as a morphological state), the corresponding
+* entry in the vector is the amount of time spent in that Category on that edge.
+*/
+gsl_matrix* BROWNIE::GetVCVforOneModel(nxsstring chosentaxset, int selectedmodel)
+{
+    RMQLCAQuery lca(&intrees.GetIthTreeRef(chosentree-1));
+    vector<double> edgeweight(lca.GetNumNodes(),0.0);
+    for (int node=1;node<lca.GetNumNodes();node++) {
+        vector<double> modelcategoryvector(lca.GetNode(node)->GetModelCategory());
+        for (int position=0;position<staterestrictionvector.size();position++) {
+            if (staterestrictionvector[position]==selectedmodel) { //position is the called state, staterestrictionvector.at(position) gives the rate category to which that state will be assigned
+                edgeweight[node]+=modelcategoryvector[position];
             }
         }
-//matrixsingular=TestSingularity(VCV);
-return VCV;
     }
+    return GetVCVwithEdgeWeights(chosentaxset,lca,edgeweight);
+}
 
 
 /*Returns a VCV matrix for the selected taxset for one model
@@ -15484,178 +15257,26 @@ return VCV;
 */
 gsl_matrix* BROWNIE::GetVCVforChangeNoChange(nxsstring chosentaxset, bool wantchangeedges)
 {
-    nxsstring currenttaxonlabel;
-    nxsstring currenttaxonlabeltaxset;
-std::string currenttaxonlabelnodeptr;
-    int ntaxintaxset=0;
-    IntSet& taxonlist = assumptions->GetTaxSet( chosentaxset );
-    IntSet& taxonlistr = assumptions->GetTaxSet( chosentaxset );
-    IntSet& taxonlistc = assumptions->GetTaxSet( chosentaxset );
-    if (taxonlist.empty()) {
-        errormsg= "Error: Taxset ";
-        errormsg+=chosentaxset.c_str();
-        errormsg+=" does not exist.\nYou can define it using the taxset command.";
-        throw XNexus (errormsg );
-    }
-IntSet::const_iterator xi;
-    for( xi = taxonlist.begin(); xi != taxonlist.end(); xi++ ) {
-        ntaxintaxset++;
-        currenttaxonlabel=taxa->GetTaxonLabel(*xi);
-    }
-    Tree t = intrees.GetIthTree(chosentree-1);
-    gsl_matrix *VCV=gsl_matrix_calloc(ntaxintaxset,ntaxintaxset);
-    int rowcount=-1;
-    nxsstring rtaxon;
-    nxsstring ctaxon;
-IntSet::const_iterator ri;
-
-    for( ri = taxonlistr.begin(); ri != taxonlistr.end(); ri++ ) {
-        int colcount=-1;
-        rowcount++;
-        rtaxon=taxa->GetTaxonLabel(*ri);
-        nxsstring rtaxonUnderscores=blanks_to_underscores(rtaxon);
-        nxsstring rtaxonBlanks=underscores_to_blanks(rtaxon);
-        Node *rleafptr;
-        NodeIterator <Node> n (t.GetRoot());
-        Node *q = n.begin();
-        bool goodmatch=false;
-        while (q)
-        {
-            if (q->IsLeaf())
-            {
-                string qlabel;
-                qlabel=q->GetLabel();
-                //nxsstring qlabel2<<qlabel;
-                //qlabel2=blanks_to_underscores(qlabel2);
-                if (qlabel==rtaxon.c_str() || qlabel==rtaxonUnderscores.c_str() || qlabel==rtaxonBlanks.c_str()) {
-                    rleafptr=q;
-                    goodmatch=true;
-                }
+    RMQLCAQuery lca(&intrees.GetIthTreeRef(chosentree-1));
+    vector<double> edgeweight(lca.GetNumNodes(),0.0);
+    for (int node=1;node<lca.GetNumNodes();node++) {
+        vector<double> modelcategoryvector(lca.GetNode(node)->GetModelCategory());
+        int numberofnonzeroentries=0;
+        double temppathlength=0;
+        for (int modelcat=0;modelcat<modelcategoryvector.size();modelcat++) {
+            if (modelcategoryvector[modelcat]>0) {
+                temppathlength+=modelcategoryvector[modelcat];
+                numberofnonzeroentries++;
             }
-            q = n.next();
         }
-        if (goodmatch==false) {
-            errormsg= "Error: there was trouble identifying taxon ";
-            errormsg+=rtaxon.c_str();
-            errormsg+=".\nTry removing strange characters (underscores, dashes,\nperiods, spaces, etc.) in its name. Sorry.\nPlease let me know about this error.";
-            throw XNexus (errormsg );
+        if (wantchangeedges && (numberofnonzeroentries>1)) {
+            edgeweight[node]=temppathlength;
         }
-IntSet::const_iterator ci;
-        for( ci = taxonlistc.begin(); ci != taxonlistc.end(); ci++ ) {
-            colcount++;
-            ctaxon=taxa->GetTaxonLabel(*ci);
-            nxsstring ctaxonUnderscores=blanks_to_underscores(ctaxon);
-            nxsstring ctaxonBlanks=underscores_to_blanks(ctaxon);
-            Node *cleafptr;
-            NodeIterator <Node> n (t.GetRoot());
-            Node *q = n.begin();
-            bool goodmatch=false;
-            while (q)
-            {
-                if (q->IsLeaf())
-                {
-                    string qlabel;
-                    qlabel=q->GetLabel();
-                    // nxsstring qlabel2<<qlabel;
-                    //qlabel2=blanks_to_underscores(qlabel2);
-                    if (qlabel==ctaxon.c_str() || qlabel==ctaxonUnderscores.c_str() || qlabel==ctaxonBlanks.c_str()) {
-                        cleafptr=q;
-                        goodmatch=true;
-                    }
-                }
-                q = n.next();
-            }
-            if (goodmatch==false) {
-                errormsg= "Error: there was trouble identifying taxon ";
-                errormsg+=ctaxon.c_str();
-                errormsg+=".\nTry removing strange characters (underscores, dashes,\nperiods, spaces, etc.) in its name. Sorry.\nPlease let me know about this error.";
-                throw XNexus (errormsg );
-            }
-            double pathlength=0;
-            Node *a;
-            a=rleafptr;
-/*            if (debugmode) {
-                cout<<"Taxa "<<rleafptr->GetLabel()<<" (rtaxon="<<rtaxon<<") and "<<cleafptr->GetLabel()<<" (ctaxon="<<ctaxon<<"): ";
-            }*/
-            if (cleafptr==rleafptr) { //We need the pendant edge length
-                                      // float unweightedpathlength=cleafptr->GetEdgeLength();
-                                      //gsl_vector *modelcategoryvector;
-                                      //modelcategoryvector=gsl_vector_calloc(cleafptr->GetModelCategory());
-                vector<double> modelcategoryvector(cleafptr->GetModelCategory());
-                // if (modelcategoryvector->size==0) {
-                //     pathlength+=0;
-                //}
-                //else if(modelcategoryvector->size<(selectedmodel-1)) {
-                //			errormsg= "Error: ModelCategory vector too short for the number of submodels ";
-                //			throw XNexus (errormsg );
-                //		}
-                //		else {
-                int numberofnonzeroentries=0;
-                double temppathlength=0;
-                for (int modelcat=0;modelcat<modelcategoryvector.size();modelcat++) {
-                    if (modelcategoryvector[modelcat]>0) {
-                        temppathlength+=modelcategoryvector[modelcat];
-                        numberofnonzeroentries++;
-                    }
-                }
-                if (wantchangeedges && (numberofnonzeroentries>1)) {
-                    pathlength+=temppathlength;
-                }
-                if (!wantchangeedges && (numberofnonzeroentries<2)) {
-                    pathlength+=temppathlength;
-                }
-
-                //		}
-            }
-            bool mrcanotfound=true;
-/*            if (debugmode) {
-                cout<<pathlength;
-            }*/
-            while (a->GetAnc() && mrcanotfound) { //General strategy here:
-                a=a->GetAnc();
-                Node *b;
-                b=cleafptr;
-                while (b->GetAnc() && mrcanotfound) {
-                    b=b->GetAnc();
-                    if (a==b) {
-                        Node* mrca;
-                        mrca=a;
-                        mrcanotfound=false;
-                        while(mrca->GetAnc()) {
-                            vector<double> modelcategoryvector(mrca->GetModelCategory());
-                            int numberofnonzeroentries=0;
-                            double temppathlength=0;
-                            for (int modelcat=0;modelcat<modelcategoryvector.size();modelcat++) {
-                                if (modelcategoryvector[modelcat]>0) {
-                                    temppathlength+=modelcategoryvector[modelcat];
-                                    numberofnonzeroentries++;
-                                }
-                            }
-                            if (wantchangeedges && (numberofnonzeroentries>1)) {
-                                pathlength+=temppathlength;
-/*                                if (debugmode) {
-                                    cout<<" + "<<temppathlength;
-                                }*/
-                            }
-                            if (!wantchangeedges && (numberofnonzeroentries<2)) {
-                                pathlength+=temppathlength;
-/*                                if (debugmode) {
-                                    cout<<" + "<<temppathlength;
-                                }*/
-                            }
-                            mrca=mrca->GetAnc();
-                        }
-                    }
-                }
-            }
-            gsl_matrix_set(VCV,rowcount,colcount,pathlength);
-/*            if (debugmode) {
-                cout<<" = "<<pathlength<<endl;
-            }*/
+        if (!wantchangeedges && (numberofnonzeroentries<2)) {
+            edgeweight[node]=temppathlength;
         }
     }
-//matrixsingular=TestSingularity(VCV);
-return VCV;
+    return GetVCVwithEdgeWeights(chosentaxset,lca,edgeweight);
 }
 
 void BROWNIE::PrintMatrix(gsl_matrix *VCV)
@@ -15875,7 +15496,7 @@ void BROWNIE::HandleDebugOptimization( NexusToken& token )
         }
         else if (token.Abbreviation("TAxset") ) {
             //adequateinput=true;
-            if (trees->GetNumTrees()<1) {
+            if (GetNumLoopTrees()<1) {
                 errormsg = "Error: No valid trees are loaded.";
                 throw XNexus (errormsg, token.GetFilePosition(), token.GetFileLine(), token.GetFileColumn() );
             }
@@ -15938,7 +15559,7 @@ void BROWNIE::HandleDebugOptimization( NexusToken& token )
         int originalchosenchar=chosenchar;
         if (treeloop) {
             starttree=1;
-            stoptree=trees->GetNumTrees();
+            stoptree=GetNumLoopTrees();
         }
         else {
             starttree=chosentree;
@@ -15967,8 +15588,8 @@ void BROWNIE::HandleDebugOptimization( NexusToken& token )
 			
 		}
         for (chosentree=starttree;chosentree<=stoptree;chosentree++) {
-			double treeweight=trees->GetTreeWeight(chosentree-1);
-			nxsstring treename=trees->GetTreeName(chosentree-1);
+			double treeweight=GetLoopTreeWeight(chosentree-1);
+			nxsstring treename=GetLoopTreeName(chosentree-1);
 			for (chosenchar=startchar;chosenchar<=stopchar;chosenchar++) {
 				if (tablef_open) {
 				//	tmessage="\n";
@@ -16510,8 +16131,7 @@ void BROWNIE::HandleDebugOptimization( NexusToken& token )
 						gsl_vector_free(optimalvalues);
 					}
 					if (chosenmodel==14) {
-						Tree t = intrees.GetIthTree(chosentree-1);
-						double MaxRootTipLength=t.GetMaxPathLength();
+						double MaxRootTipLength=intrees.GetIthTreeRef(chosentree-1).GetMaxPathLength();
 						if (debugmode) {
 							cout<<"MaxRootTipLength = "<<MaxRootTipLength<<endl;
 						}
@@ -19219,7 +18839,8 @@ NodePtr BROWNIE::EstimateMLDiscreteCharJointAncestralStates(gsl_matrix * RateMat
 
 	map<Node*, vector<vector<int> > > Cvector; // gives C vector, as in Pupko et al algorithm
 	//Tree T=intrees.GetIthTree(chosentree-1);
-	Tree *Tptr=&(intrees.Trees[chosentree-1]);
+	Tree *Tptr=&(intrees.GetIthTreeForEdit(chosentree-1));
+	ClearGeneTreeCaches();
 	(*Tptr).Update();
 	(*Tptr).GetNodeDepths();
 	//(*Tptr).Draw(cout);
@@ -20040,18 +19661,28 @@ double BROWNIE::CalculateDiscreteCharLnL(gsl_matrix * RateMatrix, gsl_vector * a
 		startingdiscretechosenchar=0;
 		endingdiscretechosenchar=discretecharacters->GetNChar();
 	}
+	CompactTree CompactT(intrees.GetIthTreeRef(chosentree-1)); //the tree, leaf taxa, and transition probabilities on each edge are the same for every character
+	vector<int> leaftaxon(CompactT.GetNumLeaves());
+	for (int leafnum=0;leafnum<CompactT.GetNumLeaves();leafnum++) {
+		leaftaxon[leafnum]=taxa->FindTaxon(CompactT.GetLabel(CompactT.GetLeaves()[leafnum]));
+	}
+	vector<gsl_matrix *> Pmatrices(CompactT.GetNumNodes(),(gsl_matrix *)NULL);
+	for (int node=0;node<CompactT.GetNumNodes();node++) {
+		if (node!=CompactT.GetRoot()) {
+			Pmatrices[node]=ComputeTransitionProbBuiltInFn(RateMatrix,CompactT.GetEdgeLength(node));
+		}
+	}
+	const vector<int> &postorder=CompactT.GetPostorder(); //Goes from tips down
 	int olddiscretechosenchar=discretechosenchar;
 	for (discretechosenchar=startingdiscretechosenchar;discretechosenchar<endingdiscretechosenchar;discretechosenchar++) {
 		if ((discretecharacters->GetObsNumStates(discretechosenchar))>1 || variablecharonly==false) { //so, ignore invariant characters if variablecharonly==true
 			Superdouble L=0;
-			map<Node*, vector<Superdouble> > stateprobatnodes;
-			Tree T=intrees.GetIthTree(chosentree-1);
-			NodeIterator <Node> n (T.GetRoot()); //Goes from tips down
-			NodePtr currentnode = n.begin();
-			while (currentnode)
+			vector<vector<Superdouble> > stateprobatnodes(CompactT.GetNumNodes());
+			for (int nodeindex=0;nodeindex<postorder.size();nodeindex++)
 			{
-				if (currentnode->IsLeaf() ) {
-					int statenumber=discretecharacters->GetInternalRepresentation(taxa->FindTaxon(currentnode->GetLabel()),discretechosenchar); //NOTE: for discrete chars, the number starts at 0
+				int currentnode=postorder[nodeindex];
+				if (CompactT.IsLeaf(currentnode) ) {
+					int statenumber=discretecharacters->GetInternalRepresentation(leaftaxon[CompactT.GetLeafNumber(currentnode)],discretechosenchar); //NOTE: for discrete chars, the number starts at 0
 					for(int j=0;j<ancestralstatevector->size;j++) {
 						Superdouble probofstatej=0; //do all in straight prob, then convert to ln L
 						if (j==statenumber) {
@@ -20067,68 +19698,39 @@ double BROWNIE::CalculateDiscreteCharLnL(gsl_matrix * RateMatrix, gsl_vector * a
 				}
 				else { //must be an internal node, including the root
 					for(int i=0;i<ancestralstatevector->size;i++) { //do this for each possible state at the current node
-						NodePtr descnode=currentnode->GetChild();
+						int descnode=CompactT.GetFirstChild(currentnode);
 						Superdouble probofstatei=1;
-						while (descnode!=NULL) { 
-							gsl_matrix * Pmatrix=ComputeTransitionProbBuiltInFn(RateMatrix,descnode->GetEdgeLength());
+						while (descnode>=0) { 
+							gsl_matrix * Pmatrix=Pmatrices[descnode];
 							Superdouble probofthissubtree=0;
-/*							if (debugmode) {
-								Tree PrunedTree;
-								PrunedTree.SetRoot((intrees.GetIthTree(chosentree-1)).CopyOfSubtree(descnode));
-								cout<<endl;
-								PrunedTree.Write(cout);
-							}*/
 							for(int j=0;j<ancestralstatevector->size;j++) {
 								Superdouble transitionprob=gsl_matrix_get(Pmatrix,i,j);
 								probofthissubtree+=transitionprob*((stateprobatnodes[descnode])[j]); //Prob of going from i to j on desc branch times the prob of the subtree with root state j
 								if (debugmode) {
 									cout<<"CalculateDiscreteCharLnL: j = "<<j<<", probofthissubtree = "<<probofthissubtree.getMantissa()<<" x 10^"<<probofthissubtree.getExponent()<<", -ln(probofthissubtree) = "<<-1.0*probofthissubtree.getLn()<<endl<<endl;
 								}
-
-							/*	if (debugmode) {
-									cout<<"From "<<i<<" to "<<j<<" has move prob "<<gsl_matrix_get(Pmatrix,i,j)<<" and input subtree prob "<<((stateprobatnodes[descnode])[j])<<" product "<<transitionprob*((stateprobatnodes[descnode])[j])<<" and cumulative prob "<<probofthissubtree<<endl;
-								} */
 							}
 							probofstatei*=probofthissubtree;
-							descnode=descnode->GetSibling(); //we're going to look at all descendant subtrees (even in case of polytomies)
-							gsl_matrix_free(Pmatrix);
+							descnode=CompactT.GetSibling(descnode); //we're going to look at all descendant subtrees (even in case of polytomies)
 						}
 						(stateprobatnodes[currentnode]).push_back(probofstatei);
-
-				/*		if (debugmode) {
-							cout<<"CalculateDiscreteCharLnL: i = "<<i<<", probofstatei = "<<probofstatei<<", -ln(probofstatei) = "<<-1.0*probofstatei.getLn()<<endl<<endl;
-						} */
 					}
 				}
-		/*		if (debugmode) {
-					Superdouble totalprob=0;
-					cout<<"(stateprobatnodes[currentnode])[i] ";
-					for(int i=0;i<ancestralstatevector->size;i++) {
-						cout<<"state "<<i<<" "<<(stateprobatnodes[currentnode])[i]<<" [totalprob is "<<totalprob<<"], ";
-						totalprob+=(stateprobatnodes[currentnode])[i];
-					}
-					cout<<" mantissa="<<totalprob.getMantissa()<<"total = "<<totalprob<<endl;
-					//assert(totalprob.getMantissa()>0);
-				} */
-				currentnode = n.next();
-				
 			}
 	//now, finish up by getting the weighted sum at the root
 			for (int i=0;i<ancestralstatevector->size;i++) {
 				Superdouble ancestralprob=gsl_vector_get(ancestralstatevector,i);
-				L+=ancestralprob*((stateprobatnodes[T.GetRoot()])[i]);
+				L+=ancestralprob*((stateprobatnodes[CompactT.GetRoot()])[i]);
 			}
 			if (variablecharonly) {
 				L=L/Superdouble(1.0-Prob); //after equation 3 in Lewis 2001 and equation 8 in Felsenstein 1992
 			}		
-/*			if (debugmode) {
-				cout<<"CalculateDiscreteCharLnL: original ("<<neglnL<<" * -1.0*log(L) [L="<<L<<"] = ";
-			}  */
 			neglnL+=-1.0*L.getLn();
-/*			if (debugmode) {
-				cout<<neglnL<<endl;
-			} */
-			
+		}
+	}
+	for (int node=0;node<Pmatrices.size();node++) {
+		if (Pmatrices[node]!=NULL) {
+			gsl_matrix_free(Pmatrices[node]);
 		}
 	}
 	discretechosenchar=olddiscretechosenchar;
@@ -20175,7 +19777,7 @@ double BROWNIE::CalculateDiscreteCharLnLHetero(gsl_matrix * RateMatrixHetero, gs
 		if ((discretecharacters->GetObsNumStates(discretechosenchar))>1 || variablecharonly==false) { //so, ignore invariant characters if variablecharonly==true
 			Superdouble L=0;
 			map<Node*, vector<Superdouble> > stateprobatnodes;
-			Tree T=intrees.GetIthTree(chosentree-1);
+			const Tree &T=intrees.GetIthTreeRef(chosentree-1);
 			NodeIterator <Node> n (T.GetRoot()); //Goes from tips down
 			NodePtr currentnode = n.begin();
 			while (currentnode)
@@ -20361,15 +19963,21 @@ double BROWNIE::CalculateDiscreteCharLnLHetero(gsl_matrix * RateMatrixHetero, gs
 double BROWNIE::CalculateDiscreteCharProbAllConstant(gsl_matrix * RateMatrix, gsl_vector * ancestralstatevector)
 {
 	double Prob=0;
+	CompactTree CompactT(intrees.GetIthTreeRef(chosentree-1));
+	vector<gsl_matrix *> Pmatrices(CompactT.GetNumNodes(),(gsl_matrix *)NULL);
+	for (int node=0;node<CompactT.GetNumNodes();node++) {
+		if (node!=CompactT.GetRoot()) {
+			Pmatrices[node]=ComputeTransitionProbBuiltInFn(RateMatrix,CompactT.GetEdgeLength(node));
+		}
+	}
+	const vector<int> &postorder=CompactT.GetPostorder(); //Goes from tips down
 	for (int tipstate=0;  tipstate<localnumbercharstates; tipstate++) { //we loop over all possible tip states
 		double L=0;
-		map<Node*, vector<double> > stateprobatnodes;
-		Tree T=intrees.GetIthTree(chosentree-1);
-		NodeIterator <Node> n (T.GetRoot()); //Goes from tips down
-		NodePtr currentnode = n.begin();
-		while (currentnode)
+		vector<vector<double> > stateprobatnodes(CompactT.GetNumNodes());
+		for (int nodeindex=0;nodeindex<postorder.size();nodeindex++)
 		{
-			if (currentnode->IsLeaf() ) {
+			int currentnode=postorder[nodeindex];
+			if (CompactT.IsLeaf(currentnode) ) {
 				int statenumber=tipstate; //we force all tips to have the same state
 				for(int j=0;j<ancestralstatevector->size;j++) {
 					double probofstatej=0; //do all in straight prob, then convert to ln L
@@ -20381,29 +19989,32 @@ double BROWNIE::CalculateDiscreteCharProbAllConstant(gsl_matrix * RateMatrix, gs
 			}
 			else { //must be an internal node, including the root
 				for(int i=0;i<ancestralstatevector->size;i++) { //do this for each possible state at the current node
-					NodePtr descnode=currentnode->GetChild();
+					int descnode=CompactT.GetFirstChild(currentnode);
 					double probofstatei=1;
-					while (descnode!=NULL) { 
-						gsl_matrix * Pmatrix=ComputeTransitionProbBuiltInFn(RateMatrix,descnode->GetEdgeLength());
+					while (descnode>=0) { 
+						gsl_matrix * Pmatrix=Pmatrices[descnode];
 						double probofthissubtree=0;
 						for(int j=0;j<ancestralstatevector->size;j++) {
 							probofthissubtree+=(gsl_matrix_get(Pmatrix,i,j))*((stateprobatnodes[descnode])[j]); //Prob of going from i to j on desc branch times the prob of the subtree with root state j
 						}
 						probofstatei*=probofthissubtree;
-						descnode=descnode->GetSibling(); //we're going to look at all descendant subtrees (even in case of polytomies)
-						gsl_matrix_free(Pmatrix);
+						descnode=CompactT.GetSibling(descnode); //we're going to look at all descendant subtrees (even in case of polytomies)
 					}
 					(stateprobatnodes[currentnode]).push_back(probofstatei);
 				}
 			}
-			currentnode = n.next();
 		}
 	//now, finish up by getting the weighted sum at the root
 		for (int i=0;i<ancestralstatevector->size;i++) {
-			L+=(gsl_vector_get(ancestralstatevector,i))*((stateprobatnodes[T.GetRoot()])[i]);
+			L+=(gsl_vector_get(ancestralstatevector,i))*((stateprobatnodes[CompactT.GetRoot()])[i]);
 		}
 		Prob+=L;
 	}
+	for (int node=0;node<Pmatrices.size();node++) {
+		if (Pmatrices[node]!=NULL) {
+			gsl_matrix_free(Pmatrices[node]);
+		}
+	}
 	return Prob;
 }
 
@@ -20450,7 +20061,7 @@ double BROWNIE::CalculateDiscreteLindy2(double rateA, double rateB)
 		for (int currentchar=1;currentchar<=nchartotal;currentchar++) {
 			//cout<<"rateA is "<<rateA<<endl;
 			map<Node*, vector<double> > stateprobatnodes;
-			Tree T=intrees.GetIthTree(chosentree-1);
+			const Tree &T=intrees.GetIthTreeRef(chosentree-1);
 			PreorderIterator <Node> n (T.GetRoot());
 			NodePtr currentnode = n.begin();
 			vector<double> ancstatevec;
@@ -20663,8 +20274,9 @@ void BROWNIE::HandleTimeSlice( NexusToken& token )
         		adequateinput=true;
 				//adequateinput=true;
 				int originalchosentree=chosentree;
-				for (chosentree = 1; chosentree <= trees->GetNumTrees(); chosentree++) {
-					Tree *Tptr=&(intrees.Trees[chosentree-1]);
+				for (chosentree = 1; chosentree <= GetNumLoopTrees(); chosentree++) {
+					Tree *Tptr=&(intrees.GetIthTreeForEdit(chosentree-1));
+					ClearGeneTreeCaches();
 					(*Tptr).SetPathLengths();
 					double MaxLength=(*Tptr).GetMaxPathLength();
 					//cout<<"MaxPathLength = "<<MaxLength<<endl;
@@ -20839,8 +20451,9 @@ void BROWNIE::HandleSpeciationTransform( NexusToken& token )
         if( token.Equals(";") ) {
         	if (donenothing) {
 				int originalchosentree=chosentree;
-				for (chosentree = 1; chosentree <= trees->GetNumTrees(); chosentree++) {
-					Tree *Tptr=&(intrees.Trees[chosentree-1]);
+				for (chosentree = 1; chosentree <= GetNumLoopTrees(); chosentree++) {
+					Tree *Tptr=&(intrees.GetIthTreeForEdit(chosentree-1));
+					ClearGeneTreeCaches();
 					(*Tptr).SetPathLengths();
 					NodeIterator <Node> n ((*Tptr).GetRoot());
 					Node *q = n.begin();
@@ -7,12 +7,20 @@
 #define maxModelCategoryStates         10
 #define BROWNIE_EPSILON 0.00001
 #define BROWNIE_MAXLIKELIHOOD 1000000000 //Big but not big enough to blow up numerical optimization (I think).
+#define BROWNIE_CHECKPOINT_MAGIC "BRCKPT\x01"
+#define BROWNIE_CHECKPOINT_VERSION 2
 #include <gsl/gsl_math.h>
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_block.h>
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_matrix.h>
 #include "containingtree.h"
+#include "compacttree.h"
+#include "tripletindex.h"
+#include "coalprob.h"
+#include "coalsim.h"
+#include "gtpscore.h"
+#include "quartetindex.h"
 #include "charactersblock2.h"
 
 
@@ -44,6 +52,11 @@ public:
 	int minsamplesperspecies;
 	int maxstartstops;
 	int rearrlimit;
+	int sprbatch; //number of SPR rearrangements made and scored at once in a heuristic search
+	double maxtime; //seconds of wall-clock time a heuristic search may run before stopping with the best trees so far; 0 for no limit
+	nxsstring checkpointfilename; //file to save the state of a heuristic search to, so it can be resumed; empty for none
+	double checkpointinterval; //seconds between checkpoints during a replicate
+	bool resumesearch; //start a heuristic search from checkpointfilename, if it holds a checkpoint
     bool steepest;
 	bool exhaustive;
     bool status;
@@ -107,6 +120,10 @@ public:
     int randomstarts;
 	nxsstring treefilename;
 	bool useCOAL;
+	CoalescentProbability coalprobs; //gene trees, and their probabilities on species trees already tried, for scoring with useCOAL
+	GeneTreeParsimony gtpscorer; //gene trees stored for counting duplications
+	vector<int> gtpgenetrees; //input tree each tree in gtpscorer stands for
+	vector<int> genetreerepresentative; //for each input tree, the first input tree with the same topology (see GroupIdenticalGeneTrees)
 	bool useMS;
 	int msbasereps;
 	int contourBrlenToExport;
@@ -118,7 +135,7 @@ public:
 	double markedmultiplier;
 	double brlensigma;
 	int numbrlenadjustments;
-	map< vector<int>, int> quartetcounts;
+	QuartetIndex QuartetCounts; //number of times each quartet occurs on the input trees
 	map< vector<int>, int> qualifiedquartets;
 	vector<int> quartetspertaxon;
     double stepsize;
@@ -152,11 +169,10 @@ public:
     int progressbarprinted;
 	gsl_matrix *TaxonDistance; //used for taxon-taxon distances, measured in terms of triplets
 	gsl_matrix *TaxonProportDistance;
-	map<nxsstring,int> TripletCounts; //If triplet is (5,3),6, the triplet string is 3_5_6 (first two digits are the closest pair, ordered with the smaller first). If (6,5),3, the string is 5_6_3
-	map<nxsstring,int> TripleCounts; //List of number of times each triple (set of three taxa, regardless of topology) appears: this may different for different sets of taxa, due to some taxa being missing from some treees 
+	TripletIndex TripletCounts; //Number of times each triplet, such as (5,3),6, appears; the number of times each triple (set of three taxa, regardless of topology) appears is the sum over its three triplets: this may different for different sets of taxa, due to some taxa being missing from some treees
+	double tripletmemorylimit; //in MB: above this, triplet counts are kept only for triples that are seen
 	ContainingTree ComputeTripletNJTree();
 	virtual void InitializeQuartetCounts();
-	vector<nxsstring> ReturnClade(Tree *T, nxsstring a, nxsstring b, nxsstring c);
 	virtual void DoNast();
 	virtual void HandleNast(NexusToken&);
 	double npercent;
@@ -167,8 +183,11 @@ public:
     bool showtries;
     vector<ContainingTree> RawBestTrees; //Contains all the best trees with just species labels; cleared every time a better tree is found
     vector<ContainingTree> FormattedBestTrees; //Uses samples as labels. Is useful as this way you don't have to remember the convertsamplestospecies for each best tree
-	vector<nxsstring> ContourSearchDescription; //Stores a tree description and tab-delimited file with branch lengths and likelihood scores
-	vector<vector <double> > ContourSearchVector;
+    set<vector<unsigned long long> > FormattedBestTopologies; //topology keys (see CompactTree::GetTopologyKey) of the fully resolved trees in FormattedBestTrees; cleared along with it
+    vector<int> UnresolvedFormattedBestTrees; //positions in FormattedBestTrees of trees with polytomies, which still need a triplet comparison
+	vector<nxsstring> ContourSearchTables; //file holding the contour grid of each stored best tree, written as a tab-delimited table of likelihood scores and branch lengths with the tree
+	nxsstring ContourSearchFile; //rows of the last contour grid, written as they are found: branch lengths, then the score less that of the best point
+	long ContourSearchRows; //number of rows in ContourSearchFile
 	vector<ContainingTree> BestBranchlengthTreeForThisNextTree; //For optimizing branch lengths
     double bestscore;
 	double bestscorelocal;
@@ -200,9 +219,15 @@ public:
 	double browniesafe_gsl_sf_exp(double x);
     void PreOrderTraversal( NexusToken& token);
     double GetTripletScore(ContainingTree *SpeciesTreePtr);
+    double GetTripletScoreForSpecies(int i, double totalscore);
 	void GetTaxonTaxonTripletDistances();
     vector<int> GetTripletOverlap(ContainingTree *t1, ContainingTree *t2, int taxaincommon);
+    bool GetTripletOverlap(QTComparison &comparison, ContainingTree *t2, vector<int> &tripletoverlapoutput);
 	void DelDupes();
+	void WriteSearchCheckpoint(int replicate, ContainingTree *RepTree, const vector<double> &localscorevector, int movecount, const vector<int> &moveflags); //RepTree is the tree reached within replicate, or NULL between replicates
+	bool ReadSearchCheckpoint(int &replicate, bool &inreplicate, ContainingTree &RepTree, vector<int> &assignment, double &localscore, vector<double> &localscorevector, int &movecount, vector<int> &moveflags);
+	bool IsNewBestTopology(ContainingTree &FormattedTree, vector<unsigned long long> &topologykey);
+	void RecordBestTopology(const vector<unsigned long long> &topologykey);
 	void HandleAccuracy( NexusToken& token );
 	void ComputeAccuracy();
 	void HandlePartitionedEdgeSupport ( NexusToken& token);
@@ -285,7 +310,7 @@ public:
     void HandleGrepCount(NexusToken& token);
 	virtual nxsstring PipeLeafGTP ();
 	virtual nxsstring PipeLeafSpeciesTree ();
-	virtual nxsstring PipeGTP (Tree intree);
+	virtual nxsstring PipeGTP (const Tree &intree);
 	virtual nxsstring PipeSpeciesTree (ContainingTree *SpeciesTreePtr);
 	virtual nxsstring PipeEndOfTreeGTP ();
 	virtual nxsstring PipeEndOfTreeSpeciesTree ();	
@@ -293,13 +318,16 @@ public:
 	virtual nxsstring PipeRightParenthesis();
 	virtual nxsstring PipeSiblingSymbol();
 	virtual nxsstring PipeInternal();
-        virtual nxsstring ReturnFinalSpeciesTree (Tree t);
+        virtual nxsstring ReturnFinalSpeciesTree (const Tree &t);
         virtual int PruneToOverlappingLeaves(ContainingTree *t1, ContainingTree *t2);
         virtual int PrepareTreesForTriplet(ContainingTree *t1, ContainingTree *t2);
         virtual void HandleCompareRandomTrees(NexusToken& token);
         virtual nxsstring PipeLeafFinalSpeciesTree();
         virtual vector<ContainingTree> MakePrettyForOutput();
         virtual void FormatAndStoreBestTree(ContainingTree *NewBestTree,vector<double> scorevector);
+        void WriteContourTable(ostream &out, const nxsstring &tablefile);
+        nxsstring ContourTableFileName(int tablenumber);
+        void ClearContourSearchTables();
         int badgtpcount;
         vector<vector<double> > CDFvector;
         vector<vector<int> > CladeVector;
@@ -316,9 +344,29 @@ public:
 		virtual bool CheckConvertSamplesToSpeciesTooManySpecies();
 		virtual bool CheckConvertSamplesToSpeciesTooFewSpecies();
 		virtual double DoAllAssignments(double bestscore, int maxspecies, ContainingTree *SpeciesTree );
+		virtual void AssignSpeciesExhaustively(int species, int maxspecies, ContainingTree *SpeciesTree, double tripletscore, double &bestscore);
+		virtual bool CherryOrderAllowed(int species);
+		virtual double GetStructureScoreOfSpecies(int species, double bestscore);
+		virtual void ScoreExhaustiveAssignment(ContainingTree *SpeciesTree, double tripletscore, double &bestscore);
+		map<unsigned long long, double> structurescorecache; //structure score of each set of samples (bit i for sample i) tried as one species in an exhaustive search
+		vector<int> speciescherrypartner; //species each species forms a cherry with on the species tree of an exhaustive search, or 0
+		vector<double> exhaustivetreeweights;
+		long assignmentsscored;
+		long assignmentspruned;
      //   virtual double GetGTPScore(ContainingTree *SpeciesTreePtr); //took out as no longer use external GTP
         virtual double GetGTPScoreNew(ContainingTree *SpeciesTreePtr);
+		virtual void PrepareGTPScorer();
+		virtual vector<double> GetGTPTreeWeights();
+		virtual void ClearGeneTreeCaches();
+		virtual void GroupIdenticalGeneTrees();
+		virtual double GetWeightedDuplicationsOnTree(ContainingTree *SpeciesTreePtr, const vector<double> &treeweights, double limit, bool &exceeded);
         virtual vector<double> GetCombinedScore(ContainingTree *SpeciesTreePtr);
+		vector<int> GetSpeciesTreeLeafSpecies(ContainingTree &SpeciesTree);
+		double GetCOALScoreOfGeneTrees(CoalescentProbability &scorer, ContainingTree &SpeciesTree, const vector<int> &leafspecies, const vector<int> &genetrees);
+		vector<double> OptimizeSpeciesTreeBranchLengths(ContainingTree &SpeciesTree);
+		vector<double> ContourSearchBranchLengths(ContainingTree &SpeciesTree);
+		virtual void GetCombinedScores(vector<ContainingTree> &SpeciesTrees, vector<vector<double> > &scorevectors, vector<bool> &abortedscores);
+		virtual void GetSPRNeighborhood(ContainingTree &StartTree, int maxtrees, vector<ContainingTree> &SwapTrees, vector<vector<int> > &BreakVectors, vector<vector<int> > &AttachVectors, vector<bool> &MoreSwaps);
 	Node *cur;
 	std::stack < Node *, std::vector<Node *> > stk;
     void PurgeBlocks();
@@ -334,7 +382,9 @@ public:
 	gsl_matrix* GetVCVwithKappa(nxsstring chosentaxset,double kappa); //don't forget to use DeleteStem
 	gsl_matrix* ConvertVCVwithDelta(gsl_matrix * VCVorig,double delta); //takes VCV as input; could use DeleteStem(GetVCV(chosentaxset)) as input
 	gsl_matrix* ConvertVCVwithLambda(gsl_matrix * VCVorig,double lambda);//takes VCV as input; could use DeleteStem(GetVCV(chosentaxset)) as input
-	gsl_matrix* GetVCVwithTree(nxsstring chosentaxset, Tree t);
+	gsl_matrix* GetVCVwithTree(nxsstring chosentaxset, const Tree &t);
+	gsl_matrix* GetVCVwithCompactTree(nxsstring chosentaxset, const CompactTree &t, double kappa);
+    gsl_matrix* GetVCVwithEdgeWeights(nxsstring chosentaxset, const RMQLCAQuery &lca, const vector<double> &edgeweight);
     gsl_matrix* GetVCVforOneModel(nxsstring chosentaxset, int selectedmodel);
     gsl_matrix* GetStartStopTimesforOneState(nxsstring chosentaxset, int selectedstate);
     gsl_matrix* GetVCVforChangeNoChange(nxsstring chosentaxset, bool wantchangeedges);
@@ -373,6 +423,9 @@ public:
     gsl_vector* GetTipResiduals(gsl_vector *tips, double ancestralstate);
     double EstimateRate(gsl_matrix *VCV, gsl_vector *tipresiduals);
     void HandleGettrees( NexusToken& token );
+    int GetNumLoopTrees(); //trees in the TREES block, or if none, those from GetTrees
+    double GetLoopTreeWeight(int i);
+    nxsstring GetLoopTreeName(int i);
     void EnteringBlock( nxsstring blockName );
     void ExitingBlock( nxsstring blockName );
     void ExecuteStarting() {}
@@ -1,6 +1,13 @@
 #include "cdfvectorholder.h"
 #include <iostream>
+#include <fstream>
 #include <vector>
+#include <string>
+#include <string.h>
+#include <gsl/gsl_math.h>
+#include <gsl/gsl_rng.h>
+#include <gsl/gsl_randist.h>
+#include "TreeLib.h"
 
 using namespace std;
 
@@ -65,3 +72,192 @@ vector<vector<double> > CDFvectorholder::Initialize() {
 
   return CDFvectorcontents;
 }
+
+//Grows a random rooted tree as ContainingTree::RandomTree does, splitting a leaf chosen at random until there are ntax, and numbers its
+//leaves at random as ConvertTaxonNamesToRandomTaxonNumbers does. Only the taxa numbered below ncommon are kept (the ones a tree of
+//ncommon taxa shares with it), and for each pair of them the depth of their most recent common ancestor, in ancestordepth[a*ncommon+b].
+static void RandomTreeAncestorDepths(int ntax, int ncommon, gsl_rng *rng, vector<int> &ancestordepth)
+{
+	vector<int> nodedepth(1,0);
+	vector<int> firstchild(1,-1);
+	vector<int> leaves;
+	for (int child=0; child<2; child++) {
+		nodedepth.push_back(1);
+		firstchild.push_back(-1);
+		leaves.push_back(nodedepth.size()-1);
+	}
+	firstchild[0]=1; //children of a node are always made together, so the second child is firstchild+1
+	while (leaves.size()<ntax) {
+		int chosenleaf=gsl_rng_uniform_int(rng,leaves.size());
+		int node=leaves[chosenleaf];
+		firstchild[node]=nodedepth.size();
+		for (int child=0; child<2; child++) {
+			nodedepth.push_back(nodedepth[node]+1);
+			firstchild.push_back(-1);
+		}
+		leaves[chosenleaf]=firstchild[node];
+		leaves.push_back(firstchild[node]+1);
+	}
+	vector<int> taxonnumbers(leaves.size());
+	for (int i=0; i<taxonnumbers.size(); i++) {
+		taxonnumbers[i]=i;
+	}
+	gsl_ran_shuffle(rng,&taxonnumbers[0],taxonnumbers.size(),sizeof(int));
+	vector<vector<int> > taxabelow(nodedepth.size());
+	for (int i=0; i<leaves.size(); i++) {
+		if (taxonnumbers[i]<ncommon) {
+			taxabelow[leaves[i]].push_back(taxonnumbers[i]);
+		}
+	}
+	ancestordepth.assign(ncommon*ncommon,0);
+	for (int node=nodedepth.size()-1; node>=0; node--) { //children are always made after their ancestor
+		if (firstchild[node]>=0) {
+			vector<int> &left=taxabelow[firstchild[node]];
+			vector<int> &right=taxabelow[firstchild[node]+1];
+			for (int i=0; i<left.size(); i++) {
+				for (int j=0; j<right.size(); j++) {
+					ancestordepth[left[i]*ncommon+right[j]]=nodedepth[node];
+					ancestordepth[right[j]*ncommon+left[i]]=nodedepth[node];
+				}
+			}
+			taxabelow[node].swap(left);
+			taxabelow[node].insert(taxabelow[node].end(),right.begin(),right.end());
+			vector<int>().swap(right);
+		}
+	}
+}
+
+//In a tree with no polytomies, two of the three pairs of a triplet have the same common ancestor, and the third pair's is more recent
+static long CountTripletDisagreements(const vector<int> &ancestordepth1, const vector<int> &ancestordepth2, int ncommon)
+{
+	long disagreements=0;
+	for (int i=0; i<ncommon; i++) {
+		for (int j=i+1; j<ncommon; j++) {
+			int ij1=ancestordepth1[i*ncommon+j];
+			int ij2=ancestordepth2[i*ncommon+j];
+			for (int k=j+1; k<ncommon; k++) {
+				int ik1=ancestordepth1[i*ncommon+k];
+				int ik2=ancestordepth2[i*ncommon+k];
+				int resolution1=(ij1>ik1 ? 0 : (ik1>ij1 ? 1 : 2));
+				int resolution2=(ij2>ik2 ? 0 : (ik2>ij2 ? 1 : 2));
+				if (resolution1!=resolution2) {
+					disagreements++;
+				}
+			}
+		}
+	}
+	return disagreements;
+}
+
+void CDFvectorholder::SimulateDisagreements(int ltax, int rtax, long reps, unsigned long seed, vector<long> &disagreements)
+{
+	int ncommon=GSL_MIN(ltax,rtax);
+	disagreements.assign(GSL_MAX(reps,0),0);
+	long nblocks=(reps+CDFVECTOR_BLOCKSIZE-1)/CDFVECTOR_BLOCKSIZE;
+#pragma omp parallel for schedule(dynamic)
+	for (long block=0;block<nblocks;block++) {
+		gsl_rng *blockrng=gsl_rng_alloc(gsl_rng_mt19937);
+		gsl_rng_set(blockrng,seed+block);
+		vector<int> ancestordepth1;
+		vector<int> ancestordepth2;
+		long blockend=GSL_MIN((block+1)*CDFVECTOR_BLOCKSIZE,reps);
+		for (long rep=block*CDFVECTOR_BLOCKSIZE;rep<blockend;rep++) {
+			RandomTreeAncestorDepths(ltax,ncommon,blockrng,ancestordepth1);
+			RandomTreeAncestorDepths(rtax,ncommon,blockrng,ancestordepth2);
+			disagreements[rep]=CountTripletDisagreements(ancestordepth1,ancestordepth2,ncommon);
+		}
+		gsl_rng_free(blockrng);
+	}
+}
+
+vector<double> CDFvectorholder::MakeCDF(const vector<long> &disagreements, int ntax)
+{
+	long ntriplets=(long(ntax)*(ntax-1)*(ntax-2))/6;
+	vector<long> counts(ntriplets+1,0);
+	for (long rep=0; rep<disagreements.size(); rep++) {
+		counts[disagreements[rep]]++;
+	}
+	vector<double> cdf(ntriplets+1,1.0);
+	long cumulativecount=0;
+	for (long i=0; i<=ntriplets; i++) {
+		cumulativecount+=counts[i];
+		cdf[i]=GSL_MAX(cumulativecount,1)/double(GSL_MAX(disagreements.size(),1));
+	}
+	return cdf;
+}
+
+bool CDFvectorholder::ReadTables(const char *filename, vector<vector<double> > &CDFvectorcontents, bool replace, vector<int> &skippedntax)
+{
+	skippedntax.clear();
+	ifstream f(filename, ios::in | ios::binary);
+	if (!f) {
+		return false;
+	}
+	f.seekg(0, ios::end);
+	streamoff length=f.tellg();
+	f.seekg(0, ios::beg);
+	if (length<streamoff(2*strlen(CDFVECTOR_MAGIC))) {
+		return false;
+	}
+	vector<char> data(length);
+	if (!f.read(&data[0],length)) {
+		return false;
+	}
+	f.close();
+
+	BinaryBuffer b(&data[0],&data[0]+length);
+	string magic, endmagic;
+	int version, ntables;
+	b.GetString(magic);
+	b.Get(version);
+	bool ok=b.IsOK() && magic==CDFVECTOR_MAGIC && version==CDFVECTOR_VERSION && b.Get(ntables) && ntables>=0;
+	vector<int> ntaxa;
+	vector<vector<double> > tables;
+	for (int i=0; ok && i<ntables; i++) {
+		int ntax;
+		tables.push_back(vector<double>());
+		ok=b.Get(ntax) && b.GetVector(tables.back()) && ntax>=3 && tables.back().size()==(long(ntax)*(ntax-1)*(ntax-2))/6+1;
+		ntaxa.push_back(ntax);
+	}
+	ok=ok && b.GetString(endmagic) && endmagic==CDFVECTOR_MAGIC && b.GetPosition()==&data[0]+length;
+	if (!ok) {
+		return false;
+	}
+	for (int i=0; i<ntables; i++) {
+		if (CDFvectorcontents.size()<ntaxa[i]-2) {
+			CDFvectorcontents.resize(ntaxa[i]-2);
+		}
+		if (CDFvectorcontents[ntaxa[i]-3].size()>0 && !replace) {
+			skippedntax.push_back(ntaxa[i]);
+			continue;
+		}
+		CDFvectorcontents[ntaxa[i]-3].swap(tables[i]);
+	}
+	return true;
+}
+
+bool CDFvectorholder::WriteTables(const char *filename, const vector<vector<double> > &CDFvectorcontents)
+{
+	ofstream f(filename, ios::out | ios::binary | ios::trunc);
+	if (!f) {
+		return false;
+	}
+	int ntables=0;
+	for (int i=0; i<CDFvectorcontents.size(); i++) {
+		if (CDFvectorcontents[i].size()>0) {
+			ntables++;
+		}
+	}
+	PutBinaryString(f,CDFVECTOR_MAGIC);
+	PutBinary(f,int(CDFVECTOR_VERSION));
+	PutBinary(f,ntables);
+	for (int i=0; i<CDFvectorcontents.size(); i++) {
+		if (CDFvectorcontents[i].size()>0) {
+			PutBinary(f,i+3);
+			PutBinaryVector(f,CDFvectorcontents[i]);
+		}
+	}
+	PutBinaryString(f,CDFVECTOR_MAGIC);
+	f.close();
+	return f.good();
+}
@@ -5,6 +5,27 @@
 
 using namespace std;
 
+/*
+ *  cdfvectorholder.h
+ *
+ *  Tables of the cumulative distribution of the number of triplets on which two random trees
+ *  disagree, for 3 to 50 taxa: entry i of the table for n taxa is the probability that two
+ *  trees of n taxa disagree on at most i of their n choose 3 triplets. Tables are held by
+ *  number of taxa less three, and an empty table means there is none for that many taxa.
+ *
+ *  More tables can be simulated (see SimulateDisagreements) and kept in a binary file: magic,
+ *  format version, the number of tables, then the number of taxa and entries of each table,
+ *  and the magic again to show the file is complete, all in the byte order of the machine that
+ *  wrote it. Tables read from a file replace those for the same number of taxa.
+ *
+ *  GPL2
+ *
+ */
+
+#define CDFVECTOR_MAGIC "BRCDFV\x01"
+#define CDFVECTOR_VERSION 1
+#define CDFVECTOR_BLOCKSIZE 1000 //pairs of trees per random number stream
+
 const double cdfv03[] = {0.33143,1};
 const double cdfv04[] = {0.0743,0.14798,0.33336,0.78098,1};
 const double cdfv05[] = {0.01156,0.0325,0.04166,0.07611,0.13168,0.23259,0.40661,0.58719,0.82218,0.98517,1};
@@ -64,6 +85,10 @@ public:
 public:
 	CDFvectorholder();
 	vector<vector<double> > Initialize();
+	void SimulateDisagreements(int ltax, int rtax, long reps, unsigned long seed, vector<long> &disagreements); //number of triplets of their shared taxa on which each of reps pairs of random trees, of ltax and rtax taxa, disagree. Pairs are simulated in parallel, in blocks with their own random number generators seeded from seed, so results do not depend on the number of threads used
+	vector<double> MakeCDF(const vector<long> &disagreements, int ntax); //table for ntax taxa from simulated disagreements; a count of zero is taken as one, so no probability is zero
+	bool ReadTables(const char *filename, vector<vector<double> > &CDFvectorcontents, bool replace, vector<int> &skippedntax); //false, leaving CDFvectorcontents unchanged, if the file can't be read or is damaged. Tables for numbers of taxa that already have one are only taken if replace is true; otherwise those numbers of taxa are listed in skippedntax
+	bool WriteTables(const char *filename, const vector<vector<double> > &CDFvectorcontents);
 //	~CDFvectorholder();
 	//virtual vector<vector<double> > returnCDFvectorcontents();
 };
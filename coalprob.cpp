@@ -0,0 +1,371 @@
+/*
+ *  coalprob.cpp
+ *
+ *  GPL2
+ *
+ */
+#include <algorithm>
+#include <sstream>
+#include <string.h>
+#include <math.h>
+#include <gsl/gsl_math.h>
+#include "nodeiterator.h"
+#include "coalprob.h"
+
+/*
+ Tavare (1984) equation 6.1: probability that u lineages have coalesced to exactly v after time T
+ (in coalescent units). The sum alternates in sign, so it is done in long double and clamped to [0,1].
+ */
+double CoalescentTransitionProbability(int u, int v, double T)
+{
+	if (u==0) {
+		return (v==0) ? 1.0 : 0.0;
+	}
+	if (v<1 || v>u) {
+		return 0.0;
+	}
+	if (gsl_isinf(T)) {
+		return (v==1) ? 1.0 : 0.0;
+	}
+	if (T<=0) {
+		return (u==v) ? 1.0 : 0.0;
+	}
+	long double total=0;
+	for (int k=v;k<=u;k++) {
+		long double logterm=-0.5*k*(k-1)*T+log(2.0*k-1.0);
+		logterm+=lgamma(v+k-1.0)-lgamma(1.0*v); //rising factorial v^(k-1)
+		logterm+=lgamma(u+1.0)-lgamma(u-k+1.0); //falling factorial u_[k]
+		logterm-=lgamma(v+1.0)+lgamma(k-v+1.0);
+		logterm-=lgamma(u+k*1.0)-lgamma(1.0*u); //rising factorial u^(k)
+		long double term=expl(logterm);
+		if ((k-v)%2==1) {
+			total-=term;
+		}
+		else {
+			total+=term;
+		}
+	}
+	return GSL_MAX(0.0,GSL_MIN(1.0,(double)total));
+}
+
+CoalescentProbability::CoalescentProbability()
+{
+	speciestreekey=0;
+}
+
+void CoalescentProbability::Clear()
+{
+	topologychild1.clear();
+	topologychild2.clear();
+	topologysample.clear();
+	probabilitycache.clear();
+	topologylookup.clear();
+	genetreetopology.clear();
+	speciestreekey=0;
+}
+
+void CoalescentProbability::CopyGeneTrees(const CoalescentProbability &other)
+{
+	topologychild1=other.topologychild1;
+	topologychild2=other.topologychild2;
+	topologysample=other.topologysample;
+	probabilitycache.clear();
+	topologylookup=other.topologylookup;
+	genetreetopology=other.genetreetopology;
+	speciestreekey=0;
+}
+
+//children sorted so that the string is the same however the tree is drawn
+string CoalescentProbability::CanonicalString(Node *p, map<Node *, int> &leafsample)
+{
+	ostringstream out;
+	if (p->IsLeaf()) {
+		out<<leafsample[p];
+		return out.str();
+	}
+	vector<string> childstrings;
+	for (NodePtr q=p->GetChild();q!=NULL;q=q->GetSibling()) {
+		childstrings.push_back(CanonicalString(q,leafsample));
+	}
+	sort(childstrings.begin(),childstrings.end());
+	out<<"(";
+	for (int i=0;i<childstrings.size();i++) {
+		if (i>0) {
+			out<<",";
+		}
+		out<<childstrings[i];
+	}
+	out<<")";
+	return out.str();
+}
+
+bool CoalescentProbability::AddGeneTree(const Tree &t, const vector<int> &leafsamples)
+{
+	map<Node *, int> nodenumber;
+	map<Node *, int> leafsample;
+	vector<int> child1;
+	vector<int> child2;
+	vector<int> sample;
+	int leafcount=0;
+	NodeIterator <Node> n (t.GetRoot());
+	NodePtr currentnode = n.begin();
+	while (currentnode)
+	{
+		nodenumber[currentnode]=child1.size();
+		if (currentnode->IsLeaf()) {
+			if (leafcount>=leafsamples.size()) {
+				return false;
+			}
+			leafsample[currentnode]=leafsamples[leafcount];
+			child1.push_back(-1);
+			child2.push_back(-1);
+			sample.push_back(leafsamples[leafcount]);
+			leafcount++;
+		}
+		else {
+			NodePtr firstchild=currentnode->GetChild();
+			if (firstchild==NULL || firstchild->GetSibling()==NULL || (firstchild->GetSibling())->GetSibling()!=NULL) {
+				return false; //coalescent histories are only defined for rooted, fully resolved gene trees
+			}
+			child1.push_back(nodenumber[firstchild]);
+			child2.push_back(nodenumber[firstchild->GetSibling()]);
+			sample.push_back(-1);
+		}
+		currentnode = n.next();
+	}
+	string key=CanonicalString(t.GetRoot(),leafsample);
+	map<string,int>::iterator found=topologylookup.find(key);
+	if (found!=topologylookup.end()) {
+		genetreetopology.push_back(found->second);
+	}
+	else {
+		int topology=topologychild1.size();
+		topologylookup[key]=topology;
+		topologychild1.push_back(child1);
+		topologychild2.push_back(child2);
+		topologysample.push_back(sample);
+		genetreetopology.push_back(topology);
+	}
+	return true;
+}
+
+//the finalizer from splitmix64
+static unsigned long long MixSpeciesKey(unsigned long long key)
+{
+	key^=key>>30;
+	key*=0xBF58476D1CE4E5B9ULL;
+	key^=key>>27;
+	key*=0x94D049BB133111EBULL;
+	key^=key>>31;
+	return key;
+}
+
+//tips are hashed from the samples they hold, so the key changes if either the tree or the assignment of samples changes. Branch
+//lengths are rounded by dropping the last 20 bits of their mantissas, which is defined for any length, even infinite or NaN
+unsigned long long CoalescentProbability::SpeciesKey(Node *p, map<Node *, int> &tipspecies, const vector<int> &samplestospecies)
+{
+	unsigned long long key;
+	if (p->IsLeaf()) {
+		key=0x9E3779B97F4A7C15ULL;
+		for (int i=0;i<samplestospecies.size();i++) {
+			if (samplestospecies[i]==tipspecies[p]) {
+				key=MixSpeciesKey(key^(unsigned long long)(i+1));
+			}
+		}
+	}
+	else {
+		vector<unsigned long long> childkeys;
+		for (NodePtr q=p->GetChild();q!=NULL;q=q->GetSibling()) {
+			childkeys.push_back(SpeciesKey(q,tipspecies,samplestospecies));
+		}
+		sort(childkeys.begin(),childkeys.end());
+		key=0xC2B2AE3D27D4EB4FULL;
+		for (int i=0;i<childkeys.size();i++) {
+			key=MixSpeciesKey(key^childkeys[i]);
+		}
+	}
+	if (p->GetAnc()!=NULL) {
+		double length=p->GetEdgeLength();
+		unsigned long long lengthbits;
+		memcpy(&lengthbits,&length,sizeof(lengthbits));
+		lengthbits&=~((1ULL<<20)-1);
+		key=MixSpeciesKey(key^MixSpeciesKey(lengthbits+0x632BE59BD9B4E019ULL));
+	}
+	return key;
+}
+
+void CoalescentProbability::SetSpeciesTree(Tree &speciestree, const vector<int> &leafspecies, const vector<int> &samplestospecies)
+{
+	map<Node *, int> nodenumber;
+	map<Node *, int> tipspecies;
+	map<int, int> speciestip;
+	specieschildren.clear();
+	speciesbrlen.clear();
+	int leafcount=0;
+	NodeIterator <Node> n (speciestree.GetRoot());
+	NodePtr currentnode = n.begin();
+	while (currentnode)
+	{
+		nodenumber[currentnode]=specieschildren.size();
+		vector<int> children;
+		if (currentnode->IsLeaf()) {
+			tipspecies[currentnode]=leafspecies[leafcount];
+			speciestip[leafspecies[leafcount]]=specieschildren.size();
+			leafcount++;
+		}
+		else {
+			for (NodePtr q=currentnode->GetChild();q!=NULL;q=q->GetSibling()) {
+				children.push_back(nodenumber[q]);
+			}
+		}
+		specieschildren.push_back(children);
+		speciesbrlen.push_back(currentnode->GetEdgeLength());
+		currentnode = n.next();
+	}
+	samplenode.assign(samplestospecies.size(),-1);
+	for (int i=0;i<samplestospecies.size();i++) {
+		map<int, int>::iterator found=speciestip.find(samplestospecies[i]);
+		if (found!=speciestip.end()) {
+			samplenode[i]=found->second;
+		}
+	}
+	speciestreekey=SpeciesKey(speciestree.GetRoot(),tipspecies,samplestospecies);
+}
+
+double CoalescentProbability::GetGeneTreeProbability(int genetreenumber)
+{
+	int topology=genetreetopology[genetreenumber];
+	pair<unsigned long long,int> key(speciestreekey,topology);
+	map<pair<unsigned long long,int>,double>::iterator found=probabilitycache.find(key);
+	if (found!=probabilitycache.end()) {
+		return found->second;
+	}
+	double probability=ComputeProbability(topology);
+	if (probabilitycache.size()>=COALPROB_MAXCACHE) {
+		probabilitycache.clear();
+	}
+	probabilitycache[key]=probability;
+	return probability;
+}
+
+double CoalescentProbability::ComputeProbability(int topology)
+{
+	const vector<int> &child1=topologychild1[topology];
+	const vector<int> &child2=topologychild2[topology];
+	const vector<int> &sample=topologysample[topology];
+	int ngenenodes=child1.size();
+	int nspeciesnodes=specieschildren.size();
+	vector<vector<int> > tipgenes(nspeciesnodes);
+	for (int g=0;g<ngenenodes;g++) {
+		if (child1[g]<0) {
+			if (sample[g]<0 || sample[g]>=samplenode.size() || samplenode[sample[g]]<0) {
+				return 0.0; //sample is not in any species on this tree
+			}
+			tipgenes[samplenode[sample[g]]].push_back(g);
+		}
+	}
+	vector<map<vector<int>,double> > outconfigs(nspeciesnodes); //for each branch, probability of each set of gene lineages leaving it
+	vector<bool> present(ngenenodes,false);
+	vector<int> eventsize(ngenenodes,0);
+	for (int s=0;s<nspeciesnodes;s++) {
+		map<vector<int>,double> inconfigs;
+		if (specieschildren[s].size()==0) {
+			inconfigs[tipgenes[s]]=1.0;
+		}
+		else {
+			inconfigs[vector<int>()]=1.0;
+			for (int c=0;c<specieschildren[s].size();c++) {
+				map<vector<int>,double> combined;
+				map<vector<int>,double> &childconfigs=outconfigs[specieschildren[s][c]];
+				for (map<vector<int>,double>::iterator i=inconfigs.begin();i!=inconfigs.end();i++) {
+					for (map<vector<int>,double>::iterator j=childconfigs.begin();j!=childconfigs.end();j++) {
+						vector<int> lineages;
+						merge((i->first).begin(),(i->first).end(),(j->first).begin(),(j->first).end(),back_inserter(lineages));
+						combined[lineages]+=(i->second)*(j->second);
+					}
+				}
+				inconfigs.swap(combined);
+				childconfigs.clear();
+			}
+		}
+		bool isroot=(s==nspeciesnodes-1);
+		double brlen=(isroot ? GSL_POSINF : speciesbrlen[s]);
+		for (map<vector<int>,double>::iterator i=inconfigs.begin();i!=inconfigs.end();i++) {
+			const vector<int> &inconfig=i->first;
+			for (int j=0;j<inconfig.size();j++) {
+				present[inconfig[j]]=true;
+			}
+			//gene nodes that could coalesce in this branch, in postorder
+			vector<bool> reachable=present;
+			vector<int> candidates;
+			for (int g=0;g<ngenenodes;g++) {
+				if (child1[g]>=0 && reachable[child1[g]] && reachable[child2[g]]) {
+					reachable[g]=true;
+					candidates.push_back(g);
+				}
+			}
+			EnumerateBranch(topology,inconfig,candidates,0,present,eventsize,0,0.0,brlen,isroot,i->second,outconfigs[s]);
+			for (int j=0;j<inconfig.size();j++) {
+				present[inconfig[j]]=false;
+			}
+		}
+	}
+	double probability=0;
+	for (map<vector<int>,double>::iterator i=outconfigs[nspeciesnodes-1].begin();i!=outconfigs[nspeciesnodes-1].end();i++) {
+		probability+=i->second;
+	}
+	return probability;
+}
+
+/*
+ Decides, for each candidate in postorder, whether it coalesces in this branch, so that each allowed set
+ of events is visited once. eventsize holds the number of events in this branch at or below each event, so
+ the number of orders of the events is nevents!/prod(eventsize) (exp(logweight) holds 1/prod(eventsize)).
+ */
+void CoalescentProbability::EnumerateBranch(int topology, const vector<int> &inconfig, const vector<int> &candidates, int position, vector<bool> &present, vector<int> &eventsize, int nevents, double logweight, double brlen, bool isroot, double inprob, map<vector<int>,double> &outconfigs)
+{
+	if (position==candidates.size()) {
+		int u=inconfig.size();
+		int v=u-nevents;
+		if (isroot && u>0 && v!=1) {
+			return;
+		}
+		double transition=CoalescentTransitionProbability(u,v,brlen);
+		if (transition==0) {
+			return;
+		}
+		double logorders=lgamma(nevents+1.0)+logweight;
+		for (int i=v+1;i<=u;i++) {
+			logorders-=log(0.5*i*(i-1));
+		}
+		vector<int> lineages;
+		for (int j=0;j<inconfig.size();j++) {
+			if (present[inconfig[j]]) {
+				lineages.push_back(inconfig[j]);
+			}
+		}
+		for (int j=0;j<candidates.size();j++) {
+			if (present[candidates[j]]) {
+				lineages.push_back(candidates[j]);
+			}
+		}
+		sort(lineages.begin(),lineages.end());
+		outconfigs[lineages]+=inprob*transition*exp(logorders);
+		return;
+	}
+	EnumerateBranch(topology,inconfig,candidates,position+1,present,eventsize,nevents,logweight,brlen,isroot,inprob,outconfigs);
+	int g=candidates[position];
+	int c1=topologychild1[topology][g];
+	int c2=topologychild2[topology][g];
+	if (present[c1] && present[c2]) {
+		eventsize[g]=1+eventsize[c1]+eventsize[c2];
+		present[c1]=false;
+		present[c2]=false;
+		present[g]=true;
+		EnumerateBranch(topology,inconfig,candidates,position+1,present,eventsize,nevents+1,logweight-log(1.0*eventsize[g]),brlen,isroot,inprob,outconfigs);
+		present[g]=false;
+		present[c1]=true;
+		present[c2]=true;
+		eventsize[g]=0;
+	}
+}
@@ -0,0 +1,69 @@
+#ifndef COALPROB_H
+#define COALPROB_H
+#include <iostream>
+#include <vector>
+#include <map>
+#include <string>
+#include "TreeLib.h"
+
+using namespace std;
+
+/*
+ *  coalprob.h
+ *
+ *  Probability of a gene tree topology given a species tree (branch lengths in coalescent
+ *  units) under the multispecies coalescent, with any number of samples per species, as
+ *  COAL (Degnan and Salter 2005) computes it with intra yes. Rather than listing every
+ *  coalescent history, the species tree is traversed from the tips down, keeping the
+ *  probability of each set of gene lineages that can leave each branch; histories that
+ *  leave a branch with the same set of lineages are summed before going further down.
+ *  Within a branch with u lineages entering and v leaving, a set of k coalescences adds
+ *  p_uv(T) * w / d, where p_uv is Tavare's (1984) probability, w the number of orders of
+ *  the k events allowed by the gene tree, and d = C(u,2)C(u-1,2)...C(v+1,2).
+ *
+ *  Identical gene tree topologies are stored once, and the probability of each under the
+ *  species trees (and sample assignments) it has already been evaluated on is remembered.
+ *  A species tree is known by a 64 bit hash of its shape, the samples in each tip, and its
+ *  branch lengths (rounded to about ten significant digits), and one cache of bounded size
+ *  holds the probabilities for all topologies.
+ *
+ *  GPL2
+ *
+ */
+
+#define COALPROB_MAXCACHE 250000 //probabilities remembered, over all gene tree topologies; the cache is emptied when full
+
+class CoalescentProbability
+{
+public:
+	CoalescentProbability();
+	void Clear();
+	bool AddGeneTree(const Tree &t, const vector<int> &leafsamples); //leafsamples are sample numbers of the leaves in postorder; false if the tree is not rooted and fully resolved
+	int GetNumGeneTrees() const { return genetreetopology.size(); };
+	int GetNumUniqueGeneTrees() const { return topologychild1.size(); };
+	void SetSpeciesTree(Tree &speciestree, const vector<int> &leafspecies, const vector<int> &samplestospecies); //leafspecies are species numbers of the leaves in postorder; samplestospecies gives each sample's species number
+	double GetGeneTreeProbability(int genetreenumber);
+	void ClearCache() { probabilitycache.clear(); };
+	void CopyGeneTrees(const CoalescentProbability &other); //the gene trees of other, without its cache; set a species tree before getting probabilities
+protected:
+	//gene tree topologies: nodes in postorder, leaves have child -1 and a sample number
+	vector<vector<int> > topologychild1;
+	vector<vector<int> > topologychild2;
+	vector<vector<int> > topologysample;
+	map<pair<unsigned long long,int>,double> probabilitycache; //keyed by species tree key and topology
+	map<string,int> topologylookup;
+	vector<int> genetreetopology; //unique topology of each gene tree added
+	//current species tree: nodes in postorder, root last
+	vector<vector<int> > specieschildren;
+	vector<double> speciesbrlen;
+	vector<int> samplenode; //species tree tip holding each sample, or -1
+	unsigned long long speciestreekey;
+	string CanonicalString(Node *p, map<Node *, int> &leafsample);
+	unsigned long long SpeciesKey(Node *p, map<Node *, int> &tipspecies, const vector<int> &samplestospecies);
+	double ComputeProbability(int topology);
+	void EnumerateBranch(int topology, const vector<int> &inconfig, const vector<int> &candidates, int position, vector<bool> &present, vector<int> &eventsize, int nevents, double logweight, double brlen, bool isroot, double inprob, map<vector<int>,double> &outconfigs);
+};
+
+double CoalescentTransitionProbability(int u, int v, double T); //Tavare's probability that u lineages become v in time T
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ *  coalsim.cpp
+ *
+ *  GPL2
+ *
+ */
+#include <algorithm>
+#include <gsl/gsl_math.h>
+#include <gsl/gsl_randist.h>
+#include "nodeiterator.h"
+#include "coalsim.h"
+
+//the finalizer from splitmix64
+static TopologyHash MixTopologyHash(TopologyHash key)
+{
+	key^=key>>30;
+	key*=0xBF58476D1CE4E5B9ULL;
+	key^=key>>27;
+	key*=0x94D049BB133111EBULL;
+	key^=key>>31;
+	return key;
+}
+
+TopologyHash LeafTopologyHash(int species)
+{
+	return MixTopologyHash(0x9E3779B97F4A7C15ULL+(TopologyHash)species);
+}
+
+TopologyHash CombineTopologyHash(TopologyHash a, TopologyHash b)
+{
+	TopologyHash lo=GSL_MIN(a,b);
+	TopologyHash hi=GSL_MAX(a,b);
+	return MixTopologyHash(lo^MixTopologyHash(hi+0x632BE59BD9B4E019ULL));
+}
+
+//nodes with more than two children are hashed in sorted order; they can never match a simulated tree
+TopologyHash GetSpeciesTopologyHash(const Tree &t, const vector<int> &leafspecies, int *symmetricnodes)
+{
+	map<Node *, TopologyHash> hash;
+	int leafcount=0;
+	if (symmetricnodes!=NULL) {
+		*symmetricnodes=0;
+	}
+	NodeIterator <Node> n (t.GetRoot());
+	NodePtr currentnode = n.begin();
+	while (currentnode)
+	{
+		if (currentnode->IsLeaf()) {
+			hash[currentnode]=LeafTopologyHash(leafspecies[leafcount]);
+			leafcount++;
+		}
+		else {
+			vector<TopologyHash> childhashes;
+			for (NodePtr q=currentnode->GetChild();q!=NULL;q=q->GetSibling()) {
+				childhashes.push_back(hash[q]);
+			}
+			sort(childhashes.begin(),childhashes.end());
+			TopologyHash combined=childhashes[0];
+			for (int i=1;i<childhashes.size();i++) {
+				combined=CombineTopologyHash(combined,childhashes[i]);
+			}
+			if (childhashes.size()>2) {
+				combined=MixTopologyHash(combined+childhashes.size());
+			}
+			else if (childhashes.size()==2 && childhashes[0]==childhashes[1] && symmetricnodes!=NULL) {
+				(*symmetricnodes)++;
+			}
+			hash[currentnode]=combined;
+		}
+		currentnode = n.next();
+	}
+	return hash[t.GetRoot()];
+}
+
+CoalescentSimulator::CoalescentSimulator() : pairrate(2.0)
+{
+}
+
+void CoalescentSimulator::SetSpeciesTree(Tree &speciestree, const vector<int> &leafspecies, const vector<int> &samplesperspecies)
+{
+	map<Node *, int> nodenumber;
+	vector<double> height;
+	vector<int> ancestor;
+	specieschildren.clear();
+	speciestipsamples.clear();
+	speciestipnumber.clear();
+	int leafcount=0;
+	NodeIterator <Node> n (speciestree.GetRoot());
+	NodePtr currentnode = n.begin();
+	while (currentnode)
+	{
+		int nodeid=specieschildren.size();
+		nodenumber[currentnode]=nodeid;
+		vector<int> children;
+		double nodeheight=0;
+		if (currentnode->IsLeaf()) {
+			int species=leafspecies[leafcount];
+			leafcount++;
+			speciestipnumber.push_back(species);
+			if (species>=1 && species<=samplesperspecies.size()) {
+				speciestipsamples.push_back(samplesperspecies[species-1]);
+			}
+			else {
+				speciestipsamples.push_back(0);
+			}
+		}
+		else {
+			for (NodePtr q=currentnode->GetChild();q!=NULL;q=q->GetSibling()) {
+				children.push_back(nodenumber[q]);
+				ancestor[nodenumber[q]]=nodeid;
+			}
+			for (NodePtr q=currentnode->GetChild();q!=NULL;q=q->GetChild()) { //the split time ms was given: assumes an ultrametric tree
+				nodeheight+=q->GetEdgeLength();
+			}
+			speciestipnumber.push_back(0);
+			speciestipsamples.push_back(0);
+		}
+		specieschildren.push_back(children);
+		height.push_back(nodeheight);
+		ancestor.push_back(-1);
+		currentnode = n.next();
+	}
+	speciesduration.assign(specieschildren.size(),GSL_POSINF);
+	for (int i=0;i<specieschildren.size();i++) {
+		if (ancestor[i]>=0) {
+			speciesduration[i]=GSL_MAX(0.0,height[ancestor[i]]-height[i]);
+		}
+	}
+}
+
+TopologyHash CoalescentSimulator::SimulateTopology(gsl_rng *rng) const
+{
+	vector<vector<TopologyHash> > lineages(specieschildren.size());
+	for (int i=0;i<specieschildren.size();i++) {
+		vector<TopologyHash> &current=lineages[i];
+		if (specieschildren[i].size()==0) {
+			current.assign(speciestipsamples[i],LeafTopologyHash(speciestipnumber[i]));
+		}
+		else {
+			for (int c=0;c<specieschildren[i].size();c++) {
+				vector<TopologyHash> &childlineages=lineages[specieschildren[i][c]];
+				current.insert(current.end(),childlineages.begin(),childlineages.end());
+				vector<TopologyHash>().swap(childlineages);
+			}
+		}
+		double timeleft=speciesduration[i];
+		while (current.size()>1) {
+			int k=current.size();
+			double waitingtime=gsl_ran_exponential(rng,1.0/(pairrate*0.5*k*(k-1)));
+			if (waitingtime>timeleft) {
+				break;
+			}
+			timeleft-=waitingtime;
+			int first=gsl_rng_uniform_int(rng,k);
+			int second=gsl_rng_uniform_int(rng,k-1);
+			if (second>=first) {
+				second++;
+			}
+			current[first]=CombineTopologyHash(current[first],current[second]);
+			current[second]=current[k-1];
+			current.pop_back();
+		}
+	}
+	if (lineages.size()==0 || lineages[lineages.size()-1].size()==0) {
+		return 0;
+	}
+	return lineages[lineages.size()-1][0];
+}
+
+void CoalescentSimulator::CountTopologies(long reps, unsigned long seed, const vector<TopologyHash> &targets, vector<long> &counts) const
+{
+	vector<TopologyHash> sortedtargets=targets;
+	sort(sortedtargets.begin(),sortedtargets.end());
+	sortedtargets.erase(unique(sortedtargets.begin(),sortedtargets.end()),sortedtargets.end());
+	vector<long> sortedcounts(sortedtargets.size(),0);
+	long nblocks=(reps+COALSIM_BLOCKSIZE-1)/COALSIM_BLOCKSIZE;
+#pragma omp parallel for schedule(dynamic)
+	for (long block=0;block<nblocks;block++) {
+		gsl_rng *blockrng=gsl_rng_alloc(gsl_rng_mt19937);
+		gsl_rng_set(blockrng,seed+block);
+		vector<long> blockcounts(sortedtargets.size(),0);
+		long blockreps=GSL_MIN(COALSIM_BLOCKSIZE,reps-block*COALSIM_BLOCKSIZE);
+		for (long rep=0;rep<blockreps;rep++) {
+			TopologyHash simulated=SimulateTopology(blockrng);
+			vector<TopologyHash>::iterator found=lower_bound(sortedtargets.begin(),sortedtargets.end(),simulated);
+			if (found!=sortedtargets.end() && *found==simulated) {
+				blockcounts[found-sortedtargets.begin()]++;
+			}
+		}
+		gsl_rng_free(blockrng);
+#pragma omp critical
+		{
+			for (int i=0;i<sortedcounts.size();i++) {
+				sortedcounts[i]+=blockcounts[i];
+			}
+		}
+	}
+	counts.assign(targets.size(),0);
+	for (int i=0;i<targets.size();i++) {
+		counts[i]=sortedcounts[lower_bound(sortedtargets.begin(),sortedtargets.end(),targets[i])-sortedtargets.begin()];
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef COALSIM_H
+#define COALSIM_H
+#include <iostream>
+#include <vector>
+#include <map>
+#include <gsl/gsl_rng.h>
+#include "TreeLib.h"
+
+using namespace std;
+
+/*
+ *  coalsim.h
+ *
+ *  Simulates gene trees within a species tree under the coalescent, as ms -T -I ... -ej ... did,
+ *  and counts how often each of a set of gene tree topologies is produced. Only the topology
+ *  with samples relabeled by species matters for these counts, so simulated trees are never
+ *  built: each lineage just carries a hash of the species-labeled topology below it, which is
+ *  the same however the children are ordered. A gene tree matches a simulated tree if their
+ *  hashes are equal, just as it matched the grep regex made from it.
+ *
+ *  Replicates are divided into blocks, each with its own random number generator seeded from
+ *  one starting seed, so results do not depend on the number of threads used.
+ *
+ *  GPL2
+ *
+ */
+
+typedef unsigned long long TopologyHash;
+
+#define COALSIM_BLOCKSIZE 1000 //replicates per random number stream
+
+TopologyHash LeafTopologyHash(int species);
+TopologyHash CombineTopologyHash(TopologyHash a, TopologyHash b); //symmetric in a and b
+TopologyHash GetSpeciesTopologyHash(const Tree &t, const vector<int> &leafspecies, int *symmetricnodes=NULL); //leafspecies are species of the leaves in postorder; symmetricnodes counts nodes whose two subtrees have the same hash
+
+class CoalescentSimulator
+{
+public:
+	CoalescentSimulator();
+	void SetSpeciesTree(Tree &speciestree, const vector<int> &leafspecies, const vector<int> &samplesperspecies); //leafspecies are species numbers (starting at 1) of leaves in postorder; samplesperspecies[i] is the number of samples of species i+1
+	void SetCoalescenceRate(double rate) { pairrate=rate; }; //rate at which each pair of lineages coalesces per unit of branch length
+	TopologyHash SimulateTopology(gsl_rng *rng) const;
+	void CountTopologies(long reps, unsigned long seed, const vector<TopologyHash> &targets, vector<long> &counts) const; //counts[i] is the number of replicates with topology targets[i]
+protected:
+	vector<vector<int> > specieschildren; //nodes in postorder, root last
+	vector<double> speciesduration; //time from each node to its ancestor, with heights taken as ms did along the first child
+	vector<int> speciestipsamples; //number of samples at each tip, 0 for internal nodes
+	vector<int> speciestipnumber;
+	double pairrate;
+};
+
+#endif
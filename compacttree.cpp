@@ -0,0 +1,225 @@
+/*
+ *  compacttree.cpp
+ *
+ *  GPL2
+ *
+ */
+#include <map>
+#include <string>
+#include <algorithm>
+#include "nodeiterator.h"
+#include "compacttree.h"
+
+CompactTree::CompactTree()
+{
+}
+
+CompactTree::CompactTree(const Tree &t)
+{
+	Compile(t);
+}
+
+void CompactTree::Compile(const Tree &t)
+{
+	parent.clear();
+	firstchild.clear();
+	sibling.clear();
+	depth.clear();
+	edgelength.clear();
+	label.clear();
+	preorder.clear();
+	postorder.clear();
+	leaves.clear();
+	taxon.clear();
+	if (t.GetRoot()==NULL) {
+		height.clear();
+		leafnumber.clear();
+		firstleaf.clear();
+		lastleaf.clear();
+		return;
+	}
+	map<Node *, int> nodenumber;
+	PreorderIterator <Node> n (t.GetRoot());
+	NodePtr currentnode = n.begin();
+	while (currentnode)
+	{
+		int number=parent.size();
+		nodenumber[currentnode]=number;
+		if (currentnode->GetAnc()==NULL || number==0) {
+			parent.push_back(-1);
+			depth.push_back(0);
+		}
+		else {
+			int ancnumber=nodenumber[currentnode->GetAnc()];
+			parent.push_back(ancnumber);
+			depth.push_back(depth[ancnumber]+1);
+		}
+		firstchild.push_back(-1);
+		sibling.push_back(-1);
+		edgelength.push_back(currentnode->GetEdgeLength());
+		label.push_back(currentnode->GetLabel());
+		taxon.push_back(currentnode->IsLeaf() ? currentnode->GetTaxonNumber() : -1);
+		preorder.push_back(number);
+		currentnode = n.next();
+	}
+	int nnodes=parent.size();
+	NodeIterator <Node> m (t.GetRoot());
+	currentnode = m.begin();
+	while (currentnode)
+	{
+		int number=nodenumber[currentnode];
+		postorder.push_back(number);
+		if (currentnode->GetChild()!=NULL) {
+			firstchild[number]=nodenumber[currentnode->GetChild()];
+		}
+		if (currentnode->GetSibling()!=NULL && number!=0) {
+			sibling[number]=nodenumber[currentnode->GetSibling()];
+		}
+		currentnode = m.next();
+	}
+	leafnumber.assign(nnodes,-1);
+	firstleaf.assign(nnodes,0);
+	lastleaf.assign(nnodes,0);
+	for (int i=0;i<nnodes;i++) {
+		int node=postorder[i];
+		if (IsLeaf(node)) {
+			leafnumber[node]=leaves.size();
+			firstleaf[node]=leaves.size();
+			leaves.push_back(node);
+			lastleaf[node]=leaves.size();
+		}
+		else {
+			firstleaf[node]=firstleaf[firstchild[node]];
+			int lastchild=firstchild[node];
+			while (sibling[lastchild]>=0) {
+				lastchild=sibling[lastchild];
+			}
+			lastleaf[node]=lastleaf[lastchild];
+		}
+	}
+	UpdateHeights();
+}
+
+void CompactTree::UpdateHeights()
+{
+	int nnodes=parent.size();
+	height.assign(nnodes,0.0);
+	for (int node=1;node<nnodes;node++) { //preorder, so the ancestor is already done
+		height[node]=height[parent[node]]+edgelength[node];
+	}
+}
+
+int CompactTree::GetLeafWithLabel(const string &s) const
+{
+	int found=-1;
+	for (int i=0;i<leaves.size();i++) {
+		if (label[leaves[i]]==s) {
+			found=leaves[i];
+		}
+	}
+	return found;
+}
+
+int CompactTree::LCA(int a, int b) const
+{
+	while (depth[a]>depth[b]) {
+		a=parent[a];
+	}
+	while (depth[b]>depth[a]) {
+		b=parent[b];
+	}
+	while (a!=b) {
+		a=parent[a];
+		b=parent[b];
+	}
+	return a;
+}
+
+bool CompactTree::GetTopologyKey(vector<unsigned long long> &key) const
+{
+	int nnodes=parent.size();
+	vector<unsigned long long> clusterhash(nnodes,0);
+	bool resolved=true;
+	key.clear();
+	for (int nodeindex=0;nodeindex<nnodes;nodeindex++) {
+		int node=postorder[nodeindex];
+		if (IsLeaf(node)) {
+			unsigned long long labelhash=14695981039346656037ULL; //FNV-1a, then mixed so sums of hashes don't collide easily
+			for (int k=0;k<label[node].size();k++) {
+				labelhash=(labelhash^((unsigned char)label[node][k]))*1099511628211ULL;
+			}
+			labelhash=(labelhash^(labelhash>>30))*0xbf58476d1ce4e5b9ULL;
+			labelhash=(labelhash^(labelhash>>27))*0x94d049bb133111ebULL;
+			clusterhash[node]=labelhash^(labelhash>>31);
+		}
+		else {
+			int numchildren=0;
+			for (int child=firstchild[node];child>=0;child=sibling[child]) {
+				clusterhash[node]+=clusterhash[child];
+				numchildren++;
+			}
+			if (numchildren!=2) {
+				resolved=false;
+			}
+			key.push_back(clusterhash[node]);
+		}
+	}
+	if (nnodes==1) { //a single leaf
+		key.push_back(clusterhash[0]);
+	}
+	sort(key.begin(),key.end());
+	return resolved;
+}
+
+bool CompactTree::SameTopology(const CompactTree &other) const
+{
+	int nleaves=leaves.size();
+	int nnodes=parent.size();
+	if (other.GetNumLeaves()!=nleaves || other.GetNumNodes()!=nnodes) {
+		return false;
+	}
+	map<string, int> leafwithlabel;
+	for (int i=0;i<nleaves;i++) {
+		leafwithlabel[label[leaves[i]]]=i;
+	}
+	if ((int)leafwithlabel.size()!=nleaves) { //labels must be unique to match leaves
+		return false;
+	}
+	//each cluster of other, in this tree's leaf numbers, must be a range [firstleaf, lastleaf) that is also a cluster here
+	vector<int> first(nnodes,nleaves);
+	vector<int> last(nnodes,0);
+	vector<int> count(nnodes,0);
+	vector<bool> leafused(nleaves,false);
+	vector<pair<int, int> > clusters;
+	vector<pair<int, int> > otherclusters;
+	for (int nodeindex=0;nodeindex<nnodes;nodeindex++) {
+		int node=other.postorder[nodeindex];
+		if (other.IsLeaf(node)) {
+			map<string, int>::const_iterator found=leafwithlabel.find(other.label[node]);
+			if (found==leafwithlabel.end() || leafused[found->second]) {
+				return false;
+			}
+			leafused[found->second]=true;
+			first[node]=found->second;
+			last[node]=found->second+1;
+			count[node]=1;
+		}
+		else {
+			for (int child=other.firstchild[node];child>=0;child=other.sibling[child]) {
+				first[node]=min(first[node],first[child]);
+				last[node]=max(last[node],last[child]);
+				count[node]+=count[child];
+			}
+			if (last[node]-first[node]!=count[node]) {
+				return false;
+			}
+			otherclusters.push_back(pair<int, int>(first[node],last[node]));
+		}
+		if (!IsLeaf(node)) {
+			clusters.push_back(pair<int, int>(firstleaf[node],lastleaf[node]));
+		}
+	}
+	sort(clusters.begin(),clusters.end());
+	sort(otherclusters.begin(),otherclusters.end());
+	return (clusters==otherclusters);
+}
@@ -0,0 +1,75 @@
+#ifndef COMPACTTREE_H
+#define COMPACTTREE_H
+#include <iostream>
+#include <vector>
+#include <string>
+#include "TreeLib.h"
+
+using namespace std;
+
+/*
+ *  compacttree.h
+ *
+ *  A read-only copy of a Tree laid out as flat arrays, for code that walks the same tree many
+ *  times (likelihoods, VCV matrices, triplet, quartet, and GTP counting). Nodes are numbered in
+ *  preorder, so the root is 0 and every node comes after its ancestor; the postorder is kept as
+ *  a separate array. Leaves are also numbered 0..nleaves-1 in postorder, and the leaves below
+ *  any node are the contiguous range [GetFirstLeaf, GetLastLeaf) of that order.
+ *
+ *  Edge lengths are doubles. Heights are distances from the root (the root's own edge is not
+ *  counted). Edge lengths can be changed without compiling the tree again; call UpdateHeights
+ *  afterwards.
+ *
+ *  GPL2
+ *
+ */
+
+class CompactTree
+{
+public:
+	CompactTree();
+	CompactTree(const Tree &t);
+	void Compile(const Tree &t);
+	int GetNumNodes() const { return parent.size(); };
+	int GetNumLeaves() const { return leaves.size(); };
+	int GetRoot() const { return 0; };
+	int GetParent(int node) const { return parent[node]; }; //-1 for the root
+	int GetFirstChild(int node) const { return firstchild[node]; }; //-1 for a leaf
+	int GetSibling(int node) const { return sibling[node]; }; //-1 for the last child
+	bool IsLeaf(int node) const { return firstchild[node]<0; };
+	int GetDepth(int node) const { return depth[node]; }; //number of edges from the root
+	double GetEdgeLength(int node) const { return edgelength[node]; };
+	void SetEdgeLength(int node, double length) { edgelength[node]=length; };
+	double GetHeight(int node) const { return height[node]; };
+	void UpdateHeights();
+	const string &GetLabel(int node) const { return label[node]; };
+	const vector<int> &GetPreorder() const { return preorder; }; //simply 0..n-1, for symmetry with GetPostorder
+	const vector<int> &GetPostorder() const { return postorder; };
+	const vector<int> &GetLeaves() const { return leaves; }; //leaf nodes in postorder
+	int GetLeafNumber(int node) const { return leafnumber[node]; }; //position of a leaf in GetLeaves, -1 for internal nodes
+	int GetFirstLeaf(int node) const { return firstleaf[node]; };
+	int GetLastLeaf(int node) const { return lastleaf[node]; }; //one past the last leaf below node
+	int GetTaxon(int node) const { return taxon[node]; }; //starts as the leaf's taxon number from the Tree (see Node::GetTaxonNumber); -1 if not known
+	void SetTaxon(int node, int taxonnumber) { taxon[node]=taxonnumber; };
+	int GetLeafWithLabel(const string &s) const; //last matching leaf in postorder, or -1
+	int LCA(int a, int b) const;
+	bool GetTopologyKey(vector<unsigned long long> &key) const; //sorted hashes of the clusters, a cluster's hash being the sum of hashes of its leaf labels, so trees with the same rooted topology and labels have the same key; false if some node doesn't have exactly two descendants
+	bool SameTopology(const CompactTree &other) const; //same rooted topology and leaf labels, comparing the clusters themselves rather than keys
+protected:
+	vector<int> parent;
+	vector<int> firstchild;
+	vector<int> sibling;
+	vector<int> depth;
+	vector<double> edgelength;
+	vector<double> height;
+	vector<string> label;
+	vector<int> preorder;
+	vector<int> postorder;
+	vector<int> leaves;
+	vector<int> leafnumber;
+	vector<int> firstleaf;
+	vector<int> lastleaf;
+	vector<int> taxon;
+};
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ *  gtpscore.cpp
+ *
+ *  GPL2
+ *
+ */
+#include <map>
+#include <assert.h>
+#include <gsl/gsl_math.h>
+#include "gtpscore.h"
+
+GeneTreeParsimony::GeneTreeParsimony()
+{
+}
+
+void GeneTreeParsimony::Clear()
+{
+	genechild1.clear();
+	genechild2.clear();
+	genesample.clear();
+}
+
+bool GeneTreeParsimony::AddGeneTree(const CompactTree &t)
+{
+	vector<int> nodenumber(t.GetNumNodes());
+	vector<int> child1;
+	vector<int> child2;
+	vector<int> sample;
+	const vector<int> &postorder=t.GetPostorder();
+	for (int i=0;i<postorder.size();i++) {
+		int node=postorder[i];
+		nodenumber[node]=i;
+		if (t.IsLeaf(node)) {
+			child1.push_back(-1);
+			child2.push_back(-1);
+			sample.push_back(t.GetTaxon(node));
+		}
+		else {
+			int g1=t.GetFirstChild(node);
+			int g2=t.GetSibling(g1);
+			if (g2<0) {
+				return false;
+			}
+			child1.push_back(nodenumber[g1]); //as before, only the first two descendants of a polytomy are used
+			child2.push_back(nodenumber[g2]);
+			sample.push_back(-1);
+		}
+	}
+	genechild1.push_back(child1);
+	genechild2.push_back(child2);
+	genesample.push_back(sample);
+	return true;
+}
+
+void GeneTreeParsimony::SetSpeciesTree(const CompactTree &speciestree, const vector<int> &samplestospecies)
+{
+	currentspeciestree.Set(speciestree,samplestospecies);
+}
+
+void GTPSpeciesTree::Set(const CompactTree &speciestree, const vector<int> &samplestospecies)
+{
+	int nodecount=speciestree.GetNumNodes();
+	map<int, int> speciesleaf;
+	for (int node=0;node<nodecount;node++) { //nodes are numbered in preorder
+		if (speciestree.IsLeaf(node) && speciesleaf.find(speciestree.GetTaxon(node))==speciesleaf.end()) {
+			speciesleaf[speciestree.GetTaxon(node)]=node;
+		}
+	}
+	samplenode.assign(samplestospecies.size(),-1);
+	for (int i=0;i<samplestospecies.size();i++) {
+		map<int, int>::iterator found=speciesleaf.find(samplestospecies[i]);
+		if (found!=speciesleaf.end()) {
+			samplenode[i]=found->second;
+		}
+	}
+
+	//Euler tour, without recursion: a node is written when it is reached and again after each of its descendants
+	vector<int> tour;
+	eulerfirst.assign(nodecount,-1);
+	vector<int> stack;
+	stack.push_back(speciestree.GetRoot());
+	int lastvisited=-1;
+	while (!stack.empty()) {
+		int p=stack.back();
+		if (eulerfirst[p]<0) {
+			eulerfirst[p]=tour.size();
+			tour.push_back(p);
+			if (!speciestree.IsLeaf(p)) {
+				stack.push_back(speciestree.GetFirstChild(p));
+				continue;
+			}
+		}
+		else {
+			tour.push_back(p);
+			int next=speciestree.GetSibling(lastvisited);
+			if (next>=0) {
+				stack.push_back(next);
+				continue;
+			}
+		}
+		lastvisited=p;
+		stack.pop_back();
+	}
+
+	floorlog2.assign(tour.size()+1,0);
+	for (int i=2;i<floorlog2.size();i++) {
+		floorlog2[i]=floorlog2[i/2]+1;
+	}
+	eulermin.resize(floorlog2[tour.size()]+1);
+	eulermin[0]=tour;
+	for (int k=1;k<eulermin.size();k++) {
+		int span=1<<(k-1);
+		eulermin[k].resize(tour.size()-(1<<k)+1);
+		for (int i=0;i<eulermin[k].size();i++) {
+			eulermin[k][i]=GSL_MIN(eulermin[k-1][i],eulermin[k-1][i+span]);
+		}
+	}
+}
+
+int GTPSpeciesTree::LCA(int a, int b) const
+{
+	int left=eulerfirst[a];
+	int right=eulerfirst[b];
+	if (left>right) {
+		int temp=left;
+		left=right;
+		right=temp;
+	}
+	int k=floorlog2[right-left+1];
+	return GSL_MIN(eulermin[k][left],eulermin[k][right-(1<<k)+1]);
+}
+
+int GeneTreeParsimony::GetDuplications(int genetreenumber) const
+{
+	return GetDuplications(genetreenumber,currentspeciestree);
+}
+
+int GeneTreeParsimony::GetDuplications(int genetreenumber, const GTPSpeciesTree &speciestree) const
+{
+	const vector<int> &child1=genechild1[genetreenumber];
+	const vector<int> &child2=genechild2[genetreenumber];
+	const vector<int> &sample=genesample[genetreenumber];
+	int nnodes=child1.size();
+	vector<int> mapping(nnodes);
+	vector<bool> marked(nnodes,false); //whether it predates a speciation event and so could be a strong duplication
+	int numDup=0;
+	for (int i=0;i<nnodes;i++) {
+		if (child1[i]<0) {
+			assert(sample[i]>=0 && sample[i]<speciestree.GetNumSamples());
+			mapping[i]=speciestree.GetSampleNode(sample[i]);
+			assert(mapping[i]>=0);
+		}
+		else {
+			int a=mapping[child1[i]];
+			int b=mapping[child2[i]];
+			int m=speciestree.LCA(a,b);
+			mapping[i]=m;
+			if (m==a || m==b) {
+				if (marked[child1[i]] || marked[child2[i]]) { //idea from Sanderson
+					marked[i]=true;
+					numDup++;
+				}
+			}
+			else {
+				marked[i]=true; //since it's a speciation event
+			}
+		}
+	}
+	return numDup;
+}
+
+double GeneTreeParsimony::GetWeightedDuplications(const vector<double> &weights, double limit, bool &exceeded) const
+{
+	return GetWeightedDuplications(currentspeciestree,weights,limit,exceeded);
+}
+
+double GeneTreeParsimony::GetWeightedDuplications(const GTPSpeciesTree &speciestree, const vector<double> &weights, double limit, bool &exceeded) const
+{
+	int ntrees=genechild1.size();
+	vector<double> treescores(ntrees,0.0);
+	double runningtotal=0;
+	bool stop=false;
+#pragma omp parallel for schedule(dynamic)
+	for (int selectedtree=0; selectedtree<ntrees; selectedtree++) {
+		bool skip;
+#pragma omp atomic read
+		skip=stop;
+		if (!skip && weights[selectedtree]!=0) {
+			double score=weights[selectedtree]*GetDuplications(selectedtree,speciestree);
+			treescores[selectedtree]=score;
+#pragma omp atomic
+			runningtotal+=score;
+			double seentotal;
+#pragma omp atomic read
+			seentotal=runningtotal;
+			if (seentotal>limit) {
+#pragma omp atomic write
+				stop=true;
+			}
+		}
+	}
+	double total=0;
+	for (int selectedtree=0; selectedtree<ntrees; selectedtree++) {
+		total+=treescores[selectedtree];
+	}
+	exceeded=(stop || total>limit);
+	return total;
+}
@@ -0,0 +1,60 @@
+#ifndef GTPSCORE_H
+#define GTPSCORE_H
+#include <iostream>
+#include <vector>
+#include "compacttree.h"
+
+using namespace std;
+
+/*
+ *  gtpscore.h
+ *
+ *  Gene tree parsimony: the number of strong duplications needed to fit each gene tree in a
+ *  species tree, using the mapping of Zmasek & Eddy (2001) with Sanderson's restriction to
+ *  duplications that predate a speciation event. Gene trees are stored once as arrays in
+ *  postorder. For each species tree, the nodes are numbered in preorder and an Euler tour of
+ *  the tree is stored with a sparse table, so the LCA of any two species nodes is the smallest
+ *  preorder number in a range of the tour, found in constant time. Each gene tree is then
+ *  scored in a single postorder pass, and gene trees are scored in parallel. The species tree
+ *  is held in a GTPSpeciesTree, and the gene trees are only read while scoring, so different
+ *  species trees can also be scored in parallel.
+ *
+ *  GPL2
+ *
+ */
+
+class GTPSpeciesTree //a species tree ready for LCA queries; kept apart from the gene trees so several species trees can be scored at once
+{
+public:
+	void Set(const CompactTree &speciestree, const vector<int> &samplestospecies); //leaves must have their species numbers set as taxa; samplestospecies gives each sample's species number
+	int GetSampleNode(int sample) const { return samplenode[sample]; };
+	int GetNumSamples() const { return samplenode.size(); };
+	int LCA(int a, int b) const;
+protected:
+	vector<int> eulerfirst; //first position of each node in the Euler tour
+	vector<vector<int> > eulermin; //eulermin[k][i] is the smallest node number in positions i to i+2^k-1 of the tour
+	vector<int> floorlog2;
+	vector<int> samplenode; //species tree leaf holding each sample, or -1
+};
+
+class GeneTreeParsimony
+{
+public:
+	GeneTreeParsimony();
+	void Clear();
+	bool AddGeneTree(const CompactTree &t); //leaves must have their sample numbers set as taxa; false if a node has only one descendant
+	int GetNumGeneTrees() const { return genechild1.size(); };
+	void SetSpeciesTree(const CompactTree &speciestree, const vector<int> &samplestospecies); //as GTPSpeciesTree::Set, for the species tree used by the functions below without one
+	int GetDuplications(int genetreenumber) const;
+	int GetDuplications(int genetreenumber, const GTPSpeciesTree &speciestree) const;
+	double GetWeightedDuplications(const vector<double> &weights, double limit, bool &exceeded) const; //sum of weight times duplications; stops early, setting exceeded, once the sum passes limit. Trees with weight 0 are skipped
+	double GetWeightedDuplications(const GTPSpeciesTree &speciestree, const vector<double> &weights, double limit, bool &exceeded) const;
+protected:
+	//gene trees: nodes in postorder, leaves have child -1 and a sample number
+	vector<vector<int> > genechild1;
+	vector<vector<int> > genechild2;
+	vector<vector<int> > genesample;
+	GTPSpeciesTree currentspeciestree;
+};
+
+#endif
@@ -116,6 +116,7 @@ void NexusToken::AppendToComment( char ch )
  */
 void NexusToken::AppendToToken( char ch )
 {
+#if defined( __BORLANDC__ )
 	// first three lines proved necessary to keep
    // Borland's implementation of STL from crashing
    // under some circumstances
@@ -124,6 +125,9 @@ void NexusToken::AppendToToken( char ch )
    s[1] = '\0';
 
    token += s;
+#else
+   token += ch;
+#endif
 }
 
 /**
@@ -144,9 +148,10 @@ void NexusToken::AppendToToken( char ch )
  * <li> if character read is neither a carriage return nor a line feed,
  *   col is incremented by one and the character is returned as is to the
  *   calling function
- * <li> in all cases, the variable filepos is updated using a call to
- *   the tellg function of istream.
  * </ul>
+ * The file position is not updated here: tellg can cost a system call,
+ * so GetFilePosition asks the stream only when a position is wanted
+ * (which is only when reporting an error).
  */
 char NexusToken::GetNextChar()
 {
@@ -175,8 +180,6 @@ char NexusToken::GetNextChar()
 		atEOL = 0;
 	}
 
-	filepos = in.tellg();
-
    if( atEOF )
       return '\0';
    else if( atEOL )
@@ -395,10 +398,11 @@ void NexusToken::GetParentheticalToken()
 	// rdmp
 	// This method is used to read Newick tree decsriptions, but these may exten beyon the
 	// last ')' (e.g., information on branch length for the root node). This next hack keeps
-	// reading until we hit the semicolon
-	while (in.peek() != ';')
+	// reading until we hit the semicolon (or the end of the file)
+	while ((int)in.peek() != ';')
 	{
-		ch = in.get();
+		ch = GetNextChar();
+		if( atEOF ) break;
 		AppendToToken (ch);
 	}
 	
@@ -426,32 +430,19 @@ void NexusToken::GetParentheticalToken()
  */
 bool NexusToken::IsPunctuation( char ch )
 {
-	char punctuation[21];
-	punctuation[0]  = '(';
-	punctuation[1]  = ')';
-	punctuation[2]  = '[';
-	punctuation[3]  = ']';
-	punctuation[4]  = '{';
-	punctuation[5]  = '}';
-	punctuation[6]  = '/';
-	punctuation[7]  = '\\';
-	punctuation[8]  = ',';
-	punctuation[9]  = ';';
-	punctuation[10] = ':';
-	punctuation[11] = '=';
-	punctuation[12] = '*';
-	punctuation[13] = '\'';
-	punctuation[14] = '"';
-	punctuation[15] = '`';
-	punctuation[16] = '+';
-	punctuation[17] = '-';
-	punctuation[18] = '<';
-	punctuation[19] = '>';
-	punctuation[20] = '\0';
-
+   // a switch rather than strchr on a list, as this is called for every
+   // character read; '\0' is included, as strchr would have matched it
    bool is_punctuation = false;
-   if( strchr( punctuation, ch ) != NULL )
-      is_punctuation = true;
+   switch( ch ) {
+      case '(': case ')': case '[': case ']': case '{': case '}':
+      case '/': case '\\': case ',': case ';': case ':': case '=':
+      case '*': case '\'': case '"': case '`': case '+': case '-':
+      case '<': case '>': case '\0':
+         is_punctuation = true;
+         break;
+      default:
+         break;
+   }
    if( labileFlags & tildeIsPunctuation  && ch == '~' )
       is_punctuation = true;
    if( labileFlags & useSpecialPunctuation  && ch == special )
@@ -470,18 +461,10 @@ bool NexusToken::IsPunctuation( char ch )
  */
 bool NexusToken::IsWhitespace( char ch )
 {
-	char whitespace[4];
-	whitespace[0]  = ' ';
-	whitespace[1]  = '\t';
-	whitespace[2]  = '\n';
-	whitespace[3]  = '\0';
-
-	bool ws = false;
-
-	// if ch is found in the whitespace array, it's whitespace
+	// if ch is one of these (including '\0', which strchr on the old
+	// whitespace array also matched), it's whitespace
 	//
-	if( strchr( whitespace, ch ) != NULL )
-		ws = true;
+	bool ws = ( ch == ' ' || ch == '\t' || ch == '\n' || ch == '\0' );
 
 	// unless of course ch is the newline character and we're currently
 	// treating newlines as darkspace!
@@ -685,13 +668,14 @@ long  NexusToken::GetFileColumn()
 /**
  * @method GetFilePosition [streampos:public]
  *
- * Returns value stored in filepos, which keeps track of the current
- * position in the data file (i.e., number of characters since the
- * beginning of the file).  Note: for Metrowerks compiler, you must use the
+ * Returns the current position in the data file (i.e., number of
+ * characters since the beginning of the file), asking the stream for it
+ * and storing it in filepos.  Note: for Metrowerks compiler, you must use the
  * offset() method of the streampos class to use the value returned.
  */
 std::streampos  NexusToken::GetFilePosition()
 {
+	filepos = in.tellg();
 	return filepos;
 }
 
@@ -17,6 +17,7 @@ using namespace std;
  * @copyright  Copyright © 1999. All Rights Reserved.
  * @variable   ntax [int:private] number of taxa (set from NTAX specification)
  * @variable   taxonLabels [LabelList:private] storage for list of taxon labels
+ * @variable   labelHash [vector<int>:private] open addressing hash table of positions in taxonLabels, so FindTaxon doesn't scan the list
  * @see        LabelList
  * @see        Nexus
  * @see        NexusBlock
@@ -142,6 +143,7 @@ void TaxaBlock::Read( NexusToken& token )
             for( int i = 0; i < ntax; i++ ) {
                 token.GetNextToken();
                 taxonLabels.push_back( token.GetToken() );
+                AddToLabelHash( taxonLabels.size()-1 );
                 assignmentsToSpecies.push_back( 0 ); //Added by BCO -- this says that initially, all samples are in one species
             }
 
@@ -223,6 +225,7 @@ void TaxaBlock::Reset()
 {
    isEmpty = true;
 	taxonLabels.erase( taxonLabels.begin(), taxonLabels.end() );
+   labelHash.clear();
    ntax = 0;
 }
 
@@ -237,6 +240,7 @@ void TaxaBlock::AddTaxonLabel( nxsstring s )
 {
    isEmpty = false;
 	taxonLabels.push_back(s);
+   AddToLabelHash( taxonLabels.size()-1 );
    ntax++;
 }
 
@@ -251,6 +255,7 @@ void TaxaBlock::ChangeTaxonLabel( int i, nxsstring s )
 {
 	assert( i < (int)taxonLabels.size() );
    taxonLabels[i] = s;
+   RebuildLabelHash();
 }
 
 /**
@@ -295,9 +300,7 @@ nxsstring TaxaBlock::GetTaxonLabel( int i )
  */
 bool TaxaBlock::IsAlreadyDefined( nxsstring s )
 {
-   LabelList::const_iterator iter = find( taxonLabels.begin(), taxonLabels.end(), s );
-   int taxonLabelFound = ( iter != taxonLabels.end() );
-   return taxonLabelFound;
+   return ( FindInLabelHash( s ) >= 0 );
 }
 
 /**
@@ -307,18 +310,15 @@ bool TaxaBlock::IsAlreadyDefined( nxsstring s )
  *
  * Returns index of taxon named s in taxonLabels list.  If taxon named
  * s cannot be found, or if there are no labels currently stored in
- * the taxonLabels list, throws nosuchtaxon exception.
+ * the taxonLabels list, throws nosuchtaxon exception. If s appears
+ * more than once, the first index is returned. The lookup goes through
+ * labelHash, so it takes constant time rather than a scan of the list.
  */
 int TaxaBlock::FindTaxon( nxsstring s )
 {
-   int k = 0;
-   LabelList::const_iterator i;
-   for( i = taxonLabels.begin(); i != taxonLabels.end(); ++i ) {
-      if( *i == s ) break;
-      k++;
-   }
+   int k = FindInLabelHash( s );
 
-   if( i == taxonLabels.end() ) {
+   if( k < 0 ) {
 	   cout<<"ERROR: Cannot find taxon "<<s<<endl; //BCO added this output (throw exception was already present)
       throw TaxaBlock::nosuchtaxon();
    }
@@ -347,3 +347,84 @@ void TaxaBlock::SetNtax( int n )
    ntax = n;
 }
 
+/**
+ * @method HashTaxonLabel [static]
+ * @param s [nxsstring] the label to hash
+ *
+ * FNV-1a hash of the characters of s.
+ */
+static unsigned long HashTaxonLabel( const nxsstring& s )
+{
+   unsigned long h = 2166136261UL;
+   for( int i = 0; i < (int)s.size(); i++ ) {
+      h ^= (unsigned char)s[i];
+      h *= 16777619UL;
+   }
+   return h;
+}
+
+/**
+ * @method FindInLabelHash [int:private]
+ * @param s [nxsstring] the label to look up
+ *
+ * Returns the first index of s in taxonLabels, or -1 if it is not there.
+ */
+int TaxaBlock::FindInLabelHash( const nxsstring& s )
+{
+   if( labelHash.empty() )
+      return -1;
+   unsigned long mask = labelHash.size() - 1;
+   unsigned long slot = HashTaxonLabel( s ) & mask;
+   while( labelHash[slot] >= 0 ) {
+      if( taxonLabels[ labelHash[slot] ] == s )
+         return labelHash[slot];
+      slot = ( slot + 1 ) & mask;
+   }
+   return -1;
+}
+
+/**
+ * @method AddToLabelHash [void:private]
+ * @param i [int] the position in taxonLabels to add
+ *
+ * Adds label i to labelHash, doubling the table (which is kept at least
+ * twice as large as the number of labels) if needed. A label that is
+ * already present keeps its earlier position, so FindTaxon still returns
+ * the first match.
+ */
+void TaxaBlock::AddToLabelHash( int i )
+{
+   if( 2 * (int)taxonLabels.size() > (int)labelHash.size() ) {
+      RebuildLabelHash();
+      return;
+   }
+   if( FindInLabelHash( taxonLabels[i] ) >= 0 )
+      return;
+   unsigned long mask = labelHash.size() - 1;
+   unsigned long slot = HashTaxonLabel( taxonLabels[i] ) & mask;
+   while( labelHash[slot] >= 0 )
+      slot = ( slot + 1 ) & mask;
+   labelHash[slot] = i;
+}
+
+/**
+ * @method RebuildLabelHash [void:private]
+ *
+ * Fills labelHash from scratch with every label in taxonLabels.
+ */
+void TaxaBlock::RebuildLabelHash()
+{
+   unsigned long tablesize = 16;
+   while( tablesize < 2 * taxonLabels.size() )
+      tablesize *= 2;
+   labelHash.assign( tablesize, -1 );
+   unsigned long mask = tablesize - 1;
+   for( int i = 0; i < (int)taxonLabels.size(); i++ ) {
+      if( FindInLabelHash( taxonLabels[i] ) >= 0 )
+         continue;
+      unsigned long slot = HashTaxonLabel( taxonLabels[i] ) & mask;
+      while( labelHash[slot] >= 0 )
+         slot = ( slot + 1 ) & mask;
+      labelHash[slot] = i;
+   }
+}
@@ -24,12 +24,16 @@ class TaxaBlock : public NexusBlock
 
 	int ntax;
 	LabelList taxonLabels;
+	std::vector<int> labelHash; //Added by BCO: positions in taxonLabels by hash of label, -1 if empty
         
 public:
    class nosuchtaxon {}; // exception potentially thrown by FindTaxon
 
 private:
    void SetNtax( int n );
+   void AddToLabelHash( int i );
+   void RebuildLabelHash();
+   int  FindInLabelHash( const nxsstring& s );
 
 protected:
 	void Read( NexusToken& token );
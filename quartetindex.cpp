@@ -0,0 +1,276 @@
+/*
+ *  quartetindex.cpp
+ *
+ *  GPL2
+ *
+ */
+#include <algorithm>
+#include <assert.h>
+#include <gsl/gsl_math.h>
+#include "quartetindex.h"
+
+QuadKey PackQuad(int a, int b, int c, int d)
+{
+	return (((QuadKey)a)<<48) | (((QuadKey)b)<<32) | (((QuadKey)c)<<16) | ((QuadKey)d);
+}
+
+void UnpackQuad(QuadKey key, int &a, int &b, int &c, int &d)
+{
+	a=(int)((key>>48) & 0xFFFF);
+	b=(int)((key>>32) & 0xFFFF);
+	c=(int)((key>>16) & 0xFFFF);
+	d=(int)(key & 0xFFFF);
+}
+
+//the finalizer from splitmix64; packed keys are very regular, so they need mixing before masking
+static unsigned long long MixQuadKey(QuadKey key)
+{
+	key^=key>>30;
+	key*=0xBF58476D1CE4E5B9ULL;
+	key^=key>>27;
+	key*=0x94D049BB133111EBULL;
+	key^=key>>31;
+	return key;
+}
+
+QuartetIndex::QuartetIndex() : hashused(0)
+{
+	hashkeys.assign(1024,QUARTETINDEX_EMPTYKEY);
+	hashcounts.assign(4*1024,0);
+}
+
+void QuartetIndex::Clear()
+{
+	hashkeys.assign(1024,QUARTETINDEX_EMPTYKEY);
+	hashcounts.assign(4*1024,0);
+	hashused=0;
+}
+
+//returns the slot holding key, or the empty slot where it would go
+unsigned long long QuartetIndex::FindSlot(QuadKey key) const
+{
+	unsigned long long mask=hashkeys.size()-1;
+	unsigned long long slot=MixQuadKey(key) & mask;
+	while (hashkeys[slot]!=key && hashkeys[slot]!=QUARTETINDEX_EMPTYKEY) {
+		slot=(slot+1) & mask;
+	}
+	return slot;
+}
+
+void QuartetIndex::GrowHash()
+{
+	vector<QuadKey> oldkeys;
+	vector<unsigned int> oldcounts;
+	oldkeys.swap(hashkeys);
+	oldcounts.swap(hashcounts);
+	hashkeys.assign(2*oldkeys.size(),QUARTETINDEX_EMPTYKEY);
+	hashcounts.assign(4*hashkeys.size(),0);
+	for (unsigned long long i=0;i<oldkeys.size();i++) {
+		if (oldkeys[i]!=QUARTETINDEX_EMPTYKEY) {
+			unsigned long long slot=FindSlot(oldkeys[i]);
+			hashkeys[slot]=oldkeys[i];
+			for (int topology=0;topology<4;topology++) {
+				hashcounts[4*slot+topology]=oldcounts[4*i+topology];
+			}
+		}
+	}
+}
+
+void QuartetIndex::AddSorted(QuadKey key, int topology, unsigned int count)
+{
+	unsigned long long slot=FindSlot(key);
+	if (hashkeys[slot]==QUARTETINDEX_EMPTYKEY) {
+		if (10*(hashused+1)>7*hashkeys.size()) { //keep load under 0.7
+			GrowHash();
+			slot=FindSlot(key);
+		}
+		hashkeys[slot]=key;
+		hashused++;
+	}
+	hashcounts[4*slot+topology]+=count;
+}
+
+unsigned int QuartetIndex::GetSorted(QuadKey key, int topology) const
+{
+	if (hashused==0) {
+		return 0;
+	}
+	unsigned long long slot=FindSlot(key);
+	if (hashkeys[slot]==QUARTETINDEX_EMPTYKEY) {
+		return 0;
+	}
+	return hashcounts[4*slot+topology];
+}
+
+bool QuartetIndex::SortQuad(int a, int b, int c, int d, QuadKey &key, int &topology) const
+{
+	int taxonarray[4]={a, b, c, d};
+	sort(taxonarray,taxonarray+4);
+	if (taxonarray[0]<0 || taxonarray[3]>=QUARTETINDEX_MAXTAXA || taxonarray[0]==taxonarray[1] || taxonarray[1]==taxonarray[2] || taxonarray[2]==taxonarray[3]) {
+		return false;
+	}
+	key=PackQuad(taxonarray[0],taxonarray[1],taxonarray[2],taxonarray[3]);
+	int partner; //the taxon on the same side as the smallest one
+	if (taxonarray[0]==a) {
+		partner=b;
+	}
+	else if (taxonarray[0]==b) {
+		partner=a;
+	}
+	else if (taxonarray[0]==c) {
+		partner=d;
+	}
+	else {
+		partner=c;
+	}
+	if (partner==taxonarray[1]) {
+		topology=0;
+	}
+	else if (partner==taxonarray[2]) {
+		topology=1;
+	}
+	else {
+		topology=2;
+	}
+	return true;
+}
+
+//quartets with a repeated taxon (a sample appearing twice on one tree) are not recorded
+void QuartetIndex::AddQuartet(int a, int b, int c, int d, unsigned int count)
+{
+	QuadKey key;
+	int topology;
+	if (SortQuad(a,b,c,d,key,topology)) {
+		AddSorted(key,topology,count);
+	}
+}
+
+void QuartetIndex::AddUnresolved(int a, int b, int c, int d, unsigned int count)
+{
+	QuadKey key;
+	int topology;
+	if (SortQuad(a,b,c,d,key,topology)) {
+		AddSorted(key,3,count);
+	}
+}
+
+unsigned int QuartetIndex::GetQuartetCount(int a, int b, int c, int d) const
+{
+	QuadKey key;
+	int topology;
+	if (!SortQuad(a,b,c,d,key,topology)) {
+		return 0;
+	}
+	return GetSorted(key,topology);
+}
+
+unsigned int QuartetIndex::GetUnresolvedCount(int a, int b, int c, int d) const
+{
+	QuadKey key;
+	int topology;
+	if (!SortQuad(a,b,c,d,key,topology)) {
+		return 0;
+	}
+	return GetSorted(key,3);
+}
+
+unsigned int QuartetIndex::GetQuadCount(int a, int b, int c, int d) const
+{
+	QuadKey key;
+	int topology;
+	if (!SortQuad(a,b,c,d,key,topology)) {
+		return 0;
+	}
+	unsigned int total=0;
+	for (topology=0;topology<4;topology++) {
+		total+=GetSorted(key,topology);
+	}
+	return total;
+}
+
+void QuartetIndex::GetObservedQuads(vector<QuadKey> &keys) const
+{
+	keys.clear();
+	for (unsigned long long slot=0;slot<hashkeys.size();slot++) {
+		if (hashkeys[slot]!=QUARTETINDEX_EMPTYKEY) {
+			keys.push_back(hashkeys[slot]);
+		}
+	}
+	sort(keys.begin(),keys.end());
+}
+
+void QuartetIndex::Merge(const QuartetIndex &other)
+{
+	for (unsigned long long slot=0;slot<other.hashkeys.size();slot++) {
+		if (other.hashkeys[slot]!=QUARTETINDEX_EMPTYKEY) {
+			for (int topology=0;topology<4;topology++) {
+				unsigned int count=other.hashcounts[4*slot+topology];
+				if (count>0) {
+					AddSorted(other.hashkeys[slot],topology,count);
+				}
+			}
+		}
+	}
+}
+
+double QuartetIndex::GetMemoryUsed() const
+{
+	return 1.0*sizeof(QuadKey)*hashkeys.size()+1.0*sizeof(unsigned int)*hashcounts.size();
+}
+
+/*
+ Adds every quartet on tree t. The leaves below any node are a range of leaf positions, and two
+ leaves in different children of node v have v as their LCA. This fills in the LCA depth of every
+ pair of leaves in one pass, after which each quartet is decided by comparing three sums.
+ */
+unsigned long long QuartetIndex::AddTree(const CompactTree &t)
+{
+	int nleaves=t.GetNumLeaves();
+	vector<int> leaftaxa(nleaves);
+	for (int x=0;x<nleaves;x++) {
+		leaftaxa[x]=t.GetTaxon(t.GetLeaves()[x]);
+	}
+	vector<int> lcadepth(nleaves*nleaves,0);
+	for (int v=0;v<t.GetNumNodes();v++) {
+		int vdepth=t.GetDepth(v);
+		for (int ichild=t.GetFirstChild(v);ichild>=0;ichild=t.GetSibling(ichild)) {
+			for (int jchild=t.GetSibling(ichild);jchild>=0;jchild=t.GetSibling(jchild)) {
+				for (int x=t.GetFirstLeaf(ichild);x<t.GetLastLeaf(ichild);x++) {
+					for (int y=t.GetFirstLeaf(jchild);y<t.GetLastLeaf(jchild);y++) {
+						lcadepth[x*nleaves+y]=vdepth;
+						lcadepth[y*nleaves+x]=vdepth;
+					}
+				}
+			}
+		}
+	}
+	unsigned long long nquartets=0;
+	for (int w=0;w<nleaves;w++) {
+		for (int x=w+1;x<nleaves;x++) {
+			int wx=lcadepth[w*nleaves+x];
+			for (int y=x+1;y<nleaves;y++) {
+				int wy=lcadepth[w*nleaves+y];
+				int xy=lcadepth[x*nleaves+y];
+				for (int z=y+1;z<nleaves;z++) {
+					int wxyz=wx+lcadepth[y*nleaves+z];
+					int wyxz=wy+lcadepth[x*nleaves+z];
+					int wzxy=lcadepth[w*nleaves+z]+xy;
+					if (wxyz>wyxz && wxyz>wzxy) {
+						AddQuartet(leaftaxa[w],leaftaxa[x],leaftaxa[y],leaftaxa[z]);
+					}
+					else if (wyxz>wxyz && wyxz>wzxy) {
+						AddQuartet(leaftaxa[w],leaftaxa[y],leaftaxa[x],leaftaxa[z]);
+					}
+					else if (wzxy>wxyz && wzxy>wyxz) {
+						AddQuartet(leaftaxa[w],leaftaxa[z],leaftaxa[x],leaftaxa[y]);
+					}
+					else {
+						AddUnresolved(leaftaxa[w],leaftaxa[x],leaftaxa[y],leaftaxa[z]);
+					}
+					nquartets++;
+				}
+			}
+		}
+	}
+	return nquartets;
+}
@@ -0,0 +1,61 @@
+#ifndef QUARTETINDEX_H
+#define QUARTETINDEX_H
+#include <iostream>
+#include <vector>
+#include "compacttree.h"
+
+using namespace std;
+
+/*
+ *  quartetindex.h
+ *
+ *  Counts of unrooted quartets, keyed by taxon number. A set of four taxa a<b<c<d is packed
+ *  into one 64 bit key (16 bits per taxon) and holds four counts: ab|cd is topology 0, ac|bd
+ *  is topology 1, ad|bc is topology 2, and an unresolved quartet is topology 3. Only the
+ *  sets actually seen are stored, in an open addressing hash table.
+ *
+ *  Quartets on a tree are found from the depths of the LCAs of each pair of leaves: with
+ *  x, y, z, w on the tree, xy|zw holds if depth(LCA(x,y))+depth(LCA(z,w)) is larger than the
+ *  same sum for either other pairing (the four point condition for a tree with unit edge
+ *  lengths); if no sum is largest the quartet is unresolved. Depths for all pairs are found
+ *  in one traversal, so each quartet takes constant time.
+ *
+ *  GPL2
+ *
+ */
+
+typedef unsigned long long QuadKey;
+
+#define QUARTETINDEX_MAXTAXA 65536 //2^16, the most taxa a packed key can hold
+#define QUARTETINDEX_EMPTYKEY 0xFFFFFFFFFFFFFFFFULL //can't be a real key, as taxa in a key differ
+
+QuadKey PackQuad(int a, int b, int c, int d); //a<b<c<d
+void UnpackQuad(QuadKey key, int &a, int &b, int &c, int &d);
+
+class QuartetIndex
+{
+public:
+	QuartetIndex();
+	void Clear();
+	void AddQuartet(int a, int b, int c, int d, unsigned int count=1); //ab|cd; taxa in any order
+	void AddUnresolved(int a, int b, int c, int d, unsigned int count=1);
+	unsigned int GetQuartetCount(int a, int b, int c, int d) const; //number of times ab|cd was seen
+	unsigned int GetUnresolvedCount(int a, int b, int c, int d) const;
+	unsigned int GetQuadCount(int a, int b, int c, int d) const; //number of times a, b, c, and d were on the same tree
+	void Merge(const QuartetIndex &other); //adds the counts in other to this one
+	unsigned long long AddTree(const CompactTree &t); //adds every quartet on the tree; leaves must have their taxon numbers set. Returns the number of quartets added
+	void GetObservedQuads(vector<QuadKey> &keys) const; //sorted keys of all sets of four taxa seen
+	unsigned long long GetNumQuads() const { return hashused; };
+	double GetMemoryUsed() const; //in bytes
+protected:
+	vector<QuadKey> hashkeys;
+	vector<unsigned int> hashcounts; //4 counters per slot
+	unsigned long long hashused;
+	unsigned long long FindSlot(QuadKey key) const;
+	void GrowHash();
+	void AddSorted(QuadKey key, int topology, unsigned int count);
+	unsigned int GetSorted(QuadKey key, int topology) const;
+	bool SortQuad(int a, int b, int c, int d, QuadKey &key, int &topology) const; //key of the set, and topology of ab|cd; false if a taxon is repeated
+};
+
+#endif
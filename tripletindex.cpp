@@ -0,0 +1,401 @@
+/*
+ *  tripletindex.cpp
+ *
+ *  GPL2
+ *
+ */
+#include <algorithm>
+#include <assert.h>
+#include <gsl/gsl_math.h>
+#include "tripletindex.h"
+
+TripleKey PackTriple(int a, int b, int c)
+{
+	return (((TripleKey)a)<<42) | (((TripleKey)b)<<21) | ((TripleKey)c);
+}
+
+void UnpackTriple(TripleKey key, int &a, int &b, int &c)
+{
+	a=(int)((key>>42) & 0x1FFFFF);
+	b=(int)((key>>21) & 0x1FFFFF);
+	c=(int)(key & 0x1FFFFF);
+}
+
+//the finalizer from splitmix64; packed keys are very regular, so they need mixing before masking
+static unsigned long long MixTripleKey(TripleKey key)
+{
+	key^=key>>30;
+	key*=0xBF58476D1CE4E5B9ULL;
+	key^=key>>27;
+	key*=0x94D049BB133111EBULL;
+	key^=key>>31;
+	return key;
+}
+
+static int CounterWidthFor(unsigned int maxcount)
+{
+	if (maxcount<=0xFF) {
+		return 1;
+	}
+	else if (maxcount<=0xFFFF) {
+		return 2;
+	}
+	return 4;
+}
+
+static unsigned int CounterMaxFor(int width)
+{
+	if (width==1) {
+		return 0xFF;
+	}
+	else if (width==2) {
+		return 0xFFFF;
+	}
+	return 0xFFFFFFFF;
+}
+
+TripletIndex::TripletIndex() : ntax(0), dense(true), memorylimit(0), width(1), hashused(0)
+{
+}
+
+void TripletIndex::Initialize(int ntaxin, unsigned int maxcount, double memorylimitmb)
+{
+	assert(ntaxin>=0 && ntaxin<TRIPLETINDEX_MAXTAXA);
+	ntax=ntaxin;
+	memorylimit=1048576.0*memorylimitmb;
+	width=CounterWidthFor(maxcount);
+	densecounts.clear();
+	hashkeys.clear();
+	hashcounts.clear();
+	hashused=0;
+	double densebytes=3.0*width*NumTriples();
+	dense=(memorylimit<=0 || densebytes<=memorylimit);
+	if (dense) {
+		densecounts.assign(3*width*NumTriples(),0);
+	}
+	else {
+		hashkeys.assign(1024,TRIPLETINDEX_EMPTYKEY);
+		hashcounts.assign(3*1024,0);
+	}
+}
+
+void TripletIndex::Clear()
+{
+	if (dense) {
+		std::fill(densecounts.begin(),densecounts.end(),0);
+	}
+	else {
+		std::fill(hashkeys.begin(),hashkeys.end(),TRIPLETINDEX_EMPTYKEY);
+		std::fill(hashcounts.begin(),hashcounts.end(),0);
+		hashused=0;
+	}
+}
+
+unsigned long long TripletIndex::NumTriples() const
+{
+	unsigned long long n=ntax;
+	if (n<3) {
+		return 0;
+	}
+	return (n*(n-1)*(n-2))/6;
+}
+
+//rank of a<b<c among all triples in colex order: C(c,3)+C(b,2)+a
+unsigned long long TripletIndex::Rank(int a, int b, int c) const
+{
+	unsigned long long cc=c;
+	unsigned long long bb=b;
+	return (cc*(cc-1)*(cc-2))/6+(bb*(bb-1))/2+a;
+}
+
+unsigned int TripletIndex::GetDense(unsigned long long cell) const
+{
+	if (width==1) {
+		return densecounts[cell];
+	}
+	else if (width==2) {
+		return ((const unsigned short *)&densecounts[0])[cell];
+	}
+	return ((const unsigned int *)&densecounts[0])[cell];
+}
+
+void TripletIndex::SetDense(unsigned long long cell, unsigned int value)
+{
+	if (width==1) {
+		densecounts[cell]=(unsigned char)value;
+	}
+	else if (width==2) {
+		((unsigned short *)&densecounts[0])[cell]=(unsigned short)value;
+	}
+	else {
+		((unsigned int *)&densecounts[0])[cell]=value;
+	}
+}
+
+//re-encode the dense counters so they can hold newmax
+void TripletIndex::Widen(unsigned int newmax)
+{
+	int newwidth=CounterWidthFor(newmax);
+	if (newwidth<=width) {
+		return;
+	}
+	unsigned long long ncells=3*NumTriples();
+	vector<unsigned char> oldcounts;
+	oldcounts.swap(densecounts);
+	int oldwidth=width;
+	densecounts.assign(ncells*newwidth,0);
+	width=newwidth;
+	for (unsigned long long cell=0;cell<ncells;cell++) {
+		unsigned int value;
+		if (oldwidth==1) {
+			value=oldcounts[cell];
+		}
+		else {
+			value=((const unsigned short *)&oldcounts[0])[cell];
+		}
+		SetDense(cell,value);
+	}
+}
+
+//returns the slot holding key, or the empty slot where it would go
+unsigned long long TripletIndex::FindSlot(TripleKey key) const
+{
+	unsigned long long mask=hashkeys.size()-1;
+	unsigned long long slot=MixTripleKey(key) & mask;
+	while (hashkeys[slot]!=key && hashkeys[slot]!=TRIPLETINDEX_EMPTYKEY) {
+		slot=(slot+1) & mask;
+	}
+	return slot;
+}
+
+void TripletIndex::GrowHash()
+{
+	vector<TripleKey> oldkeys;
+	vector<unsigned int> oldcounts;
+	oldkeys.swap(hashkeys);
+	oldcounts.swap(hashcounts);
+	hashkeys.assign(2*oldkeys.size(),TRIPLETINDEX_EMPTYKEY);
+	hashcounts.assign(3*hashkeys.size(),0);
+	for (unsigned long long i=0;i<oldkeys.size();i++) {
+		if (oldkeys[i]!=TRIPLETINDEX_EMPTYKEY) {
+			unsigned long long slot=FindSlot(oldkeys[i]);
+			hashkeys[slot]=oldkeys[i];
+			for (int topology=0;topology<3;topology++) {
+				hashcounts[3*slot+topology]=oldcounts[3*i+topology];
+			}
+		}
+	}
+}
+
+void TripletIndex::AddSorted(int a, int b, int c, int topology, unsigned int count)
+{
+	if (dense) {
+		unsigned long long cell=3*Rank(a,b,c)+topology;
+		unsigned int value=GetDense(cell);
+		if (value+count>CounterMaxFor(width) || value+count<value) {
+			Widen(value+count<value ? 0xFFFFFFFF : value+count);
+		}
+		SetDense(cell,value+count);
+	}
+	else {
+		TripleKey key=PackTriple(a,b,c);
+		unsigned long long slot=FindSlot(key);
+		if (hashkeys[slot]==TRIPLETINDEX_EMPTYKEY) {
+			if (10*(hashused+1)>7*hashkeys.size()) { //keep load under 0.7
+				GrowHash();
+				slot=FindSlot(key);
+			}
+			hashkeys[slot]=key;
+			hashused++;
+		}
+		hashcounts[3*slot+topology]+=count;
+	}
+}
+
+unsigned int TripletIndex::GetSorted(int a, int b, int c, int topology) const
+{
+	if (dense) {
+		return GetDense(3*Rank(a,b,c)+topology);
+	}
+	if (hashused==0) {
+		return 0;
+	}
+	unsigned long long slot=FindSlot(PackTriple(a,b,c));
+	if (hashkeys[slot]==TRIPLETINDEX_EMPTYKEY) {
+		return 0;
+	}
+	return hashcounts[3*slot+topology];
+}
+
+//triples with a repeated taxon (a sample appearing twice on one tree) are not recorded
+void TripletIndex::AddTriplet(int a, int b, int outgroup, unsigned int count)
+{
+	if (a==b || a==outgroup || b==outgroup) {
+		return;
+	}
+	int lo=GSL_MIN(a,b);
+	int hi=GSL_MAX(a,b);
+	if (outgroup<lo) {
+		AddSorted(outgroup,lo,hi,0,count);
+	}
+	else if (outgroup<hi) {
+		AddSorted(lo,outgroup,hi,1,count);
+	}
+	else {
+		AddSorted(lo,hi,outgroup,2,count);
+	}
+}
+
+unsigned int TripletIndex::GetTripletCount(int a, int b, int outgroup) const
+{
+	if (a==b || a==outgroup || b==outgroup || a>=ntax || b>=ntax || outgroup>=ntax) {
+		return 0;
+	}
+	int lo=GSL_MIN(a,b);
+	int hi=GSL_MAX(a,b);
+	if (outgroup<lo) {
+		return GetSorted(outgroup,lo,hi,0);
+	}
+	else if (outgroup<hi) {
+		return GetSorted(lo,outgroup,hi,1);
+	}
+	return GetSorted(lo,hi,outgroup,2);
+}
+
+unsigned int TripletIndex::GetTripleCount(int a, int b, int c) const
+{
+	if (a==b || a==c || b==c || a>=ntax || b>=ntax || c>=ntax) {
+		return 0;
+	}
+	int taxonarray[3]={a, b, c};
+	sort(taxonarray,taxonarray+3);
+	unsigned int total=0;
+	for (int topology=0;topology<3;topology++) {
+		total+=GetSorted(taxonarray[0],taxonarray[1],taxonarray[2],topology);
+	}
+	return total;
+}
+
+void TripletIndex::GetObservedTriples(vector<TripleKey> &keys) const
+{
+	keys.clear();
+	if (dense) {
+		unsigned long long rank=0;
+		for (int c=2;c<ntax;c++) {
+			for (int b=1;b<c;b++) {
+				for (int a=0;a<b;a++) {
+					if (GetDense(3*rank)>0 || GetDense(3*rank+1)>0 || GetDense(3*rank+2)>0) {
+						keys.push_back(PackTriple(a,b,c));
+					}
+					rank++;
+				}
+			}
+		}
+	}
+	else {
+		for (unsigned long long slot=0;slot<hashkeys.size();slot++) {
+			if (hashkeys[slot]!=TRIPLETINDEX_EMPTYKEY) {
+				keys.push_back(hashkeys[slot]);
+			}
+		}
+	}
+	sort(keys.begin(),keys.end());
+}
+
+void TripletIndex::Merge(const TripletIndex &other)
+{
+	assert(other.ntax<=ntax);
+	if (dense && other.dense && other.ntax==ntax) { //same layout, so just add cell by cell
+		unsigned long long ncells=3*NumTriples();
+		unsigned int newmax=0;
+		for (unsigned long long cell=0;cell<ncells;cell++) {
+			unsigned long long sum=(unsigned long long)GetDense(cell)+other.GetDense(cell);
+			newmax=GSL_MAX(newmax,(unsigned int)GSL_MIN(sum,0xFFFFFFFFULL));
+		}
+		Widen(newmax);
+		for (unsigned long long cell=0;cell<ncells;cell++) {
+			SetDense(cell,GetDense(cell)+other.GetDense(cell));
+		}
+		return;
+	}
+	vector<TripleKey> keys;
+	other.GetObservedTriples(keys);
+	for (unsigned long long i=0;i<keys.size();i++) {
+		int a, b, c;
+		UnpackTriple(keys[i],a,b,c);
+		for (int topology=0;topology<3;topology++) {
+			unsigned int count=other.GetSorted(a,b,c,topology);
+			if (count>0) {
+				AddSorted(a,b,c,topology,count);
+			}
+		}
+	}
+}
+
+double TripletIndex::GetMemoryUsed() const
+{
+	return 1.0*densecounts.size()+1.0*sizeof(TripleKey)*hashkeys.size()+1.0*sizeof(unsigned int)*hashcounts.size();
+}
+
+/*
+ Adds every triplet on tree t. The leaves below any node are a range of leaf positions. Two leaves x and y in different children i<j of node v have v as
+ their LCA, so with any leaf outside v they form (x,y),z. With a leaf in a later child of v they form
+ a polytomy; as when triplets were found by LCA depth over leaf combinations, ties go to the first
+ two leaves in postorder, so that is also (x,y),z. Everything else is counted at a node below v.
+ If taxondistance is given, each taxon's diagonal element is incremented by the number of triples it
+ is in, and element (i,j) by the number of triplets where i and j are closest.
+ Returns the number of triples on the tree.
+ */
+unsigned long long TripletIndex::AddTree(const CompactTree &t, gsl_matrix *taxondistance, unsigned int count)
+{
+	int nleaves=t.GetNumLeaves();
+	vector<int> leaftaxa(nleaves);
+	for (int x=0;x<nleaves;x++) {
+		leaftaxa[x]=t.GetTaxon(t.GetLeaves()[x]);
+	}
+	const vector<int> &postorder=t.GetPostorder();
+	for (int nodeindex=0;nodeindex<postorder.size();nodeindex++) {
+		int v=postorder[nodeindex];
+		if (t.IsLeaf(v)) {
+			continue;
+		}
+		int vfirst=t.GetFirstLeaf(v);
+		for (int ichild=t.GetFirstChild(v);ichild>=0;ichild=t.GetSibling(ichild)) {
+			int ifirst=t.GetFirstLeaf(ichild);
+			int ilast=t.GetLastLeaf(ichild);
+			for (int jchild=t.GetSibling(ichild);jchild>=0;jchild=t.GetSibling(jchild)) {
+				int jfirst=t.GetFirstLeaf(jchild);
+				int jlast=t.GetLastLeaf(jchild);
+				int noutgroups=vfirst+(nleaves-jlast); //leaves before v, plus leaves after child j
+				for (int x=ifirst;x<ilast;x++) {
+					int xtaxon=leaftaxa[x];
+					for (int y=jfirst;y<jlast;y++) {
+						int ytaxon=leaftaxa[y];
+						for (int z=0;z<vfirst;z++) {
+							AddTriplet(xtaxon,ytaxon,leaftaxa[z],count);
+						}
+						for (int z=jlast;z<nleaves;z++) {
+							AddTriplet(xtaxon,ytaxon,leaftaxa[z],count);
+						}
+						if (taxondistance!=NULL && noutgroups>0) {
+							gsl_matrix_set(taxondistance,xtaxon,ytaxon,(1.0*noutgroups*count)+gsl_matrix_get(taxondistance,xtaxon,ytaxon));
+							if (xtaxon!=ytaxon) {
+								gsl_matrix_set(taxondistance,ytaxon,xtaxon,(1.0*noutgroups*count)+gsl_matrix_get(taxondistance,ytaxon,xtaxon));
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+	unsigned long long triplesperleaf=0;
+	if (nleaves>=3) {
+		triplesperleaf=((unsigned long long)(nleaves-1)*(nleaves-2))/2;
+	}
+	if (taxondistance!=NULL) {
+		for (int x=0;x<nleaves;x++) {
+			gsl_matrix_set(taxondistance,leaftaxa[x],leaftaxa[x],(1.0*triplesperleaf*count)+gsl_matrix_get(taxondistance,leaftaxa[x],leaftaxa[x]));
+		}
+	}
+	return (triplesperleaf*nleaves)/3;
+}
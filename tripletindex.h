@@ -0,0 +1,73 @@
+#ifndef TRIPLETINDEX_H
+#define TRIPLETINDEX_H
+#include <iostream>
+#include <vector>
+#include <gsl/gsl_matrix.h>
+#include "compacttree.h"
+
+using namespace std;
+
+/*
+ *  tripletindex.h
+ *
+ *  Counts of rooted triplets, keyed by taxon number rather than by strings like "3_5_6".
+ *  A triple is a set of three taxa a<b<c, packed into one 64 bit key (21 bits per taxon).
+ *  Each triple holds three topology counts, one for each choice of outgroup: (b,c),a is
+ *  topology 0, (a,c),b is topology 1, and (a,b),c is topology 2. The number of times the
+ *  triple co-occurs on a tree is the sum of the three, so it is not stored separately.
+ *
+ *  If all triples fit within the memory limit, counts are kept in a dense array indexed by
+ *  the combinatorial rank of the triple, using the narrowest counter (1, 2, or 4 bytes) that
+ *  can hold them; counters are widened if a count ever overflows. Otherwise an open
+ *  addressing hash table holds only the triples actually seen, which for gene trees with
+ *  missing samples is far smaller than n choose 3.
+ *
+ *  GPL2
+ *
+ */
+
+typedef unsigned long long TripleKey;
+
+#define TRIPLETINDEX_MAXTAXA 2097152 //2^21, the most taxa a packed key can hold
+#define TRIPLETINDEX_EMPTYKEY 0xFFFFFFFFFFFFFFFFULL
+
+TripleKey PackTriple(int a, int b, int c); //a<b<c
+void UnpackTriple(TripleKey key, int &a, int &b, int &c);
+
+class TripletIndex
+{
+public:
+	TripletIndex();
+	void Initialize(int ntax, unsigned int maxcount, double memorylimitmb); //maxcount is the expected largest count (i.e., number of trees); memorylimitmb<=0 means no limit
+	void Clear(); //zeroes the counts but keeps the layout
+	void AddTriplet(int a, int b, int outgroup, unsigned int count=1); //(a,b),outgroup; a and b in any order
+	unsigned int GetTripletCount(int a, int b, int outgroup) const; //number of times (a,b),outgroup was seen
+	unsigned int GetTripleCount(int a, int b, int c) const; //number of times a, b, and c were on the same tree, in any order
+	void Merge(const TripletIndex &other); //adds the counts in other to this one
+	unsigned long long AddTree(const CompactTree &t, gsl_matrix *taxondistance=NULL, unsigned int count=1); //adds every triplet on the tree count times; leaves must have their taxon numbers set. Returns the number of triplets on the tree
+	void GetObservedTriples(vector<TripleKey> &keys) const; //sorted keys of all triples with a nonzero count
+	bool IsDense() const { return dense; };
+	int GetNumTaxa() const { return ntax; };
+	int GetCounterWidth() const { return width; };
+	double GetMemoryUsed() const; //in bytes
+protected:
+	int ntax;
+	bool dense;
+	double memorylimit; //in bytes
+	int width; //bytes per dense counter
+	vector<unsigned char> densecounts; //3 counters per triple, triple rank r at [3*r*width]
+	vector<TripleKey> hashkeys;
+	vector<unsigned int> hashcounts; //3 counters per slot
+	unsigned long long hashused;
+	unsigned long long NumTriples() const;
+	unsigned long long Rank(int a, int b, int c) const; //a<b<c
+	unsigned int GetDense(unsigned long long cell) const;
+	void SetDense(unsigned long long cell, unsigned int value);
+	void Widen(unsigned int newmax);
+	unsigned long long FindSlot(TripleKey key) const;
+	void GrowHash();
+	void AddSorted(int a, int b, int c, int topology, unsigned int count);
+	unsigned int GetSorted(int a, int b, int c, int topology) const;
+};
+
+#endif